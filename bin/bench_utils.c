@@ -0,0 +1,92 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#if !defined _WIN32
+# include <arpa/inet.h>
+#else
+# include <winsock2.h>
+#endif
+
+#include "bench_utils.h"
+
+smb_session *bench_connect(const char *host, const char *login,
+                           const char *password, const char *share,
+                           smb_tid *tid)
+{
+  struct in_addr  addr;
+  smb_session     *session;
+
+  if (!inet_aton(host, &addr))
+  {
+    netbios_ns *ns = netbios_ns_new();
+
+    if (netbios_ns_resolve(ns, host, NETBIOS_FILESERVER, &addr.s_addr))
+    {
+      fprintf(stderr, "Unable to resolve %s\n", host);
+      exit(42);
+    }
+    netbios_ns_destroy(ns);
+  }
+
+  session = smb_session_new();
+  if (smb_session_connect(session, host, inet_ntoa(addr), NULL,
+                          SMB_TRANSPORT_TCP) != DSM_SUCCESS)
+  {
+    fprintf(stderr, "Unable to connect to %s\n", host);
+    exit(42);
+  }
+
+  smb_session_set_creds(session, host, login, password);
+  if (smb_session_login(session) != DSM_SUCCESS)
+  {
+    fprintf(stderr, "Authentication FAILURE.\n");
+    exit(42);
+  }
+
+  if (smb_tree_connect(session, share, tid) != DSM_SUCCESS)
+  {
+    fprintf(stderr, "Unable to connect to %s share\n", share);
+    exit(42);
+  }
+
+  return session;
+}
+
+double      bench_now(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
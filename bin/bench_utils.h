@@ -0,0 +1,47 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+// Helpers shared by the benchmark and stress programs
+
+#ifndef _BENCH_UTILS_H_
+#define _BENCH_UTILS_H_
+
+#include "bdsm.h"
+
+// Connect and login to 'host' (an IP address or a NetBIOS name), then connect
+// to 'share'. Exits on failure.
+smb_session *bench_connect(const char *host, const char *login,
+                           const char *password, const char *share,
+                           smb_tid *tid);
+
+// Monotonic time in seconds
+double      bench_now(void);
+
+#endif
@@ -0,0 +1,151 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*
+ * Copies made by smb_fread() on the READ_ANDX path, and what they cost.
+ *
+ * The data of the replies is normally received straight into the caller's
+ * buffer. In thread-safe mode, replies are received whole and routed to the
+ * thread waiting for them, then the data is copied out: that's the buffered
+ * path, which the same file is read again with. Read-ahead is left disabled.
+ *
+ *   dsm_copy_bench 127.0.0.1 user password share '\big.bin' 3
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+# include <x86intrin.h>
+# define HAVE_RDTSC
+#endif
+
+#include "bench_utils.h"
+
+#define READ_SIZE   (1024 * 1024)
+
+static uint64_t cycles(void)
+{
+#ifdef HAVE_RDTSC
+  return __rdtsc();
+#else
+  return 0;
+#endif
+}
+
+int main(int ac, char **av)
+{
+  static const char *modes[] = { "zero-copy", "buffered" };
+  smb_session       *session;
+  smb_tid           tid;
+  smb_fd            fd;
+  char              *buf;
+  int               runs;
+
+  if (ac < 6)
+  {
+    fprintf(stderr, "usage: %s host login password share file [runs]\n",
+            av[0]);
+    exit(1);
+  }
+  runs = ac > 6 ? atoi(av[6]) : 3;
+
+  session = bench_connect(av[1], av[2], av[3], av[4], &tid);
+  if (smb_fopen(session, tid, av[5], SMB_MOD_RO, &fd) != DSM_SUCCESS)
+  {
+    fprintf(stderr, "Unable to open %s\n", av[5]);
+    exit(42);
+  }
+
+  buf = malloc(READ_SIZE);
+  if (!buf)
+    exit(1);
+
+  for (int run = 0; run < runs; run++)
+  {
+    for (int mode = 0; mode < 2; mode++)
+    {
+      smb_file_stats  before, after;
+      uint64_t        total, copied, tsc;
+      clock_t         cpu;
+      double          start, elapsed, mb;
+      ssize_t         res;
+
+      smb_session_set_thread_safe(session, mode == 1);
+      smb_fseek(session, fd, 0, SMB_SEEK_SET);
+      smb_file_get_stats(session, fd, &before);
+
+      start = bench_now();
+      cpu   = clock();
+      tsc   = cycles();
+      while ((res = smb_fread(session, fd, buf, READ_SIZE)) > 0)
+        ;
+      tsc     = cycles() - tsc;
+      cpu     = clock() - cpu;
+      elapsed = bench_now() - start;
+
+      if (res < 0)
+      {
+        fprintf(stderr, "Read failed\n");
+        exit(42);
+      }
+
+      smb_file_get_stats(session, fd, &after);
+      total  = after.bytes_read - before.bytes_read;
+      copied = after.bytes_copied - before.bytes_copied;
+      mb     = total / 1e6;
+      if (mb == 0)
+      {
+        fprintf(stderr, "Empty file\n");
+        exit(42);
+      }
+
+      printf("%-9s: %"PRIu64" bytes, %"PRIu64" copied (%.2f per byte), "
+             "%.1f MB/s, %.2f CPU ms/MB", modes[mode], total, copied,
+             (double)copied / total, mb / elapsed,
+             cpu * 1000.0 / CLOCKS_PER_SEC / mb);
+#ifdef HAVE_RDTSC
+      // Most of the time is spent waiting for the server, only count the
+      // cycles of the time on the CPU
+      printf(", %.0f cycles/MB",
+             (double)cpu / CLOCKS_PER_SEC * (tsc / elapsed) / mb);
+#endif
+      printf("\n");
+    }
+  }
+
+  free(buf);
+  smb_fclose(session, fd);
+  smb_session_destroy(session);
+
+  return 0;
+}
@@ -0,0 +1,99 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*
+ * Open file table benchmark: opens the same file many times on one share,
+ * then times the lookup of every descriptor with smb_fseek(SEEK_CUR), which
+ * doesn't touch the network. Opening and closing are timed too, but include
+ * a round trip each. E.g. for 10k descriptors:
+ *
+ *   dsm_fd_bench 127.0.0.1 user password share '\file' 10000
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+
+#include "bench_utils.h"
+
+#define ROUNDS 100
+
+int main(int ac, char **av)
+{
+  smb_session   *session;
+  smb_tid       tid;
+  smb_fd        *fds;
+  size_t        count = 10000;
+  double        start, open_time, seek_time;
+
+  if (ac != 6 && ac != 7)
+  {
+    fprintf(stderr, "usage: %s host login password share file [count]\n",
+            av[0]);
+    exit(1);
+  }
+  if (ac == 7)
+    count = atol(av[6]);
+  if ((fds = calloc(count, sizeof(smb_fd))) == NULL)
+    exit(42);
+
+  session = bench_connect(av[1], av[2], av[3], av[4], &tid);
+
+  start = bench_now();
+  for (size_t i = 0; i < count; i++)
+    if (smb_fopen(session, tid, av[5], SMB_MOD_RO, &fds[i]) != DSM_SUCCESS)
+    {
+      fprintf(stderr, "Unable to open %s (%zu opened)\n", av[5], i);
+      exit(42);
+    }
+  open_time = bench_now() - start;
+
+  start = bench_now();
+  for (int r = 0; r < ROUNDS; r++)
+    for (size_t i = 0; i < count; i++)
+      if (smb_fseek(session, fds[i], 0, SMB_SEEK_CUR) < 0)
+      {
+        fprintf(stderr, "Descriptor %zu not found\n", i);
+        exit(42);
+      }
+  seek_time = bench_now() - start;
+
+  printf("%zu descriptors: open %.1fus, lookup %.1fns each\n", count,
+         open_time * 1e6 / count, seek_time * 1e9 / count / ROUNDS);
+
+  start = bench_now();
+  for (size_t i = 0; i < count; i++)
+    smb_fclose(session, fds[i]);
+  printf("close %.1fus each\n", (bench_now() - start) * 1e6 / count);
+
+  free(fds);
+  smb_session_destroy(session);
+
+  return 0;
+}
@@ -0,0 +1,120 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*
+ * Directory listing benchmark: lists a directory with smb_find() and walks
+ * the result by index with smb_stat_list_at(), then lists it again with
+ * smb_find_open(). Given a count, the directory is first filled with that
+ * many empty files, e.g. for 100k entries:
+ *
+ *   dsm_list_bench 127.0.0.1 user password share '\list_bench' 100000
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "bench_utils.h"
+
+int main(int ac, char **av)
+{
+  smb_session   *session;
+  smb_tid       tid;
+  smb_stat_list list;
+  smb_find_iter *it;
+  char          path[1024];
+  size_t        count, entries = 0;
+  uint64_t      total = 0;
+  double        start, find_time, at_time;
+
+  if (ac != 6 && ac != 7)
+  {
+    fprintf(stderr, "usage: %s host login password share directory [count]\n",
+            av[0]);
+    exit(1);
+  }
+
+  session = bench_connect(av[1], av[2], av[3], av[4], &tid);
+
+  if (ac == 7)
+  {
+    smb_directory_create(session, tid, av[5]);  // It may already exist
+    for (long i = 0; i < atol(av[6]); i++)
+    {
+      smb_fd fd;
+
+      snprintf(path, sizeof(path), "%s\\f%07ld", av[5], i);
+      if (smb_fopen(session, tid, path, SMB_MOD_RW, &fd) != DSM_SUCCESS)
+      {
+        fprintf(stderr, "Unable to create %s\n", path);
+        exit(42);
+      }
+      smb_fclose(session, fd);
+    }
+  }
+
+  snprintf(path, sizeof(path), "%s\\*", av[5]);
+
+  start = bench_now();
+  list  = smb_find(session, tid, path);
+  find_time = bench_now() - start;
+  if (!list)
+  {
+    fprintf(stderr, "Unable to list %s\n", av[5]);
+    exit(42);
+  }
+
+  start = bench_now();
+  count = smb_stat_list_count(list);
+  for (size_t i = 0; i < count; i++)
+    total += smb_stat_get(smb_stat_list_at(list, i), SMB_STAT_SIZE);
+  at_time = bench_now() - start;
+  smb_stat_list_destroy(list);
+
+  printf("smb_find: %zu entries in %.3fs, indexed walk in %.6fs\n", count,
+         find_time, at_time);
+
+  start = bench_now();
+  if ((it = smb_find_open(session, tid, path)) == NULL)
+  {
+    fprintf(stderr, "Unable to list %s\n", av[5]);
+    exit(42);
+  }
+  while (smb_find_next_entry(it) != NULL)
+    entries++;
+  smb_find_close(it);
+
+  printf("smb_find_open: %zu entries in %.3fs\n", entries,
+         bench_now() - start);
+
+  smb_session_destroy(session);
+
+  return 0;
+}
@@ -0,0 +1,201 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*
+ * Checks of the name resolution through name servers, against local
+ * dsm_ns_responder processes (name servers on 127.0.0.2 and 127.0.0.3, and
+ * a host answering broadcasts):
+ * - the servers are asked at once, the first positive answer wins and a
+ *   negative one waits for the other servers;
+ * - when all the servers answer negatively, the broadcast query follows;
+ * - unless the broadcast is disabled, the resolution then fails at once.
+ * The responder is looked for next to this program, unless given:
+ *
+ *   dsm_ns_check [path/to/dsm_ns_responder]
+ *
+ * Binding port 137 needs root. Exits with 0 if the checks pass, 77 if they
+ * can't run and 42 if one fails.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <signal.h>
+#include <unistd.h>
+#include <ifaddrs.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <sys/wait.h>
+
+#include "bench_utils.h"
+
+#define NB_RESPONDERS 3
+
+static const char   *responder;
+static pid_t        pids[NB_RESPONDERS];
+static int          failed;
+
+// Start a responder, see bin/ns_responder.c, and wait for it to be ready
+static void start(int i, const char *address, const char *answer,
+                  const char *delay)
+{
+  char  line[16] = { 0 };
+  int   fds[2];
+  FILE  *out;
+
+  if (pipe(fds) != 0 || (pids[i] = fork()) < 0)
+    exit(42);
+  if (pids[i] == 0)
+  {
+    dup2(fds[1], STDOUT_FILENO);
+    close(fds[0]);
+    execl(responder, responder, address, "srv", answer, delay, (char *)NULL);
+    perror(responder);
+    _exit(42);
+  }
+
+  close(fds[1]);
+  out = fdopen(fds[0], "r");
+  if (!fgets(line, sizeof(line), out) || strcmp(line, "ready\n"))
+  {
+    fprintf(stderr, "skipped: unable to start %s on %s\n", responder,
+            address);
+    exit(77);
+  }
+  fclose(out);
+}
+
+static void stop_all(void)
+{
+  for (int i = 0; i < NB_RESPONDERS; i++)
+    if (pids[i] > 0)
+    {
+      kill(pids[i], SIGTERM);
+      waitpid(pids[i], NULL, 0);
+      pids[i] = 0;
+    }
+}
+
+// Resolve "srv" and check the result, 'expected' being NULL for a failure
+static void check(const char *what, int broadcast, const char *expected,
+                  double max_time)
+{
+  uint32_t        servers[2];
+  struct in_addr  addr = { 0 };
+  netbios_ns      *ns;
+  double          start, time;
+  int             res;
+
+  inet_aton("127.0.0.2", (struct in_addr *)&servers[0]);
+  inet_aton("127.0.0.3", (struct in_addr *)&servers[1]);
+  if ((ns = netbios_ns_new()) == NULL
+      || netbios_ns_set_name_servers(ns, servers, 2, broadcast) != 0)
+    exit(42);
+
+  start = bench_now();
+  res   = netbios_ns_resolve(ns, "srv", NETBIOS_FILESERVER, &addr.s_addr);
+  time  = bench_now() - start;
+  netbios_ns_destroy(ns);
+
+  if ((expected == NULL) != (res != 0)
+      || (expected != NULL && strcmp(inet_ntoa(addr), expected))
+      || time > max_time)
+  {
+    printf("FAIL %s: %s in %.3fs\n", what, res ? "not found"
+           : inet_ntoa(addr), time);
+    failed = 1;
+  }
+  else
+    printf("ok   %s (%.3fs)\n", what, time);
+}
+
+// Is there an interface the broadcast queries go through ?
+static int has_broadcast(void)
+{
+  struct ifaddrs  *ifaddrs, *a;
+  int             found = 0;
+
+  if (getifaddrs(&ifaddrs) != 0)
+    return 0;
+  for (a = ifaddrs; a != NULL; a = a->ifa_next)
+    if (a->ifa_addr != NULL && a->ifa_addr->sa_family == AF_INET
+        && (a->ifa_flags & IFF_BROADCAST) && (a->ifa_flags & IFF_UP))
+      found = 1;
+  freeifaddrs(ifaddrs);
+
+  return found;
+}
+
+int main(int ac, char **av)
+{
+  static char   path[1024];
+  const char    *slash;
+  int           dir_len;
+
+  if (ac > 1)
+    responder = av[1];
+  else
+  {
+    // Libtool runs this program from .libs, the responder isn't linked
+    // with libdsm and stays in the build directory
+    slash   = strrchr(av[0], '/');
+    dir_len = slash ? (int)(slash - av[0] + 1) : 0;
+    if (dir_len >= 6 && !strncmp(av[0] + dir_len - 6, ".libs/", 6))
+      dir_len -= 6;
+    snprintf(path, sizeof(path), "%.*sdsm_ns_responder", dir_len, av[0]);
+    responder = path;
+  }
+  signal(SIGPIPE, SIG_IGN);
+  atexit(stop_all);
+
+  // The server race
+  start(0, "127.0.0.2", "10.0.0.2", "500");
+  start(1, "127.0.0.3", "10.0.0.3", NULL);
+  check("the fastest server wins", 0, "10.0.0.3", 0.4);
+  stop_all();
+
+  start(0, "127.0.0.2", "-", NULL);
+  start(1, "127.0.0.3", "10.0.0.3", "200");
+  check("a negative answer waits for the other servers", 0, "10.0.0.3", 1.0);
+  stop_all();
+
+  // All the servers answer negatively
+  start(0, "127.0.0.2", "-", NULL);
+  start(1, "127.0.0.3", "-", NULL);
+  start(2, "0.0.0.0", "10.0.0.9", NULL);
+  if (has_broadcast())
+    check("negative answers fall back to the broadcast", 1, "10.0.0.9", 1.0);
+  else
+    printf("skipped: no broadcast interface for the fallback\n");
+  check("negative answers fail at once without broadcast", 0, NULL, 0.5);
+  stop_all();
+
+  return failed ? 42 : 0;
+}
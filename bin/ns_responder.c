@@ -0,0 +1,164 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*
+ * Minimal NetBIOS name service responder, for testing the name resolution
+ * against local name servers (see dsm_ns_check). It answers the NB queries
+ * for one name, on UDP port 137 of the given address:
+ * - bound to a loopback address, it plays a name server: it answers the
+ *   queries sent to that address, with the given ip or, given "-", with a
+ *   negative "name error" answer;
+ * - bound to 0.0.0.0, it plays the host owning the name: it only answers
+ *   broadcast queries, and never negatively.
+ * The answers can be delayed, e.g. for a slow name server:
+ *
+ *   dsm_ns_responder 127.0.0.2 srv 10.0.0.2 300
+ *
+ * "ready" is printed once the port is bound. Binding port 137 needs root.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include <strings.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+
+#define NS_PORT           137
+#define NS_HEADER         12
+#define NS_ENCODED_NAME   34  // Length, 32 encoded chars and the root label
+#define NS_FLAG_BROADCAST 0x0010
+#define NS_TTL            300
+
+// Decode the first level encoded name of a query, without its type
+static void decode_name(const uint8_t *encoded, char *name)
+{
+  int len;
+
+  for (int i = 0; i < 15; i++)
+    name[i] = ((encoded[1 + 2 * i] - 'A') << 4) | (encoded[2 + 2 * i] - 'A');
+  for (len = 15; len > 0 && name[len - 1] == ' '; len--)
+    ;
+  name[len] = 0;
+}
+
+static void put16(uint8_t *p, uint16_t v)
+{
+  p[0] = v >> 8;
+  p[1] = v & 0xff;
+}
+
+int main(int ac, char **av)
+{
+  struct sockaddr_in  addr, from;
+  socklen_t           from_len;
+  uint8_t             buf[576], answer[NS_HEADER + NS_ENCODED_NAME + 16];
+  char                name[16];
+  struct in_addr      ip;
+  int                 sock, on = 1, server, negative;
+  unsigned int        delay = 0;
+  ssize_t             size, len;
+
+  if (ac != 4 && ac != 5)
+  {
+    fprintf(stderr, "usage: %s address name ip|- [delay_ms]\n", av[0]);
+    exit(1);
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sin_family = AF_INET;
+  addr.sin_port   = htons(NS_PORT);
+  negative = !strcmp(av[3], "-");
+  if (!inet_aton(av[1], &addr.sin_addr) || (!negative && !inet_aton(av[3], &ip)))
+  {
+    fprintf(stderr, "Invalid address\n");
+    exit(1);
+  }
+  server = addr.sin_addr.s_addr != INADDR_ANY;
+  if (ac == 5)
+    delay = atoi(av[4]);
+
+  sock = socket(AF_INET, SOCK_DGRAM, 0);
+  if (sock < 0
+      || setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0
+      || bind(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+  {
+    perror("Unable to bind");
+    exit(42);
+  }
+  printf("ready\n");
+  fflush(stdout);
+
+  while (1)
+  {
+    from_len = sizeof(from);
+    size = recvfrom(sock, buf, sizeof(buf), 0, (struct sockaddr *)&from,
+                    &from_len);
+    if (size < NS_HEADER + NS_ENCODED_NAME + 4 || (buf[2] & 0x80)
+        || buf[NS_HEADER] != 0x20)
+      continue;   // Not a query
+    if (server == ((buf[3] & NS_FLAG_BROADCAST) != 0))
+      continue;   // Not for this role
+
+    // A negative name server knows no name at all
+    decode_name(buf + NS_HEADER, name);
+    if (strcasecmp(name, av[2]) && !(server && negative))
+      continue;
+
+    if (delay > 0)
+      usleep(delay * 1000);
+
+    // Answer: the header, the queried name echoed, then the NB record
+    memset(answer, 0, sizeof(answer));
+    memcpy(answer, buf, 2);                       // Transaction id
+    put16(answer + 2, negative ? 0x8583 : 0x8500);
+    put16(answer + 6, 1);                         // One answer
+    memcpy(answer + NS_HEADER, buf + NS_HEADER, NS_ENCODED_NAME);
+    len = NS_HEADER + NS_ENCODED_NAME;
+    put16(answer + len, 0x20);                    // NB
+    put16(answer + len + 2, 1);                   // IN
+    if (!negative)
+    {
+      answer[len + 6] = NS_TTL >> 8;
+      answer[len + 7] = NS_TTL & 0xff;
+      put16(answer + len + 8, 6);
+      memcpy(answer + len + 12, &ip.s_addr, 4);
+      len += 16;
+    }
+    else
+      len += 10;
+
+    sendto(sock, answer, len, 0, (struct sockaddr *)&from, from_len);
+  }
+
+  return 0;
+}
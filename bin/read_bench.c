@@ -0,0 +1,111 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*
+ * Sequential read throughput of smb_fread() for several read windows (see
+ * smb_session_set_read_window()).
+ *
+ * The window matters once there is latency, which can be added on loopback
+ * to measure against a local Samba:
+ *
+ *   tc qdisc add dev lo root netem delay 10ms
+ *   dsm_read_bench 127.0.0.1 user password share '\big.bin' 1 2 4 8 16
+ *   tc qdisc del dev lo root
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <inttypes.h>
+
+#include "bench_utils.h"
+
+#define READ_SIZE   (8 * 1024 * 1024)
+
+int main(int ac, char **av)
+{
+  smb_session   *session;
+  smb_tid       tid;
+  smb_fd        fd;
+  char          *buf;
+
+  if (ac < 7)
+  {
+    fprintf(stderr, "usage: %s host login password share file window...\n",
+            av[0]);
+    exit(1);
+  }
+
+  session = bench_connect(av[1], av[2], av[3], av[4], &tid);
+  if (smb_fopen(session, tid, av[5], SMB_MOD_RO, &fd) != DSM_SUCCESS)
+  {
+    fprintf(stderr, "Unable to open %s\n", av[5]);
+    exit(42);
+  }
+
+  buf = malloc(READ_SIZE);
+  if (!buf)
+    exit(1);
+
+  for (int i = 6; i < ac; i++)
+  {
+    uint64_t  total = 0;
+    ssize_t   res;
+    double    start, elapsed;
+    int       window;
+
+    window = smb_session_set_read_window(session, atoi(av[i]));
+    if (window < 0)
+    {
+      fprintf(stderr, "Invalid window %s\n", av[i]);
+      exit(1);
+    }
+
+    smb_fseek(session, fd, 0, SMB_SEEK_SET);
+    start = bench_now();
+    while ((res = smb_fread(session, fd, buf, READ_SIZE)) > 0)
+      total += res;
+    elapsed = bench_now() - start;
+
+    if (res < 0)
+    {
+      fprintf(stderr, "Read failed\n");
+      exit(42);
+    }
+
+    printf("window %2d: %"PRIu64" bytes in %.2fs, %.1f MB/s\n", window, total,
+           elapsed, total / elapsed / 1e6);
+  }
+
+  free(buf);
+  smb_fclose(session, fd);
+  smb_session_destroy(session);
+
+  return 0;
+}
@@ -0,0 +1,170 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/*
+ * Stress test of the thread-safe session mode (see
+ * smb_session_set_thread_safe()): several rounds of threads share one
+ * session, each one opening the file and checking random reads and stats
+ * against a copy read beforehand. New threads are started for every round,
+ * like in a thread pool which churns.
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <pthread.h>
+#include <inttypes.h>
+
+#include "bench_utils.h"
+
+#define NB_THREADS  16
+#define NB_ROUNDS   4
+#define NB_OPS      200
+#define MAX_SIZE    (16 * 1024 * 1024)
+#define MAX_READ    (256 * 1024)
+
+static smb_session  *session;
+static smb_tid      tid;
+static const char   *path;
+static char         *data;
+static size_t       data_size;
+
+static void *stress_thread(void *opaque)
+{
+  unsigned int  seed = (unsigned int)(uintptr_t)opaque;
+  char          *buf;
+  smb_fd        fd;
+  long          errors = 0;
+
+  buf = malloc(MAX_READ);
+  if (!buf || smb_fopen(session, tid, path, SMB_MOD_RO, &fd) != DSM_SUCCESS)
+  {
+    free(buf);
+    return (void *)1;
+  }
+
+  for (int i = 0; i < NB_OPS; i++)
+  {
+    if (i % 10 == 0)
+    {
+      smb_stat st = smb_fstat(session, tid, path);
+
+      if (!st || smb_stat_get(st, SMB_STAT_SIZE) < data_size)
+        errors++;
+      smb_stat_destroy(st);
+    }
+    else
+    {
+      size_t  offset = rand_r(&seed) % data_size;
+      size_t  len = rand_r(&seed) % MAX_READ + 1;
+      ssize_t res;
+
+      if (len > data_size - offset)
+        len = data_size - offset;
+      res = smb_pread(session, fd, buf, len, offset);
+      if (res != (ssize_t)len || memcmp(buf, data + offset, len))
+        errors++;
+    }
+  }
+
+  smb_fclose(session, fd);
+  free(buf);
+
+  return (void *)errors;
+}
+
+int main(int ac, char **av)
+{
+  pthread_t threads[NB_THREADS];
+  smb_fd    fd;
+  ssize_t   res;
+  long      errors = 0;
+  double    start;
+
+  if (ac != 6)
+  {
+    fprintf(stderr, "usage: %s host login password share file\n", av[0]);
+    exit(1);
+  }
+
+  session = bench_connect(av[1], av[2], av[3], av[4], &tid);
+  path    = av[5];
+
+  // What the threads compare their reads with
+  data = malloc(MAX_SIZE);
+  if (!data || smb_fopen(session, tid, path, SMB_MOD_RO, &fd) != DSM_SUCCESS)
+  {
+    fprintf(stderr, "Unable to open %s\n", path);
+    exit(42);
+  }
+  while (data_size < MAX_SIZE
+         && (res = smb_fread(session, fd, data + data_size,
+                             MAX_SIZE - data_size)) > 0)
+    data_size += res;
+  smb_fclose(session, fd);
+  if (data_size == 0)
+  {
+    fprintf(stderr, "%s is empty\n", path);
+    exit(42);
+  }
+
+  if (smb_session_set_thread_safe(session, 1) != DSM_SUCCESS)
+  {
+    fprintf(stderr, "Unable to enable the thread-safe mode\n");
+    exit(42);
+  }
+
+  start = bench_now();
+  for (int round = 0; round < NB_ROUNDS; round++)
+  {
+    for (int i = 0; i < NB_THREADS; i++)
+      if (pthread_create(&threads[i], NULL, stress_thread,
+                         (void *)(uintptr_t)(round * NB_THREADS + i + 1)))
+      {
+        fprintf(stderr, "Unable to start a thread\n");
+        exit(1);
+      }
+    for (int i = 0; i < NB_THREADS; i++)
+    {
+      void *thread_errors;
+
+      pthread_join(threads[i], &thread_errors);
+      errors += (long)thread_errors;
+    }
+  }
+
+  printf("%d threads x %d rounds x %d operations in %.2fs, %ld errors\n",
+         NB_THREADS, NB_ROUNDS, NB_OPS, bench_now() - start, errors);
+
+  free(data);
+  smb_session_destroy(session);
+
+  return errors != 0;
+}
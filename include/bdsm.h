@@ -43,5 +43,9 @@
 #include "bdsm/smb_file.h"
 #include "bdsm/smb_stat.h"
 #include "bdsm/smb_dir.h"
+#include "bdsm/smb_async.h"
+#include "bdsm/smb_pool.h"
+#include "bdsm/smb_transfer.h"
+#include "bdsm/smb_walk.h"
 
 #endif
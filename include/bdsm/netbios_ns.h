@@ -31,6 +31,7 @@
 #ifndef __BDSM_NETBIOS_NS_H_
 #define __BDSM_NETBIOS_NS_H_
 
+#include <stddef.h>
 #include <stdint.h>
 
 /**
@@ -91,7 +92,8 @@ void          netbios_ns_destroy(netbios_ns *ns);
 /**
  * @brief Resolve a Netbios name
  * @details This function tries to resolves the given NetBIOS name with the
- * given type on the LAN, using broadcast queries. No WINS server is called.
+ * given type on the LAN, using broadcast queries, or by asking the name
+ * servers set with netbios_ns_set_name_servers().
  *
  * @param ns the netbios name service object.
  * @param name the null-terminated ASCII netbios name to resolve. If it's
@@ -103,6 +105,24 @@ void          netbios_ns_destroy(netbios_ns *ns);
 int           netbios_ns_resolve(netbios_ns *ns, const char *name,
                                  char type, uint32_t *addr);
 
+/**
+ * @brief Resolve names with NBNS (WINS) servers
+ * @details netbios_ns_resolve() and netbios_ns_resolve_batch() then send
+ * their queries to all the servers at once and take the first answer. If
+ * the servers don't answer in time, or all answer that they don't know the
+ * name, a broadcast query is sent, unless 'broadcast' is 0.
+ *
+ * @param ns the netbios name service object.
+ * @param servers The ip addresses of the servers in network byte order
+ * @param count The number of servers, 0 to resolve with broadcast queries
+ * only (the default)
+ * @param broadcast Whether to fall back to broadcast queries
+ * @return 0 on success or -1 on failure
+ */
+int           netbios_ns_set_name_servers(netbios_ns *ns,
+                                          const uint32_t *servers,
+                                          size_t count, int broadcast);
+
 /**
  * @brief Perform an inverse netbios lookup (get name from ip)
  * @details This function does a NBSTAT and stores all the returned entry in
@@ -113,10 +133,136 @@ int           netbios_ns_resolve(netbios_ns *ns, const char *name,
  * @param ip The ip address in network byte order.
  *
  * @return A null-terminated ASCII string containing the NETBIOS name. You don't
- * own the it (it'll be freed when destroying/clearing the name service)
+ * own the it (it'll be freed when destroying/clearing the name service). Once
+ * the TTL of the answer is over, the next lookup of the ip asks the host
+ * again and the string is updated in place with its answer.
  */
 const char          *netbios_ns_inverse(netbios_ns *ns, uint32_t ip);
 
+/**
+ * @brief Called by netbios_ns_inverse_batch() for each host
+ *
+ * @param p_opaque The opaque pointer given to netbios_ns_inverse_batch()
+ * @param ip The ip address of the host, in network byte order
+ * @param entry The names of the host, or NULL if it didn't answer. It's owned
+ * by the name service, like the entries of the discovery.
+ */
+typedef void (*netbios_ns_inverse_cb)(void *p_opaque, uint32_t ip,
+                                      netbios_ns_entry *entry);
+
+/**
+ * @struct netbios_ns_batch_opts
+ * @brief Settings of netbios_ns_inverse_batch() and netbios_ns_resolve_batch()
+ */
+typedef struct
+{
+    unsigned int    rate;       ///< Queries sent per second, 0 for no limit (default 1000)
+    unsigned int    timeout;    ///< How long to wait for an answer, in ms (default 1000)
+    unsigned int    retries;    ///< Times an unanswered query is sent again (default 1)
+}                   netbios_ns_batch_opts;
+
+/**
+ * @brief Perform inverse lookups of many ip addresses at once
+ * @details Unlike netbios_ns_inverse(), the NBSTAT queries don't wait for the
+ * previous answers: they're sent at the given rate, each host with its own
+ * transaction id, and the answers are handled as they arrive. A host which
+ * doesn't answer within the timeout is asked again 'retries' times.
+ *
+ * The hosts already in the cache are reported first, without any query.
+ * The callback musn't call the other functions of the name service.
+ *
+ * @param ns The name service object.
+ * @param ips The ip addresses to look up, in network byte order
+ * @param count The number of addresses in 'ips'
+ * @param cb Called once for each address, as soon as its result is known
+ * @param p_opaque Passed to the callback
+ * @param opts The settings, NULL for the defaults
+ *
+ * @return The number of hosts which answered, or -1 on error
+ */
+int                 netbios_ns_inverse_batch(netbios_ns *ns, const uint32_t *ips,
+                                             size_t count,
+                                             netbios_ns_inverse_cb cb,
+                                             void *p_opaque,
+                                             const netbios_ns_batch_opts *opts);
+
+/**
+ * @brief Called by netbios_ns_resolve_batch() for each name
+ *
+ * @param p_opaque The opaque pointer given to netbios_ns_resolve_batch()
+ * @param name The name, as given to netbios_ns_resolve_batch()
+ * @param addr The IP address in network byte order of the machine, or 0 if
+ * the name couldn't be resolved
+ */
+typedef void (*netbios_ns_resolve_cb)(void *p_opaque, const char *name,
+                                      uint32_t addr);
+
+/**
+ * @brief Resolve many Netbios names at once
+ * @details This is netbios_ns_resolve() for a list of names: the queries
+ * are all sent without waiting for the previous answers, at the given rate
+ * and with a transaction id each. When name servers are set, the timeout and
+ * retries apply to the servers first, then to the broadcast. The answers are handled as they
+ * arrive, and an unanswered query is sent again 'retries' times.
+ *
+ * The names already in the cache (or which failed to resolve recently) are
+ * reported first, without any query. A name given several times, whatever
+ * the case, is asked only once and reported for each occurrence.
+ * The callback musn't call the other functions of the name service.
+ *
+ * @param ns The name service object.
+ * @param names The null-terminated ASCII netbios names to resolve
+ * @param count The number of names
+ * @param type The type of the names to look for. @see netbios_defs.h
+ * @param cb Called once for each name, as soon as its result is known
+ * @param p_opaque Passed to the callback
+ * @param opts The settings, NULL for the defaults
+ *
+ * @return The number of names resolved, or -1 on error
+ */
+int                 netbios_ns_resolve_batch(netbios_ns *ns,
+                                             const char * const *names,
+                                             size_t count, char type,
+                                             netbios_ns_resolve_cb cb,
+                                             void *p_opaque,
+                                             const netbios_ns_batch_opts *opts);
+
+/**
+ * @struct netbios_ns_cache_stats
+ * @brief Counters of the name cache, see netbios_ns_get_cache_stats()
+ */
+typedef struct
+{
+    uint64_t    hits;           ///< Lookups answered from the cache
+    uint64_t    misses;         ///< Lookups which were sent on the network
+    uint64_t    negative_hits;  ///< Resolutions failed because the name recently failed to resolve
+    size_t      entries;        ///< Records currently cached, failed names and expired ones included
+}           netbios_ns_cache_stats;
+
+/**
+ * @brief Set for how long a name that failed to resolve isn't asked again
+ * @details When nobody answers a netbios_ns_resolve() query, further
+ * resolutions of the same name and type fail right away for 'ttl' seconds.
+ * This is 10 seconds by default.
+ *
+ * Resolved names are kept for the TTL given by the host which answered, and
+ * the names found with netbios_ns_inverse() until the host says otherwise.
+ *
+ * @param ns The name service object.
+ * @param ttl In seconds, 0 not to remember failures
+ */
+void                netbios_ns_set_negative_ttl(netbios_ns *ns, unsigned int ttl);
+
+/**
+ * @brief Get the counters of the name cache of netbios_ns_resolve() and
+ * netbios_ns_inverse()
+ *
+ * @param ns The name service object.
+ * @param[out] stats Where to store the counters
+ */
+void                netbios_ns_get_cache_stats(netbios_ns *ns,
+                                               netbios_ns_cache_stats *stats);
+
 typedef struct
 {
     // Opaque pointer that will be passed to callbacks
@@ -139,11 +285,56 @@ typedef struct
  * every timeout seconds @param callbacks The callbacks previously setup by the
  * caller
  *
+ * On systems that support it, there is a socket per network interface and
+ * the broadcasts of the interfaces are staggered instead of all sent at once.
+ *
  * @return 0 on success or -1 on failure
  */
 int netbios_ns_discover_start(netbios_ns *ns, unsigned int broadcast_timeout,
                               netbios_ns_discover_callbacks *callbacks);
 
+/**
+ * @brief Prepare a NETBIOS discovery driven by the caller
+ * @details Same as netbios_ns_discover_start(), but without a thread: the
+ * discovery only makes progress when netbios_ns_discover_process() is called,
+ * which lets it run in the event loop of the application. The callbacks are
+ * called from netbios_ns_discover_process(). Use netbios_ns_discover_stop()
+ * to end it.
+ *
+ * @param ns The name service object.
+ * @param broadcast_timeout Do a broadcast every timeout seconds, or only once
+ * if 0
+ * @param callbacks The callbacks previously setup by the caller
+ * @return 0 on success or -1 on failure
+ */
+int netbios_ns_discover_open(netbios_ns *ns, unsigned int broadcast_timeout,
+                             netbios_ns_discover_callbacks *callbacks);
+
+/**
+ * @brief Get the file descriptor of a discovery
+ * @details For use with poll(), epoll or any event loop: it becomes readable
+ * when answers arrive, netbios_ns_discover_process() must then be called. It
+ * must not be read from directly.
+ *
+ * @param ns The name service object.
+ * @return The file descriptor or -1 if no discovery is started
+ */
+int netbios_ns_discover_get_fd(netbios_ns *ns);
+
+/**
+ * @brief Make a discovery progress without blocking
+ * @details Handles the answers received so far, forgets the machines which
+ * stopped answering and sends the broadcasts which are due. Call it when the
+ * file descriptor of netbios_ns_discover_get_fd() is readable, and when the
+ * delay it returned is over.
+ *
+ * @param ns The name service object, with a discovery opened by
+ * netbios_ns_discover_open()
+ * @return The delay in milliseconds before it must be called again if nothing
+ * is received (INT_MAX if there is nothing to wait for), or -1 on failure
+ */
+int netbios_ns_discover_process(netbios_ns *ns);
+
 /**
  * @brief Stop the NETBIOS discovery.
  * @param ns The name service object.
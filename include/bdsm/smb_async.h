@@ -0,0 +1,223 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/**
+ * @file smb_async.h
+ * @brief Asynchronous file operations
+ * @details These functions send their request and return immediately, the
+ * reply is processed later by smb_session_wait() (or by any synchronous call
+ * made on the same session in the meantime), which calls the completion
+ * callback. Many requests can thus be in flight at the same time on a single
+ * session, the server may answer them in any order.
+ *
+ * Callbacks are called from the thread waiting on the session. They may issue
+ * new asynchronous requests but must not call synchronous functions on the
+ * same session. When the connection fails or the session is destroyed, the
+ * callbacks of all pending requests are called with #DSM_ERROR_NETWORK.
+ *
+ * All these functions return #DSM_SUCCESS if the request has been sent, in
+ * which case the callback will be called exactly once, or a DSM error code
+ * otherwise (and the callback won't be called).
+ */
+
+#ifndef __BDSM_SMB_ASYNC_H_
+#define __BDSM_SMB_ASYNC_H_
+
+#include "smb_session.h"
+
+/**
+ * @brief Process replies until at least one pending request is completed
+ * @details Blocks until a reply is received. Returns immediately if there is
+ * no pending request.
+ *
+ * @param s The session object
+ * @return #DSM_SUCCESS or #DSM_ERROR_NETWORK if the connection failed (all
+ * the pending requests are then completed with this error)
+ */
+int             smb_session_wait(smb_session *s);
+
+/**
+ * @brief Process replies until there is no more pending request
+ *
+ * @param s The session object
+ * @return #DSM_SUCCESS or #DSM_ERROR_NETWORK if the connection failed
+ */
+int             smb_session_wait_all(smb_session *s);
+
+/**
+ * @brief Get the number of asynchronous requests waiting for their reply
+ *
+ * @param s The session object
+ * @return The number of pending requests
+ */
+unsigned int    smb_session_pending_count(smb_session *s);
+
+/** The session needs to read from its socket, see smb_session_want() */
+#define SMB_SESSION_WANT_READ   (1 << 0)
+/** The session needs to write to its socket, see smb_session_want() */
+#define SMB_SESSION_WANT_WRITE  (1 << 1)
+
+/**
+ * @brief Get the socket of a connected session
+ * @details For use with poll(), epoll or any event loop, along with
+ * smb_session_want() and smb_session_process(). The socket must not be read
+ * from or written to directly.
+ *
+ * @param s The session object
+ * @return The socket file descriptor or -1 if the session isn't connected
+ */
+int             smb_session_get_fd(smb_session *s);
+
+/**
+ * @brief Switch a session to non-blocking mode (or back)
+ * @details In non-blocking mode, requests are queued instead of blocking
+ * when the socket buffer is full, and sent as the socket becomes writable by
+ * smb_session_process(). The data given to smb_fwrite_async() is copied.
+ * Synchronous calls and smb_session_wait() are still allowed, they block
+ * until their reply is received. Not available on thread-safe sessions.
+ *
+ * @param s The session object, connected
+ * @param nonblocking 1 to enable non-blocking mode, 0 to disable it
+ * @return #DSM_SUCCESS or a DSM error code
+ */
+int             smb_session_set_nonblocking(smb_session *s, int nonblocking);
+
+/**
+ * @brief What the session is waiting for to make progress
+ *
+ * @param s The session object
+ * @return A combination of #SMB_SESSION_WANT_READ (there are pending
+ * requests) and #SMB_SESSION_WANT_WRITE (there is queued data to send)
+ */
+int             smb_session_want(smb_session *s);
+
+/**
+ * @brief Make progress without blocking
+ * @details Sends as much queued data as the socket accepts, then processes
+ * every reply fully received so far, calling the completion callbacks. Call
+ * it whenever the socket is readable or writable, as told by
+ * smb_session_want().
+ *
+ * @param s The session object
+ * @return #DSM_SUCCESS or #DSM_ERROR_NETWORK if the connection failed (all
+ * the pending requests are then completed with this error)
+ */
+int             smb_session_process(smb_session *s);
+
+/**
+ * @brief Asynchronous version of smb_fopen()
+ * @details On success, the new descriptor is given in the 'fd' field of the
+ * result.
+ *
+ * @param s The session object
+ * @param tid The tid of the share the file is in
+ * @param path The path of the file to open
+ * @param mod The access modes requested (example: #SMB_MOD_RO)
+ * @param cb The completion callback, can be NULL
+ * @param opaque User data given to the callback
+ * @return #DSM_SUCCESS if the request was sent or a DSM error code
+ */
+int             smb_fopen_async(smb_session *s, smb_tid tid, const char *path,
+                                uint32_t mod, smb_async_cb cb, void *opaque);
+
+/**
+ * @brief Read from an open file at a given offset, asynchronously
+ * @details At most one protocol request worth of data is read, the number of
+ * bytes read is given in the 'size' field of the result and may be less than
+ * buf_size. The read pointer of the file is not used nor modified. The data
+ * is received straight into 'buf', which must stay valid until the callback
+ * is called.
+ *
+ * @param s The session object
+ * @param fd The SMB file descriptor
+ * @param buf Where to store the data, can be NULL to skip it
+ * @param buf_size The number of bytes to read
+ * @param offset Where to read from in the file
+ * @param cb The completion callback, can be NULL
+ * @param opaque User data given to the callback
+ * @return #DSM_SUCCESS if the request was sent or a DSM error code
+ */
+int             smb_fread_async(smb_session *s, smb_fd fd, void *buf,
+                                size_t buf_size, uint64_t offset,
+                                smb_async_cb cb, void *opaque);
+
+/**
+ * @brief Write to an open file at a given offset, asynchronously
+ * @details At most one protocol request worth of data is written, the number
+ * of bytes written is given in the 'size' field of the result. The data is
+ * sent (or copied, in non-blocking mode) before this function returns, 'buf'
+ * can be reused right away. The
+ * read/write pointer of the file is not used nor modified.
+ *
+ * @param s The session object
+ * @param fd The SMB file descriptor
+ * @param buf The data to write
+ * @param buf_size The number of bytes to write
+ * @param offset Where to write in the file
+ * @param cb The completion callback, can be NULL
+ * @param opaque User data given to the callback
+ * @return #DSM_SUCCESS if the request was sent or a DSM error code
+ */
+int             smb_fwrite_async(smb_session *s, smb_fd fd, const void *buf,
+                                 size_t buf_size, uint64_t offset,
+                                 smb_async_cb cb, void *opaque);
+
+/**
+ * @brief Asynchronous version of smb_fclose()
+ * @details The descriptor is invalid as soon as this function is called.
+ * Data buffered by write-behind is flushed first. If that fails, the file is
+ * closed all the same and the callback gets the error of the flush.
+ *
+ * @param s The session object
+ * @param fd The SMB file descriptor
+ * @param cb The completion callback, can be NULL
+ * @param opaque User data given to the callback
+ * @return #DSM_SUCCESS if the request was sent or a DSM error code
+ */
+int             smb_fclose_async(smb_session *s, smb_fd fd, smb_async_cb cb,
+                                 void *opaque);
+
+/**
+ * @brief Asynchronous version of smb_fstat()
+ * @details On success, the file status is given in the 'st' field of the
+ * result, it belongs to the callback which has to release it with
+ * smb_stat_destroy().
+ *
+ * @param s The session object
+ * @param tid The tid of the share the file is in
+ * @param path The path of the file
+ * @param cb The completion callback, can be NULL
+ * @param opaque User data given to the callback
+ * @return #DSM_SUCCESS if the request was sent or a DSM error code
+ */
+int             smb_fstat_async(smb_session *s, smb_tid tid, const char *path,
+                                smb_async_cb cb, void *opaque);
+
+#endif
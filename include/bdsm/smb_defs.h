@@ -75,6 +75,19 @@ enum
     SMB_SEEK_CUR                = 1
 };
 
+//-----------------------------------------------------------------------------/
+// smb_walk() callback return values
+//-----------------------------------------------------------------------------/
+enum
+{
+    /// Go on with the walk
+    SMB_WALK_CONTINUE           = 0,
+    /// Don't enter this directory
+    SMB_WALK_SKIP               = 1,
+    /// Stop the walk
+    SMB_WALK_STOP               = 2
+};
+
 enum smb_session_supports_what
 {
     SMB_SESSION_XSEC            = 0,
@@ -146,8 +159,11 @@ enum smb_session_supports_what
 #define NT_STATUS_INVALID_SMB               0x00010002
 #define NT_STATUS_SMB_BAD_TID               0x00050002
 #define NT_STATUS_SMB_BAD_UID               0x005b0002
+#define NT_STATUS_BUFFER_OVERFLOW           0x80000005
+#define NT_STATUS_NO_MORE_FILES             0x80000006
 #define NT_STATUS_NOT_IMPLEMENTED           0xc0000002
 #define NT_STATUS_INVALID_DEVICE_REQUEST    0xc0000010
+#define NT_STATUS_INVALID_PARAMETER         0xc000000d
 #define NT_STATUS_NO_SUCH_DEVICE            0xc000000e
 #define NT_STATUS_NO_SUCH_FILE              0xc000000f
 #define NT_STATUS_MORE_PROCESSING_REQUIRED  0xc0000016
@@ -169,6 +185,7 @@ enum smb_session_supports_what
 #define NT_STATUS_MEDIA_WRITE_PROTECTED     0xc00000a2
 #define NT_STATUS_ILLEGAL_FUNCTION          0xc00000af
 #define NT_STATUS_FILE_IS_A_DIRECTORY       0xc00000ba
+#define NT_STATUS_NOT_SUPPORTED             0xc00000bb
 #define NT_STATUS_FILE_RENAMED              0xc00000d5
 #define NT_STATUS_REDIRECTOR_NOT_STARTED    0xc00000fb
 #define NT_STATUS_DIRECTORY_NOT_EMPTY       0xc0000101
@@ -176,6 +193,7 @@ enum smb_session_supports_what
 #define NT_STATUS_TOO_MANY_OPENED_FILES     0xc000011f
 #define NT_STATUS_CANNOT_DELETE             0xc0000121
 #define NT_STATUS_FILE_DELETED              0xc0000123
+#define NT_STATUS_INVALID_LEVEL             0xc0000148
 #define NT_STATUS_INSUFF_SERVER_RESOURCES   0xc0000205
 
 #define DSM_SUCCESS         (0)
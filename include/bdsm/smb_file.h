@@ -61,6 +61,9 @@ int       smb_fopen(smb_session *s, smb_tid tid, const char *path,
  * @details The smb_fd is invalidated and MUST not be use it anymore. You can
  * give it the 0 value.
  *
+ * Data buffered by write-behind is flushed first, but a failure can't be
+ * reported: call smb_fflush() before to check it.
+ *
  * @param s The session object
  * @param fd The SMB file descriptor
  */
@@ -73,6 +76,10 @@ void      smb_fclose(smb_session *s, smb_fd fd);
  * the memory pointed by 'buf' from the open file represented by the smb file
  * descriptor 'fd'.
  *
+ * If a read window has been set with smb_session_set_read_window(), large
+ * reads are split into several pipelined requests and this function returns
+ * once the whole buffer is filled or the end of file is reached.
+ *
  * @param[in] s The session object
  * @param[in] fd [description]
  * @param[out] buf can be NULL in order to skip buf_size bytes
@@ -87,6 +94,10 @@ ssize_t   smb_fread(smb_session *s, smb_fd fd, void *buf, size_t buf_size);
  * to the current seek offset of the open file represented by the smb file
  * descriptor 'fd'.
  *
+ * If write-behind is enabled with smb_file_set_write_behind(), the data is
+ * buffered and the whole buffer is accepted. An error of a buffered write is
+ * reported by the next call.
+ *
  * @param[in] s The session object
  * @param[in] fd [description]
  * @param[out] buf [description]
@@ -95,6 +106,42 @@ ssize_t   smb_fread(smb_session *s, smb_fd fd, void *buf, size_t buf_size);
  */
 ssize_t   smb_fwrite(smb_session *s, smb_fd fd, void *buf, size_t buf_size);
 
+/**
+ * @brief Read from an open file at a given offset
+ * @details Unlike smb_fread(), the read pointer of the file is neither used
+ * nor modified, so it's safe for random access on a shared descriptor. The
+ * read is split into as many requests as needed (pipelined if a read window
+ * has been set) until 'buf_size' bytes are read or the end of file is
+ * reached.
+ *
+ * @param[in] s The session object
+ * @param[in] fd The SMB file descriptor
+ * @param[out] buf can be NULL in order to skip buf_size bytes
+ * @param[in] buf_size The number of bytes to read
+ * @param[in] offset Where to read from in the file
+ * @return The number of bytes read (less than buf_size only at end of file or
+ * on error) or -1 if nothing could be read.
+ */
+ssize_t   smb_pread(smb_session *s, smb_fd fd, void *buf, size_t buf_size,
+                    uint64_t offset);
+
+/**
+ * @brief Write to an open file at a given offset
+ * @details Unlike smb_fwrite(), the read/write pointer of the file is neither
+ * used nor modified. The data is sent in as many requests as needed until
+ * 'buf_size' bytes are written.
+ *
+ * @param[in] s The session object
+ * @param[in] fd The SMB file descriptor
+ * @param[in] buf The data to write
+ * @param[in] buf_size The number of bytes to write
+ * @param[in] offset Where to write in the file
+ * @return The number of bytes written (less than buf_size only on error) or
+ * -1 if nothing could be written.
+ */
+ssize_t   smb_pwrite(smb_session *s, smb_fd fd, const void *buf,
+                     size_t buf_size, uint64_t offset);
+
 /**
  * @brief Sets/Moves/Get the read/write pointer for a given file
  * @details The behavior of this function is the same as the Unix fseek()
@@ -115,6 +162,76 @@ ssize_t   smb_fwrite(smb_session *s, smb_fd fd, void *buf, size_t buf_size);
  */
 ssize_t   smb_fseek(smb_session *s, smb_fd fd, off_t offset, int whence);
 
+/**
+ * @brief Enable read-ahead on an open file
+ * @details Once the reads of smb_fread() are found to be sequential, a
+ * window of 'window' bytes is read at once and the next window is prefetched
+ * asynchronously while the current one is consumed. Reads smaller than the
+ * window are then served from memory. Writing to the file or seeking away
+ * from the buffered data discards it.
+ *
+ * The buffers cost twice the window in memory. Pick a window made of a few
+ * times the session max read size to keep the server busy.
+ *
+ * @param s The session object
+ * @param fd The SMB file descriptor
+ * @param window The size of the read-ahead window in bytes, 0 to disable it
+ * @return #DSM_SUCCESS or a DSM error code
+ *
+ * @see smb_file_get_stats
+ */
+int       smb_file_set_readahead(smb_session *s, smb_fd fd, size_t window);
+
+/**
+ * @brief Get the read counters of an open file
+ * @details The hit rate of the read-ahead is stats.hits / stats.reads, and
+ * bytes_wire / bytes_read tells how much of what was read ahead got used.
+ * bytes_copied counts the copies of file data made on its way to the
+ * caller, which receiving READ_ANDX data in place avoids.
+ *
+ * @param s The session object
+ * @param fd The SMB file descriptor
+ * @param stats Where to store the counters
+ * @return #DSM_SUCCESS or a DSM error code
+ */
+int       smb_file_get_stats(smb_session *s, smb_fd fd,
+                             smb_file_stats *stats);
+
+/**
+ * @brief Enable write-behind on an open file
+ * @details Adjacent writes of smb_fwrite() and smb_pwrite() are gathered in a
+ * buffer of 'threshold' bytes, sent as WRITE_ANDX requests of the maximum
+ * size once it's full. The replies aren't waited for until the next flush.
+ * Reading from the file, smb_fflush() and smb_fclose() send what's buffered
+ * and wait for it to be written.
+ *
+ * A failed write is reported by the next write or flush of the file. Data
+ * which couldn't be sent at all (the connection failed) stays buffered, and
+ * the next smb_fflush() sends it again.
+ *
+ * @param s The session object
+ * @param fd The SMB file descriptor
+ * @param threshold The size of the buffer in bytes, 0 to disable write-behind
+ * (flushing what's buffered)
+ * @param write_through If zero, the server may acknowledge writes before
+ * they reach the disk. The files opened with #SMB_MOD_RW are created with the
+ * write-through option anyway.
+ * @return #DSM_SUCCESS or a DSM error code, which can be the error of a
+ * previous write. The settings are then left unchanged, with what wasn't
+ * written still buffered.
+ */
+int       smb_file_set_write_behind(smb_session *s, smb_fd fd,
+                                    size_t threshold, int write_through);
+
+/**
+ * @brief Send the data buffered by write-behind and wait for it to be written
+ *
+ * @param s The session object
+ * @param fd The SMB file descriptor
+ * @return #DSM_SUCCESS or the error of a write done since the last call
+ */
+int       smb_fflush(smb_session *s, smb_fd fd);
+
 /**
  * @brief remove a file on a share.
  * @details Use this function to delete a file
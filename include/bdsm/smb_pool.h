@@ -0,0 +1,152 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/**
+ * @file smb_pool.h
+ * @brief Pool of sessions to a share
+ * @details A pool keeps up to a given number of authenticated connections to
+ * the same share of a server, so that connecting, negotiating and logging in
+ * is done once per connection instead of once per user. Connections are
+ * leased to one user at a time, created on demand and reconnected when found
+ * dead. Large reads can also be striped over several connections, which helps
+ * when a single TCP stream can't fill the link.
+ */
+
+#ifndef __BDSM_SMB_POOL_H_
+#define __BDSM_SMB_POOL_H_
+
+#include "smb_session.h"
+
+/**
+ * @brief Allocate a new pool
+ * @details Nothing is connected until smb_session_pool_connect().
+ *
+ * @param size The maximum number of connections
+ * @return A new pool or NULL on failure
+ */
+smb_session_pool *smb_session_pool_new(unsigned int size);
+
+/**
+ * @brief Close all the connections of a pool and free it
+ * @details All the leased sessions must have been released.
+ *
+ * @param pool The pool to destroy
+ */
+void            smb_session_pool_destroy(smb_session_pool *pool);
+
+/**
+ * @brief Set the credentials used by the connections of the pool
+ * @details Same as smb_session_set_creds(), it must be called before
+ * smb_session_pool_connect().
+ */
+void            smb_session_pool_set_creds(smb_session_pool *pool,
+                                           const char *domain,
+                                           const char *login,
+                                           const char *password);
+
+/**
+ * @brief Set the target of the pool and open its first connection
+ * @details The arguments are the same as those of smb_session_connect() and
+ * smb_tree_connect(). The first connection is established right away, so
+ * that errors are reported here, the others are established when needed.
+ *
+ * @param pool The pool object
+ * @param hostname The netbios name of the server
+ * @param ip The ip of the server
+ * @param user_port The port to connect to if the default ones fail, can be
+ * NULL
+ * @param transport SMB_TRANSPORT_TCP or SMB_TRANSPORT_NBT
+ * @param share The name of the share to connect to
+ * @return 0 on success or a DSM error code in case of error
+ */
+int             smb_session_pool_connect(smb_session_pool *pool,
+                                         const char *hostname, const char *ip,
+                                         const char *user_port, int transport,
+                                         const char *share);
+
+/**
+ * @brief Set the read window of the sessions of the pool
+ * @see smb_session_set_read_window
+ */
+void            smb_session_pool_set_read_window(smb_session_pool *pool,
+                                                 unsigned int window);
+
+/**
+ * @brief Get the maximum number of connections of the pool
+ */
+unsigned int    smb_session_pool_get_size(smb_session_pool *pool);
+
+/**
+ * @brief Get a session for exclusive use
+ * @details Waits for a connection to be available if they are all leased.
+ * An idle connection found closed by the server is reconnected.
+ *
+ * @param pool The pool object
+ * @param tid Where to store the tid of the share on the returned session
+ * @return A session, logged in and connected to the share of the pool, or
+ * NULL if no connection could be established
+ */
+smb_session     *smb_session_pool_lease(smb_session_pool *pool, smb_tid *tid);
+
+/**
+ * @brief Give back a session obtained with smb_session_pool_lease()
+ * @details The files opened on the session should have been closed.
+ *
+ * @param pool The pool object
+ * @param s The session to release
+ * @param failed Non-zero if a network error occured while using the session,
+ * it is then reconnected before being leased again
+ */
+void            smb_session_pool_release(smb_session_pool *pool,
+                                         smb_session *s, int failed);
+
+/**
+ * @brief Read a part of a file using several connections at once
+ * @details The range is split into chunks read in parallel, each connection
+ * of the pool opening the file on its own. A chunk whose read fails is
+ * retried once on a new connection, then handed over to another connection.
+ * Returns once the whole range is read or the end of file is reached.
+ *
+ * @param pool The pool object
+ * @param path The path of the file in the share
+ * @param buf Where to store the data
+ * @param buf_size The number of bytes to read
+ * @param offset Where to read from in the file
+ * @param stripes The number of connections to use, 0 to use the size of the
+ * pool
+ * @return The number of bytes read (less than buf_size only at end of file)
+ * or -1 if a part of the range before the end of file couldn't be read.
+ */
+ssize_t         smb_session_pool_pread(smb_session_pool *pool,
+                                       const char *path, void *buf,
+                                       size_t buf_size, uint64_t offset,
+                                       unsigned int stripes);
+
+#endif
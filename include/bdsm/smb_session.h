@@ -135,6 +135,100 @@ const char      *smb_session_server_name(smb_session *s);
  */
 int             smb_session_supports(smb_session *s, int what);
 
+/**
+ * @brief Set how many READ_ANDX requests smb_fread() may keep in flight
+ * @details When the window is greater than 1, a smb_fread() larger than a
+ * single protocol read is split into several requests at consecutive offsets
+ * which are sent without waiting for the previous replies. This hides the
+ * network latency on large sequential reads. The window is clamped to the
+ * maximum number of pending requests advertised by the server (if connected).
+ *
+ * @param s The session object
+ * @param window The number of requests in flight, 1 (the default) disables
+ * pipelining
+ *
+ * @return The window actually in use or a DSM error code in case of error
+ */
+int             smb_session_set_read_window(smb_session *s, unsigned int window);
+
+/**
+ * @brief Set how many entries a directory listing asks for per round trip
+ * @details Each FIND_FIRST2/FIND_NEXT2 request of smb_find() and
+ * smb_find_open() asks for up to 'count' entries, in a reply of at most
+ * 'buf_size' bytes of data. The server sends whichever limit is reached
+ * first. The buffer is capped to what a single message can carry.
+ *
+ * Unless the server handles only one request at a time, the next batch is
+ * requested as soon as a batch arrives, while it is being consumed.
+ *
+ * @param s The session object
+ * @param count The number of entries per request, 0 for the default
+ * @param buf_size The maximum size of each reply, 0 for the largest possible
+ *
+ * @return #DSM_SUCCESS or a DSM error code in case of error
+ */
+int             smb_session_set_find_batch(smb_session *s, uint16_t count,
+                                           uint16_t buf_size);
+
+/**
+ * @brief Cache the status of files and directories
+ * @details smb_fstat() results and the entries listed by smb_find(),
+ * smb_find_open() or smb_walk() are kept for 'ttl_ms' milliseconds, and
+ * smb_fstat() is answered from them without asking the server. Once
+ * 'max_entries' paths are cached, the least recently used one is dropped.
+ *
+ * Removing, moving, creating or writing to files with this session forgets
+ * about the paths involved and their parent directory. Changes made by other
+ * clients are only seen once the entries expire.
+ *
+ * Changing the settings empties the cache and resets its counters.
+ *
+ * @param s The session object
+ * @param ttl_ms How long an entry is valid, 0 to keep it until it's evicted
+ * or invalidated
+ * @param max_entries The maximum number of cached paths, 0 to disable the
+ * cache (the default)
+ * @return #DSM_SUCCESS or a DSM error code in case of error
+ *
+ * @see smb_session_get_stat_cache_stats
+ */
+int             smb_session_set_stat_cache(smb_session *s,
+                                           unsigned int ttl_ms,
+                                           size_t max_entries);
+
+/**
+ * @brief Get the counters of the metadata cache
+ * @details They are all 0 if the cache isn't enabled.
+ *
+ * @param s The session object
+ * @param stats Where to store the counters
+ * @return #DSM_SUCCESS or a DSM error code in case of error
+ */
+int             smb_session_get_stat_cache_stats(smb_session *s,
+                                                 smb_stat_cache_stats *stats);
+
+/**
+ * @brief Allow several threads to use the session at the same time
+ * @details Once enabled, the session can be shared by threads issuing
+ * operations concurrently, typically on different files. Their requests are
+ * interleaved on the connection and each reply is routed back to the thread
+ * which sent the request, using its multiplex ID. Whichever thread is waiting
+ * receives for all the others, so the callbacks of async requests may run in
+ * any of them.
+ *
+ * Operations on a given smb_fd must still be serialized by the caller, and
+ * smb_session_get_nt_status() reports the last error of the calling thread.
+ * This can't be combined with smb_session_set_nonblocking(). Enable it before
+ * the session is shared. What the session keeps for each thread is freed
+ * when the thread exits, so threads may come and go, but none may exit while
+ * smb_session_destroy() runs.
+ *
+ * @param s The session object
+ * @param thread_safe 1 to enable thread-safe mode, 0 to disable it
+ * @return #DSM_SUCCESS or a DSM error code
+ */
+int             smb_session_set_thread_safe(smb_session *s, int thread_safe);
+
 /**
 
  * @brief Get the last NT_STATUS
@@ -65,10 +65,49 @@
  * @param pattern The pattern to match files. '\\*' will list all the files at
  * the root of the share. '\\afolder\\*' will list all the files inside of the
  * 'afolder' directory.
- * @return An opaque list of smb_stat or NULL in case of error
+ * @return An opaque list of smb_stat, in the order the server sent them, or
+ * NULL in case of error. The list is stored in a single block of memory.
+ * Versions up to 0.2.7 returned the entries in the reverse order.
  */
 smb_stat_list   smb_find(smb_session *s, smb_tid tid, const char *pattern);
 
+/**
+ * @brief Start listing the files matching a pattern, one at a time
+ * @details Unlike smb_find(), the entries are returned as the replies of the
+ * server arrive, and at most two replies are held in memory: the one being
+ * iterated and the next one, requested ahead (see
+ * smb_session_set_find_batch()). Other operations can be done on the session
+ * between two entries.
+ *
+ * @param s The session object
+ * @param tid The share inside of which we want to find files obtained by
+ * smb_tree_connect()
+ * @param pattern The pattern to match files, see smb_find()
+ * @return An iterator to use with smb_find_next_entry() and to release with
+ * smb_find_close(), or NULL in case of error
+ */
+smb_find_iter   *smb_find_open(smb_session *s, smb_tid tid,
+                               const char *pattern);
+
+/**
+ * @brief Get the next file of a listing
+ *
+ * @param it An iterator returned by smb_find_open()
+ * @return The status of the next file, or NULL at the end of the listing or
+ * in case of error (see smb_find_close()). It belongs to the iterator and is
+ * only valid until the next call.
+ */
+smb_stat        smb_find_next_entry(smb_find_iter *it);
+
+/**
+ * @brief Stop a listing and release its iterator
+ *
+ * @param it An iterator returned by smb_find_open()
+ * @return #DSM_SUCCESS if no error stopped the listing, a DSM error code
+ * otherwise
+ */
+int             smb_find_close(smb_find_iter *it);
+
 /**
  * @brief Get the status of a file from it's path inside of a share
  *
@@ -84,9 +123,30 @@ smb_stat_list   smb_find(smb_session *s, smb_tid tid, const char *pattern);
 
 smb_file  *smb_fstat(smb_session *s, smb_tid tid, const char *path);
 
+/**
+ * @brief Get the status of several files of a share at once
+ * @details The queries are pipelined, up to what the server accepts, instead
+ * of waiting for each reply before sending the next query like successive
+ * smb_fstat() calls do.
+ *
+ * @param s The session object
+ * @param tid The tree id of a share obtained by smb_tree_connect()
+ * @param paths The paths of the files, like for smb_fstat()
+ * @param count The number of paths
+ * @param st An array of 'count' smb_stat receiving the status of each path,
+ * or NULL for those which couldn't be queried. They must be destroyed with
+ * smb_stat_destroy(), even if the function fails.
+ *
+ * @return The number of files found, or -1 if the session failed
+ */
+ssize_t   smb_fstat_many(smb_session *s, smb_tid tid,
+                         const char * const *paths, size_t count,
+                         smb_stat *st);
+
 /**
  * @brief Get the status of an open file from it's file descriptor
- * @details The file status will be those at the time of open
+ * @details The file status will be those at the time of open, or of the
+ * last smb_stat_fd_refresh() or smb_stat_fd_size() call
  *
  * @param s The session object
  * @param fd The smb_fd from which you want infos/status
@@ -96,17 +156,48 @@ smb_file  *smb_fstat(smb_session *s, smb_tid tid, const char *path);
  */
 smb_stat        smb_stat_fd(smb_session *s, smb_fd fd);
 
+/**
+ * @brief Update the status of an open file from the server
+ * @details The file is queried by its handle rather than its path, so this
+ * works even if it was renamed since it was opened. Data buffered by
+ * write-behind is flushed first. The new status is available through
+ * smb_stat_fd().
+ *
+ * @param s The session object
+ * @param fd The SMB file descriptor
+ * @return #DSM_SUCCESS or a DSM error code
+ */
+int             smb_stat_fd_refresh(smb_session *s, smb_fd fd);
+
+/**
+ * @brief Get the current size of an open file from the server
+ * @details A cheaper smb_stat_fd_refresh() for polling a growing file: only
+ * the sizes are queried and updated.
+ *
+ * @param s The session object
+ * @param fd The SMB file descriptor
+ * @param size Where to store the size of the file
+ * @return #DSM_SUCCESS or a DSM error code
+ */
+int             smb_stat_fd_size(smb_session *s, smb_fd fd, uint64_t *size);
+
 /**
  * @brief Clear a smb_stat object, reclaiming its memory
+ * @details Same as smb_stat_list_destroy(): given the first entry of a
+ * listing, the whole listing is freed. The other entries of a listing are
+ * freed along with it, destroying them alone does nothing.
  *
- * @param stat A smb_stat object returned by smb_fstat. 
+ * @param stat A smb_stat object returned by smb_fstat() or smb_fstat_many()
  */
 void            smb_stat_destroy(smb_stat stat);
 
 /**
  * @brief Get the number of item in a smb_stat_list file info
+ * @details This doesn't walk the list returned by smb_find(). Given one of
+ * its entries, as returned by smb_stat_list_next(), it counts the entries
+ * from there to the end.
  *
- * @param list The list you want the length of
+ * @param list The list you want the length of, as returned by smb_find()
  * @return The length of the list. It returns 0 if the list is invalid
  */
 size_t            smb_stat_list_count(smb_stat_list list);
@@ -114,8 +205,10 @@ size_t            smb_stat_list_count(smb_stat_list list);
 smb_stat        smb_stat_list_next(smb_stat_list stat);
 /**
  * @brief Get the element at the given position.
+ * @details This doesn't walk the list returned by smb_find(). Like for
+ * smb_stat_list_count(), the position is relative to the entry given.
  *
- * @param list A stat list
+ * @param list A stat list, as returned by smb_find()
  * @param index The position of the element you want.
  *
  * @return An opaque smb_stat or NULL in case of error
@@ -124,6 +217,9 @@ smb_stat        smb_stat_list_at(smb_stat_list list, size_t index);
 
 /**
  * @brief Destroy and release a list of file stat returned by smb_find
+ * @details Given another entry of the listing, this does nothing: the
+ * listing is freed at once from its first entry. A smb_stat returned by
+ * smb_fstat() can be released with this function too.
  *
  * @param list The stat_list to free
  */
@@ -0,0 +1,82 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/**
+ * @file smb_transfer.h
+ * @brief Whole file transfers
+ * @details These functions copy a whole file between a share and a local file
+ * descriptor. The file is split into pieces of one protocol request each,
+ * several of them being in flight at once on every connection used. Local
+ * I/O is done with pread()/pwrite() as pieces complete, in whatever order.
+ */
+
+#ifndef __BDSM_SMB_TRANSFER_H_
+#define __BDSM_SMB_TRANSFER_H_
+
+#include "smb_session.h"
+
+/**
+ * @brief Copy a remote file to a local file
+ * @details The local file is extended to the size of the remote one first
+ * (sparsely, where the filesystem allows it). If a pool is given in the
+ * options, its connections download parts of the file in parallel with the
+ * session 's', each in its own thread.
+ *
+ * @param s The session object
+ * @param tid The tid of the share the file is in
+ * @param remote_path The path of the file to download
+ * @param local_fd A file descriptor open for writing on a regular file
+ * @param opts The transfer options, can be NULL
+ * @return #DSM_SUCCESS, #DSM_ERROR_GENERIC if the pool of the options isn't
+ * connected to the same share, or a DSM error code
+ */
+int             smb_file_download(smb_session *s, smb_tid tid,
+                                  const char *remote_path, int local_fd,
+                                  const smb_transfer_opts *opts);
+
+/**
+ * @brief Copy a local file to a remote file
+ * @details The remote file is created, or truncated if it exists. If a pool
+ * is given in the options, its connections upload parts of the file in
+ * parallel with the session 's', each in its own thread.
+ *
+ * @param s The session object
+ * @param tid The tid of the share to write to
+ * @param remote_path The path of the file to create
+ * @param local_fd A file descriptor open for reading on a regular file
+ * @param opts The transfer options, can be NULL
+ * @return #DSM_SUCCESS, #DSM_ERROR_GENERIC if the pool of the options isn't
+ * connected to the same share, or a DSM error code
+ */
+int             smb_file_upload(smb_session *s, smb_tid tid,
+                                const char *remote_path, int local_fd,
+                                const smb_transfer_opts *opts);
+
+#endif
@@ -38,6 +38,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 
 #define _FILE_OFFSET_BITS 64
 
@@ -81,6 +82,18 @@ typedef struct
  */
 typedef struct smb_session smb_session;
 
+/**
+ * @brief An opaque data structure to represent a pool of sessions to the
+ * same share.
+ */
+typedef struct smb_session_pool smb_session_pool;
+
+/**
+ * @brief An opaque data structure to represent a directory listing in
+ * progress, see smb_find_open().
+ */
+typedef struct smb_find_iter smb_find_iter;
+
 /**
  * @struct smb_share_list
  * @brief An opaque object representing the list of share of a SMB file server.
@@ -104,4 +117,107 @@ typedef smb_file *smb_stat_list;
  */
 typedef smb_file *smb_stat;
 
+/**
+ * @struct smb_async_result
+ * @brief The outcome of an asynchronous operation, given to its completion
+ * callback. Only the fields relevant to the operation are set.
+ */
+typedef struct
+{
+    int         status;     ///< DSM_SUCCESS or a DSM error code
+    uint32_t    nt_status;  ///< NT status of the reply (when status is DSM_ERROR_NT)
+    smb_fd      fd;         ///< The new file descriptor (smb_fopen_async())
+    ssize_t     size;       ///< Bytes read or written (smb_fread_async(), smb_fwrite_async())
+    smb_stat    st;         ///< File status (smb_fstat_async()), to be freed with smb_stat_destroy()
+}           smb_async_result;
+
+/**
+ * @struct smb_file_stats
+ * @brief Read counters of an open file, see smb_file_get_stats()
+ */
+typedef struct
+{
+    uint64_t    reads;         ///< Calls to smb_fread()
+    uint64_t    hits;          ///< Reads served from the read-ahead without waiting for the server
+    uint64_t    bytes_read;    ///< Bytes returned by smb_fread()
+    uint64_t    bytes_wire;    ///< File data received from the server, read-ahead included
+    uint64_t    bytes_copied;  ///< File data copied in memory before reaching the buffer of smb_fread()
+}           smb_file_stats;
+
+/**
+ * @struct smb_stat_cache_stats
+ * @brief Counters of the metadata cache, see smb_session_get_stat_cache_stats()
+ */
+typedef struct
+{
+    uint64_t    hits;       ///< smb_fstat() calls answered from the cache
+    uint64_t    misses;     ///< smb_fstat() calls which went to the server
+    size_t      entries;    ///< Paths currently in the cache
+}           smb_stat_cache_stats;
+
+/**
+ * @brief Completion callback of an asynchronous operation
+ *
+ * @param s The session the operation was issued on
+ * @param res The result of the operation, only valid during the call
+ * @param opaque The user data given when the operation was issued
+ */
+typedef void (*smb_async_cb)(smb_session *s, const smb_async_result *res,
+                             void *opaque);
+
+/**
+ * @brief Progress callback of smb_file_download() and smb_file_upload()
+ *
+ * @param done The number of bytes transferred so far
+ * @param total The size of the file
+ * @param rate The average throughput since the beginning, in bytes/second
+ * @param opaque The user data given in the options
+ */
+typedef void (*smb_transfer_cb)(uint64_t done, uint64_t total, uint64_t rate,
+                                void *opaque);
+
+/**
+ * @struct smb_transfer_opts
+ * @brief Options of smb_file_download() and smb_file_upload(), all the fields
+ * can be left to 0/NULL.
+ */
+typedef struct
+{
+    unsigned int        window;     ///< Requests in flight per connection (0 for the default)
+    smb_session_pool    *pool;      ///< Additional connections to use, on the same share of the same server, can be NULL
+    unsigned int        connections;///< Max number of connections used, the caller's session included (so 1 takes none from the pool), 0 for the whole pool
+    smb_transfer_cb     progress;   ///< Progress callback, can be NULL
+    void                *opaque;    ///< User data given to the progress callback
+}           smb_transfer_opts;
+
+/**
+ * @brief Callback of smb_walk(), called for each entry found
+ * @details The calls are serialized, even when the walk uses several threads.
+ *
+ * @param path The path of the entry in the share
+ * @param st The status of the entry, only valid during the call. NULL if
+ * 'path' is a directory that couldn't be listed
+ * @param depth How deep the entry is, 1 for the entries of the root
+ * @param opaque The user data given to smb_walk()
+ * @return #SMB_WALK_CONTINUE, #SMB_WALK_SKIP or #SMB_WALK_STOP
+ */
+typedef int (*smb_walk_cb)(const char *path, smb_stat st, unsigned int depth,
+                           void *opaque);
+
+/**
+ * @struct smb_walk_opts
+ * @brief Options of smb_walk(), all the fields can be left to 0/NULL.
+ * @details The patterns match the name of an entry, case insensitively,
+ * '*' standing for any string and '?' for any character.
+ */
+typedef struct
+{
+    unsigned int        max_depth;  ///< Deepest level reported, 0 for no limit
+    const char          *include;   ///< Only report the entries matching this pattern, can be NULL
+    const char          *exclude;   ///< Neither report nor enter what matches this pattern, can be NULL
+    unsigned int        threads;    ///< Threads listing on the session, 0 for 1. More need a thread-safe session
+    smb_session_pool    *pool;      ///< Additional connections to use, on the walked share of the same server, can be NULL
+    unsigned int        connections;///< Max number of connections used, the caller's session included (so 1 takes none from the pool), 0 for the whole pool
+}           smb_walk_opts;
+
 #endif
@@ -0,0 +1,67 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+/**
+ * @file smb_walk.h
+ * @brief Recursive listing of a directory tree
+ * @details The directories of the tree are listed by several workers at
+ * once: threads sharing the caller's session and connections of a pool. Each
+ * worker has its own queue of directories to list, where it puts those it
+ * finds, and takes work from the queues of the others when its own is empty.
+ */
+
+#ifndef __BDSM_SMB_WALK_H_
+#define __BDSM_SMB_WALK_H_
+
+#include "smb_session.h"
+
+/**
+ * @brief List a directory tree recursively
+ * @details The callback is called for every entry of 'root' and its
+ * subdirectories, in no particular order (but a directory is reported before
+ * its content). The "." and ".." entries are ignored. A directory that can't
+ * be listed is reported with a NULL status and the walk goes on.
+ *
+ * @param s The session object
+ * @param tid The tid of the share to walk
+ * @param root The path of the directory to start from, "\\" for the root of
+ * the share
+ * @param cb The function called for each entry
+ * @param opaque User data given to the callback
+ * @param opts The walk options, can be NULL
+ * @return #DSM_SUCCESS if the walk completed or was stopped by the callback,
+ * #DSM_ERROR_GENERIC if the pool of the options isn't connected to the same
+ * share, a DSM error code otherwise
+ */
+int             smb_walk(smb_session *s, smb_tid tid, const char *root,
+                         smb_walk_cb cb, void *opaque,
+                         const smb_walk_opts *opts);
+
+#endif
@@ -54,6 +54,7 @@
 #define NETBIOS_FLAG_TRUNCATED  (1 << 9)
 #define NETBIOS_FLAG_RECURSIVE  (1 << 8)
 #define NETBIOS_FLAG_BROADCAST  (1 << 4)
+#define NETBIOS_RCODE_MASK      0x000f  // Error code of an answer
 
 // Name Service Query
 #define NETBIOS_OP_NAME_QUERY         0x00
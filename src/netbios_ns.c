@@ -35,11 +35,13 @@
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
+#include <ctype.h>
 #include <pthread.h>
 #include <sys/time.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
+#include <limits.h>
 #include <assert.h>
 #ifdef HAVE_SYS_QUEUE_H
 # include <sys/queue.h>
@@ -61,6 +63,10 @@
 # endif
 # include <net/if.h>
 #endif
+#if defined(__linux__) && defined(HAVE_GETIFADDRS)
+# include <sys/epoll.h>
+# define NETBIOS_NS_EPOLL // The discovery has a socket per interface
+#endif
 
 #include "../include/bdsm/netbios_ns.h"
 
@@ -73,7 +79,8 @@
 enum name_query_type {
     NAME_QUERY_TYPE_INVALID,
     NAME_QUERY_TYPE_NB,
-    NAME_QUERY_TYPE_NBSTAT
+    NAME_QUERY_TYPE_NBSTAT,
+    NAME_QUERY_TYPE_NEGATIVE    // Error answer of a name server
 };
 static char name_query_broadcast[] = NETBIOS_WILDCARD;
 
@@ -81,8 +88,28 @@ enum ns_entry_flag {
     NS_ENTRY_FLAG_INVALID = 0x00,
     NS_ENTRY_FLAG_VALID_IP = 0x01,
     NS_ENTRY_FLAG_VALID_NAME = 0x02,
+    NS_ENTRY_FLAG_NEGATIVE = 0x04,      // The name failed to resolve
+    NS_ENTRY_FLAG_DISCOVERED = 0x08,    // Reported added by the discovery
 };
 
+// How long a name that failed to resolve isn't asked again, in seconds
+#define NETBIOS_NS_NEGATIVE_TTL 10
+// Minimum size of the hash indexes
+#define NETBIOS_NS_MIN_BUCKETS  64
+// How long netbios_ns_resolve() waits for an answer, in ms
+#define NETBIOS_NS_RESOLVE_TIMEOUT  2000
+// Defaults of netbios_ns_inverse_batch() and netbios_ns_resolve_batch()
+#define NETBIOS_NS_BATCH_RATE     1000  // Queries per second
+#define NETBIOS_NS_BATCH_TIMEOUT  1000  // ms
+#define NETBIOS_NS_BATCH_RETRIES  1
+// Queries netbios_ns_inverse_batch() may send at once, whatever the rate
+#define NETBIOS_NS_BATCH_BURST    8
+// Delay between the first broadcasts of two interfaces of the discovery, ms
+#define NETBIOS_NS_DISCOVER_STAGGER     50
+// Interfaces and datagrams handled by a netbios_ns_discover_process() call
+#define NETBIOS_NS_DISCOVER_MAX_EVENTS  16
+#define NETBIOS_NS_DISCOVER_MAX_RECV    64
+
 struct netbios_ns_entry
 {
     TAILQ_ENTRY(netbios_ns_entry) next;
@@ -92,9 +119,20 @@ struct netbios_ns_entry
     char                          type;
     int                           flag;
     time_t                        last_time_seen;
+    time_t                        expires;      // 0 if it doesn't expire
+    netbios_ns_entry              *name_next;   // Chain of the name index
+    netbios_ns_entry              *ip_next;     // Chain of the ip index
 };
 typedef TAILQ_HEAD(, netbios_ns_entry) NS_ENTRY_QUEUE;
 
+// A network interface the discovery broadcasts on
+typedef struct
+{
+    int                 socket;         // Bound to the address of the interface
+    uint32_t            broadcast;      // 0 to broadcast on all of them
+    uint64_t            next_broadcast; // In ms, UINT64_MAX for never
+}                       netbios_ns_iface;
+
 #define RECV_BUFFER_SIZE 1500 // Max MTU frame size for ethernet
 
 struct netbios_ns
@@ -103,6 +141,15 @@ struct netbios_ns
     struct sockaddr_in  addr;
     uint16_t            last_trn_id;  // Last transaction id used;
     NS_ENTRY_QUEUE      entry_queue;
+    netbios_ns_entry    **by_name;    // Entries with a valid name, by name
+    netbios_ns_entry    **by_ip;      // Entries with a valid ip, by ip
+    size_t              buckets;      // Size of both indexes, a power of two
+    size_t              nb_entries;
+    unsigned int        negative_ttl; // In seconds, 0 to disable
+    uint32_t            *name_servers; // See netbios_ns_set_name_servers()
+    size_t              nb_name_servers;
+    bool                broadcast;    // Resolve with broadcast queries
+    netbios_ns_cache_stats stats;
     uint8_t             buffer[RECV_BUFFER_SIZE];
 #ifdef HAVE_PIPE
     int                 abort_pipe[2];
@@ -113,13 +160,19 @@ struct netbios_ns
     unsigned int        discover_broadcast_timeout;
     pthread_t           discover_thread;
     bool                discover_started;
+    bool                discover_threaded; // Started by netbios_ns_discover_start()
     netbios_ns_discover_callbacks discover_callbacks;
+    netbios_ns_iface    *ifaces;        // Where the discovery broadcasts
+    size_t              nb_ifaces;
+    int                 discover_fd;    // Readable when answers arrive
+    uint64_t            discover_next_expiry; // In ms
 };
 
 typedef struct netbios_ns_name_query netbios_ns_name_query;
 struct netbios_ns_name_query
 {
     enum name_query_type type;
+    uint32_t ttl;               // Of the answer, in seconds
     union {
         struct {
             uint32_t ip;
@@ -212,6 +265,14 @@ static void netbios_ns_abort(netbios_ns *ns)
     write(ns->abort_pipe[1], &buf, sizeof(uint8_t));
 }
 
+// Undo netbios_ns_abort() once the discovery thread is gone
+static void netbios_ns_abort_clear(netbios_ns *ns)
+{
+    uint8_t buf;
+    if (read(ns->abort_pipe[0], &buf, sizeof(uint8_t)) < 0)
+        BDSM_perror("netbios_ns_abort_clear: ");
+}
+
 #else
 
 static int    ns_open_abort_pipe(netbios_ns *ns)
@@ -239,22 +300,29 @@ static void netbios_ns_abort(netbios_ns *ns)
     pthread_mutex_unlock(&ns->abort_lock);
 }
 
+static void netbios_ns_abort_clear(netbios_ns *ns)
+{
+    pthread_mutex_lock(&ns->abort_lock);
+    ns->aborted = false;
+    pthread_mutex_unlock(&ns->abort_lock);
+}
+
 #endif
 
 static uint16_t query_type_nb = 0x2000;
 static uint16_t query_type_nbstat = 0x2100;
 static uint16_t query_class_in = 0x0100;
 
-static ssize_t netbios_ns_send_packet(netbios_ns* ns, netbios_query* q, uint32_t ip)
+static ssize_t netbios_ns_send_packet(int sock, netbios_query* q, uint32_t ip)
 {
     struct sockaddr_in  addr;
     
     addr.sin_addr.s_addr  = ip;
     addr.sin_family       = AF_INET;
-    addr.sin_port         = htons(NETBIOS_PORT_NAME);
+    addr.sin_port         = htons(atoi(NETBIOS_PORT_NAME));
     
     BDSM_dbg("Sending netbios packet to %s\n", inet_ntoa(addr.sin_addr));
-    return sendto(ns->socket, (void *)q->packet,
+    return sendto(sock, (void *)q->packet,
                   sizeof(netbios_query_packet) + q->cursor, 0,
                   (struct sockaddr *)&addr, sizeof(struct sockaddr_in));
 }
@@ -280,7 +348,7 @@ static void netbios_ns_broadcast_packet(netbios_ns* ns, netbios_query* q)
             continue;
         
         uint32_t ip = sin->sin_addr.s_addr;
-        if (netbios_ns_send_packet(ns, q, ip) == -1)
+        if (netbios_ns_send_packet(ns->socket, q, ip) == -1)
             BDSM_perror("Failed to broadcast");
     }
     freeifaddrs(addrs);
@@ -290,7 +358,7 @@ static void netbios_ns_broadcast_packet(netbios_ns* ns, netbios_query* q)
 
 static void netbios_ns_broadcast_packet(netbios_ns* ns, netbios_query* q)
 {
-    netbios_ns_send_packet(ns, q, INADDR_BROADCAST);
+    netbios_ns_send_packet(ns->socket, q, INADDR_BROADCAST);
 }
 
 #endif
@@ -311,7 +379,7 @@ static void netbios_ns_broadcast_packet(netbios_ns* ns, netbios_query* q)
         {
             uint32_t broadcast = infolist[index].iiAddress.AddressIn.sin_addr.s_addr & infolist[index].iiNetmask.AddressIn.sin_addr.s_addr;
             broadcast |= ~ infolist[index].iiNetmask.AddressIn.sin_addr.S_un.S_addr;
-            if (netbios_ns_send_packet(ns, q, broadcast) == -1)
+            if (netbios_ns_send_packet(ns->socket, q, broadcast) == -1)
                 BDSM_perror("Failed to broadcast");
         }
     }
@@ -319,11 +387,15 @@ static void netbios_ns_broadcast_packet(netbios_ns* ns, netbios_query* q)
 
 #endif
 
-static int netbios_ns_send_name_query(netbios_ns *ns,
-                                      uint32_t ip,
-                                      enum name_query_type type,
-                                      const char *name,
-                                      uint16_t query_flag)
+// Send a name query with the given transaction id. It's broadcast on all
+// the interfaces if ip is 0, 'sock' is used otherwise.
+static int netbios_ns_send_name_query_id(netbios_ns *ns,
+                                         int sock,
+                                         uint32_t ip,
+                                         enum name_query_type type,
+                                         const char *name,
+                                         uint16_t query_flag,
+                                         uint16_t trn_id)
 {
     uint16_t            query_type;
     netbios_query       *q;
@@ -356,12 +428,11 @@ static int netbios_ns_send_name_query(netbios_ns *ns,
     netbios_query_append(q, (const char *)&query_class_in, 2);
     q->packet->queries = htons(1);
     
-    // Increment transaction ID, not to reuse them
-    q->packet->trn_id = htons(ns->last_trn_id + 1);
+    q->packet->trn_id = htons(trn_id);
     
     if (ip != 0)
     {
-        ssize_t sent = netbios_ns_send_packet(ns, q, ip);
+        ssize_t sent = netbios_ns_send_packet(sock, q, ip);
         if (sent < 0)
         {
             BDSM_perror("netbios_ns_send_name_query: ");
@@ -378,6 +449,20 @@ static int netbios_ns_send_name_query(netbios_ns *ns,
     
     netbios_query_destroy(q);
     
+    return 0;
+}
+
+static int netbios_ns_send_name_query(netbios_ns *ns,
+                                      uint32_t ip,
+                                      enum name_query_type type,
+                                      const char *name,
+                                      uint16_t query_flag)
+{
+    // Increment transaction ID, not to reuse them
+    if (netbios_ns_send_name_query_id(ns, ns->socket, ip, type, name,
+                                      query_flag, ns->last_trn_id + 1) == -1)
+        return -1;
+    
     ns->last_trn_id++; // Remember the last transaction id.
     return 0;
 }
@@ -390,6 +475,7 @@ static int netbios_ns_handle_query(netbios_ns *ns, size_t size,
     uint8_t name_size;
     uint16_t *p_type, type;
     uint16_t *p_data_length, data_length;
+    uint32_t ttl;
     char     *p_data;
     
     // check for packet size
@@ -413,6 +499,13 @@ static int netbios_ns_handle_query(netbios_ns *ns, size_t size,
     if (!out_name_query)
         return 0;
     
+    // A name server doesn't know the name, the answer may not be there
+    if (ntohs(q->flags) & NETBIOS_RCODE_MASK)
+    {
+        out_name_query->type = NAME_QUERY_TYPE_NEGATIVE;
+        return 0;
+    }
+    
     // get Name size, should be 0x20
     if (size < sizeof(netbios_query_packet) + 1)
         return -1;
@@ -420,11 +513,13 @@ static int netbios_ns_handle_query(netbios_ns *ns, size_t size,
     if (name_size != 0x20)
         return -1;
     
-    // get type and data_length
-    if (size < sizeof(netbios_query_packet) + name_size + 11)
+    // get type, ttl and data_length
+    if (size < sizeof(netbios_query_packet) + name_size + 12)
         return -1;
     p_type = (uint16_t *) (q->payload + name_size + 2);
     type = *p_type;
+    memcpy(&ttl, q->payload + name_size + 6, sizeof(ttl));
+    out_name_query->ttl = ntohl(ttl);
     p_data_length = (uint16_t *) (q->payload + name_size + 10);
     data_length = ntohs(*p_data_length);
     
@@ -434,7 +529,12 @@ static int netbios_ns_handle_query(netbios_ns *ns, size_t size,
     
     if (type == query_type_nb) {
         out_name_query->type = NAME_QUERY_TYPE_NB;
-        out_name_query->u.nb.ip = recv_ip;
+        // The address is in the answer, after the NB flags, and may not be
+        // the one of the sender (multihomed host, name server)
+        if (data_length >= 6)
+            memcpy(&out_name_query->u.nb.ip, p_data + 2, sizeof(uint32_t));
+        else
+            out_name_query->u.nb.ip = recv_ip;
     } else if (type == query_type_nbstat) {
         uint8_t name_count;
         const char *names = NULL;
@@ -596,69 +696,335 @@ static void netbios_ns_copy_name(char *dest, const char *src)
             break;
 }
 
-static void netbios_ns_entry_set_name(netbios_ns_entry *entry,
+// Names are compared case insensitively, on their first 15 chars
+static uint32_t netbios_ns_name_hash(const char *name)
+{
+    uint32_t hash = 2166136261u;
+
+    for (int i = 0; i < NETBIOS_NAME_LENGTH && name[i]; i++)
+    {
+        hash ^= (uint8_t)toupper((unsigned char)name[i]);
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static bool netbios_ns_name_equal(const char *a, const char *b)
+{
+    for (int i = 0; i < NETBIOS_NAME_LENGTH; i++)
+    {
+        if (toupper((unsigned char)a[i]) != toupper((unsigned char)b[i]))
+            return false;
+        if (a[i] == 0)
+            break;
+    }
+
+    return true;
+}
+
+static uint32_t netbios_ns_ip_hash(uint32_t ip)
+{
+    ip ^= ip >> 16;
+    ip *= 0x85ebca6b;
+    ip ^= ip >> 13;
+    ip *= 0xc2b2ae35;
+    ip ^= ip >> 16;
+
+    return ip;
+}
+
+static void netbios_ns_index_name(netbios_ns *ns, netbios_ns_entry *entry)
+{
+    size_t bucket = netbios_ns_name_hash(entry->name) & (ns->buckets - 1);
+
+    entry->name_next = ns->by_name[bucket];
+    ns->by_name[bucket] = entry;
+}
+
+static void netbios_ns_index_ip(netbios_ns *ns, netbios_ns_entry *entry)
+{
+    size_t bucket = netbios_ns_ip_hash(entry->address.s_addr)
+                    & (ns->buckets - 1);
+
+    entry->ip_next = ns->by_ip[bucket];
+    ns->by_ip[bucket] = entry;
+}
+
+static void netbios_ns_unindex_name(netbios_ns *ns, netbios_ns_entry *entry)
+{
+    size_t bucket = netbios_ns_name_hash(entry->name) & (ns->buckets - 1);
+
+    for (netbios_ns_entry **p = &ns->by_name[bucket]; *p != NULL;
+         p = &(*p)->name_next)
+        if (*p == entry)
+        {
+            *p = entry->name_next;
+            break;
+        }
+}
+
+static void netbios_ns_unindex_ip(netbios_ns *ns, netbios_ns_entry *entry)
+{
+    size_t bucket = netbios_ns_ip_hash(entry->address.s_addr)
+                    & (ns->buckets - 1);
+
+    for (netbios_ns_entry **p = &ns->by_ip[bucket]; *p != NULL;
+         p = &(*p)->ip_next)
+        if (*p == entry)
+        {
+            *p = entry->ip_next;
+            break;
+        }
+}
+
+// Keep the indexes at least as large as the number of entries
+static int netbios_ns_index_grow(netbios_ns *ns)
+{
+    netbios_ns_entry  **by_name, **by_ip, *iter;
+    size_t            buckets;
+
+    buckets = ns->buckets ? ns->buckets * 2 : NETBIOS_NS_MIN_BUCKETS;
+    by_name = calloc(buckets, sizeof(*by_name));
+    by_ip   = calloc(buckets, sizeof(*by_ip));
+    if (!by_name || !by_ip)
+    {
+        free(by_name);
+        free(by_ip);
+        return -1;
+    }
+
+    free(ns->by_name);
+    free(ns->by_ip);
+    ns->by_name = by_name;
+    ns->by_ip   = by_ip;
+    ns->buckets = buckets;
+
+    TAILQ_FOREACH(iter, &ns->entry_queue, next)
+    {
+        if (iter->flag & NS_ENTRY_FLAG_VALID_NAME)
+            netbios_ns_index_name(ns, iter);
+        if (iter->flag & NS_ENTRY_FLAG_VALID_IP)
+            netbios_ns_index_ip(ns, iter);
+    }
+
+    return 0;
+}
+
+static void netbios_ns_entry_set_name(netbios_ns *ns,
+                                      netbios_ns_entry *entry,
                                       const char *name, const char *group,
                                       char type)
 {
     if (name != NULL)
+    {
+        if (entry->flag & NS_ENTRY_FLAG_VALID_NAME)
+            netbios_ns_unindex_name(ns, entry);
         netbios_ns_copy_name(entry->name, name);
+        netbios_ns_index_name(ns, entry);
+        entry->flag |= NS_ENTRY_FLAG_VALID_NAME;
+    }
     if (group != NULL)
         netbios_ns_copy_name(entry->group, group);
-    
+
     entry->type = type;
-    entry->flag |= NS_ENTRY_FLAG_VALID_NAME;
 }
 
-static netbios_ns_entry *netbios_ns_entry_add(netbios_ns *ns, uint32_t ip)
+// Same as netbios_ns_entry_set_name(), with a name given by the user
+static void netbios_ns_entry_set_user_name(netbios_ns *ns,
+                                           netbios_ns_entry *entry,
+                                           const char *name, char type)
+{
+    char    padded[NETBIOS_NAME_LENGTH];
+    size_t  len;
+
+    for (len = 0; len < NETBIOS_NAME_LENGTH && name[len]; len++)
+        ;
+    memset(padded, ' ', sizeof(padded));
+    for (size_t i = 0; i < len; i++)
+        padded[i] = toupper((unsigned char)name[i]);
+
+    netbios_ns_entry_set_name(ns, entry, padded, NULL, type);
+}
+
+static netbios_ns_entry *netbios_ns_entry_new(netbios_ns *ns)
 {
     netbios_ns_entry  *entry;
-    
+
+    if (ns->nb_entries >= ns->buckets && netbios_ns_index_grow(ns) == -1
+        && ns->buckets == 0)
+        return NULL;
+
     entry = calloc(1, sizeof(netbios_ns_entry));
     if (!entry)
         return NULL;
-    
+
+    TAILQ_INSERT_HEAD(&ns->entry_queue, entry, next);
+    ns->nb_entries++;
+
+    return entry;
+}
+
+// Is the TTL of the entry over ? Expired entries are skipped by the lookups
+// but not freed, the name netbios_ns_inverse() returned must stay valid. The
+// next answer for the same host or name refreshes them in place.
+static bool netbios_ns_entry_expired(const netbios_ns_entry *entry, time_t now)
+{
+    return entry->expires != 0 && now >= entry->expires;
+}
+
+// Find an expired entry of the ip, to refresh instead of adding one
+static netbios_ns_entry *netbios_ns_stale_ip(netbios_ns *ns, uint32_t ip)
+{
+    netbios_ns_entry  *iter;
+    time_t            now;
+
+    if (ns->buckets == 0)
+        return NULL;
+
+    now = time(NULL);
+    for (iter = ns->by_ip[netbios_ns_ip_hash(ip) & (ns->buckets - 1)];
+         iter != NULL; iter = iter->ip_next)
+        if (iter->address.s_addr == ip && netbios_ns_entry_expired(iter, now))
+        {
+            BDSM_dbg("netbios_ns: refreshing expired entry '%s'\n",
+                     iter->name);
+            return iter;
+        }
+
+    return NULL;
+}
+
+// Find the expired record of a failed resolution of the name, to refresh
+static netbios_ns_entry *netbios_ns_stale_negative(netbios_ns *ns,
+                                                   const char *name, char type)
+{
+    netbios_ns_entry  *iter;
+    time_t            now;
+
+    if (ns->buckets == 0)
+        return NULL;
+
+    now = time(NULL);
+    for (iter = ns->by_name[netbios_ns_name_hash(name) & (ns->buckets - 1)];
+         iter != NULL; iter = iter->name_next)
+        if (iter->flag & NS_ENTRY_FLAG_NEGATIVE && iter->type == type
+            && netbios_ns_name_equal(name, iter->name)
+            && netbios_ns_entry_expired(iter, now))
+            return iter;
+
+    return NULL;
+}
+
+static netbios_ns_entry *netbios_ns_entry_add(netbios_ns *ns, uint32_t ip)
+{
+    netbios_ns_entry  *entry;
+
+    if ((entry = netbios_ns_stale_ip(ns, ip)) != NULL)
+    {
+        entry->expires = 0;
+        return entry;
+    }
+
+    entry = netbios_ns_entry_new(ns);
+    if (!entry)
+        return NULL;
+
     entry->address.s_addr = ip;
     entry->flag |= NS_ENTRY_FLAG_VALID_IP;
-    
-    TAILQ_INSERT_HEAD(&ns->entry_queue, entry, next);
-    
+    netbios_ns_index_ip(ns, entry);
+
     return entry;
 }
 
-// Find an entry in the list. Search by name if name is not NULL,
+static void netbios_ns_entry_remove(netbios_ns *ns, netbios_ns_entry *entry)
+{
+    if (entry->flag & NS_ENTRY_FLAG_VALID_NAME)
+        netbios_ns_unindex_name(ns, entry);
+    if (entry->flag & NS_ENTRY_FLAG_VALID_IP)
+        netbios_ns_unindex_ip(ns, entry);
+    TAILQ_REMOVE(&ns->entry_queue, entry, next);
+    ns->nb_entries--;
+    free(entry);
+}
+
+// Find an entry in the list. Search by name and type if name is not NULL,
 // or by ip otherwise
 static netbios_ns_entry *netbios_ns_entry_find(netbios_ns *ns, const char *by_name,
-                                               uint32_t ip)
+                                               char type, uint32_t ip)
 {
     netbios_ns_entry  *iter;
-    
+    time_t            now;
+
     bdsm_assert(ns != NULL);
     if(ns==NULL){
         return NULL;
     }
-    
-    TAILQ_FOREACH(iter, &ns->entry_queue, next)
+
+    if (ns->buckets == 0)
+        return NULL;
+
+    now = time(NULL);
+    if (by_name != NULL)
+    {
+        size_t bucket = netbios_ns_name_hash(by_name) & (ns->buckets - 1);
+
+        for (iter = ns->by_name[bucket]; iter != NULL; iter = iter->name_next)
+        {
+            if (iter->flag & NS_ENTRY_FLAG_NEGATIVE || iter->type != type
+                || !netbios_ns_name_equal(by_name, iter->name))
+                continue;
+            if (!netbios_ns_entry_expired(iter, now))
+                return iter;
+        }
+    }
+    else
     {
-        if (by_name != NULL)
+        size_t bucket = netbios_ns_ip_hash(ip) & (ns->buckets - 1);
+
+        for (iter = ns->by_ip[bucket]; iter != NULL; iter = iter->ip_next)
         {
-            if (iter->flag & NS_ENTRY_FLAG_VALID_NAME
-                && !strncmp(by_name, iter->name, NETBIOS_NAME_LENGTH))
+            if (iter->address.s_addr != ip)
+                continue;
+            if (!netbios_ns_entry_expired(iter, now))
                 return iter;
         }
-        else if (iter->flag & NS_ENTRY_FLAG_VALID_IP
-                 && iter->address.s_addr == ip)
+    }
+
+    return NULL;
+}
+
+// Find the record of a name of the given type which failed to resolve
+static netbios_ns_entry *netbios_ns_negative_find(netbios_ns *ns,
+                                                  const char *name, char type)
+{
+    netbios_ns_entry  *iter;
+    time_t            now;
+    size_t            bucket;
+
+    if (ns->buckets == 0)
+        return NULL;
+
+    now = time(NULL);
+    bucket = netbios_ns_name_hash(name) & (ns->buckets - 1);
+    for (iter = ns->by_name[bucket]; iter != NULL; iter = iter->name_next)
+    {
+        if (!(iter->flag & NS_ENTRY_FLAG_NEGATIVE) || iter->type != type
+            || !netbios_ns_name_equal(name, iter->name))
+            continue;
+        if (!netbios_ns_entry_expired(iter, now))
             return iter;
     }
-    
+
     return NULL;
 }
 
 static void netbios_ns_entry_clear(netbios_ns *ns)
 {
     netbios_ns_entry  *entry, *entry_next;
-    
+
     bdsm_assert(ns != NULL);
-    
+
     if(ns==NULL){
         return;
     }
@@ -670,6 +1036,11 @@ static void netbios_ns_entry_clear(netbios_ns *ns)
         TAILQ_REMOVE(&ns->entry_queue, entry, next);
         free(entry);
     }
+    free(ns->by_name);
+    free(ns->by_ip);
+    ns->by_name = ns->by_ip = NULL;
+    ns->buckets = 0;
+    ns->nb_entries = 0;
 }
 
 netbios_ns  *netbios_ns_new()
@@ -694,6 +1065,8 @@ netbios_ns  *netbios_ns_new()
     
     TAILQ_INIT(&ns->entry_queue);
     ns->last_trn_id   = rand();
+    ns->negative_ttl  = NETBIOS_NS_NEGATIVE_TTL;
+    ns->broadcast     = true;
     
     return ns;
 }
@@ -703,7 +1076,10 @@ void          netbios_ns_destroy(netbios_ns *ns)
     if (!ns)
         return;
     
+    if (ns->discover_started)
+        netbios_ns_discover_stop(ns);
     netbios_ns_entry_clear(ns);
+    free(ns->name_servers);
     
     if (ns->socket != -1)
         closesocket(ns->socket);
@@ -713,54 +1089,55 @@ void          netbios_ns_destroy(netbios_ns *ns)
     free(ns);
 }
 
-int      netbios_ns_resolve(netbios_ns *ns, const char *name, char type, uint32_t *addr)
+// Remember the address a name resolved to, for 'ttl' seconds (forever if 0)
+static void netbios_ns_cache_name(netbios_ns *ns, const char *name, char type,
+                                  uint32_t ip, uint32_t ttl)
 {
-    netbios_ns_entry    *cached;
-    struct timeval      timeout;
-    char                *encoded_name;
-    ssize_t             recv;
-    netbios_ns_name_query name_query;
-    
-    bdsm_assert(ns != NULL && !ns->discover_started);
-    
-    if ((cached = netbios_ns_entry_find(ns, name, 0)) != NULL)
-    {
-        *addr = cached->address.s_addr;
-        return 0;
-    }
-    
-    if ((encoded_name = netbios_name_encode(name, 0, type)) == NULL)
-        return -1;
-    
-    if (netbios_ns_send_name_query(ns, 0, NAME_QUERY_TYPE_NB, encoded_name,
-                                   NETBIOS_FLAG_RECURSIVE |
-                                   NETBIOS_FLAG_BROADCAST) == -1)
-    {
-        free(encoded_name);
-        return -1;
-        
-    }
-    free(encoded_name);
-    
-    // Now wait for a reply and pray
-    timeout.tv_sec = 2;
-    timeout.tv_usec = 420;
-    recv = netbios_ns_recv(ns, &timeout, NULL, true, 0, &name_query);
-    
-    if (recv < 0)
-        BDSM_perror("netbios_ns_resolve:");
-    else
+    netbios_ns_entry *entry;
+
+    entry = netbios_ns_entry_add(ns, ip);
+    if (!entry)
+        return;
+    netbios_ns_entry_set_user_name(ns, entry, name, type);
+    if (ttl != 0)
+        entry->expires = time(NULL) + ttl;
+}
+
+// Remember that nobody answered for a name, see netbios_ns_set_negative_ttl()
+static void netbios_ns_cache_failure(netbios_ns *ns, const char *name,
+                                     char type)
+{
+    netbios_ns_entry *entry;
+
+    if (ns->negative_ttl == 0)
+        return;
+
+    entry = netbios_ns_stale_negative(ns, name, type);
+    if (!entry)
+        entry = netbios_ns_entry_new(ns);
+    if (!entry)
+        return;
+    entry->flag |= NS_ENTRY_FLAG_NEGATIVE;
+    netbios_ns_entry_set_user_name(ns, entry, name, type);
+    entry->expires = time(NULL) + ns->negative_ttl;
+}
+
+// Add the entry of the host which answered a NBSTAT query
+static netbios_ns_entry *netbios_ns_cache_nbstat(netbios_ns *ns, uint32_t ip,
+                                                 netbios_ns_name_query *name_query)
+{
+    netbios_ns_entry *entry;
+
+    entry = netbios_ns_entry_add(ns, ip);
+    if (entry)
     {
-        if (name_query.type == NAME_QUERY_TYPE_NB)
-        {
-            *addr = name_query.u.nb.ip;
-            BDSM_dbg("netbios_ns_resolve, received a reply for '%s', ip: 0x%X!\n", name, *addr);
-            return 0;
-        } else
-            BDSM_dbg("netbios_ns_resolve, wrong query type received\n");
+        netbios_ns_entry_set_name(ns, entry, name_query->u.nbstat.name,
+                                  name_query->u.nbstat.group,
+                                  name_query->u.nbstat.type);
+        if (name_query->ttl != 0)
+            entry->expires = time(NULL) + name_query->ttl;
     }
-    
-    return -1;
+    return entry;
 }
 
 // Perform inverse name resolution. Grap an IP and return the first <20> field
@@ -771,10 +1148,13 @@ static netbios_ns_entry *netbios_ns_inverse_internal(netbios_ns *ns, uint32_t ip
     struct timeval      timeout;
     ssize_t             recv;
     netbios_ns_name_query name_query;
-    netbios_ns_entry *entry;
     
-    if ((cached = netbios_ns_entry_find(ns, NULL, ip)) != NULL)
+    if ((cached = netbios_ns_entry_find(ns, NULL, 0, ip)) != NULL)
+    {
+        ns->stats.hits++;
         return cached;
+    }
+    ns->stats.misses++;
     
     if (netbios_ns_send_name_query(ns, ip, NAME_QUERY_TYPE_NBSTAT,
                                    name_query_broadcast, 0) == -1)
@@ -797,12 +1177,7 @@ static netbios_ns_entry *netbios_ns_inverse_internal(netbios_ns *ns, uint32_t ip
         BDSM_dbg("netbios_ns_inverse, received a reply for '%s' !\n",
                  inet_ntoa(*(struct in_addr *)&ip));
     
-    entry = netbios_ns_entry_add(ns, ip);
-    if (entry)
-        netbios_ns_entry_set_name(entry, name_query.u.nbstat.name,
-                                  name_query.u.nbstat.group,
-                                  name_query.u.nbstat.type);
-    return entry;
+    return netbios_ns_cache_nbstat(ns, ip, &name_query);
 error:
     BDSM_perror("netbios_ns_inverse: ");
     return NULL;
@@ -820,135 +1195,1049 @@ const char *netbios_ns_inverse(netbios_ns *ns, uint32_t ip)
     return NULL;
 }
 
-const char *netbios_ns_entry_name(netbios_ns_entry *entry)
+// State of a query of a batch
+typedef struct
 {
-    return entry ? entry->name : NULL;
-}
+    uint64_t    deadline;       // When to stop waiting for its answer, in ms
+    unsigned    attempts;       // Times it was sent so far
+    bool        queued;         // Waiting to be sent again
+    bool        done;
+}               netbios_ns_batch_query;
 
-const char *netbios_ns_entry_group(netbios_ns_entry *entry)
+// A query sent, see netbios_ns_batch_run()
+typedef struct
 {
-    return entry ? entry->group : NULL;
-}
+    size_t      i;
+    unsigned    attempt;        // Outdated once the query is sent again
+}               netbios_ns_batch_sent;
 
-uint32_t netbios_ns_entry_ip(netbios_ns_entry *entry)
+// What an answer means for its query
+enum batch_answer {
+    BATCH_ANSWER_DONE,          // It's over
+    BATCH_ANSWER_WAIT,          // Other answers may follow
+    BATCH_ANSWER_RESEND,        // Send the query again without waiting
+};
+
+/*
+ * Queries sent concurrently by netbios_ns_inverse_batch() and
+ * netbios_ns_resolve_batch(). Query i uses the transaction id base + i.
+ */
+typedef struct netbios_ns_batch netbios_ns_batch;
+struct netbios_ns_batch
 {
-    return entry ? entry->address.s_addr : 0;
-}
+    netbios_ns              *ns;
+    netbios_ns_batch_opts   opts;
+    netbios_ns_batch_query  *queries;
+    size_t                  count;
+    size_t                  remaining;      // Queries not done yet
+    unsigned                max_attempts;   // Times a query may be sent
+    uint16_t                base;
+    // Send query i
+    int                     (*send)(netbios_ns_batch *b, size_t i);
+    // Is the answer in ns->buffer, received from 'addr', one to query i ?
+    bool                    (*match)(netbios_ns_batch *b, size_t i,
+                                     struct sockaddr_in *addr,
+                                     netbios_ns_name_query *name_query);
+    // Query i got an answer, or failed if name_query is NULL (the return
+    // value is then ignored)
+    enum batch_answer       (*done)(netbios_ns_batch *b, size_t i,
+                                    netbios_ns_name_query *name_query);
+    void                    *ctx;
+};
 
-char netbios_ns_entry_type(netbios_ns_entry *entry)
+static uint64_t netbios_ns_time_ms(void)
 {
-    return entry ? entry->type : -1;
+    struct timeval tv;
+
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000 + tv.tv_usec / 1000;
 }
 
-static void *netbios_ns_discover_thread(void *opaque)
+static int netbios_ns_batch_init(netbios_ns_batch *b, netbios_ns *ns,
+                                 size_t count,
+                                 const netbios_ns_batch_opts *opts)
 {
-    netbios_ns *ns = (netbios_ns *) opaque;
-    while (true)
+    netbios_ns_batch_opts defaults = { NETBIOS_NS_BATCH_RATE,
+                                       NETBIOS_NS_BATCH_TIMEOUT,
+                                       NETBIOS_NS_BATCH_RETRIES };
+
+    memset(b, 0, sizeof(*b));
+    b->ns      = ns;
+    b->opts    = opts != NULL ? *opts : defaults;
+    b->count   = count;
+    b->max_attempts = b->opts.retries + 1;
+    b->queries = calloc(count, sizeof(*b->queries));
+    if (!b->queries)
+        return -1;
+
+    // Each query gets its own transaction id
+    b->base = ns->last_trn_id + 1;
+    ns->last_trn_id += count;
+    b->remaining = count;
+
+    return 0;
+}
+
+static void netbios_ns_batch_fail(netbios_ns_batch *b, size_t i)
+{
+    b->queries[i].done = true;
+    b->remaining--;
+    b->done(b, i, NULL);
+}
+
+// Send the queries not done yet and wait for their answers
+static int netbios_ns_batch_run(netbios_ns_batch *b)
+{
+    netbios_ns_batch_opts   *o = &b->opts;
+    netbios_ns_batch_query  *queries = b->queries;
+    netbios_ns_batch_sent   *flight;        // Ring of the queries sent
+    size_t                  *retry;         // Ring of the queries to resend
+    size_t                  flight_size = b->count * b->max_attempts;
+    size_t                  flight_head = 0, flight_len = 0;
+    size_t                  retry_head = 0, retry_len = 0;
+    size_t                  count = b->count, next = 0, sent = 0, i;
+    uint64_t                start;
+    int                     ret = 0;
+
+    if (b->remaining == 0)
+        return 0;
+
+    flight = malloc(flight_size * sizeof(*flight));
+    retry  = malloc(count * sizeof(*retry));
+    if (!flight || !retry)
     {
-        const int remove_timeout = 5 * ns->discover_broadcast_timeout;
+        free(flight);
+        free(retry);
+        return -1;
+    }
+
+    start = netbios_ns_time_ms();
+    while (b->remaining > 0)
+    {
+        uint64_t            now = netbios_ns_time_ms(), wait;
+        netbios_ns_batch_sent *f;
+        struct timeval      timeout;
+        struct sockaddr_in  recv_addr;
+        netbios_ns_name_query name_query;
+        ssize_t             res;
+
+        // Send again the queries which weren't answered in time, or give up
+        while (flight_len > 0)
+        {
+            netbios_ns_batch_sent *f = &flight[flight_head];
+
+            i = f->i;
+            if (queries[i].attempts == f->attempt && !queries[i].done
+                && !queries[i].queued && queries[i].deadline > now)
+                break;
+            flight_head = (flight_head + 1) % flight_size;
+            flight_len--;
+            if (queries[i].attempts != f->attempt || queries[i].done
+                || queries[i].queued)
+                continue;
+            if (queries[i].attempts < b->max_attempts)
+            {
+                queries[i].queued = true;
+                retry[(retry_head + retry_len++) % count] = i;
+            }
+            else
+                netbios_ns_batch_fail(b, i);
+        }
+
+        // Send as many queries as the rate allows, retries first
+        while (retry_len > 0 || next < count)
+        {
+            if (o->rate != 0
+                && sent >= NETBIOS_NS_BATCH_BURST + (now - start) * o->rate / 1000)
+                break;
+
+            if (retry_len > 0)
+            {
+                i = retry[retry_head];
+                retry_head = (retry_head + 1) % count;
+                retry_len--;
+                queries[i].queued = false;
+            }
+            else
+            {
+                i = next++;
+                if (queries[i].done)
+                    continue;
+            }
+
+            sent++;
+            queries[i].attempts++;
+            if (b->send(b, i) == -1)
+            {
+                netbios_ns_batch_fail(b, i);
+                continue;
+            }
+            queries[i].deadline = now + o->timeout;
+            f = &flight[(flight_head + flight_len++) % flight_size];
+            f->i = i;
+            f->attempt = queries[i].attempts;
+        }
+
+        if (b->remaining == 0)
+            break;
+
+        // Collect answers until the next query is due
+        wait = o->timeout;
+        if (flight_len > 0)
+        {
+            uint64_t deadline = queries[flight[flight_head].i].deadline;
+            wait = deadline > now ? deadline - now : 0;
+        }
+        if ((retry_len > 0 || next < count) && o->rate != 0
+            && wait > 1000 / o->rate)
+            wait = 1000 / o->rate + 1;
+
+        timeout.tv_sec  = wait / 1000;
+        timeout.tv_usec = (wait % 1000) * 1000;
+        res = netbios_ns_recv(b->ns, &timeout, &recv_addr, false, 0,
+                              &name_query);
+        if (res < 0)
+        {
+            ret = -1;
+            break;
+        }
+        if (res == 0)
+            continue;
+
+        // Find the query from the transaction id, the same id is used by
+        // several queries of very large batches
+        for (i = (uint16_t)(ntohs(((netbios_query_packet *)b->ns->buffer)->trn_id)
+                            - b->base);
+             i < count; i += 0x10000)
+            if (!queries[i].done && queries[i].attempts > 0
+                && b->match(b, i, &recv_addr, &name_query))
+                break;
+        if (i >= count)
+            continue; // Late or unrelated answer
+
+        switch (b->done(b, i, &name_query))
+        {
+            case BATCH_ANSWER_DONE:
+                queries[i].done = true;
+                b->remaining--;
+                break;
+            case BATCH_ANSWER_RESEND:
+                if (queries[i].queued)
+                    break;
+                if (queries[i].attempts < b->max_attempts)
+                {
+                    queries[i].queued = true;
+                    retry[(retry_head + retry_len++) % count] = i;
+                }
+                else
+                    netbios_ns_batch_fail(b, i);
+                break;
+            case BATCH_ANSWER_WAIT:
+                break;
+        }
+    }
+
+    free(flight);
+    free(retry);
+
+    return ret;
+}
+
+typedef struct
+{
+    const uint32_t          *ips;
+    netbios_ns_inverse_cb   cb;
+    void                    *p_opaque;
+    int                     found;
+}                           netbios_ns_inverse_ctx;
+
+static int netbios_ns_inverse_send(netbios_ns_batch *b, size_t i)
+{
+    netbios_ns_inverse_ctx *ctx = b->ctx;
+
+    return netbios_ns_send_name_query_id(b->ns, b->ns->socket, ctx->ips[i],
+                                         NAME_QUERY_TYPE_NBSTAT,
+                                         name_query_broadcast, 0,
+                                         b->base + i);
+}
+
+static bool netbios_ns_inverse_match(netbios_ns_batch *b, size_t i,
+                                     struct sockaddr_in *addr,
+                                     netbios_ns_name_query *name_query)
+{
+    netbios_ns_inverse_ctx *ctx = b->ctx;
+
+    (void)name_query;
+    return ctx->ips[i] == addr->sin_addr.s_addr;
+}
+
+static enum batch_answer netbios_ns_inverse_done(netbios_ns_batch *b, size_t i,
+                                                 netbios_ns_name_query *name_query)
+{
+    netbios_ns_inverse_ctx  *ctx = b->ctx;
+    netbios_ns_entry        *entry = NULL;
+
+    // Hosts without a file server name are reported as silent
+    if (name_query != NULL && name_query->type == NAME_QUERY_TYPE_NBSTAT)
+        entry = netbios_ns_cache_nbstat(b->ns, ctx->ips[i], name_query);
+    if (entry != NULL)
+        ctx->found++;
+
+    ctx->cb(ctx->p_opaque, ctx->ips[i], entry);
+    return BATCH_ANSWER_DONE;
+}
+
+int netbios_ns_inverse_batch(netbios_ns *ns, const uint32_t *ips, size_t count,
+                             netbios_ns_inverse_cb cb, void *p_opaque,
+                             const netbios_ns_batch_opts *opts)
+{
+    netbios_ns_inverse_ctx  ctx = { ips, cb, p_opaque, 0 };
+    netbios_ns_batch        b;
+    int                     res;
+
+    bdsm_assert(ns != NULL && !ns->discover_started && cb != NULL);
+
+    if (ns == NULL || ns->discover_started || cb == NULL
+        || (count > 0 && ips == NULL))
+        return -1;
+    if (count == 0)
+        return 0;
+
+    if (netbios_ns_batch_init(&b, ns, count, opts) == -1)
+        return -1;
+    b.send  = netbios_ns_inverse_send;
+    b.match = netbios_ns_inverse_match;
+    b.done  = netbios_ns_inverse_done;
+    b.ctx   = &ctx;
+
+    // The hosts already known are answered right away
+    for (size_t i = 0; i < count; i++)
+    {
+        netbios_ns_entry *cached = ips[i] ? netbios_ns_entry_find(ns, NULL, 0, ips[i])
+                                          : NULL;
+
+        if (cached != NULL)
+        {
+            ns->stats.hits++;
+            ctx.found++;
+            b.queries[i].done = true;
+            b.remaining--;
+            cb(p_opaque, ips[i], cached);
+        }
+        else if (ips[i] == 0)
+            netbios_ns_batch_fail(&b, i);
+        else
+            ns->stats.misses++;
+    }
+
+    res = netbios_ns_batch_run(&b);
+    free(b.queries);
+
+    return res == -1 ? -1 : ctx.found;
+}
+
+// A name of netbios_ns_resolve_batch() and the names asked with it
+typedef struct
+{
+    char                    *encoded;       // As sent in the query
+    const char              *name;          // The first of the names
+    size_t                  first;          // Index in names of the first one
+    size_t                  last;
+    size_t                  negatives;      // Name servers which don't know it
+    bool                    servers_done;   // Broadcast from now on
+}                           netbios_ns_resolve_query;
+
+typedef struct
+{
+    const char * const      *names;
+    size_t                  count;
+    char                    type;
+    size_t                  *next_name;     // Next name with the same query
+    netbios_ns_resolve_query *queries;
+    netbios_ns_resolve_cb   cb;
+    void                    *p_opaque;
+    int                     found;
+}                           netbios_ns_resolve_ctx;
+
+static int netbios_ns_resolve_send(netbios_ns_batch *b, size_t i)
+{
+    netbios_ns_resolve_ctx      *ctx = b->ctx;
+    netbios_ns_resolve_query    *q = &ctx->queries[i];
+    netbios_ns                  *ns = b->ns;
+
+    // The name servers are all asked at once, before any broadcast
+    if (ns->nb_name_servers > 0 && !q->servers_done)
+    {
+        if (b->queries[i].attempts <= b->opts.retries + 1)
+        {
+            size_t sent = 0;
+
+            q->negatives = 0;
+            for (size_t s = 0; s < ns->nb_name_servers; s++)
+                if (netbios_ns_send_name_query_id(ns, ns->socket,
+                                                  ns->name_servers[s],
+                                                  NAME_QUERY_TYPE_NB,
+                                                  q->encoded,
+                                                  NETBIOS_FLAG_RECURSIVE,
+                                                  b->base + i) == 0)
+                    sent++;
+            if (sent > 0 || !ns->broadcast)
+                return sent > 0 ? 0 : -1;
+        }
+        q->servers_done = true;
+    }
+
+    return netbios_ns_send_name_query_id(ns, ns->socket, 0,
+                                         NAME_QUERY_TYPE_NB,
+                                         q->encoded,
+                                         NETBIOS_FLAG_RECURSIVE |
+                                         NETBIOS_FLAG_BROADCAST,
+                                         b->base + i);
+}
+
+static bool netbios_ns_resolve_match(netbios_ns_batch *b, size_t i,
+                                     struct sockaddr_in *addr,
+                                     netbios_ns_name_query *name_query)
+{
+    netbios_ns_resolve_ctx  *ctx = b->ctx;
+    netbios_query_packet    *q = (netbios_query_packet *)b->ns->buffer;
+
+    // Only name servers answer that a name doesn't exist
+    if (name_query->type == NAME_QUERY_TYPE_NEGATIVE)
+    {
+        for (size_t s = 0; s < b->ns->nb_name_servers; s++)
+            if (b->ns->name_servers[s] == addr->sin_addr.s_addr)
+                return !ctx->queries[i].servers_done;
+        return false;
+    }
+
+    // Anyone can answer a broadcast query, check the answer is for our
+    // name. netbios_ns_handle_query() checked the encoded name is there
+    return !memcmp(q->payload, ctx->queries[i].encoded, 34);
+}
+
+// Report the result of query i to all the names which were waiting for it
+static void netbios_ns_resolve_report(netbios_ns_resolve_ctx *ctx, size_t i,
+                                      uint32_t ip)
+{
+    for (size_t j = ctx->queries[i].first; j != SIZE_MAX; j = ctx->next_name[j])
+    {
+        if (ip != 0)
+            ctx->found++;
+        ctx->cb(ctx->p_opaque, ctx->names[j], ip);
+    }
+}
+
+static enum batch_answer netbios_ns_resolve_done(netbios_ns_batch *b, size_t i,
+                                                 netbios_ns_name_query *name_query)
+{
+    netbios_ns_resolve_ctx      *ctx = b->ctx;
+    netbios_ns_resolve_query    *q = &ctx->queries[i];
+
+    if (name_query != NULL && name_query->type == NAME_QUERY_TYPE_NB)
+    {
+        netbios_ns_cache_name(b->ns, q->name, ctx->type, name_query->u.nb.ip,
+                              name_query->ttl);
+        netbios_ns_resolve_report(ctx, i, name_query->u.nb.ip);
+        return BATCH_ANSWER_DONE;
+    }
+
+    if (name_query != NULL)
+    {
+        if (name_query->type != NAME_QUERY_TYPE_NEGATIVE
+            || ++q->negatives < b->ns->nb_name_servers)
+            return BATCH_ANSWER_WAIT;
+
+        // None of the servers knows the name, try the broadcast now
+        if (b->ns->broadcast)
+        {
+            q->servers_done = true;
+            return BATCH_ANSWER_RESEND;
+        }
+    }
+
+    netbios_ns_cache_failure(b->ns, q->name, ctx->type);
+    netbios_ns_resolve_report(ctx, i, 0);
+    return BATCH_ANSWER_DONE;
+}
+
+int netbios_ns_resolve_batch(netbios_ns *ns, const char * const *names,
+                             size_t count, char type,
+                             netbios_ns_resolve_cb cb, void *p_opaque,
+                             const netbios_ns_batch_opts *opts)
+{
+    netbios_ns_resolve_ctx  ctx;
+    netbios_ns_batch        b;
+    size_t                  *slots;     // Queries by name, open addressing
+    size_t                  nb_queries = 0, mask;
+    int                     res = -1;
+
+    bdsm_assert(ns != NULL && !ns->discover_started && cb != NULL);
+
+    if (ns == NULL || ns->discover_started || cb == NULL
+        || (count > 0 && names == NULL))
+        return -1;
+    if (count == 0)
+        return 0;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.names     = names;
+    ctx.count     = count;
+    ctx.type      = type;
+    ctx.cb        = cb;
+    ctx.p_opaque  = p_opaque;
+    ctx.next_name = malloc(count * sizeof(*ctx.next_name));
+    ctx.queries   = calloc(count, sizeof(*ctx.queries));
+    for (mask = NETBIOS_NS_MIN_BUCKETS; mask < 2 * count; mask *= 2)
+        ;
+    slots = malloc(mask * sizeof(*slots));
+    mask--;
+    if (!ctx.next_name || !ctx.queries || !slots)
+        goto end;
+    memset(slots, 0xff, (mask + 1) * sizeof(*slots));
+
+    // Names are answered from the cache, or wait for the query of the first
+    // occurrence of the same name
+    for (size_t i = 0; i < count; i++)
+    {
+        netbios_ns_entry *cached;
+        size_t           slot;
+
+        ctx.next_name[i] = SIZE_MAX;
+        if ((cached = netbios_ns_entry_find(ns, names[i], type, 0)) != NULL)
+        {
+            ns->stats.hits++;
+            ctx.found++;
+            cb(p_opaque, names[i], cached->address.s_addr);
+            continue;
+        }
+        if (netbios_ns_negative_find(ns, names[i], type) != NULL)
+        {
+            ns->stats.negative_hits++;
+            cb(p_opaque, names[i], 0);
+            continue;
+        }
+
+        for (slot = netbios_ns_name_hash(names[i]) & mask;
+             slots[slot] != SIZE_MAX; slot = (slot + 1) & mask)
+            if (netbios_ns_name_equal(ctx.queries[slots[slot]].name, names[i]))
+                break;
+
+        if (slots[slot] == SIZE_MAX)
+        {
+            netbios_ns_resolve_query *q = &ctx.queries[nb_queries];
+
+            q->encoded = netbios_name_encode(names[i], 0, type);
+            if (!q->encoded)
+                goto end;
+            q->name  = names[i];
+            q->first = q->last = i;
+            slots[slot] = nb_queries++;
+            ns->stats.misses++;
+        }
+        else
+        {
+            netbios_ns_resolve_query *q = &ctx.queries[slots[slot]];
+
+            ctx.next_name[q->last] = i;
+            q->last = i;
+        }
+    }
+
+    if (nb_queries == 0)
+    {
+        res = 0;
+        goto end;
+    }
+    if (netbios_ns_batch_init(&b, ns, nb_queries, opts) == -1)
+        goto end;
+    if (ns->nb_name_servers > 0 && ns->broadcast)
+        b.max_attempts *= 2;
+    b.send  = netbios_ns_resolve_send;
+    b.match = netbios_ns_resolve_match;
+    b.done  = netbios_ns_resolve_done;
+    b.ctx   = &ctx;
+
+    res = netbios_ns_batch_run(&b);
+    free(b.queries);
+
+end:
+    for (size_t q = 0; ctx.queries != NULL && q < nb_queries; q++)
+        free(ctx.queries[q].encoded);
+    free(ctx.queries);
+    free(ctx.next_name);
+    free(slots);
+
+    return res == -1 ? -1 : ctx.found;
+}
+
+static void netbios_ns_resolve_one(void *p_opaque, const char *name,
+                                   uint32_t addr)
+{
+    (void)name;
+    *(uint32_t *)p_opaque = addr;
+}
+
+int      netbios_ns_resolve(netbios_ns *ns, const char *name, char type, uint32_t *addr)
+{
+    netbios_ns_batch_opts opts = { 0, NETBIOS_NS_RESOLVE_TIMEOUT, 0 };
+    uint32_t            found = 0;
+    
+    bdsm_assert(ns != NULL && !ns->discover_started);
+    
+    if (netbios_ns_resolve_batch(ns, &name, 1, type, netbios_ns_resolve_one,
+                                 &found, &opts) != 1)
+        return -1;
+    
+    BDSM_dbg("netbios_ns_resolve, received a reply for '%s', ip: 0x%X!\n", name, found);
+    *addr = found;
+    return 0;
+}
+
+int netbios_ns_set_name_servers(netbios_ns *ns, const uint32_t *servers,
+                                size_t count, int broadcast)
+{
+    uint32_t *copy = NULL;
+
+    bdsm_assert(ns != NULL && (count == 0 || servers != NULL));
+
+    if (ns == NULL || (count > 0 && servers == NULL))
+        return -1;
+
+    if (count > 0)
+    {
+        copy = malloc(count * sizeof(*copy));
+        if (!copy)
+            return -1;
+        memcpy(copy, servers, count * sizeof(*copy));
+    }
+
+    free(ns->name_servers);
+    ns->name_servers    = copy;
+    ns->nb_name_servers = count;
+    ns->broadcast       = count == 0 || broadcast;
+
+    return 0;
+}
+
+const char *netbios_ns_entry_name(netbios_ns_entry *entry)
+{
+    return entry ? entry->name : NULL;
+}
+
+const char *netbios_ns_entry_group(netbios_ns_entry *entry)
+{
+    return entry ? entry->group : NULL;
+}
+
+uint32_t netbios_ns_entry_ip(netbios_ns_entry *entry)
+{
+    return entry ? entry->address.s_addr : 0;
+}
+
+char netbios_ns_entry_type(netbios_ns_entry *entry)
+{
+    return entry ? entry->type : -1;
+}
+
+void netbios_ns_set_negative_ttl(netbios_ns *ns, unsigned int ttl)
+{
+    bdsm_assert(ns != NULL);
+
+    if (ns != NULL)
+        ns->negative_ttl = ttl;
+}
+
+void netbios_ns_get_cache_stats(netbios_ns *ns, netbios_ns_cache_stats *stats)
+{
+    bdsm_assert(ns != NULL && stats != NULL);
+
+    if (ns != NULL && stats != NULL)
+    {
+        *stats = ns->stats;
+        stats->entries = ns->nb_entries;
+    }
+}
+
+#ifdef NETBIOS_NS_EPOLL
+
+static int netbios_ns_iface_open(uint32_t addr)
+{
+    struct sockaddr_in  sin;
+    int                 sock, sock_opt = 1;
+
+    if ((sock = socket(AF_INET, SOCK_DGRAM, 0)) < 0)
+        return -1;
+
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family      = AF_INET;
+    sin.sin_port        = htons(0);
+    sin.sin_addr.s_addr = addr;
+    if (setsockopt(sock, SOL_SOCKET, SO_BROADCAST,
+                   (void *)&sock_opt, sizeof(sock_opt)) < 0
+        || bind(sock, (struct sockaddr *)&sin, sizeof(sin)) < 0)
+    {
+        closesocket(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+// One socket per interface, all of them in an epoll set
+static void netbios_ns_discover_open_ifaces(netbios_ns *ns)
+{
+    struct ifaddrs *addrs;
+
+    if ((ns->discover_fd = epoll_create(1)) == -1)
+        return;
+    if (getifaddrs(&addrs) != 0)
+        return;
+
+    for (struct ifaddrs *a = addrs; a != NULL; a = a->ifa_next)
+    {
+        netbios_ns_iface    *ifaces, *iface;
+        struct epoll_event  event;
+        int                 sock;
+
+        if ((a->ifa_flags & IFF_BROADCAST) == 0 || (a->ifa_flags & IFF_UP) == 0)
+            continue;
+        if (!a->ifa_addr || a->ifa_addr->sa_family != PF_INET
+            || !a->ifa_broadaddr)
+            continue;
+
+        ifaces = realloc(ns->ifaces, (ns->nb_ifaces + 1) * sizeof(*ifaces));
+        if (!ifaces)
+            break;
+        ns->ifaces = ifaces;
+
+        sock = netbios_ns_iface_open(
+                   ((struct sockaddr_in *)a->ifa_addr)->sin_addr.s_addr);
+        if (sock == -1)
+        {
+            BDSM_perror("netbios_ns_discover, interface socket: ");
+            continue;
+        }
+
+        memset(&event, 0, sizeof(event));
+        event.events   = EPOLLIN;
+        event.data.u32 = ns->nb_ifaces;
+        if (epoll_ctl(ns->discover_fd, EPOLL_CTL_ADD, sock, &event) == -1)
+        {
+            closesocket(sock);
+            continue;
+        }
+
+        iface = &ns->ifaces[ns->nb_ifaces++];
+        iface->socket    = sock;
+        iface->broadcast =
+            ((struct sockaddr_in *)a->ifa_broadaddr)->sin_addr.s_addr;
+        BDSM_dbg("netbios_ns_discover, broadcasting on %s\n", a->ifa_name);
+    }
+    freeifaddrs(addrs);
+}
+
+#endif
+
+static void netbios_ns_discover_close_ifaces(netbios_ns *ns)
+{
+    for (size_t i = 0; i < ns->nb_ifaces; i++)
+        if (ns->ifaces[i].socket != ns->socket)
+            closesocket(ns->ifaces[i].socket);
+    if (ns->discover_fd != -1 && ns->discover_fd != ns->socket)
+        close(ns->discover_fd);
+
+    free(ns->ifaces);
+    ns->ifaces      = NULL;
+    ns->nb_ifaces   = 0;
+    ns->discover_fd = -1;
+}
+
+static int netbios_ns_discover_setup(netbios_ns *ns,
+                                     unsigned int broadcast_timeout,
+                                     netbios_ns_discover_callbacks *callbacks)
+{
+    netbios_ns_entry  *entry;
+    uint64_t          now;
+
+    if (ns->discover_started || !callbacks)
+        return -1;
+
+    ns->discover_callbacks = *callbacks;
+    ns->discover_broadcast_timeout = broadcast_timeout;
+
+    // Nothing was reported to these callbacks yet
+    TAILQ_FOREACH(entry, &ns->entry_queue, next)
+        entry->flag &= ~NS_ENTRY_FLAG_DISCOVERED;
+
+    ns->discover_fd = -1;
+#ifdef NETBIOS_NS_EPOLL
+    netbios_ns_discover_open_ifaces(ns);
+#endif
+    if (ns->nb_ifaces == 0)
+    {
+        // Broadcast on all the interfaces with the main socket
+        netbios_ns_discover_close_ifaces(ns);
+        ns->ifaces = calloc(1, sizeof(*ns->ifaces));
+        if (!ns->ifaces)
+            return -1;
+        ns->ifaces[0].socket    = ns->socket;
+        ns->ifaces[0].broadcast = 0;
+        ns->nb_ifaces   = 1;
+        ns->discover_fd = ns->socket;
+    }
+
+    // Don't broadcast on all the interfaces at the same time
+    now = netbios_ns_time_ms();
+    for (size_t i = 0; i < ns->nb_ifaces; i++)
+        ns->ifaces[i].next_broadcast = now + i * NETBIOS_NS_DISCOVER_STAGGER
+                                       + rand() % NETBIOS_NS_DISCOVER_STAGGER;
+    ns->discover_next_expiry = now;
+    ns->discover_started = true;
+
+    return 0;
+}
+
+static void netbios_ns_discover_handle(netbios_ns *ns, netbios_ns_iface *iface,
+                                       struct sockaddr_in *recv_addr,
+                                       netbios_ns_name_query *name_query)
+{
+    netbios_ns_entry  *entry;
+    time_t            now = time(NULL);
+
+    if (name_query->type == NAME_QUERY_TYPE_NB)
+    {
+        uint32_t ip = name_query->u.nb.ip;
+        entry = netbios_ns_entry_find(ns, NULL, 0, ip);
+
+        if (!entry)
+        {
+            entry = netbios_ns_entry_add(ns, ip);
+            if (!entry)
+                return;
+        }
+        // Seen by the discovery, which removes it when it's gone
+        entry->last_time_seen = now;
+        entry->expires = 0;
+
+        // if entry was already reported, don't send NBSTAT query. A name
+        // cached by a resolution is asked again, for its group and to be
+        // reported with the name of the host
+        if (entry->flag & NS_ENTRY_FLAG_DISCOVERED)
+            return;
+
+        // send NBSTAT query, the answer comes back on the same interface
+        netbios_ns_send_name_query_id(ns, iface->socket, ip,
+                                      NAME_QUERY_TYPE_NBSTAT,
+                                      name_query_broadcast, 0,
+                                      ++ns->last_trn_id);
+    }
+    else if (name_query->type == NAME_QUERY_TYPE_NBSTAT)
+    {
+        bool send_callback;
+
+        entry = netbios_ns_entry_find(ns, NULL, 0, recv_addr->sin_addr.s_addr);
+
+        // ignore NBSTAT answers that didn't answered to NB query first.
+        if (!entry)
+            return;
+
+        entry->last_time_seen = now;
+        entry->expires = 0;
+
+        send_callback = !(entry->flag & NS_ENTRY_FLAG_DISCOVERED);
+
+        netbios_ns_entry_set_name(ns, entry, name_query->u.nbstat.name,
+                                  name_query->u.nbstat.group,
+                                  name_query->u.nbstat.type);
+        entry->flag |= NS_ENTRY_FLAG_DISCOVERED;
+        if (send_callback)
+            ns->discover_callbacks.pf_on_entry_added(
+                ns->discover_callbacks.p_opaque, entry);
+    }
+}
+
+// Handle the answers received on an interface, without blocking
+static int netbios_ns_discover_recv(netbios_ns *ns, netbios_ns_iface *iface)
+{
+    for (int n = 0; n < NETBIOS_NS_DISCOVER_MAX_RECV; n++)
+    {
+        struct sockaddr_in      addr;
+        socklen_t               addr_len = sizeof(struct sockaddr_in);
+        netbios_ns_name_query   name_query;
+        ssize_t                 size;
+
+#ifdef MSG_DONTWAIT
+        size = recvfrom(iface->socket, ns->buffer, RECV_BUFFER_SIZE,
+                        MSG_DONTWAIT, (struct sockaddr *)&addr, &addr_len);
+        if (size < 0 && (errno == EAGAIN || errno == EWOULDBLOCK
+                         || errno == EINTR))
+            return 0;
+#else
+        fd_set          read_fds;
+        struct timeval  timeout = {0, 0};
+
+        FD_ZERO(&read_fds);
+        FD_SET(iface->socket, &read_fds);
+        if (select(iface->socket + 1, &read_fds, NULL, NULL, &timeout) <= 0)
+            return 0;
+        size = recvfrom(iface->socket, ns->buffer, RECV_BUFFER_SIZE, 0,
+                        (struct sockaddr *)&addr, &addr_len);
+#endif
+        if (size < 0)
+        {
+            BDSM_perror("netbios_ns_discover: ");
+            return -1;
+        }
+
+        if (netbios_ns_handle_query(ns, (size_t)size, false,
+                                    addr.sin_addr.s_addr, &name_query) == -1)
+        {
+            BDSM_dbg("netbios_ns_discover, invalid query\n");
+            continue;
+        }
+        netbios_ns_discover_handle(ns, iface, &addr, &name_query);
+    }
+
+    return 0;
+}
+
+int netbios_ns_discover_process(netbios_ns *ns)
+{
+    uint64_t  period = ns->discover_broadcast_timeout * 1000ull;
+    uint64_t  now, next = UINT64_MAX;
+
+    bdsm_assert(ns != NULL && ns->discover_started);
+
+    if (ns == NULL || !ns->discover_started)
+        return -1;
+
+    // Receive from the interfaces which have something
+#ifdef NETBIOS_NS_EPOLL
+    if (ns->discover_fd != ns->socket)
+    {
+        struct epoll_event  events[NETBIOS_NS_DISCOVER_MAX_EVENTS];
+        int                 nb_events;
+
+        nb_events = epoll_wait(ns->discover_fd, events,
+                               NETBIOS_NS_DISCOVER_MAX_EVENTS, 0);
+        if (nb_events < 0 && errno != EINTR)
+            return -1;
+        for (int i = 0; i < nb_events; i++)
+            if (netbios_ns_discover_recv(ns,
+                                         &ns->ifaces[events[i].data.u32]) == -1)
+                return -1;
+    }
+    else
+#endif
+    if (netbios_ns_discover_recv(ns, &ns->ifaces[0]) == -1)
+        return -1;
+
+    now = netbios_ns_time_ms();
+
+    // check if cached entries timeout, the timeout value is 5 times the
+    // broadcast timeout.
+    if (period != 0 && now >= ns->discover_next_expiry)
+    {
+        const int         remove_timeout = 5 * ns->discover_broadcast_timeout;
         netbios_ns_entry  *entry, *entry_next;
-        
-        if (netbios_ns_is_aborted(ns))
-            return NULL;
-        
-        // check if cached entries timeout, the timeout value is 5 times the
-        // broadcast timeout.
-        time_t now = time(NULL);
+        time_t            now_s = time(NULL);
+
         for (entry = TAILQ_FIRST(&ns->entry_queue);
              entry != NULL; entry = entry_next)
         {
             entry_next = TAILQ_NEXT(entry, next);
-            if (now - entry->last_time_seen > remove_timeout)
+            // Entries the discovery never saw are left to their TTL, and
+            // only those reported added are reported removed
+            if (entry->last_time_seen != 0
+                && now_s - entry->last_time_seen > remove_timeout)
             {
-                if (entry->flag & NS_ENTRY_FLAG_VALID_NAME)
+                if (entry->flag & NS_ENTRY_FLAG_DISCOVERED)
                 {
                     BDSM_dbg("Discover: on_entry_removed: %s\n", entry->name);
                     ns->discover_callbacks.pf_on_entry_removed(
-                                                               ns->discover_callbacks.p_opaque, entry);
+                        ns->discover_callbacks.p_opaque, entry);
                 }
-                TAILQ_REMOVE(&ns->entry_queue, entry, next);
-                free(entry);
+                netbios_ns_entry_remove(ns, entry);
             }
         }
-        
-        // send broadbast
-        if (netbios_ns_send_name_query(ns, 0, NAME_QUERY_TYPE_NB,
-                                       name_query_broadcast, 0) == -1)
+        ns->discover_next_expiry = now + period;
+    }
+    if (period != 0)
+        next = ns->discover_next_expiry;
+
+    // Broadcast on the interfaces whose turn it is, each one keeping its own
+    // pace with some jitter, so that the answers don't all come at once
+    for (size_t i = 0; i < ns->nb_ifaces; i++)
+    {
+        netbios_ns_iface *iface = &ns->ifaces[i];
+
+        if (iface->next_broadcast <= now)
+        {
+            if (netbios_ns_send_name_query_id(ns, iface->socket,
+                                              iface->broadcast,
+                                              NAME_QUERY_TYPE_NB,
+                                              name_query_broadcast, 0,
+                                              ++ns->last_trn_id) == -1)
+                BDSM_dbg("netbios_ns_discover, broadcast failed\n");
+
+            if (period == 0)
+                iface->next_broadcast = UINT64_MAX; // Only once
+            else
+                iface->next_broadcast = now + period - period / 20
+                                        + rand() % (period / 10 + 1);
+        }
+        if (iface->next_broadcast < next)
+            next = iface->next_broadcast;
+    }
+
+    if (next == UINT64_MAX || next - now > INT_MAX)
+        return INT_MAX;
+    return (int)(next - now);
+}
+
+int netbios_ns_discover_get_fd(netbios_ns *ns)
+{
+    return ns != NULL && ns->discover_started ? ns->discover_fd : -1;
+}
+
+static void *netbios_ns_discover_thread(void *opaque)
+{
+    netbios_ns *ns = (netbios_ns *) opaque;
+    while (true)
+    {
+        fd_set          read_fds;
+        struct timeval  timeout;
+        int             delay, nfds;
+
+        delay = netbios_ns_discover_process(ns);
+        if (delay < 0)
             return NULL;
-        
-        while (true)
+#ifndef HAVE_PIPE
+        // The abort can only be noticed after select() returns
+        if (delay > 1000)
+            delay = 1000;
+#endif
+
+        FD_ZERO(&read_fds);
+        FD_SET(ns->discover_fd, &read_fds);
+        nfds = ns->discover_fd + 1;
+#ifdef HAVE_PIPE
+        FD_SET(ns->abort_pipe[0], &read_fds);
+        if (ns->abort_pipe[0] >= nfds)
+            nfds = ns->abort_pipe[0] + 1;
+#endif
+        timeout.tv_sec  = delay / 1000;
+        timeout.tv_usec = (delay % 1000) * 1000;
+
+        if (select(nfds, &read_fds, NULL, NULL, &timeout) < 0
+            && errno != EINTR)
         {
-            struct timeval      timeout;
-            struct sockaddr_in  recv_addr;
-            int                 res;
-            netbios_ns_name_query name_query;
-            
-            timeout.tv_sec = ns->discover_broadcast_timeout;
-            timeout.tv_usec = 0;
-            
-            // receive NB or NBSTAT answers
-            res = netbios_ns_recv(ns, ns->discover_broadcast_timeout == 0 ?
-                                  NULL : &timeout,
-                                  &recv_addr,
-                                  false, 0, &name_query);
-            // error or abort
-            if (res == -1)
-                return NULL;
-            
-            // timeout reached, broadcast again
-            if (res == 0)
-                break;
-            
-            time_t now = time(NULL);
-            
-            if (name_query.type == NAME_QUERY_TYPE_NB)
-            {
-                uint32_t ip = name_query.u.nb.ip;
-                entry = netbios_ns_entry_find(ns, NULL, ip);
-                
-                if (!entry)
-                {
-                    entry = netbios_ns_entry_add(ns, ip);
-                    if (!entry)
-                        return NULL;
-                }
-                entry->last_time_seen = now;
-                
-                // if entry is already valid, don't send NBSTAT query
-                if (entry->flag & NS_ENTRY_FLAG_VALID_NAME)
-                    continue;
-                
-                // send NBSTAT query
-                if (netbios_ns_send_name_query(ns, ip, NAME_QUERY_TYPE_NBSTAT,
-                                               name_query_broadcast, 0) == -1)
-                    return NULL;
-                
-            }
-            else if (name_query.type == NAME_QUERY_TYPE_NBSTAT)
-            {
-                bool send_callback;
-                
-                entry = netbios_ns_entry_find(ns, NULL,
-                                              recv_addr.sin_addr.s_addr);
-                
-                // ignore NBSTAT answers that didn't answered to NB query first.
-                if (!entry)
-                    continue;
-                
-                entry->last_time_seen = now;
-                
-                send_callback = !(entry->flag & NS_ENTRY_FLAG_VALID_NAME);
-                
-                netbios_ns_entry_set_name(entry, name_query.u.nbstat.name,
-                                          name_query.u.nbstat.group,
-                                          name_query.u.nbstat.type);
-                if (send_callback)
-                    ns->discover_callbacks.pf_on_entry_added(
-                                                             ns->discover_callbacks.p_opaque, entry);
-            }
+            BDSM_perror("netbios_ns_discover: ");
+            return NULL;
         }
-        if (ns->discover_broadcast_timeout == 0)
-            break;
+        if (netbios_ns_is_aborted(ns))
+            return NULL;
     }
     return NULL;
 }
@@ -957,25 +2246,40 @@ int netbios_ns_discover_start(netbios_ns *ns,
                               unsigned int broadcast_timeout,
                               netbios_ns_discover_callbacks *callbacks)
 {
-    if (ns->discover_started || !callbacks)
+    if (netbios_ns_discover_setup(ns, broadcast_timeout, callbacks) == -1)
         return -1;
     
-    ns->discover_callbacks = *callbacks;
-    ns->discover_broadcast_timeout = broadcast_timeout;
     if (pthread_create(&ns->discover_thread, NULL,
                        netbios_ns_discover_thread, ns) != 0)
+    {
+        netbios_ns_discover_close_ifaces(ns);
+        ns->discover_started = false;
         return -1;
-    ns->discover_started = true;
+    }
+    ns->discover_threaded = true;
     
     return 0;
 }
 
+int netbios_ns_discover_open(netbios_ns *ns,
+                             unsigned int broadcast_timeout,
+                             netbios_ns_discover_callbacks *callbacks)
+{
+    return netbios_ns_discover_setup(ns, broadcast_timeout, callbacks);
+}
+
 int netbios_ns_discover_stop(netbios_ns *ns)
 {
     if (ns->discover_started)
     {
-        netbios_ns_abort(ns);
-        pthread_join(ns->discover_thread, NULL);
+        if (ns->discover_threaded)
+        {
+            netbios_ns_abort(ns);
+            pthread_join(ns->discover_thread, NULL);
+            netbios_ns_abort_clear(ns);
+            ns->discover_threaded = false;
+        }
+        netbios_ns_discover_close_ifaces(ns);
         ns->discover_started = false;
         
         return 0;
@@ -32,6 +32,7 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
@@ -44,6 +45,7 @@
 #ifdef HAVE_SYS_SOCKET_H
 #include <sys/socket.h>
 #endif
+#include <sys/uio.h>
 #include <errno.h>
 #include <netdb.h>
 #include <fcntl.h>
@@ -125,6 +127,25 @@ error:
 
 
 
+// Read/write timeouts of the blocking operations, set once for all
+static int        netbios_session_set_timeouts(netbios_session *s)
+{
+    struct timeval write_tv, read_tv;
+
+    write_tv.tv_sec  = DSM_WRITE_TIMEOUT;
+    write_tv.tv_usec = 0;
+    read_tv.tv_sec   = DSM_READ_TIMEOUT;
+    read_tv.tv_usec  = 0;
+
+    if(setsockopt(s->socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&write_tv, sizeof write_tv)<0
+       || setsockopt(s->socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&read_tv, sizeof read_tv)<0)
+    {
+        BDSM_perror("netbios_session_connect: error setting timeouts");
+        return 0;
+    }
+    return 1;
+}
+
 static int        session_buffer_realloc(netbios_session *s, size_t new_size)
 {
     void        *new_ptr;
@@ -179,6 +200,8 @@ void              netbios_session_destroy(netbios_session *s)
     if (s->socket != -1)
         closesocket(s->socket);
 
+    free(s->out_buf);
+    free(s->in_packet);
     free(s->packet);
     free(s);
 }
@@ -196,6 +219,7 @@ int netbios_session_connect(const char *ip, const char *user_port, netbios_sessi
 
     if(s != NULL && s->packet != NULL){
     
+        s->direct_tcp = direct_tcp;
         if (direct_tcp)
         {
             ports[0] = NETBIOS_PORT_DIRECT;
@@ -246,6 +270,9 @@ int netbios_session_connect(const char *ip, const char *user_port, netbios_sessi
         if (!opened)
             goto error;
 
+        if (!netbios_session_set_timeouts(s))
+            goto error;
+
         if (!direct_tcp)
         {
             // Send the Session Request message
@@ -324,6 +351,125 @@ int               netbios_session_packet_append(netbios_session *s,
     return 0;
 }
 
+// Set the length of the message in the packet header. The length field is 17
+// bits on NBT and 24 bits on direct TCP, its high bits lie in the flags byte
+static void       netbios_session_set_length(netbios_session *s,
+                                             netbios_session_packet *packet,
+                                             size_t size)
+{
+    packet->flags  = (size >> 16) & (s->direct_tcp ? 0xff : 0x01);
+    packet->length = htons(size & 0xffff);
+}
+
+// Exchange the packet buffer with the one used to receive in non-blocking
+// mode, which must not be overwritten by messages sent in the meantime
+static int        netbios_session_swap_in(netbios_session *s)
+{
+    netbios_session_packet  *packet;
+    size_t                  payload_size;
+
+    if (s->in_packet == NULL)
+    {
+        s->in_packet = malloc(sizeof(netbios_session_packet) + NETBIOS_SESSION_IN_SIZE);
+        if (s->in_packet == NULL)
+            return 0;
+        s->in_payload_size = NETBIOS_SESSION_IN_SIZE;
+    }
+
+    packet                 = s->packet;
+    payload_size           = s->packet_payload_size;
+    s->packet              = s->in_packet;
+    s->packet_payload_size = s->in_payload_size;
+    s->in_packet           = packet;
+    s->in_payload_size     = payload_size;
+
+    return 1;
+}
+
+// Get the length of the message whose header is in the packet buffer
+static size_t     netbios_session_packet_length(netbios_session *s)
+{
+    size_t          total;
+
+    total  = ntohs(s->packet->length);
+    total |= (s->packet->flags & (s->direct_tcp ? 0xff : 0x01)) << 16;
+
+    return total;
+}
+
+// Queue data to be sent by netbios_session_flush() in non-blocking mode
+static int        netbios_session_queue(netbios_session *s, const void *data,
+                                        size_t size)
+{
+    uint8_t         *new_buf;
+    size_t          new_size;
+
+    if (s->out_len + size > s->out_size)
+    {
+        new_size = s->out_size ? s->out_size : 4096;
+        while (new_size < s->out_len + size)
+            new_size *= 2;
+        new_buf = realloc(s->out_buf, new_size);
+        if (new_buf == NULL)
+            return 0;
+        s->out_buf  = new_buf;
+        s->out_size = new_size;
+    }
+
+    memcpy(s->out_buf + s->out_len, data, size);
+    s->out_len += size;
+
+    return 1;
+}
+
+int               netbios_session_flush(netbios_session *s, int block)
+{
+    ssize_t         sent;
+
+    bdsm_assert(s != NULL && s->socket >= 0);
+
+    if (s == NULL || s->socket < 0)
+        return 0;
+
+    while (s->out_sent < s->out_len)
+    {
+        sent = send(s->socket, s->out_buf + s->out_sent,
+                    s->out_len - s->out_sent, block ? 0 : MSG_DONTWAIT);
+        if (sent < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (!block && (errno == EAGAIN || errno == EWOULDBLOCK))
+                return 1;
+            BDSM_perror("netbios_session_flush: Unable to send queued data");
+            return 0;
+        }
+        s->out_sent += sent;
+    }
+
+    s->out_sent = s->out_len = 0;
+    return 1;
+}
+
+int               netbios_session_want_write(netbios_session *s)
+{
+    return s != NULL && s->out_sent < s->out_len;
+}
+
+int               netbios_session_get_fd(netbios_session *s)
+{
+    return s != NULL ? s->socket : -1;
+}
+
+void              netbios_session_set_nonblocking(netbios_session *s,
+        int nonblocking)
+{
+    bdsm_assert(s != NULL);
+
+    if (s != NULL)
+        s->nonblocking = nonblocking;
+}
+
 int               netbios_session_packet_send(netbios_session *s)
 {
     ssize_t         to_send;
@@ -333,21 +479,17 @@ int               netbios_session_packet_send(netbios_session *s)
 
     if(s && s->packet && s->socket >= 0 && s->state > 0){
     
-        s->packet->length = htons(s->packet_cursor);
+        netbios_session_set_length(s, s->packet, s->packet_cursor);
         to_send           = sizeof(netbios_session_packet) + s->packet_cursor;
         
-        // Set write timeout
-        struct timeval write_tv;
-        write_tv.tv_sec = DSM_WRITE_TIMEOUT;
-        write_tv.tv_usec = 0;
-        ;
-        
-        if(setsockopt(s->socket, SOL_SOCKET, SO_SNDTIMEO, (const char*)&write_tv, sizeof write_tv)<0)
+        if (s->nonblocking)
         {
-            BDSM_perror("netbios_session_packet_send: error setting send timeout");
-            return 0;
+            if (!netbios_session_queue(s, s->packet, to_send)
+                || !netbios_session_flush(s, 0))
+                return 0;
+            return (int)to_send;
         }
-        
+
         sent = send(s->socket, (void *)s->packet, to_send, 0);
 
         if (sent != to_send)
@@ -362,17 +504,66 @@ int               netbios_session_packet_send(netbios_session *s)
     return 0;
 }
 
-int socket_set_recv_timeout(netbios_session *s)
+int               netbios_session_send_iov(netbios_session *s,
+        const struct iovec *iov, int iovcnt)
 {
-    //set read timeout
-    struct timeval read_tv;
-    read_tv.tv_sec = DSM_READ_TIMEOUT;
-    read_tv.tv_usec = 0;
-    
-    if(setsockopt(s->socket, SOL_SOCKET, SO_RCVTIMEO, (const char*)&read_tv, sizeof read_tv)<0){
-        return -1;
+    netbios_session_packet  hdr;
+    struct iovec            vec[NETBIOS_SESSION_MAX_IOV + 1];
+    struct msghdr           msg;
+    size_t                  size = 0;
+    ssize_t                 to_send;
+    ssize_t                 sent;
+
+    bdsm_assert(s && s->socket >= 0 && s->state > 0);
+    bdsm_assert(iovcnt >= 0 && iovcnt <= NETBIOS_SESSION_MAX_IOV);
+
+    if(s && s->socket >= 0 && s->state > 0
+       && iovcnt >= 0 && iovcnt <= NETBIOS_SESSION_MAX_IOV){
+
+        // The header lives on our stack and the caller buffers are sent as
+        // they are, the packet buffer is left alone.
+        for (int i = 0; i < iovcnt; i++)
+        {
+            vec[i + 1] = iov[i];
+            size += iov[i].iov_len;
+        }
+
+        hdr.opcode = NETBIOS_OP_SESSION_MSG;
+        netbios_session_set_length(s, &hdr, size);
+        vec[0].iov_base = (void *)&hdr;
+        vec[0].iov_len  = sizeof(netbios_session_packet);
+        to_send = sizeof(netbios_session_packet) + size;
+
+        if (s->nonblocking)
+        {
+            // The caller buffers can't be kept, copy them
+            for (int i = 0; i < iovcnt + 1; i++)
+                if (!netbios_session_queue(s, vec[i].iov_base, vec[i].iov_len))
+                    return 0;
+            if (!netbios_session_flush(s, 0))
+                return 0;
+            return (int)to_send;
+        }
+
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov    = vec;
+        msg.msg_iovlen = iovcnt + 1;
+
+        sent = sendmsg(s->socket, &msg, 0);
+
+        if (sent != to_send)
+        {
+            BDSM_perror("netbios_session_send_iov: Unable to send (full?) packet");
+            return 0;
+        }
+
+        return (int)sent;
     }
-    
+    return 0;
+}
+
+int socket_set_recv_timeout(netbios_session *s)
+{
     int socketFD = s->socket;
     int result = -1;
     
@@ -397,67 +588,95 @@ int socket_set_recv_timeout(netbios_session *s)
     return 0;
 }
 
-static ssize_t    netbios_session_get_next_packet(netbios_session *s)
+// Receive exactly 'size' bytes of the current message into 'buf'. If 'buf' is
+// NULL, the bytes are read and thrown away.
+static int        netbios_session_recv_exact(netbios_session *s, void *buf,
+                                             size_t size)
 {
+    uint8_t         scratch[4096];
     ssize_t         res;
-    size_t          total, sofar;
+    size_t          sofar = 0, chunk;
+
+    while (sofar < size)
+    {
+        chunk = size - sofar;
+        if (buf == NULL && chunk > sizeof(scratch))
+            chunk = sizeof(scratch);
+
+        res = recv(s->socket, buf ? (uint8_t *)buf + sofar : scratch, chunk, 0);
+        //BDSM_dbg("Total = %ld, sofar = %ld, res = %ld\n", size, sofar, res);
+
+        if (res <= 0)
+        {
+            BDSM_perror("netbios_session_packet_recv: ");
+            return 0;
+        }
+        sofar += res;
+    }
+
+    return 1;
+}
+
+// Get the next message from the socket, but only read its first 'max_size'
+// bytes into the packet buffer (more if they were already received in
+// non-blocking mode). Returns the full size of the message, the unread part
+// is left on the socket (see netbios_session_packet_recv_data())
+static ssize_t    netbios_session_get_next_packet(netbios_session *s,
+                                                  size_t max_size)
+{
+    size_t          total, size, got, body_got;
 
     bdsm_assert(s != NULL && s->packet != NULL && s->socket >= 0 && s->state > 0);
 
     if(s != NULL && s->packet != NULL && s->socket >= 0 && s->state > 0){
         
-        // Only get packet header and analyze it to get only needed number of bytes
-        // needed for the packet. This will prevent losing a part of next packet
-        total = sizeof(netbios_session_packet);
-        sofar = 0;
-        
-        if(socket_set_recv_timeout(s)==-1){
+        // Our request might still be queued
+        if (!netbios_session_flush(s, 1))
             return -1;
-        }
-        
-        while (sofar < total)
+
+        // Throw away what's left from a previous partial reception
+        if (s->packet_remaining > 0)
         {
-            res = recv(s->socket, (uint8_t *)(s->packet) + sofar, total - sofar, 0);
-            if (res <= 0)
-            {
-                BDSM_perror("netbios_session_packet_recv: ");
+            if (!netbios_session_recv_exact(s, NULL, s->packet_remaining))
                 return -1;
-            }
-            sofar += res;
+            s->packet_remaining = 0;
         }
 
-        total  = ntohs(s->packet->length);
-        total |= (s->packet->flags & 0x01) << 16;
-        sofar  = 0;
+        // Part of the message might have been received in non-blocking mode
+        got = s->in_got;
+        s->in_got = 0;
+        if (got > 0)
+            netbios_session_swap_in(s);
 
-        if (total + sizeof(netbios_session_packet) > s->packet_payload_size
-         && !session_buffer_realloc(s, total + sizeof(netbios_session_packet)))
+        // Only get packet header and analyze it to get only needed number of bytes
+        // needed for the packet. This will prevent losing a part of next packet
+        if(got == 0 && socket_set_recv_timeout(s)==-1){
             return -1;
-
-        //BDSM_dbg("Total = %ld, sofar = %ld\n", total, sofar);
+        }
         
-        while (sofar < total)
-        {
-            res = recv(s->socket, (uint8_t *)(s->packet) + sizeof(netbios_session_packet)
-                       + sofar, total - sofar, 0);
-            //BDSM_dbg("Total = %ld, sofar = %ld, res = %ld\n", total, sofar, res);
+        if (got < sizeof(netbios_session_packet)
+            && !netbios_session_recv_exact(s, (uint8_t *)s->packet + got,
+                                           sizeof(netbios_session_packet) - got))
+            return -1;
 
-            if (res <= 0)
-            {
-                BDSM_perror("netbios_session_packet_recv: ");
-                return -1;
-            }
-            sofar += res;
-        }
+        total    = netbios_session_packet_length(s);
+        body_got = got > sizeof(netbios_session_packet) ?
+                   got - sizeof(netbios_session_packet) : 0;
+        size     = total < max_size ? total : max_size;
+        size     = size > body_got ? size : body_got;
 
-        if (sofar > total)
-        {
-            BDSM_dbg("netbios_session_packet_recv: Packet size mismatch (%ld/%ld)\n",
-                     sofar, total);
+        if (size + sizeof(netbios_session_packet) > s->packet_payload_size
+         && !session_buffer_realloc(s, size + sizeof(netbios_session_packet)))
             return -1;
-        }
 
-        return sofar;
+        if (!netbios_session_recv_exact(s, s->packet->payload + body_got,
+                                        size - body_got))
+            return -1;
+
+        s->packet_received  = size;
+        s->packet_remaining = total - size;
+
+        return total;
         
     }
     return -1;
@@ -470,7 +689,7 @@ ssize_t           netbios_session_packet_recv(netbios_session *s, void **data)
     // ignore keepalive messages if needed
     do
     {
-        size = netbios_session_get_next_packet(s);
+        size = netbios_session_get_next_packet(s, SIZE_MAX);
     } while (size >= 0 && s->packet->opcode == NETBIOS_OP_SESSION_KEEPALIVE);
 
     if ((size >= 0) && (data != NULL))
@@ -478,3 +697,152 @@ ssize_t           netbios_session_packet_recv(netbios_session *s, void **data)
 
     return size;
 }
+
+ssize_t           netbios_session_packet_recv_partial(netbios_session *s,
+        void **data, size_t size, size_t *received)
+{
+    ssize_t         total;
+
+    // ignore keepalive messages if needed
+    do
+    {
+        total = netbios_session_get_next_packet(s, size);
+    } while (total >= 0 && s->packet->opcode == NETBIOS_OP_SESSION_KEEPALIVE);
+
+    if ((total >= 0) && (data != NULL))
+        *data = (void *) s->packet->payload;
+    if ((total >= 0) && (received != NULL))
+        *received = s->packet_received;
+
+    return total;
+}
+
+ssize_t           netbios_session_packet_recv_nonblock(netbios_session *s,
+        void **data)
+{
+    ssize_t         res;
+    size_t          total, want;
+
+    bdsm_assert(s != NULL && s->packet != NULL && s->socket >= 0 && s->state > 0);
+
+    if (s == NULL || s->packet == NULL || s->socket < 0 || s->state <= 0)
+        return -1;
+
+    // What's left from a partial reception has already arrived (or is about to)
+    if (s->packet_remaining > 0)
+    {
+        if (!netbios_session_recv_exact(s, NULL, s->packet_remaining))
+            return -1;
+        s->packet_remaining = 0;
+    }
+
+    // Work on the reception buffer, it's swapped back unless a message is
+    // complete
+    if (!netbios_session_swap_in(s))
+        return -1;
+
+    for (;;)
+    {
+        want = sizeof(netbios_session_packet);
+        if (s->in_got >= sizeof(netbios_session_packet))
+        {
+            total = netbios_session_packet_length(s);
+            want += total;
+
+            if (s->in_got == want)
+            {
+                // We have a complete message
+                s->in_got = 0;
+                if (s->packet->opcode == NETBIOS_OP_SESSION_KEEPALIVE)
+                    continue;
+
+                s->packet_received  = total;
+                s->packet_remaining = 0;
+                if (data != NULL)
+                    *data = (void *) s->packet->payload;
+                return total;
+            }
+
+            if (want > s->packet_payload_size
+             && !session_buffer_realloc(s, want))
+                break;
+        }
+
+        res = recv(s->socket, (uint8_t *)s->packet + s->in_got,
+                   want - s->in_got, MSG_DONTWAIT);
+        if (res == 0)
+        {
+            BDSM_dbg("netbios_session_packet_recv_nonblock: Connection closed\n");
+            break;
+        }
+        if (res < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+            {
+                netbios_session_swap_in(s);
+                return NETBIOS_SESSION_AGAIN;
+            }
+            BDSM_perror("netbios_session_packet_recv_nonblock: ");
+            break;
+        }
+        s->in_got += res;
+    }
+
+    if (s->packet != NULL)
+        netbios_session_swap_in(s);
+    return -1;
+}
+
+ssize_t           netbios_session_packet_recv_rest(netbios_session *s,
+        void **data)
+{
+    size_t          total;
+
+    bdsm_assert(s != NULL && s->packet != NULL && s->socket >= 0);
+
+    if (s == NULL || s->packet == NULL || s->socket < 0)
+        return -1;
+
+    if (s->packet_remaining > 0)
+    {
+        total = s->packet_received + s->packet_remaining;
+        if (total + sizeof(netbios_session_packet) > s->packet_payload_size
+         && !session_buffer_realloc(s, total + sizeof(netbios_session_packet)))
+            return -1;
+
+        if (!netbios_session_recv_exact(s, s->packet->payload + s->packet_received,
+                                        s->packet_remaining))
+            return -1;
+        s->packet_received  = total;
+        s->packet_remaining = 0;
+    }
+
+    if (data != NULL)
+        *data = (void *) s->packet->payload;
+
+    return s->packet_received;
+}
+
+int               netbios_session_packet_recv_data(netbios_session *s,
+        void *buf, size_t size)
+{
+    bdsm_assert(s != NULL && s->socket >= 0);
+
+    if (s == NULL || s->socket < 0)
+        return 0;
+
+    if (size > s->packet_remaining)
+    {
+        BDSM_dbg("netbios_session_packet_recv_data: Packet size mismatch (%ld/%ld)\n",
+                 size, s->packet_remaining);
+        return 0;
+    }
+
+    if (!netbios_session_recv_exact(s, buf, size))
+        return 0;
+    s->packet_remaining -= size;
+
+    return 1;
+}
@@ -36,6 +36,7 @@
 
 #if !defined _WIN32
 # include <netinet/in.h>
+# include <sys/uio.h>
 #else
 # include <winsock2.h>
 #endif
@@ -48,6 +49,18 @@
 #define NETBIOS_SESSION_ERROR       -1
 #define NETBIOS_SESSION_REFUSED     -2
 
+// Initial size of the non-blocking reception buffer
+#define NETBIOS_SESSION_IN_SIZE     (4096)
+// No complete message yet, see netbios_session_packet_recv_nonblock()
+#define NETBIOS_SESSION_AGAIN       -2
+
+// Max payload of a NBT session message (17 bits length field)
+#define NETBIOS_SESSION_MAX_PAYLOAD         (0x1ffff)
+// Max payload of a direct TCP message (24 bits length field)
+#define NETBIOS_SESSION_DIRECT_MAX_PAYLOAD  (0xffffff)
+// Max number of caller buffers for netbios_session_send_iov()
+#define NETBIOS_SESSION_MAX_IOV             (8)
+
 typedef struct              netbios_session_s
 {
     // The address of the remote peer;
@@ -56,12 +69,30 @@ typedef struct              netbios_session_s
     int                         socket;
     // The current sessions state; See macro before (eg. NETBIOS_SESSION_ERROR)
     int                         state;
+    // Is this a direct TCP session (port 445) rather than NBT ?
+    int                         direct_tcp;
     // What is the size of the allocated payload;
     size_t                      packet_payload_size;
     // Where is the write cursor relative to the beginning of the payload
     size_t                      packet_cursor;
+    // How many bytes of the last received message are in the buffer
+    size_t                      packet_received;
+    // How many bytes of the last received message are still on the socket
+    size_t                      packet_remaining;
     // Our allocated packet, this is where the magic happen (both send and recv :)
     netbios_session_packet      *packet;
+    // Queue messages instead of blocking on send, see netbios_session_flush()
+    int                         nonblocking;
+    // Messages waiting to be sent in non-blocking mode
+    uint8_t                     *out_buf;
+    size_t                      out_size;
+    size_t                      out_len;
+    size_t                      out_sent;
+    // The message being received in non-blocking mode and how many bytes of
+    // it (NBT header included) we have so far
+    netbios_session_packet      *in_packet;
+    size_t                      in_payload_size;
+    size_t                      in_got;
 }                           netbios_session;
 
 
@@ -77,6 +108,37 @@ void              netbios_session_packet_init(netbios_session *s);
 int               netbios_session_packet_append(netbios_session *s,
         const char *data, size_t size);
 int               netbios_session_packet_send(netbios_session *s);
+// Send a message made of the content of 'iov'. Neither the caller buffers nor
+// the header are copied into the packet buffer, so this doesn't interfere
+// with a reception in progress.
+int               netbios_session_send_iov(netbios_session *s,
+        const struct iovec *iov, int iovcnt);
 ssize_t           netbios_session_packet_recv(netbios_session *s, void **data);
+// Only read the first 'size' bytes of the next message into the session
+// buffer, the rest must be fetched with netbios_session_packet_recv_data() or
+// is discarded on next reception. Returns the full size of the message.
+ssize_t           netbios_session_packet_recv_partial(netbios_session *s,
+        void **data, size_t size, size_t *received);
+// Get the next message without blocking, if it's complete. Returns its size,
+// NETBIOS_SESSION_AGAIN if it hasn't fully arrived yet or -1 on error.
+ssize_t           netbios_session_packet_recv_nonblock(netbios_session *s,
+        void **data);
+// In non-blocking mode, messages are queued and sent as the socket allows by
+// netbios_session_flush(). Blocking receptions flush the queue first.
+void              netbios_session_set_nonblocking(netbios_session *s,
+        int nonblocking);
+// Send queued messages, without blocking unless 'block' is set
+int               netbios_session_flush(netbios_session *s, int block);
+// Is there anything queued for sending ?
+int               netbios_session_want_write(netbios_session *s);
+int               netbios_session_get_fd(netbios_session *s);
+// Receive what's left of a partially received message into the session
+// buffer, which might move. Returns the full size of the message.
+ssize_t           netbios_session_packet_recv_rest(netbios_session *s,
+        void **data);
+// Read the next 'size' bytes of a partially received message into 'buf' (or
+// discard them if 'buf' is NULL)
+int               netbios_session_packet_recv_data(netbios_session *s,
+        void *buf, size_t size);
 
 #endif
@@ -0,0 +1,314 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+
+#include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../xcode/config.h"
+#include "bdsm_debug.h"
+#include "smb_async.h"
+#include "smb_session.h"
+#include "smb_session_msg.h"
+
+smb_request     *smb_request_new(smb_async_cb cb, void *opaque)
+{
+    smb_request *req;
+
+    req = calloc(1, sizeof(smb_request));
+    if (!req)
+        return NULL;
+
+    req->hdr_size = SIZE_MAX;
+    req->cb       = cb;
+    req->opaque   = opaque;
+
+    return req;
+}
+
+int             smb_request_submit(smb_session *s, smb_request *req,
+                                   smb_message *msg, const void *data,
+                                   size_t size)
+{
+    bdsm_assert(s != NULL && req != NULL && msg != NULL);
+
+    if (!smb_session_send_req(s, msg, data, size, req))
+    {
+        free(req);
+        return DSM_ERROR_NETWORK;
+    }
+
+    return DSM_SUCCESS;
+}
+
+bool            smb_request_follow(smb_session *s, smb_request *req)
+{
+    smb_request *next;
+
+    next = smb_request_new(req->cb, req->opaque);
+    if (!next)
+        return false;
+    req->cb        = NULL;
+    next->mid      = req->mid;
+    next->hdr_size = req->hdr_size;
+    next->handler  = req->handler;
+    next->fd       = req->fd;
+    next->buf      = req->buf;
+    next->buf_size = req->buf_size;
+    next->ctx      = req->ctx;
+
+    smb_session_lock(s);
+    TAILQ_INSERT_TAIL(&s->pending, next, next);
+    s->nb_pending++;
+    smb_session_unlock(s);
+
+    return true;
+}
+
+bool            smb_request_check_nt_status(smb_session *s, smb_request *req,
+                                            smb_message *msg)
+{
+    if (smb_session_check_nt_status(s, msg))
+        return true;
+
+    req->result.status    = DSM_ERROR_NT;
+    req->result.nt_status = msg->packet->header.status;
+    return false;
+}
+
+smb_request     *smb_session_pending_find(smb_session *s, uint16_t mid)
+{
+    smb_request *iter;
+
+    TAILQ_FOREACH(iter, &s->pending, next)
+        if (iter->mid == mid)
+            return iter;
+
+    return NULL;
+}
+
+smb_request     *smb_session_pending_take(smb_session *s, uint16_t mid)
+{
+    smb_request *req;
+
+    smb_session_lock(s);
+    if ((req = smb_session_pending_find(s, mid)) != NULL)
+        TAILQ_REMOVE(&s->pending, req, next);
+    smb_session_unlock(s);
+
+    return req;
+}
+
+void            smb_request_complete(smb_session *s, smb_request *req,
+                                     smb_message *msg, size_t payload_size)
+{
+    void        *data;
+
+    // Fetch the part of the reply the handler needs in memory
+    if (msg != NULL && req->hdr_size > msg->payload_size
+        && msg->payload_size < payload_size)
+    {
+        if (s->transport.recv_rest(s->transport.session, &data) < 0)
+        {
+            msg = NULL;
+            req->result.status = DSM_ERROR_NETWORK;
+        }
+        else
+        {
+            msg->packet       = (smb_packet *)data;
+            msg->payload_size = payload_size;
+        }
+    }
+
+    req->handler(s, req, msg, payload_size);
+}
+
+void            smb_request_finish(smb_session *s, smb_request *req)
+{
+    if (req->cb != NULL)
+        req->cb(s, &req->result, req->opaque);
+    free(req);
+
+    smb_session_lock(s);
+    s->nb_pending--;
+    s->completed++;
+    if (s->thread_safe)
+        pthread_cond_broadcast(&s->cond);
+    smb_session_unlock(s);
+}
+
+void            smb_request_dispatch(smb_session *s, smb_request *req,
+                                     smb_message *msg, size_t payload_size)
+{
+    smb_request_complete(s, req, msg, payload_size);
+    smb_request_finish(s, req);
+}
+
+void            smb_session_pending_fail(smb_session *s, int status)
+{
+    smb_request *req;
+
+    for (;;)
+    {
+        smb_session_lock(s);
+        if ((req = TAILQ_FIRST(&s->pending)) != NULL)
+            TAILQ_REMOVE(&s->pending, req, next);
+        smb_session_unlock(s);
+
+        if (req == NULL)
+            break;
+
+        req->result.status = status;
+        smb_request_dispatch(s, req, NULL, 0);
+    }
+}
+
+int             smb_session_wait(smb_session *s)
+{
+    int         res;
+
+    bdsm_assert(s != NULL);
+
+    if (s == NULL)
+        return DSM_ERROR_GENERIC;
+
+    if (s->thread_safe)
+        return smb_session_wait_routed(s);
+
+    while (s->nb_pending > 0)
+    {
+        res = smb_session_recv_dispatch(s);
+        if (res < 0)
+        {
+            smb_session_pending_fail(s, DSM_ERROR_NETWORK);
+            return DSM_ERROR_NETWORK;
+        }
+        if (res > 0)
+            break;
+    }
+
+    return DSM_SUCCESS;
+}
+
+int             smb_session_wait_all(smb_session *s)
+{
+    int         res;
+
+    bdsm_assert(s != NULL);
+
+    if (s == NULL)
+        return DSM_ERROR_GENERIC;
+
+    while (s->nb_pending > 0)
+        if ((res = smb_session_wait(s)) != DSM_SUCCESS)
+            return res;
+
+    return DSM_SUCCESS;
+}
+
+unsigned int    smb_session_pending_count(smb_session *s)
+{
+    bdsm_assert(s != NULL);
+
+    return s != NULL ? s->nb_pending : 0;
+}
+
+int             smb_session_get_fd(smb_session *s)
+{
+    bdsm_assert(s != NULL);
+
+    if (s == NULL || s->transport.session == NULL)
+        return -1;
+
+    return s->transport.get_fd(s->transport.session);
+}
+
+int             smb_session_set_nonblocking(smb_session *s, int nonblocking)
+{
+    bdsm_assert(s != NULL);
+
+    if (s == NULL || s->transport.session == NULL || s->thread_safe)
+        return DSM_ERROR_GENERIC;
+
+    // Don't leave anything queued behind us
+    if (!nonblocking && !s->transport.flush(s->transport.session, 1))
+        return DSM_ERROR_NETWORK;
+
+    s->transport.set_nonblocking(s->transport.session, nonblocking);
+    s->nonblocking = nonblocking != 0;
+
+    return DSM_SUCCESS;
+}
+
+int             smb_session_want(smb_session *s)
+{
+    int         want = 0;
+
+    bdsm_assert(s != NULL);
+
+    if (s == NULL || s->transport.session == NULL)
+        return 0;
+
+    if (s->nb_pending > 0)
+        want |= SMB_SESSION_WANT_READ;
+    if (s->transport.want_write(s->transport.session))
+        want |= SMB_SESSION_WANT_WRITE;
+
+    return want;
+}
+
+int             smb_session_process(smb_session *s)
+{
+    int         res;
+
+    bdsm_assert(s != NULL);
+
+    if (s == NULL || s->transport.session == NULL || s->thread_safe)
+        return DSM_ERROR_GENERIC;
+
+    if (!s->transport.flush(s->transport.session, 0))
+        goto error;
+
+    while ((res = smb_session_recv_nonblock(s)) > 0)
+        ;
+    if (res < 0)
+        goto error;
+
+    // Callbacks might have sent new requests
+    if (!s->transport.flush(s->transport.session, 0))
+        goto error;
+
+    return DSM_SUCCESS;
+
+error:
+    smb_session_pending_fail(s, DSM_ERROR_NETWORK);
+    return DSM_ERROR_NETWORK;
+}
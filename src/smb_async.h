@@ -0,0 +1,72 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef _SMB_ASYNC_H_
+#define _SMB_ASYNC_H_
+
+#include "smb_types.h"
+#include "../include/bdsm/smb_async.h"
+
+// Allocate a request, cb can be NULL
+smb_request     *smb_request_new(smb_async_cb cb, void *opaque);
+
+// Send msg (followed by 'size' bytes of 'data' if not NULL) and make req wait
+// for the reply. On failure, req is freed and its callback isn't called.
+int             smb_request_submit(smb_session *s, smb_request *req,
+                                   smb_message *msg, const void *data,
+                                   size_t size);
+
+// For a reply sent in several messages: make a copy of req, taken from the
+// pending queue, wait for the next message with the same MID. The user
+// callback moves to the copy.
+bool            smb_request_follow(smb_session *s, smb_request *req);
+
+// Check the NT status of a reply, storing it in the request result on failure
+bool            smb_request_check_nt_status(smb_session *s, smb_request *req,
+                                            smb_message *msg);
+
+smb_request     *smb_session_pending_find(smb_session *s, uint16_t mid);
+// Find the request waiting for 'mid' and remove it from the pending queue
+smb_request     *smb_session_pending_take(smb_session *s, uint16_t mid);
+
+// Parse the reply in msg (NULL on failure, see smb_request) into the request
+// result. This might receive the rest of the reply.
+void            smb_request_complete(smb_session *s, smb_request *req,
+                                     smb_message *msg, size_t payload_size);
+// Call the user callback of a completed request and free it
+void            smb_request_finish(smb_session *s, smb_request *req);
+// Both of the above, req must have been taken from the pending queue
+void            smb_request_dispatch(smb_session *s, smb_request *req,
+                                     smb_message *msg, size_t payload_size);
+
+// Complete all pending requests with the given error
+void            smb_session_pending_fail(smb_session *s, int status);
+
+#endif
@@ -79,6 +79,7 @@
 #define SMB_CMD_RMFILE          0x06
 #define SMB_CMD_MOVE            0x07 // Move or rename
 #define SMB_CMD_QUERY_INFO      0x08 // Query Information
+#define SMB_CMD_FIND_CLOSE2     0x34
 
 //-----------------------------------------------------------------------------/
 // SMB FLAGS2 values
@@ -92,6 +93,7 @@
 #define SMB_TR2_FIND_FIRST        0x0001
 #define SMB_TR2_FIND_NEXT         0x0002
 #define SMB_TR2_QUERY_PATH        0x0005
+#define SMB_TR2_QUERY_FILE        0x0007
 #define SMB_TR2_CREATE_DIRECTORY  0x000d
 
 
@@ -158,6 +160,8 @@
 #define SMB_CAPS_NTSMB          (1 << 4)
 #define SMB_CAPS_RPC            (1 << 5)
 #define SMB_CAPS_NTFIND         (1 << 9)
+#define SMB_CAPS_LARGE_READX    (1 << 14)
+#define SMB_CAPS_LARGE_WRITEX   (1 << 15)
 #define SMB_CAPS_XSEC           (1 << 31)
 
 // File creation/open flags
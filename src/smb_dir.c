@@ -37,6 +37,7 @@
 #include "../xcode/config.h"
 #include "smb_session_msg.h"
 #include "smb_fd.h"
+#include "smb_stat_cache.h"
 #include "smb_utils.h"
 #include "smb_dir.h"
 #include "bdsm_debug.h"
@@ -79,6 +80,9 @@ int smb_directory_rm(smb_session *s, smb_tid tid, const char *path)
 
         free(utf_pattern);
 
+        // Whatever the outcome, the cached status might be stale now
+        smb_stat_cache_invalidate(s, tid, path, true);
+
         if (!smb_session_recv_msg(s, &resp_msg))
             return DSM_ERROR_NETWORK;
 
@@ -138,6 +142,8 @@ int smb_directory_create(smb_session *s, smb_tid tid, const char *path)
 
         free(utf_pattern);
 
+        smb_stat_cache_invalidate(s, tid, path, false);
+
         if (!smb_session_recv_msg(s, &resp_msg))
             return DSM_ERROR_NETWORK;
 
@@ -29,133 +29,267 @@
  *****************************************************************************/
 
 #include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
 
 #include "../xcode/config.h"
+#include "bdsm_debug.h"
 #include "smb_fd.h"
+#include "smb_file.h"
+
+// Smallest table, grown as soon as it's half full
+#define SMB_FD_TABLE_MIN    (16)
+
+static size_t   smb_fd_table_slot(const smb_fd_table *t, uint32_t key)
+{
+    // Mix the bits, the tids and fids given by servers are often sequential
+    key ^= key >> 16;
+    key *= 0x85ebca6b;
+    key ^= key >> 13;
+    key *= 0xc2b2ae35;
+    key ^= key >> 16;
+
+    return key & (t->size - 1);
+}
+
+static void     *smb_fd_table_get(const smb_fd_table *t, uint32_t key)
+{
+    size_t      i;
+
+    if (t->count == 0)
+        return NULL;
+
+    for (i = smb_fd_table_slot(t, key); t->values[i] != NULL;
+         i = (i + 1) & (t->size - 1))
+        if (t->keys[i] == key)
+            return t->values[i];
+
+    return NULL;
+}
+
+static bool     smb_fd_table_grow(smb_fd_table *t)
+{
+    smb_fd_table    bigger;
+    size_t          i, j;
+
+    bigger.size   = t->size ? t->size * 2 : SMB_FD_TABLE_MIN;
+    bigger.count  = t->count;
+    bigger.keys   = calloc(bigger.size, sizeof(uint32_t));
+    bigger.values = calloc(bigger.size, sizeof(void *));
+    if (!bigger.keys || !bigger.values)
+    {
+        free(bigger.keys);
+        free(bigger.values);
+        return false;
+    }
+
+    for (i = 0; i < t->size; i++)
+    {
+        if (t->values[i] == NULL)
+            continue;
+        j = smb_fd_table_slot(&bigger, t->keys[i]);
+        while (bigger.values[j] != NULL)
+            j = (j + 1) & (bigger.size - 1);
+        bigger.keys[j]   = t->keys[i];
+        bigger.values[j] = t->values[i];
+    }
+
+    free(t->keys);
+    free(t->values);
+    *t = bigger;
+
+    return true;
+}
+
+// Add or replace the value of 'key'
+static bool     smb_fd_table_put(smb_fd_table *t, uint32_t key, void *value)
+{
+    size_t      i;
+
+    if ((t->count + 1) * 2 > t->size && !smb_fd_table_grow(t))
+        return false;
+
+    for (i = smb_fd_table_slot(t, key); t->values[i] != NULL;
+         i = (i + 1) & (t->size - 1))
+        if (t->keys[i] == key)
+            break;
+
+    if (t->values[i] == NULL)
+        t->count++;
+    t->keys[i]   = key;
+    t->values[i] = value;
+
+    return true;
+}
+
+static void     *smb_fd_table_remove(smb_fd_table *t, uint32_t key)
+{
+    size_t      i, j, home;
+    void        *value;
+
+    if (t->count == 0)
+        return NULL;
+
+    for (i = smb_fd_table_slot(t, key); t->values[i] != NULL;
+         i = (i + 1) & (t->size - 1))
+        if (t->keys[i] == key)
+            break;
+    if ((value = t->values[i]) == NULL)
+        return NULL;
+
+    // Move back the following entries which can't be found past the hole
+    for (j = (i + 1) & (t->size - 1); t->values[j] != NULL;
+         j = (j + 1) & (t->size - 1))
+    {
+        home = smb_fd_table_slot(t, t->keys[j]);
+        if (((j - home) & (t->size - 1)) >= ((j - i) & (t->size - 1)))
+        {
+            t->keys[i]   = t->keys[j];
+            t->values[i] = t->values[j];
+            i = j;
+        }
+    }
+    t->values[i] = NULL;
+    t->count--;
+
+    return value;
+}
+
+static void     smb_fd_table_free(smb_fd_table *t)
+{
+    free(t->keys);
+    free(t->values);
+    memset(t, 0, sizeof(*t));
+}
 
 void        smb_session_share_add(smb_session *s, smb_share *share)
 {
-    smb_share *iter;
+    smb_share *old;
 
     bdsm_assert(s != NULL && share != NULL);
 
     if(s != NULL && share != NULL){
     
-        if (s->shares == NULL)
+        smb_session_lock(s);
+        // The server may give the tid of a disconnected share again
+        old = smb_fd_table_get(&s->shares, share->tid);
+        if (!smb_fd_table_put(&s->shares, share->tid, share))
         {
-            s->shares = share;
-            return;
+            BDSM_dbg("Unable to register share %hu\n", share->tid);
+            old = NULL;
         }
+        smb_session_unlock(s);
 
-        iter = s->shares;
-        while (iter->next != NULL){
-            iter = iter->next;
-        }
-        iter->next = share;
+        if (old != share)
+            free(old);
     }
     
 }
 
 smb_share *smb_session_share_get(smb_session *s, smb_tid tid)
 {
-    smb_share *iter;
+    smb_share *share;
 
     bdsm_assert(s != NULL);
 
     if(s != NULL){
         
-        iter = s->shares;
-        while (iter != NULL && iter->tid != tid)
-            iter = iter->next;
+        smb_session_lock(s);
+        share = smb_fd_table_get(&s->shares, tid);
+        smb_session_unlock(s);
 
-        return iter;
+        return share;
     }
     return NULL;
 }
 
 smb_share *smb_session_share_remove(smb_session *s, smb_tid tid)
 {
-    smb_share *iter, *keep;
+    smb_share *keep;
 
     bdsm_assert(s != NULL);
     
     if(s != NULL){
 
-        iter = s->shares;
-
-        if (iter == NULL)
-            return NULL;
-        if (iter->tid == tid)
-        {
-            s->shares = s->shares->next;
-            return iter;
-        }
-
-        while (iter->next != NULL && iter->next->tid != tid)
-            iter = iter->next;
+        smb_session_lock(s);
+        keep = smb_fd_table_remove(&s->shares, tid);
+        smb_session_unlock(s);
 
-        if (iter->next != NULL) // We found it
-        {
-            keep = iter->next;
-            iter->next = iter->next->next;
-            return keep;
-        }
+        return keep;
     }
     return NULL;
 }
 
+// A copy of the \\SERVER\Share path of a tid, NULL if it isn't connected
+static char     *smb_session_share_path(smb_session *s, smb_tid tid)
+{
+    smb_share   *share;
+    char        *path = NULL;
+
+    smb_session_lock(s);
+    if ((share = smb_fd_table_get(&s->shares, tid)) != NULL)
+        path = strdup(share->path);
+    smb_session_unlock(s);
+
+    return path;
+}
+
+bool            smb_session_share_same(smb_session *s1, smb_tid tid1,
+                                       smb_session *s2, smb_tid tid2)
+{
+    char        *path1, *path2;
+    bool        same;
+
+    bdsm_assert(s1 != NULL && s2 != NULL && s1 != s2);
+
+    if (s1 == NULL || s2 == NULL || s1 == s2)
+        return false;
+
+    // One session locked at a time, nesting them could deadlock
+    path1 = smb_session_share_path(s1, tid1);
+    path2 = smb_session_share_path(s2, tid2);
+    same  = path1 != NULL && path2 != NULL && strcasecmp(path1, path2) == 0;
+    free(path1);
+    free(path2);
+
+    return same;
+}
+
 void            smb_session_share_clear(smb_session *s)
 {
-    smb_share   *iter, *tmp;
-    smb_file    *fiter, *ftmp;
+    size_t      i;
 
     bdsm_assert(s != NULL);
 
     if(s != NULL){
-            
-        iter = s->shares;
-        while(iter != NULL)
-        {        
-            fiter = iter->files;
-            while(fiter != NULL)
-            {
-                ftmp = fiter;
-                fiter = fiter->next;
-
-                free(ftmp->name);
-                free(ftmp);
-            }   
-
-            tmp = iter;
-            iter = iter->next;
-            free(tmp);
-        }
+
+        for (i = 0; i < s->files.size; i++)
+            if (s->files.values[i] != NULL)
+                smb_file_destroy(s, s->files.values[i]);
+        smb_fd_table_free(&s->files);
+
+        for (i = 0; i < s->shares.size; i++)
+            free(s->shares.values[i]);
+        smb_fd_table_free(&s->shares);
     }
 }
 
 int         smb_session_file_add(smb_session *s, smb_tid tid, smb_file *f)
 {
-    smb_share *share;
-    smb_file  *iter;
+    int       res = 0;
 
     bdsm_assert(s != NULL && f != NULL);
 
     if(s != NULL && f != NULL){
         
-        if ((share = smb_session_share_get(s, tid)) == NULL)
-            return 0;
+        smb_session_lock(s);
+        if (smb_fd_table_get(&s->shares, tid) != NULL)
+            res = smb_fd_table_put(&s->files, SMB_FD(tid, f->fid), f);
+        smb_session_unlock(s);
 
-        if (share->files == NULL)
-            share->files = f;
-        else
-        {
-            iter = share->files;
-            while (iter->next != NULL)
-                iter = iter->next;
-            iter->next = f;
-        }
-
-        return 1;
+        return res;
     }
     
     return 0;
@@ -163,58 +297,34 @@ int         smb_session_file_add(smb_session *s, smb_tid tid, smb_file *f)
 
 smb_file  *smb_session_file_get(smb_session *s, smb_fd fd)
 {
-    smb_share *share;
-    smb_file  *iter;
+    smb_file  *file;
 
     bdsm_assert(s != NULL && fd);
 
     if(s != NULL && fd){
     
-        if ((share = smb_session_share_get(s, SMB_FD_TID(fd))) == NULL)
-            return NULL;
+        smb_session_lock(s);
+        file = smb_fd_table_get(&s->files, fd);
+        smb_session_unlock(s);
 
-        iter = share->files;
-        while (iter != NULL && iter->fid != SMB_FD_FID(fd))
-            iter = iter->next;
-
-        return iter;
-        
+        return file;
     }
     return NULL;
 }
 
 smb_file  *smb_session_file_remove(smb_session *s, smb_fd fd)
 {
-    smb_share *share;
-    smb_file  *iter, *keep;
+    smb_file  *keep;
 
     bdsm_assert(s != NULL && fd);
     
     if(s != NULL && fd){
 
-        if ((share = smb_session_share_get(s, SMB_FD_TID(fd))) == NULL)
-            return NULL;
+        smb_session_lock(s);
+        keep = smb_fd_table_remove(&s->files, fd);
+        smb_session_unlock(s);
 
-        iter = share->files;
-
-        if (iter == NULL)
-            return NULL;
-        if (iter->fid == SMB_FD_FID(fd))
-        {
-            share->files = iter->next;
-            return iter;
-        }
-
-        while (iter->next != NULL && iter->next->fid != SMB_FD_TID(fd))
-            iter = iter->next;
-        if (iter->next != NULL)
-        {
-            keep = iter->next;
-            iter->next = iter->next->next;
-            return keep;
-        }
-        else
-            return NULL;
+        return keep;
     }
     
     return NULL;
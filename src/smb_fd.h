@@ -38,6 +38,9 @@ void            smb_session_share_add(smb_session *s, smb_share *share);
 smb_share       *smb_session_share_get(smb_session *s, smb_tid tid);
 smb_share       *smb_session_share_remove(smb_session *s, smb_tid tid);
 void            smb_session_share_clear(smb_session *s);
+// Do both tids name the same \\SERVER\Share ? (case insensitive)
+bool            smb_session_share_same(smb_session *s1, smb_tid tid1,
+                                       smb_session *s2, smb_tid tid2);
 
 int             smb_session_file_add(smb_session *s, smb_tid tid, smb_file *f);
 smb_file        *smb_session_file_get(smb_session *s, smb_fd fd);
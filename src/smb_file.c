@@ -33,26 +33,128 @@
 #include <unistd.h>
 #include <string.h>
 #include <stdio.h>
+#include <stdbool.h>
 
 #include "../xcode/config.h"
+#include "smb_async.h"
 #include "smb_session_msg.h"
 #include "smb_fd.h"
+#include "smb_stat_cache.h"
 #include "smb_utils.h"
 #include "smb_file.h"
 #include "bdsm_debug.h"
 
 
+static int  smb_fopen_build(smb_tid tid, const char *path, uint32_t o_flags,
+                            smb_message **msg)
+{
+    smb_message     *req_msg;
+    smb_create_req  req;
+    size_t          path_len;
+    char            *utf_path;
+
+    path_len = smb_to_utf16(path, strlen(path) + 1, &utf_path);
+    if (path_len == 0)
+        return DSM_ERROR_CHARSET;
+
+    req_msg = smb_message_new(SMB_CMD_CREATE);
+    if (!req_msg) {
+        free(utf_path);
+        return DSM_ERROR_GENERIC;
+    }
+
+    // Set SMB Headers
+    req_msg->packet->header.tid = tid;
+
+    // Create AndX Params
+    SMB_MSG_INIT_PKT_ANDX(req);
+    req.wct            = 24;
+    req.flags          = 0;
+    req.root_fid       = 0;
+    req.access_mask    = o_flags;
+    req.alloc_size     = 0;
+    req.file_attr      = 0;
+    req.share_access   = SMB_SHARE_READ | SMB_SHARE_WRITE;
+    if ((o_flags & SMB_MOD_RW) == SMB_MOD_RW)
+    {
+        req.disposition    = SMB_DISPOSITION_FILE_SUPERSEDE; // Create if doesn't exist
+        req.create_opts    = SMB_CREATEOPT_WRITE_THROUGH;
+    }
+    else
+    {
+        req.disposition    = SMB_DISPOSITION_FILE_OPEN;  // Open and fails if doesn't exist
+        req.create_opts    = 0;                          // We dont't support create
+    }
+    req.impersonation  = SMB_IMPERSONATION_SEC_IMPERSONATE;
+    req.security_flags = SMB_SECURITY_NO_TRACKING;
+    req.path_length    = path_len;
+    req.bct            = path_len + 1;
+    SMB_MSG_PUT_PKT(req_msg, req);
+
+    // Create AndX 'Body'
+    smb_message_put8(req_msg, 0);   // Align beginning of path
+    smb_message_append(req_msg, utf_path, path_len);
+    free(utf_path);
+
+    // smb_message_put16(req_msg, 0);  // ??
+
+    *msg = req_msg;
+    return DSM_SUCCESS;
+}
+
+// Register the file opened by a successful CREATE_ANDX reply
+static int  smb_fopen_parse(smb_session *s, smb_tid tid, const char *path,
+                            smb_message *resp_msg, smb_fd *fd)
+{
+    smb_create_resp *resp;
+    smb_file        *file;
+
+    if (resp_msg->payload_size < sizeof(smb_create_resp))
+    {
+        BDSM_dbg("[smb_fopen]Malformed message.\n");
+        return DSM_ERROR_NETWORK;
+    }
+
+    resp = (smb_create_resp *)resp_msg->packet->payload;
+    file = calloc(1, sizeof(smb_file));
+    if (!file)
+        return DSM_ERROR_GENERIC;
+    // Kept to forget about the cached status of the file when it's written
+    file->name = strdup(path);
+    if (!file->name)
+    {
+        free(file);
+        return DSM_ERROR_GENERIC;
+    }
+    file->name_len      = strlen(path);
+
+    file->fid           = resp->fid;
+    file->tid           = tid;
+    file->created       = resp->created;
+    file->accessed      = resp->accessed;
+    file->written       = resp->written;
+    file->changed       = resp->changed;
+    file->alloc_size    = resp->alloc_size;
+    file->size          = resp->size;
+    file->attr          = resp->attr;
+    file->is_dir        = resp->is_dir;
+
+    // The reply is as good as a smb_fstat(), and newer than what's cached
+    // if the file was just overwritten
+    smb_stat_cache_put(s, tid, path, file->name_len, NULL, file);
+
+    smb_session_file_add(s, tid, file); // XXX Check return
+
+    *fd = SMB_FD(tid, file->fid);
+    return DSM_SUCCESS;
+}
+
 int         smb_fopen(smb_session *s, smb_tid tid, const char *path,
                       uint32_t o_flags, smb_fd *fd)
 {
     smb_share       *share;
-    smb_file        *file;
     smb_message     *req_msg, resp_msg;
-    smb_create_req req;
-    smb_create_resp *resp;
-    size_t           path_len;
     int              res;
-    char            *utf_path;
 
     bdsm_assert(s != NULL && path != NULL && fd != NULL);
 
@@ -61,129 +163,981 @@ int         smb_fopen(smb_session *s, smb_tid tid, const char *path,
         if ((share = smb_session_share_get(s, tid)) == NULL)
             return DSM_ERROR_GENERIC;
 
-        path_len = smb_to_utf16(path, strlen(path) + 1, &utf_path);
-        if (path_len == 0)
-            return DSM_ERROR_CHARSET;
+        res = smb_fopen_build(tid, path, o_flags, &req_msg);
+        if (res != DSM_SUCCESS)
+            return res;
 
-        req_msg = smb_message_new(SMB_CMD_CREATE);
-        if (!req_msg) {
-            free(utf_path);
-            return DSM_ERROR_GENERIC;
+        res = smb_session_send_msg(s, req_msg);
+        smb_message_destroy(req_msg);
+        if (!res)
+            return DSM_ERROR_NETWORK;
+
+        if (!smb_session_recv_msg(s, &resp_msg))
+            return DSM_ERROR_NETWORK;
+        if (!smb_session_check_nt_status(s, &resp_msg))
+            return DSM_ERROR_NT;
+
+        return smb_fopen_parse(s, tid, path, &resp_msg, fd);
+    }
+    
+    return DSM_ERROR_GENERIC;
+}
+
+static smb_message *smb_fclose_build(smb_fd fd)
+{
+    smb_message     *msg;
+    smb_close_req   req;
+
+    msg = smb_message_new(SMB_CMD_CLOSE);
+    if (!msg)
+        return NULL;
+
+    msg->packet->header.tid = SMB_FD_TID(fd);
+
+    SMB_MSG_INIT_PKT(req);
+    req.wct        = 3;
+    req.fid        = SMB_FD_FID(fd);
+    req.last_write = ~0;
+    req.bct        = 0;
+    SMB_MSG_PUT_PKT(msg, req);
+
+    return msg;
+}
+
+void        smb_fclose(smb_session *s, smb_fd fd)
+{
+    smb_file        *file;
+    smb_message     *msg;
+
+    bdsm_assert(s != NULL);
+    if (s==NULL || fd==0){
+        return;
+    }
+
+    // Errors can't be reported, smb_fflush() first to get them
+    smb_fflush(s, fd);
+
+    if ((file = smb_session_file_remove(s, fd)) == NULL)
+        return;
+    // The server updates the times of the file on close
+    smb_stat_cache_invalidate(s, file->tid, file->name, false);
+
+    msg = smb_fclose_build(fd);
+    if (!msg) {
+        smb_file_destroy(s, file);
+        return;
+    }
+
+    // We don't check for succes or failure, since we actually don't really
+    // care about creating a potentiel leak server side.
+    smb_session_send_msg(s, msg);
+    smb_session_recv_msg(s, 0);
+    smb_message_destroy(msg);
+
+    smb_file_destroy(s, file);
+}
+
+static smb_message *smb_fread_build(smb_file *file, uint64_t offset,
+                                    size_t max_read)
+{
+    smb_message     *req_msg;
+    smb_read_req    req;
+
+    req_msg = smb_message_new(SMB_CMD_READ);
+    if (!req_msg)
+        return NULL;
+    req_msg->packet->header.tid = file->tid;
+
+    SMB_MSG_INIT_PKT_ANDX(req);
+    req.wct              = 12;
+    req.fid              = file->fid;
+    req.offset           = offset & 0xffffffff;
+    req.max_count        = max_read & 0xffff;
+    req.min_count        = max_read & 0xffff;
+    req.max_count_high   = max_read >> 16;   // Only with CAP_LARGE_READX
+    req.remaining        = 0;
+    req.offset_high      = (offset >> 32) & 0xffffffff;
+    req.bct              = 0;
+    SMB_MSG_PUT_PKT(req_msg, req);
+
+    return req_msg;
+}
+
+// Receive the beginning of a READ_ANDX reply (the headers only)
+static size_t smb_fread_recv_hdr(smb_session *s, smb_message *resp_msg)
+{
+    return smb_session_recv_msg_partial(s, resp_msg, sizeof(smb_read_resp));
+}
+
+// Receive the data of a READ_ANDX reply whose headers were fetched by
+// smb_fread_recv_hdr() straight into buf (or skip it if buf is NULL), at most
+// max_read bytes. 'payload_size' is the full size of the reply. What had to be
+// copied is counted in 'stats' if it isn't NULL. Returns the number of bytes
+// read or -1.
+static ssize_t smb_fread_parse(smb_session *s, smb_message *resp_msg,
+                               size_t payload_size, void *buf, size_t max_read,
+                               smb_file_stats *stats)
+{
+    smb_read_resp   *resp;
+    size_t          data_len, received, in_mem = 0;
+
+    if (!smb_session_check_nt_status(s, resp_msg))
+        return -1;
+
+    if (resp_msg->payload_size < sizeof(smb_read_resp))
+    {
+        BDSM_dbg("[smb_fread]Malformed message.\n");
+        return -1;
+    }
+
+    resp = (smb_read_resp *)resp_msg->packet->payload;
+    data_len = resp->data_len | (size_t)(resp->data_len_high & 0xffff) << 16;
+
+    // Offsets are relative to the beginning of the SMB header
+    received     = sizeof(smb_header) + resp_msg->payload_size;
+    payload_size = sizeof(smb_header) + payload_size;
+    if (resp->data_offset + data_len > payload_size || data_len > max_read)
+    {
+        BDSM_dbg("[smb_fread]Malformed message.\n");
+        return -1;
+    }
+
+    // Some servers don't pad, the first bytes of data might already be there
+    if (resp->data_offset < received)
+    {
+        in_mem = received - resp->data_offset;
+        in_mem = in_mem < data_len ? in_mem : data_len;
+        if (buf)
+            memcpy(buf, (char *)resp_msg->packet + resp->data_offset, in_mem);
+    }
+    else if (!smb_session_recv_msg_data(s, NULL, resp->data_offset - received))
+        return -1;
+
+    if (!smb_session_recv_msg_data(s, buf ? (char *)buf + in_mem : NULL,
+                                   data_len - in_mem))
+        return -1;
+
+    // In thread-safe mode, the reply was first copied whole to a mailbox
+    if (stats != NULL)
+        stats->bytes_copied += (buf ? in_mem : 0)
+                               + (s->thread_safe ? data_len : 0);
+
+    return data_len;
+}
+
+typedef struct
+{
+    uint16_t        mid;        // MID of the READ_ANDX for this chunk
+    size_t          len;        // Requested length
+    ssize_t         got;        // Bytes received, -1 while in flight
+} smb_read_chunk;
+
+// Receive and drop the replies still in flight, so that they aren't taken
+// for the reply of the next request sent on the session
+static void smb_fread_drain(smb_session *s, smb_read_chunk *chunks,
+                            size_t sent, size_t in_flight)
+{
+    smb_message     resp_msg;
+    size_t          i;
+
+    while (in_flight > 0)
+    {
+        // The rest of the message is skipped by the next reception
+        if (!smb_fread_recv_hdr(s, &resp_msg))
+            return;
+
+        for (i = 0; i < sent; i++)
+            if (chunks[i].got == -1
+                && chunks[i].mid == resp_msg.packet->header.mux_id)
+            {
+                chunks[i].got = 0;
+                in_flight--;
+                break;
+            }
+    }
+}
+
+// Keeps up to s->read_window READ_ANDX requests in flight at consecutive
+// offsets. Replies are matched to their chunk by MID and copied at the right
+// place of the caller buffer, whatever the order they arrive in.
+static ssize_t smb_fread_pipelined(smb_session *s, smb_file *file,
+                                   void *buf, size_t buf_size, uint64_t offset,
+                                   size_t max_read)
+{
+    smb_read_chunk  *chunks;
+    smb_message     *req_msg, resp_msg;
+    size_t          nb_chunks, sent = 0, in_flight = 0, i, payload_size;
+    ssize_t         total = 0;
+    bool            short_read = false;
+    int             res;
+
+    nb_chunks = (buf_size + max_read - 1) / max_read;
+    chunks = calloc(nb_chunks, sizeof(smb_read_chunk));
+    if (!chunks)
+        return -1;
+
+    while (in_flight > 0 || (!short_read && sent < nb_chunks))
+    {
+        // Fill the window
+        while (!short_read && sent < nb_chunks && in_flight < s->read_window)
+        {
+            chunks[sent].len = buf_size - sent * max_read;
+            if (chunks[sent].len > max_read)
+                chunks[sent].len = max_read;
+            chunks[sent].got = -1;
+
+            req_msg = smb_fread_build(file, offset + sent * max_read,
+                                      chunks[sent].len);
+            if (!req_msg)
+                goto error;
+            res = smb_session_send_msg(s, req_msg);
+            chunks[sent].mid = req_msg->packet->header.mux_id;
+            smb_message_destroy(req_msg);
+            if (!res)
+                goto error;
+
+            sent++;
+            in_flight++;
+        }
+
+        payload_size = smb_fread_recv_hdr(s, &resp_msg);
+        if (!payload_size)
+        {
+            in_flight = 0; // The connection is lost, nothing left to receive
+            goto error;
+        }
+
+        for (i = 0; i < sent; i++)
+            if (chunks[i].got == -1
+                && chunks[i].mid == resp_msg.packet->header.mux_id)
+                break;
+        if (i == sent)
+        {
+            BDSM_dbg("[smb_fread]Unexpected reply, mid = %hu\n",
+                     resp_msg.packet->header.mux_id);
+            continue;
+        }
+
+        chunks[i].got = smb_fread_parse(s, &resp_msg, payload_size,
+                                        buf ? (char *)buf + i * max_read : NULL,
+                                        chunks[i].len, &file->stats);
+        if (chunks[i].got == -1 && i == 0)
+        {
+            chunks[i].got = 0;
+            in_flight--;
+            goto error;
         }
+        if (chunks[i].got < (ssize_t)chunks[i].len)
+        {
+            // EOF (or error) reached, don't read further but drain the
+            // replies still in flight.
+            if (chunks[i].got == -1)
+                chunks[i].got = 0;
+            short_read = true;
+        }
+        in_flight--;
+    }
+
+    // Only the contiguous part of the buffer is meaningful
+    for (i = 0; i < sent; i++)
+    {
+        total += chunks[i].got;
+        if (chunks[i].got < (ssize_t)chunks[i].len)
+            break;
+    }
+
+    free(chunks);
+    return total;
+
+error:
+    smb_fread_drain(s, chunks, sent, in_flight);
+    free(chunks);
+    return -1;
+}
+
+// Read at most buf_size bytes at 'offset', using a single READ_ANDX or the
+// pipelined path if allowed. The file offset is left untouched.
+static ssize_t smb_file_read(smb_session *s, smb_file *file, void *buf,
+                             size_t buf_size, uint64_t offset)
+{
+    smb_message     *req_msg, resp_msg;
+    size_t          max_read, payload_size;
+    ssize_t         res;
+
+    max_read = smb_session_max_read(s);
+
+    if (s->read_window > 1 && buf_size > max_read)
+    {
+        res = smb_fread_pipelined(s, file, buf, buf_size, offset, max_read);
+        if (res > 0)
+            file->stats.bytes_wire += res;
+        return res;
+    }
+
+    max_read = max_read < buf_size ? max_read : buf_size;
+
+    req_msg = smb_fread_build(file, offset, max_read);
+    if (!req_msg)
+        return -1;
+
+    res = smb_session_send_msg(s, req_msg);
+    smb_message_destroy(req_msg);
+    if (!res)
+        return -1;
+
+    payload_size = smb_fread_recv_hdr(s, &resp_msg);
+    if (!payload_size)
+        return -1;
+
+    res = smb_fread_parse(s, &resp_msg, payload_size, buf, max_read,
+                          &file->stats);
+    if (res > 0)
+        file->stats.bytes_wire += res;
+    return res;
+}
+
+/*
+ * Read-ahead
+ */
+
+static void smb_readahead_free(smb_readahead *ra)
+{
+    free(ra->segs);
+    free(ra->cur);
+    free(ra->next);
+    free(ra);
+}
+
+// The prefetch replies in flight still need the buffers, the last one frees
+// them then
+static void smb_readahead_release(smb_session *s, smb_readahead *ra)
+{
+    bool            orphan;
+
+    smb_session_lock(s);
+    orphan     = ra->in_flight > 0;
+    ra->orphan = orphan;
+    smb_session_unlock(s);
+
+    if (!orphan)
+        smb_readahead_free(ra);
+}
+
+// Forget what was read ahead, the data might not be up to date anymore
+static void smb_readahead_invalidate(smb_file *file)
+{
+    if (file->ra == NULL)
+        return;
+
+    file->ra->cur_len = 0;
+    file->ra->cur_eof = false;
+    if (file->ra->prefetching)
+        file->ra->stale = true;
+}
+
+static void smb_readahead_done(smb_session *s, const smb_async_result *res,
+                               void *opaque)
+{
+    smb_readahead_seg   *seg = opaque;
+    smb_readahead       *ra = seg->ra;
+    bool                orphan;
+
+    smb_session_lock(s);
+    seg->got = res->status == DSM_SUCCESS ? res->size : -1;
+    orphan   = --ra->in_flight == 0 && ra->orphan;
+    smb_session_unlock(s);
+
+    if (orphan)
+        smb_readahead_free(ra);
+}
+
+// Prefetch the window at 'offset' into the 'next' buffer
+static void smb_readahead_start(smb_session *s, smb_file *file,
+                                uint64_t offset)
+{
+    smb_readahead   *ra = file->ra;
+    size_t          pos = 0;
+
+    ra->prefetching = true;
+    ra->stale       = false;
+    ra->next_offset = offset;
+
+    for (size_t i = 0; i < ra->nb_segs; i++)
+        ra->segs[i].got = -1;
+
+    for (size_t i = 0; i < ra->nb_segs; i++)
+    {
+        smb_session_lock(s);
+        ra->in_flight++;
+        smb_session_unlock(s);
+
+        if (smb_fread_async(s, SMB_FD(file->tid, file->fid), ra->next + pos,
+                            ra->segs[i].len, offset + pos, smb_readahead_done,
+                            &ra->segs[i]) != DSM_SUCCESS)
+        {
+            // The window is truncated there
+            smb_session_lock(s);
+            ra->in_flight--;
+            smb_session_unlock(s);
+            break;
+        }
+        pos += ra->segs[i].len;
+    }
+}
+
+// Wait for the prefetch to complete and make it the current window, unless
+// it's stale. Returns false on network error.
+static bool smb_readahead_collect(smb_session *s, smb_file *file,
+                                  bool *waited)
+{
+    smb_readahead   *ra = file->ra;
+    uint8_t         *tmp;
+    unsigned int    in_flight;
+    bool            truncated = false;
+
+    for (;;)
+    {
+        smb_session_lock(s);
+        in_flight = ra->in_flight;
+        smb_session_unlock(s);
+        if (in_flight == 0)
+            break;
+
+        *waited = true;
+        if (smb_session_wait(s) != DSM_SUCCESS)
+            return false;
+    }
+
+    ra->prefetching = false;
+    for (size_t i = 0; i < ra->nb_segs; i++)
+        if (ra->segs[i].got > 0)
+            file->stats.bytes_wire += ra->segs[i].got;
+    if (ra->stale)
+        return true;
+
+    tmp            = ra->cur;
+    ra->cur        = ra->next;
+    ra->next       = tmp;
+    ra->cur_offset = ra->next_offset;
+    ra->cur_len    = 0;
+    ra->cur_eof    = false;
+
+    // Only the contiguous part of the window is usable
+    for (size_t i = 0; i < ra->nb_segs && !truncated; i++)
+    {
+        if (ra->segs[i].got < 0)
+            break;
+        ra->cur_len += ra->segs[i].got;
+        if (ra->segs[i].got < (ssize_t)ra->segs[i].len)
+        {
+            ra->cur_eof = true;
+            truncated   = true;
+        }
+    }
+
+    return true;
+}
+
+// Read a whole window at 'offset' synchronously into the current buffer
+static ssize_t smb_readahead_fill(smb_session *s, smb_file *file,
+                                  uint64_t offset)
+{
+    smb_readahead   *ra = file->ra;
+    size_t          done = 0;
+    ssize_t         res = 0;
+
+    while (done < ra->window)
+    {
+        res = smb_file_read(s, file, ra->cur + done, ra->window - done,
+                            offset + done);
+        if (res <= 0)
+            break;
+        done += res;
+    }
+    if (res < 0 && done == 0)
+        return -1;
+
+    ra->cur_offset = offset;
+    ra->cur_len    = done;
+    ra->cur_eof    = res == 0;
+
+    return done;
+}
+
+// Serve a read from the read-ahead buffers, refilling them as needed if the
+// access is sequential. Random reads outside the buffers go to the server.
+static ssize_t smb_readahead_read(smb_session *s, smb_file *file, void *buf,
+                                  size_t buf_size, uint64_t offset)
+{
+    smb_readahead   *ra = file->ra;
+    uint64_t        pos, end;
+    size_t          done = 0, len;
+    bool            waited = false;
+    unsigned int    in_flight;
+    ssize_t         res;
+
+    if (offset != ra->seq_end
+        && !(offset >= ra->cur_offset && offset < ra->cur_offset + ra->cur_len))
+    {
+        res = smb_file_read(s, file, buf, buf_size, offset);
+        if (res >= 0)
+            ra->seq_end = offset + res;
+        return res;
+    }
+
+    while (done < buf_size)
+    {
+        pos = offset + done;
+        end = ra->cur_offset + ra->cur_len;
+
+        if (pos >= ra->cur_offset && pos < end)
+        {
+            len = end - pos < buf_size - done ? end - pos : buf_size - done;
+            if (buf)
+            {
+                memcpy((char *)buf + done, ra->cur + (pos - ra->cur_offset),
+                       len);
+                file->stats.bytes_copied += len;
+            }
+            done += len;
+            continue;
+        }
+        if (ra->cur_eof && pos >= end)
+            break;
+
+        if (ra->prefetching && !ra->stale && pos >= ra->next_offset
+            && pos < ra->next_offset + ra->window)
+        {
+            if (!smb_readahead_collect(s, file, &waited))
+                return done > 0 ? (ssize_t)done : -1;
+            continue;
+        }
+
+        waited = true;
+        res = smb_readahead_fill(s, file, pos);
+        if (res < 0)
+            return done > 0 ? (ssize_t)done : -1;
+        if (res == 0)
+            break;
+    }
+
+    // A stale prefetch is dropped once it's over, without waiting for it
+    if (ra->prefetching && ra->stale)
+    {
+        smb_session_lock(s);
+        in_flight = ra->in_flight;
+        smb_session_unlock(s);
+        if (in_flight == 0)
+            smb_readahead_collect(s, file, &waited);
+    }
+    if (!ra->prefetching && ra->cur_len > 0 && !ra->cur_eof)
+        smb_readahead_start(s, file, ra->cur_offset + ra->cur_len);
+
+    if (!waited)
+        file->stats.hits++;
+    ra->seq_end = offset + done;
+
+    return done;
+}
+
+int         smb_file_set_readahead(smb_session *s, smb_fd fd, size_t window)
+{
+    smb_file        *file;
+    smb_readahead   *ra;
+    size_t          max_read;
+
+    bdsm_assert(s != NULL);
+    if (s == NULL || fd == 0)
+        return DSM_ERROR_GENERIC;
+
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+        return DSM_ERROR_GENERIC;
+
+    // Drop the previous buffers, along with what they hold
+    if (file->ra != NULL)
+    {
+        smb_readahead_release(s, file->ra);
+        file->ra = NULL;
+    }
+    if (window == 0)
+        return DSM_SUCCESS;
+
+    ra = calloc(1, sizeof(smb_readahead));
+    if (!ra)
+        return DSM_ERROR_GENERIC;
+
+    max_read    = smb_session_max_read(s);
+    ra->window  = window;
+    ra->nb_segs = (window + max_read - 1) / max_read;
+    ra->cur     = malloc(window);
+    ra->next    = malloc(window);
+    ra->segs    = calloc(ra->nb_segs, sizeof(smb_readahead_seg));
+    if (!ra->cur || !ra->next || !ra->segs)
+    {
+        smb_readahead_free(ra);
+        return DSM_ERROR_GENERIC;
+    }
+    for (size_t i = 0; i < ra->nb_segs; i++)
+    {
+        ra->segs[i].ra  = ra;
+        ra->segs[i].len = window - i * max_read < max_read
+                          ? window - i * max_read : max_read;
+    }
+
+    // Reading from the current position counts as sequential
+    ra->seq_end = file->offset;
+    file->ra    = ra;
+
+    return DSM_SUCCESS;
+}
+
+int         smb_file_get_stats(smb_session *s, smb_fd fd,
+                               smb_file_stats *stats)
+{
+    smb_file        *file;
+
+    bdsm_assert(s != NULL && stats != NULL);
+    if (s == NULL || stats == NULL || fd == 0)
+        return DSM_ERROR_GENERIC;
+
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+        return DSM_ERROR_GENERIC;
+
+    *stats = file->stats;
+    return DSM_SUCCESS;
+}
+
+// Build a WRITE_ANDX for 'size' bytes at 'offset', the data itself is sent
+// along with smb_session_send_msg_data()
+static smb_message *smb_fwrite_build(smb_file *file, size_t size,
+                                     uint64_t offset)
+{
+    smb_message    *req_msg;
+    smb_write_req   req;
+
+    req_msg = smb_message_new(SMB_CMD_WRITE);
+    if (!req_msg)
+        return NULL;
+    req_msg->packet->header.tid = (uint16_t)file->tid;
+
+    SMB_MSG_INIT_PKT_ANDX(req);
+    req.wct              = 14; // Must be 14
+    req.fid              = file->fid;
+    req.offset           = offset & 0xffffffff;
+    req.timeout          = 0;
+    req.write_mode       = file->no_write_through ? 0
+                                                  : SMB_WRITEMODE_WRITETHROUGH;
+    req.remaining        = 0;
+    req.data_len_high    = size >> 16; // Only with CAP_LARGE_WRITEX
+    req.data_len         = size & 0xffff;
+    req.data_offset      = sizeof(smb_packet) + sizeof(smb_write_req);
+    req.offset_high      = (offset >> 32) & 0xffffffff;
+    req.bct              = size & 0xffff;
+    SMB_MSG_PUT_PKT(req_msg, req);
+
+    return req_msg;
+}
+
+// Returns the number of bytes written according to a WRITE_ANDX reply, or -1
+static ssize_t smb_fwrite_parse(smb_message *resp_msg)
+{
+    smb_write_resp *resp;
+
+    if (resp_msg->payload_size < sizeof(smb_write_resp))
+    {
+        BDSM_dbg("[smb_fwrite]Malformed message.\n");
+        return -1;
+    }
+
+    resp = (smb_write_resp *)resp_msg->packet->payload;
+
+    return resp->data_len | (size_t)resp->data_len_high << 16;
+}
+
+// Write at most one WRITE_ANDX worth of data at 'offset'. The file offset is
+// left untouched.
+static ssize_t smb_file_write(smb_session *s, smb_file *file, const void *buf,
+                              size_t buf_size, uint64_t offset)
+{
+    smb_message    *req_msg, resp_msg;
+    size_t          max_write;
+    int             res;
+
+    smb_readahead_invalidate(file);
+    smb_stat_cache_invalidate(s, file->tid, file->name, false);
+
+    max_write = smb_session_max_write(s);
+    max_write = max_write < buf_size ? max_write : buf_size;
+
+    req_msg = smb_fwrite_build(file, max_write, offset);
+    if (!req_msg)
+        return -1;
+
+    res = smb_session_send_msg_data(s, req_msg, buf, max_write);
+    smb_message_destroy(req_msg);
+    if (!res)
+        return -1;
+
+    if (!smb_session_recv_msg(s, &resp_msg))
+        return -1;
+    if (!smb_session_check_nt_status(s, &resp_msg))
+        return -1;
+
+    return smb_fwrite_parse(&resp_msg);
+}
+
+/*
+ * Write-behind
+ */
+
+static void smb_writebehind_free(smb_writebehind *wb)
+{
+    free(wb->reqs);
+    free(wb->buf);
+    free(wb->sending);
+    free(wb);
+}
+
+static void smb_writebehind_release(smb_session *s, smb_writebehind *wb)
+{
+    bool            orphan;
+
+    smb_session_lock(s);
+    orphan     = wb->in_flight > 0;
+    wb->orphan = orphan;
+    smb_session_unlock(s);
+
+    if (!orphan)
+        smb_writebehind_free(wb);
+}
+
+// Get the first error met by the writes since last call, and forget it
+static int  smb_writebehind_error(smb_session *s, smb_writebehind *wb)
+{
+    int             res;
+
+    smb_session_lock(s);
+    res       = wb->error;
+    wb->error = DSM_SUCCESS;
+    smb_session_unlock(s);
+
+    return res;
+}
+
+static void smb_writebehind_done(smb_session *s, const smb_async_result *res,
+                                 void *opaque)
+{
+    smb_writebehind_req *req = opaque;
+    smb_writebehind     *wb = req->wb;
+    bool                orphan;
+
+    smb_session_lock(s);
+    if (wb->error == DSM_SUCCESS && res->status != DSM_SUCCESS)
+        wb->error = res->status;
+    else if (wb->error == DSM_SUCCESS && res->size != (ssize_t)req->len)
+        wb->error = DSM_ERROR_GENERIC;  // Disk full, quota...
+    orphan = --wb->in_flight == 0 && wb->orphan;
+    smb_session_unlock(s);
+
+    if (orphan)
+        smb_writebehind_free(wb);
+}
+
+// Wait until no more than 'max' writes are in flight
+static int  smb_writebehind_wait(smb_session *s, smb_writebehind *wb,
+                                 unsigned int max)
+{
+    unsigned int    in_flight;
+
+    for (;;)
+    {
+        smb_session_lock(s);
+        in_flight = wb->in_flight;
+        smb_session_unlock(s);
+        if (in_flight <= max)
+            return DSM_SUCCESS;
+
+        if (smb_session_wait(s) != DSM_SUCCESS)
+            return DSM_ERROR_NETWORK;
+    }
+}
+
+// Send the buffered data without waiting for the replies. The previous
+// flush must be over first, so that writes to the same place can't be
+// reordered. On failure, the data not sent yet stays buffered.
+static int  smb_writebehind_submit(smb_session *s, smb_file *file)
+{
+    smb_writebehind *wb = file->wb;
+    uint8_t         *tmp;
+    size_t          max_write, pos = 0;
+    unsigned int    max_mpx;
+    int             res;
+
+    if ((res = smb_writebehind_wait(s, wb, 0)) != DSM_SUCCESS)
+        return res;
+    if (wb->len == 0)
+        return DSM_SUCCESS;
+
+    tmp         = wb->sending;
+    wb->sending = wb->buf;
+    wb->buf     = tmp;
+
+    max_write = smb_session_max_write(s);
+    max_mpx   = s->srv.max_mpx != 0 ? s->srv.max_mpx : 1;
+    for (size_t i = 0; pos < wb->len; i++)
+    {
+        wb->reqs[i].wb  = wb;
+        wb->reqs[i].len = wb->len - pos < max_write ? wb->len - pos : max_write;
+
+        if ((res = smb_writebehind_wait(s, wb, max_mpx - 1)) != DSM_SUCCESS)
+            break;
+
+        smb_session_lock(s);
+        wb->in_flight++;
+        smb_session_unlock(s);
 
-        // Set SMB Headers
-        req_msg->packet->header.tid = tid;
-
-        // Create AndX Params
-        SMB_MSG_INIT_PKT_ANDX(req);
-        req.wct            = 24;
-        req.flags          = 0;
-        req.root_fid       = 0;
-        req.access_mask    = o_flags;
-        req.alloc_size     = 0;
-        req.file_attr      = 0;
-        req.share_access   = SMB_SHARE_READ | SMB_SHARE_WRITE;
-        if ((o_flags & SMB_MOD_RW) == SMB_MOD_RW)
+        res = smb_fwrite_async(s, SMB_FD(file->tid, file->fid),
+                               wb->sending + pos, wb->reqs[i].len,
+                               wb->offset + pos, smb_writebehind_done,
+                               &wb->reqs[i]);
+        if (res != DSM_SUCCESS)
         {
-            req.disposition    = SMB_DISPOSITION_FILE_SUPERSEDE; // Create if doesn't exist
-            req.create_opts    = SMB_CREATEOPT_WRITE_THROUGH;
+            smb_session_lock(s);
+            wb->in_flight--;
+            smb_session_unlock(s);
+            break;
         }
-        else
-        {
-            req.disposition    = SMB_DISPOSITION_FILE_OPEN;  // Open and fails if doesn't exist
-            req.create_opts    = 0;                          // We dont't support create
-        }
-        req.impersonation  = SMB_IMPERSONATION_SEC_IMPERSONATE;
-        req.security_flags = SMB_SECURITY_NO_TRACKING;
-        req.path_length    = path_len;
-        req.bct            = path_len + 1;
-        SMB_MSG_PUT_PKT(req_msg, req);
+        pos += wb->reqs[i].len;
+    }
 
-        // Create AndX 'Body'
-        smb_message_put8(req_msg, 0);   // Align beginning of path
-        smb_message_append(req_msg, utf_path, path_len);
-        free(utf_path);
+    // Keep what couldn't be sent for the next flush. 'buf' is free, the
+    // writes of the previous flush are over.
+    if (pos < wb->len)
+        memcpy(wb->buf, wb->sending + pos, wb->len - pos);
+    wb->offset += pos;
+    wb->len    -= pos;
 
-        // smb_message_put16(req_msg, 0);  // ??
+    return res;
+}
 
-        res = smb_session_send_msg(s, req_msg);
-        smb_message_destroy(req_msg);
-        if (!res)
-            return DSM_ERROR_NETWORK;
+// Send the buffered data and wait for all the writes to be done
+static int  smb_writebehind_sync(smb_session *s, smb_file *file)
+{
+    int             res;
 
-        if (!smb_session_recv_msg(s, &resp_msg))
-            return DSM_ERROR_NETWORK;
-        if (!smb_session_check_nt_status(s, &resp_msg))
-            return DSM_ERROR_NT;
+    if ((res = smb_writebehind_submit(s, file)) == DSM_SUCCESS)
+        res = smb_writebehind_wait(s, file->wb, 0);
+    if (res == DSM_SUCCESS)
+        res = smb_writebehind_error(s, file->wb);
 
-        if (resp_msg.payload_size < sizeof(smb_create_resp))
-        {
-            BDSM_dbg("[smb_fopen]Malformed message.\n");
-            return DSM_ERROR_NETWORK;
-        }
-        
-        resp = (smb_create_resp *)resp_msg.packet->payload;
-        file = calloc(1, sizeof(smb_file));
-        if (!file)
-            return DSM_ERROR_GENERIC;
+    return res;
+}
+
+static ssize_t smb_writebehind_write(smb_session *s, smb_file *file,
+                                     const void *buf, size_t buf_size,
+                                     uint64_t offset)
+{
+    smb_writebehind *wb = file->wb;
+    size_t          done = 0, len;
+
+    // Whatever was accepted before failed
+    if (smb_writebehind_error(s, wb) != DSM_SUCCESS)
+        return -1;
 
+    // Only adjacent writes are coalesced
+    if (wb->len > 0 && offset != wb->offset + wb->len
+        && smb_writebehind_submit(s, file) != DSM_SUCCESS)
+        return -1;
 
-        file->fid           = resp->fid;
-        file->tid           = tid;
-        file->created       = resp->created;
-        file->accessed      = resp->accessed;
-        file->written       = resp->written;
-        file->changed       = resp->changed;
-        file->alloc_size    = resp->alloc_size;
-        file->size          = resp->size;
-        file->attr          = resp->attr;
-        file->is_dir        = resp->is_dir;
+    while (done < buf_size)
+    {
+        if (wb->len == 0)
+            wb->offset = offset + done;
 
-        smb_session_file_add(s, tid, file); // XXX Check return
+        len = wb->threshold - wb->len;
+        len = len < buf_size - done ? len : buf_size - done;
+        memcpy(wb->buf + wb->len, (const char *)buf + done, len);
+        wb->len += len;
+        done    += len;
 
-        *fd = SMB_FD(tid, file->fid);
-        return DSM_SUCCESS;
+        if (wb->len == wb->threshold
+            && smb_writebehind_submit(s, file) != DSM_SUCCESS)
+            return -1;
     }
-    
-    return DSM_ERROR_GENERIC;
+
+    return done;
 }
 
-void        smb_fclose(smb_session *s, smb_fd fd)
+int         smb_file_set_write_behind(smb_session *s, smb_fd fd,
+                                      size_t threshold, int write_through)
 {
     smb_file        *file;
-    smb_message     *msg;
-    smb_close_req   req;
+    smb_writebehind *wb;
+    size_t          max_write;
+    int             res = DSM_SUCCESS;
 
     bdsm_assert(s != NULL);
-    if (s==NULL || fd==0){
-        return;
-    }
+    if (s == NULL || fd == 0)
+        return DSM_ERROR_GENERIC;
 
-    // XXX Memory leak, destroy the file after removing it
-    if ((file = smb_session_file_remove(s, fd)) == NULL)
-        return;
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+        return DSM_ERROR_GENERIC;
 
-    msg = smb_message_new(SMB_CMD_CLOSE);
-    if (!msg) {
-        free(file->name);
-        free(file);
-        return;
+    // What couldn't be sent stays buffered, for the next smb_fflush()
+    if (file->wb != NULL)
+    {
+        if ((res = smb_writebehind_sync(s, file)) != DSM_SUCCESS)
+            return res;
+        smb_writebehind_release(s, file->wb);
+        file->wb = NULL;
     }
+    file->no_write_through = !write_through;
+    if (threshold == 0)
+        return DSM_SUCCESS;
 
-    msg->packet->header.tid = SMB_FD_TID(fd);
+    wb = calloc(1, sizeof(smb_writebehind));
+    if (!wb)
+        return DSM_ERROR_GENERIC;
+
+    max_write     = smb_session_max_write(s);
+    wb->threshold = threshold;
+    wb->nb_reqs   = (threshold + max_write - 1) / max_write;
+    wb->buf       = malloc(threshold);
+    wb->sending   = malloc(threshold);
+    wb->reqs      = calloc(wb->nb_reqs, sizeof(smb_writebehind_req));
+    if (!wb->buf || !wb->sending || !wb->reqs)
+    {
+        smb_writebehind_free(wb);
+        return DSM_ERROR_GENERIC;
+    }
+    file->wb = wb;
 
-    SMB_MSG_INIT_PKT(req);
-    req.wct        = 3;
-    req.fid        = SMB_FD_FID(fd);
-    req.last_write = ~0;
-    req.bct        = 0;
-    SMB_MSG_PUT_PKT(msg, req);
+    return DSM_SUCCESS;
+}
 
-    // We don't check for succes or failure, since we actually don't really
-    // care about creating a potentiel leak server side.
-    smb_session_send_msg(s, msg);
-    smb_session_recv_msg(s, 0);
-    smb_message_destroy(msg);
+int         smb_fflush(smb_session *s, smb_fd fd)
+{
+    smb_file        *file;
+
+    bdsm_assert(s != NULL);
+    if (s == NULL || fd == 0)
+        return DSM_ERROR_GENERIC;
+
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+        return DSM_ERROR_GENERIC;
+
+    if (file->wb == NULL)
+        return DSM_SUCCESS;
+
+    return smb_writebehind_sync(s, file);
+}
+
+void        smb_file_destroy(smb_session *s, smb_file *file)
+{
+    if (file->ra != NULL)
+        smb_readahead_release(s, file->ra);
+    if (file->wb != NULL)
+        smb_writebehind_release(s, file->wb);
 
     free(file->name);
     free(file);
@@ -192,11 +1146,7 @@ void        smb_fclose(smb_session *s, smb_fd fd)
 ssize_t   smb_fread(smb_session *s, smb_fd fd, void *buf, size_t buf_size)
 {
     smb_file        *file;
-    smb_message     *req_msg, resp_msg;
-    smb_read_req    req;
-    smb_read_resp   *resp;
-    size_t          max_read;
-    int             res;
+    ssize_t         res;
 
     bdsm_assert(s != NULL);
     if (s==NULL || fd==0){
@@ -206,66 +1156,34 @@ ssize_t   smb_fread(smb_session *s, smb_fd fd, void *buf, size_t buf_size)
     if ((file = smb_session_file_get(s, fd)) == NULL)
         return -1;
 
-    req_msg = smb_message_new(SMB_CMD_READ);
-    if (!req_msg)
-        return -1;
-    req_msg->packet->header.tid = file->tid;
-
-    max_read = 0xffff;
-    max_read = max_read < buf_size ? max_read : buf_size;
-
-    SMB_MSG_INIT_PKT_ANDX(req);
-    req.wct              = 12;
-    req.fid              = file->fid;
-    req.offset           = file->offset;
-    req.max_count        = max_read;
-    req.min_count        = max_read;
-    req.max_count_high   = 0;
-    req.remaining        = 0;
-    req.offset_high      = (file->offset >> 32) & 0xffffffff;
-    req.bct              = 0;
-    SMB_MSG_PUT_PKT(req_msg, req);
+    file->stats.reads++;
 
-    res = smb_session_send_msg(s, req_msg);
-    smb_message_destroy(req_msg);
-    if (!res)
+    // Read what was written
+    if (file->wb != NULL && smb_writebehind_sync(s, file) != DSM_SUCCESS)
         return -1;
 
-    if (!smb_session_recv_msg(s, &resp_msg))
-        return -1;
-    if (!smb_session_check_nt_status(s, &resp_msg))
-        return -1;
-    
-    if (resp_msg.payload_size < sizeof(smb_read_resp))
+    // Large reads are better done directly
+    if (file->ra != NULL && buf_size < file->ra->window)
+        res = smb_readahead_read(s, file, buf, buf_size, file->offset);
+    else
     {
-        BDSM_dbg("[smb_fread]Malformed message.\n");
-        return DSM_ERROR_NETWORK;
+        res = smb_file_read(s, file, buf, buf_size, file->offset);
+        if (file->ra != NULL && res >= 0)
+            file->ra->seq_end = file->offset + res;
     }
+    if (res < 0)
+        return -1;
 
-    resp = (smb_read_resp *)resp_msg.packet->payload;
-    
-    if (resp_msg.packet->payload + resp_msg.payload_size <
-        (uint8_t *)resp_msg.packet + resp->data_offset + resp->data_len)
-    {
-        BDSM_dbg("[smb_fread]Malformed message.\n");
-        return DSM_ERROR_NETWORK;
-    }
-    
-    if (buf)
-        memcpy(buf, (char *)resp_msg.packet + resp->data_offset, resp->data_len);
-    smb_fseek(s, fd, resp->data_len, SEEK_CUR);
+    file->stats.bytes_read += res;
+    smb_fseek(s, fd, res, SEEK_CUR);
 
-    return resp->data_len;
+    return res;
 }
 
 ssize_t   smb_fwrite(smb_session *s, smb_fd fd, void *buf, size_t buf_size)
 {
     smb_file       *file;
-    smb_message    *req_msg, resp_msg;
-    smb_write_req   req;
-    smb_write_resp *resp;
-    uint16_t        max_write;
-    int             res;
+    ssize_t         res;
 
     bdsm_assert(s != NULL && buf != NULL);
     
@@ -275,60 +1193,294 @@ ssize_t   smb_fwrite(smb_session *s, smb_fd fd, void *buf, size_t buf_size)
         if (file == NULL)
             return -1;
 
-        req_msg = smb_message_new(SMB_CMD_WRITE);
-        if (!req_msg)
+        if (file->wb != NULL)
+            res = smb_writebehind_write(s, file, buf, buf_size, file->offset);
+        else
+            res = smb_file_write(s, file, buf, buf_size, file->offset);
+        if (res < 0)
             return -1;
-        req_msg->packet->header.tid = (uint16_t)file->tid;
-
-        // total size of SMB message shall not exceed maximum size of netbios data payload
-        max_write = UINT16_MAX - sizeof(smb_packet) - sizeof(smb_write_req);
-        max_write = max_write < buf_size ? max_write : (uint16_t)buf_size;
-
-        SMB_MSG_INIT_PKT_ANDX(req);
-        req.wct              = 14; // Must be 14
-        req.fid              = file->fid;
-        req.offset           = file->offset & 0xffffffff;
-        req.timeout          = 0;
-        req.write_mode       = SMB_WRITEMODE_WRITETHROUGH;
-        req.remaining        = 0;
-        req.reserved         = 0;
-        req.data_len         = max_write;
-        req.data_offset      = sizeof(smb_packet) + sizeof(smb_write_req);
-        req.offset_high      = (file->offset >> 32) & 0xffffffff;
-        req.bct              = max_write;
-        SMB_MSG_PUT_PKT(req_msg, req);
-        smb_message_append(req_msg, buf, max_write);
 
-        res = smb_session_send_msg(s, req_msg);
+        smb_fseek(s, fd, res, SEEK_CUR);
+
+        return res;
+    
+    }
+    
+    return -1;
+}
+
+ssize_t   smb_pread(smb_session *s, smb_fd fd, void *buf, size_t buf_size,
+                    uint64_t offset)
+{
+    smb_file        *file;
+    size_t          done = 0;
+    ssize_t         res;
+
+    bdsm_assert(s != NULL);
+    if (s==NULL || fd==0){
+        return -1;
+    }
+
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+        return -1;
+
+    // Read what was written
+    if (file->wb != NULL && smb_writebehind_sync(s, file) != DSM_SUCCESS)
+        return -1;
+
+    while (done < buf_size)
+    {
+        res = smb_file_read(s, file, buf ? (char *)buf + done : NULL,
+                            buf_size - done, offset + done);
+        if (res < 0)
+            return done > 0 ? (ssize_t)done : -1;
+        if (res == 0) // EOF
+            break;
+        done += res;
+    }
+
+    return done;
+}
+
+ssize_t   smb_pwrite(smb_session *s, smb_fd fd, const void *buf,
+                     size_t buf_size, uint64_t offset)
+{
+    smb_file        *file;
+    size_t          done = 0;
+    ssize_t         res;
+
+    bdsm_assert(s != NULL && buf != NULL);
+    if (s == NULL || buf == NULL || fd == 0)
+        return -1;
+
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+        return -1;
+
+    if (file->wb != NULL)
+        return smb_writebehind_write(s, file, buf, buf_size, offset);
+
+    while (done < buf_size)
+    {
+        res = smb_file_write(s, file, (const char *)buf + done,
+                             buf_size - done, offset + done);
+        if (res < 0)
+            return done > 0 ? (ssize_t)done : -1;
+        if (res == 0)
+            break;
+        done += res;
+    }
+
+    return done;
+}
+
+static void smb_fopen_async_handler(smb_session *s, smb_request *req,
+                                    smb_message *msg, size_t payload_size)
+{
+    (void)payload_size;
+
+    if (msg != NULL && smb_request_check_nt_status(s, req, msg))
+        req->result.status = smb_fopen_parse(s, SMB_FD_TID(req->fd), req->buf,
+                                             msg, &req->result.fd);
+    free(req->buf);
+}
+
+int       smb_fopen_async(smb_session *s, smb_tid tid, const char *path,
+                          uint32_t mod, smb_async_cb cb, void *opaque)
+{
+    smb_request     *req;
+    smb_message     *req_msg;
+    char            *req_path;
+    int             res;
+
+    bdsm_assert(s != NULL && path != NULL);
+    if (s == NULL || path == NULL)
+        return DSM_ERROR_GENERIC;
+
+    if (smb_session_share_get(s, tid) == NULL)
+        return DSM_ERROR_GENERIC;
+
+    res = smb_fopen_build(tid, path, mod, &req_msg);
+    if (res != DSM_SUCCESS)
+        return res;
+
+    req_path = strdup(path);
+    req = req_path ? smb_request_new(cb, opaque) : NULL;
+    if (!req) {
+        free(req_path);
         smb_message_destroy(req_msg);
-        if (!res)
-            return -1;
+        return DSM_ERROR_GENERIC;
+    }
+    req->handler = smb_fopen_async_handler;
+    req->fd      = SMB_FD(tid, 0);
+    req->buf     = req_path; // Freed by the handler
 
-        if (!smb_session_recv_msg(s, &resp_msg))
-            return -1;
-        if (!smb_session_check_nt_status(s, &resp_msg))
-            return -1;
-        
-        if (resp_msg.payload_size < sizeof(smb_write_resp))
-        {
-            BDSM_dbg("[smb_fwrite]Malformed message.\n");
-            return DSM_ERROR_NETWORK;
-        }
+    res = smb_request_submit(s, req, req_msg, NULL, 0);
+    smb_message_destroy(req_msg);
+    if (res != DSM_SUCCESS)
+        free(req_path);
+
+    return res;
+}
 
-        resp = (smb_write_resp *)resp_msg.packet->payload;
+static void smb_fread_async_handler(smb_session *s, smb_request *req,
+                                    smb_message *msg, size_t payload_size)
+{
+    if (msg == NULL || !smb_request_check_nt_status(s, req, msg))
+        return;
 
-        smb_fseek(s, fd, resp->data_len, SEEK_CUR);
+    req->result.size = smb_fread_parse(s, msg, payload_size, req->buf,
+                                       req->buf_size, NULL);
+    if (req->result.size < 0)
+        req->result.status = DSM_ERROR_NETWORK;
+}
 
-        return resp->data_len;
-    
+int       smb_fread_async(smb_session *s, smb_fd fd, void *buf,
+                          size_t buf_size, uint64_t offset,
+                          smb_async_cb cb, void *opaque)
+{
+    smb_file        *file;
+    smb_request     *req;
+    smb_message     *req_msg;
+    size_t          max_read;
+    int             res;
+
+    bdsm_assert(s != NULL);
+    if (s == NULL || fd == 0)
+        return DSM_ERROR_GENERIC;
+
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+        return DSM_ERROR_GENERIC;
+
+    max_read = smb_session_max_read(s);
+    max_read = max_read < buf_size ? max_read : buf_size;
+
+    req_msg = smb_fread_build(file, offset, max_read);
+    if (!req_msg)
+        return DSM_ERROR_GENERIC;
+
+    req = smb_request_new(cb, opaque);
+    if (!req) {
+        smb_message_destroy(req_msg);
+        return DSM_ERROR_GENERIC;
     }
-    
-    return -1;
+    req->handler  = smb_fread_async_handler;
+    req->hdr_size = sizeof(smb_read_resp); // Data goes straight to buf
+    req->buf      = buf;
+    req->buf_size = max_read;
+
+    res = smb_request_submit(s, req, req_msg, NULL, 0);
+    smb_message_destroy(req_msg);
+
+    return res;
+}
+
+static void smb_fwrite_async_handler(smb_session *s, smb_request *req,
+                                     smb_message *msg, size_t payload_size)
+{
+    (void)payload_size;
+
+    if (msg == NULL || !smb_request_check_nt_status(s, req, msg))
+        return;
+
+    req->result.size = smb_fwrite_parse(msg);
+    if (req->result.size < 0)
+        req->result.status = DSM_ERROR_NETWORK;
+}
+
+int       smb_fwrite_async(smb_session *s, smb_fd fd, const void *buf,
+                           size_t buf_size, uint64_t offset,
+                           smb_async_cb cb, void *opaque)
+{
+    smb_file        *file;
+    smb_request     *req;
+    smb_message     *req_msg;
+    size_t          max_write;
+    int             res;
+
+    bdsm_assert(s != NULL && buf != NULL);
+    if (s == NULL || buf == NULL || fd == 0)
+        return DSM_ERROR_GENERIC;
+
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+        return DSM_ERROR_GENERIC;
+    smb_readahead_invalidate(file);
+    smb_stat_cache_invalidate(s, file->tid, file->name, false);
+
+    max_write = smb_session_max_write(s);
+    max_write = max_write < buf_size ? max_write : buf_size;
+
+    req_msg = smb_fwrite_build(file, max_write, offset);
+    if (!req_msg)
+        return DSM_ERROR_GENERIC;
+
+    req = smb_request_new(cb, opaque);
+    if (!req) {
+        smb_message_destroy(req_msg);
+        return DSM_ERROR_GENERIC;
+    }
+    req->handler = smb_fwrite_async_handler;
+
+    res = smb_request_submit(s, req, req_msg, buf, max_write);
+    smb_message_destroy(req_msg);
+
+    return res;
+}
+
+static void smb_fclose_async_handler(smb_session *s, smb_request *req,
+                                     smb_message *msg, size_t payload_size)
+{
+    (void)payload_size;
+
+    // The error of the flush comes first
+    if (msg != NULL && req->result.status == DSM_SUCCESS)
+        smb_request_check_nt_status(s, req, msg);
+}
+
+int       smb_fclose_async(smb_session *s, smb_fd fd, smb_async_cb cb,
+                           void *opaque)
+{
+    smb_file        *file;
+    smb_request     *req;
+    smb_message     *req_msg;
+    int             flushed, res;
+
+    bdsm_assert(s != NULL);
+    if (s == NULL || fd == 0)
+        return DSM_ERROR_GENERIC;
+
+    // Buffered writes must reach the server before the close. If they
+    // don't, the file is closed all the same and the callback gets the error
+    flushed = smb_fflush(s, fd);
+
+    // The descriptor is invalid from now on, whatever the server says
+    if ((file = smb_session_file_remove(s, fd)) == NULL)
+        return DSM_ERROR_GENERIC;
+    smb_stat_cache_invalidate(s, file->tid, file->name, false);
+    smb_file_destroy(s, file);
+
+    req_msg = smb_fclose_build(fd);
+    if (!req_msg)
+        return DSM_ERROR_GENERIC;
+
+    req = smb_request_new(cb, opaque);
+    if (!req) {
+        smb_message_destroy(req_msg);
+        return DSM_ERROR_GENERIC;
+    }
+    req->handler = smb_fclose_async_handler;
+    req->result.status = flushed;
+
+    res = smb_request_submit(s, req, req_msg, NULL, 0);
+    smb_message_destroy(req_msg);
+
+    return res;
 }
 
 ssize_t   smb_fseek(smb_session *s, smb_fd fd, off_t offset, int whence)
 {
-    smb_file  *file;
+    smb_file        *file;
+    smb_readahead   *ra;
+    uint64_t        pos;
 
     bdsm_assert(s != NULL);
     
@@ -342,6 +1494,15 @@ ssize_t   smb_fseek(smb_session *s, smb_fd fd, off_t offset, int whence)
         else if (whence == SMB_SEEK_CUR)
             file->offset += offset;
 
+        // Seeking away breaks the sequence, the buffers would be wasted
+        ra  = file->ra;
+        pos = file->offset;
+        if (ra != NULL
+            && !(pos >= ra->cur_offset && pos <= ra->cur_offset + ra->cur_len)
+            && !(ra->prefetching && pos >= ra->next_offset
+                 && pos < ra->next_offset + ra->window))
+            smb_readahead_invalidate(file);
+
         return file->offset;
         
     }
@@ -387,6 +1548,9 @@ int  smb_file_rm(smb_session *s, smb_tid tid, const char *path)
 
         free(utf_pattern);
 
+        // Whatever the outcome, the cached status might be stale now
+        smb_stat_cache_invalidate(s, tid, path, false);
+
         if (!smb_session_recv_msg(s, &resp_msg))
             return DSM_ERROR_NETWORK;
         if (!smb_session_check_nt_status(s, &resp_msg))
@@ -459,6 +1623,10 @@ int       smb_file_mv(smb_session *s, smb_tid tid, const char *old_path, const c
         free(utf_old_path);
         free(utf_new_path);
 
+        // Whatever the outcome, the cached status might be stale now
+        smb_stat_cache_invalidate(s, tid, old_path, true);
+        smb_stat_cache_invalidate(s, tid, new_path, true);
+
         if (!smb_session_recv_msg(s, &resp_msg))
             return DSM_ERROR_NETWORK;
 
@@ -38,4 +38,8 @@
 
 #include "../include/bdsm/smb_file.h"
 
+// Free a file removed from its share. Its read-ahead buffers are kept until
+// the prefetch in flight, if any, completes.
+void        smb_file_destroy(smb_session *s, smb_file *file);
+
 #endif
@@ -92,7 +92,8 @@ SMB_PACKED_START typedef struct
   uint8_t         wct;            /* +-17 :) */                                \
   uint16_t        dialect_index;                                               \
   uint8_t         security_mode;  /* Share/User. Plaintext/Challenge */        \
-  uint32_t        diplodocus;                                                  \
+  uint16_t        max_mpx_count;  /* Max pending requests we may issue */      \
+  uint16_t        max_vcs;        /* Max virtual circuits */                   \
   uint32_t        max_bufsize;    /* Max buffer size requested by server. */   \
   uint32_t        max_rawbuffer;  /* Max raw buffer size requested by serv. */ \
   uint32_t        session_key;    /* 'MUST' be returned to server */           \
@@ -253,6 +254,14 @@ SMB_PACKED_START typedef struct
     uint16_t        bct;                // 0
 } SMB_PACKED_END   smb_close_req;
 
+//-> Find Close2
+SMB_PACKED_START typedef struct
+{
+    uint8_t         wct;                // 1
+    uint16_t        sid;                // Search ID of FIND_FIRST2
+    uint16_t        bct;                // 0
+} SMB_PACKED_END   smb_find_close2_req;
+
 
 
 //-> Read File
@@ -280,7 +289,7 @@ SMB_PACKED_START typedef struct
     uint16_t        reserved;
     uint16_t        data_len;
     uint16_t        data_offset;
-    uint32_t        data_len_high;
+    uint32_t        data_len_high;      // Continuation of data_len (LARGE_READX)
     uint32_t        reserved2;
     uint16_t        reserved3;
     uint16_t        bct;
@@ -296,7 +305,7 @@ SMB_PACKED_START typedef struct
     uint32_t        timeout;
     uint16_t        write_mode;
     uint16_t        remaining;
-    uint16_t        reserved;
+    uint16_t        data_len_high;      // Continuation of data_len (LARGE_WRITEX)
     uint16_t        data_len;
     uint16_t        data_offset;
     uint32_t        offset_high;        // Continuation of offset field'
@@ -312,7 +321,8 @@ SMB_PACKED_START typedef struct
     
     uint16_t        data_len;
     uint16_t        available;
-    uint32_t        reserved;
+    uint16_t        data_len_high;      // Continuation of data_len (LARGE_WRITEX)
+    uint16_t        reserved;
     uint16_t        bct;
 } SMB_PACKED_END   smb_write_resp;
 
@@ -473,6 +483,13 @@ SMB_PACKED_START typedef struct
     uint8_t       path[];
 } SMB_PACKED_END   smb_tr2_query;
 
+//// -> Trans2|QueryFileInfo
+SMB_PACKED_START typedef struct
+{
+    uint16_t      fid;
+    uint16_t      interest;
+} SMB_PACKED_END   smb_tr2_query_file;
+
 //<- Trans2
 
 SMB_PACKED_START typedef struct
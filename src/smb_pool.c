@@ -0,0 +1,510 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/poll.h>
+
+#include "../xcode/config.h"
+#include "bdsm_debug.h"
+#include "smb_async.h"
+#include "smb_session.h"
+#include "smb_file.h"
+#include "smb_fd.h"
+#include "smb_pool.h"
+#include "smb_share.h"
+
+// Size of the chunks smb_session_pool_pread() distributes to its connections
+#define SMB_POOL_STRIPE_SIZE    (1024 * 1024)
+// How many times a chunk is retried on a new connection
+#define SMB_POOL_RETRIES        (1)
+
+typedef struct
+{
+    smb_session         *s;             // NULL if not connected
+    smb_tid             tid;
+    bool                leased;
+    bool                failed;         // Reconnect before next lease
+}                       smb_pool_conn;
+
+struct smb_session_pool
+{
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;           // A connection was released
+    smb_pool_conn       *conns;
+    unsigned int        size;
+    unsigned int        read_window;
+    smb_creds           creds;
+    char                *hostname;
+    char                *ip;
+    char                *user_port;
+    char                *share;
+    int                 transport;
+};
+
+smb_session_pool *smb_session_pool_new(unsigned int size)
+{
+    smb_session_pool *pool;
+
+    if (size == 0)
+        return NULL;
+
+    pool = calloc(1, sizeof(smb_session_pool));
+    if (!pool)
+        return NULL;
+
+    pool->conns = calloc(size, sizeof(smb_pool_conn));
+    if (!pool->conns)
+    {
+        free(pool);
+        return NULL;
+    }
+
+    pool->size        = size;
+    pool->read_window = 1;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->cond, NULL);
+
+    return pool;
+}
+
+void            smb_session_pool_destroy(smb_session_pool *pool)
+{
+    bdsm_assert(pool != NULL);
+
+    if (pool != NULL)
+    {
+        for (unsigned int i = 0; i < pool->size; i++)
+        {
+            bdsm_assert(!pool->conns[i].leased);
+            if (pool->conns[i].s != NULL)
+                smb_session_destroy(pool->conns[i].s);
+        }
+
+        free(pool->conns);
+        free(pool->creds.domain);
+        free(pool->creds.login);
+        free(pool->creds.password);
+        free(pool->hostname);
+        free(pool->ip);
+        free(pool->user_port);
+        free(pool->share);
+        pthread_cond_destroy(&pool->cond);
+        pthread_mutex_destroy(&pool->lock);
+        free(pool);
+    }
+}
+
+static void     smb_pool_set_str(char **dst, const char *src)
+{
+    free(*dst);
+    *dst = src != NULL ? strndup(src, SMB_CREDS_MAXLEN) : NULL;
+}
+
+void            smb_session_pool_set_creds(smb_session_pool *pool,
+                                           const char *domain,
+                                           const char *login,
+                                           const char *password)
+{
+    bdsm_assert(pool != NULL);
+
+    if (pool != NULL)
+    {
+        if (domain != NULL)
+            smb_pool_set_str(&pool->creds.domain, domain);
+        if (login != NULL)
+            smb_pool_set_str(&pool->creds.login, login);
+        if (password != NULL)
+            smb_pool_set_str(&pool->creds.password, password);
+    }
+}
+
+void            smb_session_pool_set_read_window(smb_session_pool *pool,
+                                                 unsigned int window)
+{
+    bdsm_assert(pool != NULL);
+
+    if (pool != NULL)
+    {
+        pthread_mutex_lock(&pool->lock);
+        pool->read_window = window;
+        for (unsigned int i = 0; i < pool->size; i++)
+            if (pool->conns[i].s != NULL && !pool->conns[i].leased)
+                smb_session_set_read_window(pool->conns[i].s, window);
+        pthread_mutex_unlock(&pool->lock);
+    }
+}
+
+unsigned int    smb_session_pool_get_size(smb_session_pool *pool)
+{
+    bdsm_assert(pool != NULL);
+
+    return pool != NULL ? pool->size : 0;
+}
+
+// Establish the connection of a slot leased by the caller
+static int      smb_pool_conn_open(smb_session_pool *pool, smb_pool_conn *conn)
+{
+    smb_session *s;
+    int         res;
+
+    if ((s = smb_session_new()) == NULL)
+        return DSM_ERROR_GENERIC;
+
+    smb_session_set_creds(s, pool->creds.domain, pool->creds.login,
+                          pool->creds.password);
+
+    if ((res = smb_session_connect(s, pool->hostname, pool->ip,
+                                   pool->user_port, pool->transport))
+        || (res = smb_session_login(s))
+        || (res = smb_tree_connect(s, pool->share, &conn->tid)))
+    {
+        BDSM_dbg("smb_session_pool: unable to connect to %s (%d)\n",
+                 pool->hostname, res);
+        smb_session_destroy(s);
+        return res;
+    }
+
+    smb_session_set_read_window(s, pool->read_window);
+    conn->s      = s;
+    conn->failed = false;
+
+    return DSM_SUCCESS;
+}
+
+// Nothing should arrive on an idle connection, if the socket is readable the
+// server has closed it (or is about to)
+static bool     smb_pool_conn_alive(smb_pool_conn *conn)
+{
+    struct pollfd   pfd;
+
+    pfd.fd      = smb_session_get_fd(conn->s);
+    pfd.events  = POLLIN;
+    pfd.revents = 0;
+
+    return pfd.fd >= 0 && poll(&pfd, 1, 0) == 0;
+}
+
+int             smb_session_pool_connect(smb_session_pool *pool,
+                                         const char *hostname, const char *ip,
+                                         const char *user_port, int transport,
+                                         const char *share)
+{
+    smb_session *s;
+    smb_tid     tid;
+
+    bdsm_assert(pool != NULL && hostname != NULL && ip != NULL
+                && share != NULL);
+
+    if (pool == NULL || hostname == NULL || ip == NULL || share == NULL)
+        return DSM_ERROR_GENERIC;
+
+    smb_pool_set_str(&pool->hostname, hostname);
+    smb_pool_set_str(&pool->ip, ip);
+    smb_pool_set_str(&pool->user_port, user_port);
+    smb_pool_set_str(&pool->share, share);
+    pool->transport = transport;
+
+    if ((s = smb_session_pool_lease(pool, &tid)) == NULL)
+        return DSM_ERROR_NETWORK;
+    smb_session_pool_release(pool, s, 0);
+
+    return DSM_SUCCESS;
+}
+
+smb_session     *smb_session_pool_lease(smb_session_pool *pool, smb_tid *tid)
+{
+    smb_pool_conn   *conn = NULL;
+
+    bdsm_assert(pool != NULL && tid != NULL);
+
+    if (pool == NULL || tid == NULL || pool->hostname == NULL)
+        return NULL;
+
+    pthread_mutex_lock(&pool->lock);
+    for (;;)
+    {
+        // Prefer a connection already established
+        for (unsigned int i = 0; i < pool->size && conn == NULL; i++)
+            if (!pool->conns[i].leased && pool->conns[i].s != NULL)
+                conn = &pool->conns[i];
+        for (unsigned int i = 0; i < pool->size && conn == NULL; i++)
+            if (!pool->conns[i].leased)
+                conn = &pool->conns[i];
+        if (conn != NULL)
+            break;
+        pthread_cond_wait(&pool->cond, &pool->lock);
+    }
+    conn->leased = true;
+    pthread_mutex_unlock(&pool->lock);
+
+    if (conn->s != NULL && (conn->failed || !smb_pool_conn_alive(conn)))
+    {
+        BDSM_dbg("smb_session_pool: reconnecting to %s\n", pool->hostname);
+        smb_session_destroy(conn->s);
+        conn->s = NULL;
+    }
+
+    if (conn->s == NULL && smb_pool_conn_open(pool, conn) != DSM_SUCCESS)
+    {
+        pthread_mutex_lock(&pool->lock);
+        conn->leased = false;
+        pthread_cond_signal(&pool->cond);
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+
+    *tid = conn->tid;
+    return conn->s;
+}
+
+void            smb_session_pool_release(smb_session_pool *pool,
+                                         smb_session *s, int failed)
+{
+    bdsm_assert(pool != NULL && s != NULL);
+
+    if (pool == NULL || s == NULL)
+        return;
+
+    pthread_mutex_lock(&pool->lock);
+    for (unsigned int i = 0; i < pool->size; i++)
+        if (pool->conns[i].s == s)
+        {
+            bdsm_assert(pool->conns[i].leased);
+            pool->conns[i].leased = false;
+            pool->conns[i].failed = failed != 0;
+            pthread_cond_signal(&pool->cond);
+            break;
+        }
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/*
+ * Striped reads
+ */
+
+typedef struct
+{
+    smb_session_pool    *pool;
+    const char          *path;
+    uint8_t             *buf;
+    size_t              buf_size;
+    uint64_t            offset;
+    pthread_mutex_t     lock;
+    size_t              next;           // Next chunk to read
+    size_t              nb_chunks;
+    ssize_t             *got;           // Bytes read per chunk, -1 on error
+    size_t              *retry;         // Chunks given up by a worker
+    size_t              nb_retry;
+}                       smb_pool_read;
+
+// Read chunks on a leased session until there are none left. If a read
+// fails, the chunk is left in 'chunk' for a retry and false is returned.
+static bool     smb_pool_read_chunks(smb_pool_read *rd, smb_session *s,
+                                     smb_tid tid, size_t *chunk)
+{
+    smb_fd          fd;
+    size_t          len;
+    int             res;
+
+    if ((res = smb_fopen(s, tid, rd->path, SMB_MOD_RO, &fd)) != DSM_SUCCESS)
+        return res != DSM_ERROR_NETWORK;
+
+    for (;;)
+    {
+        if (*chunk == SIZE_MAX)
+        {
+            pthread_mutex_lock(&rd->lock);
+            if (rd->nb_retry > 0)
+                *chunk = rd->retry[--rd->nb_retry];
+            else if (rd->next < rd->nb_chunks)
+                *chunk = rd->next++;
+            pthread_mutex_unlock(&rd->lock);
+            if (*chunk == SIZE_MAX)
+                break;
+        }
+
+        len = rd->buf_size - *chunk * SMB_POOL_STRIPE_SIZE;
+        if (len > SMB_POOL_STRIPE_SIZE)
+            len = SMB_POOL_STRIPE_SIZE;
+
+        rd->got[*chunk] = smb_pread(s, fd,
+                                    rd->buf + *chunk * SMB_POOL_STRIPE_SIZE, len,
+                                    rd->offset + *chunk * SMB_POOL_STRIPE_SIZE);
+
+        // A read failing half-way is short too: it's only the end of file if
+        // there is nothing more to read
+        if (rd->got[*chunk] >= 0 && rd->got[*chunk] < (ssize_t)len
+            && smb_pread(s, fd, NULL, 1, rd->offset + rd->got[*chunk]
+                         + *chunk * SMB_POOL_STRIPE_SIZE) != 0)
+            rd->got[*chunk] = -1;
+        if (rd->got[*chunk] < 0)
+            return false;
+
+        if (rd->got[*chunk] < (ssize_t)len)
+        {
+            // End of file, don't go further
+            pthread_mutex_lock(&rd->lock);
+            if (rd->nb_chunks > *chunk + 1)
+                rd->nb_chunks = *chunk + 1;
+            pthread_mutex_unlock(&rd->lock);
+            *chunk = SIZE_MAX;
+            break;
+        }
+        *chunk = SIZE_MAX;
+    }
+
+    smb_fclose(s, fd);
+    return true;
+}
+
+static void     *smb_pool_read_worker(void *opaque)
+{
+    smb_pool_read   *rd = opaque;
+    smb_session     *s;
+    smb_tid         tid;
+    size_t          chunk = SIZE_MAX;
+    bool            ok;
+
+    // On failure, the connection is dropped and the chunk retried once on a
+    // fresh one
+    for (int attempt = 0; attempt <= SMB_POOL_RETRIES; attempt++)
+    {
+        if ((s = smb_session_pool_lease(rd->pool, &tid)) == NULL)
+            break;
+        ok = smb_pool_read_chunks(rd, s, tid, &chunk);
+        smb_session_pool_release(rd->pool, s, !ok);
+        if (ok)
+            break;
+    }
+
+    // Give the chunk we couldn't read to the workers still running
+    if (chunk != SIZE_MAX)
+    {
+        pthread_mutex_lock(&rd->lock);
+        rd->retry[rd->nb_retry++] = chunk;
+        pthread_mutex_unlock(&rd->lock);
+    }
+
+    return NULL;
+}
+
+ssize_t         smb_session_pool_pread(smb_session_pool *pool,
+                                       const char *path, void *buf,
+                                       size_t buf_size, uint64_t offset,
+                                       unsigned int stripes)
+{
+    smb_pool_read   rd;
+    pthread_t       *threads;
+    unsigned int    nb_threads = 0;
+    ssize_t         total = 0;
+
+    bdsm_assert(pool != NULL && path != NULL && buf != NULL);
+
+    if (pool == NULL || path == NULL || buf == NULL)
+        return -1;
+    if (buf_size == 0)
+        return 0;
+
+    if (stripes == 0 || stripes > pool->size)
+        stripes = pool->size;
+
+    rd.pool      = pool;
+    rd.path      = path;
+    rd.buf       = buf;
+    rd.buf_size  = buf_size;
+    rd.offset    = offset;
+    rd.next      = 0;
+    rd.nb_chunks = (buf_size + SMB_POOL_STRIPE_SIZE - 1) / SMB_POOL_STRIPE_SIZE;
+    rd.nb_retry  = 0;
+    if (stripes > rd.nb_chunks)
+        stripes = rd.nb_chunks;
+
+    rd.got = malloc(rd.nb_chunks * sizeof(ssize_t));
+    rd.retry = malloc(rd.nb_chunks * sizeof(size_t));
+    threads = malloc(stripes * sizeof(pthread_t));
+    if (!rd.got || !rd.retry || !threads)
+    {
+        free(rd.got);
+        free(rd.retry);
+        free(threads);
+        return -1;
+    }
+    for (size_t i = 0; i < rd.nb_chunks; i++)
+        rd.got[i] = -1;
+    pthread_mutex_init(&rd.lock, NULL);
+
+    // The calling thread takes its share of the work too
+    for (unsigned int i = 1; i < stripes; i++)
+        if (pthread_create(&threads[nb_threads], NULL, smb_pool_read_worker,
+                           &rd) == 0)
+            nb_threads++;
+    smb_pool_read_worker(&rd);
+    for (unsigned int i = 0; i < nb_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    // Up to the end of file, a chunk left unread is an error rather than a
+    // short read which would pass for the end of file
+    for (size_t i = 0; i < rd.nb_chunks; i++)
+    {
+        if (rd.got[i] < 0)
+        {
+            total = -1;
+            break;
+        }
+        total += rd.got[i];
+        if (rd.got[i] < SMB_POOL_STRIPE_SIZE)
+            break;
+    }
+
+    pthread_mutex_destroy(&rd.lock);
+    free(threads);
+    free(rd.retry);
+    free(rd.got);
+
+    return total;
+}
+
+bool            smb_session_pool_on_share(smb_session_pool *pool,
+                                          smb_session *s, smb_tid tid)
+{
+    smb_session     *ps;
+    smb_tid         ptid;
+    bool            same;
+
+    if ((ps = smb_session_pool_lease(pool, &ptid)) == NULL)
+        return true;
+    same = smb_session_share_same(s, tid, ps, ptid);
+    smb_session_pool_release(pool, ps, 0);
+
+    return same;
+}
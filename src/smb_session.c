@@ -36,11 +36,13 @@
 #include "../xcode/config.h"
 #include "../xcode/extra/spnego_asn1_mutex.h"
 #include "bdsm_debug.h"
+#include "smb_async.h"
 #include "smb_session.h"
 #include "smb_session_msg.h"
 #include "smb_fd.h"
 #include "smb_ntlm.h"
 #include "smb_spnego.h"
+#include "smb_stat_cache.h"
 #include "smb_transport.h"
 #include "compat.h"
 
@@ -60,7 +62,6 @@ smb_session   *smb_session_new()
     // Explicitly sets pointer to NULL, insted of 0
     s->spnego_asn1        = NULL;
     s->transport.session  = NULL;
-    s->shares             = NULL;
 
     s->creds.domain       = NULL;
     s->creds.login        = NULL;
@@ -68,6 +69,17 @@ smb_session   *smb_session_new()
 
     smb_buffer_init(&s->xsec_target, NULL, 0);
 
+    TAILQ_INIT(&s->pending);
+    TAILQ_INIT(&s->mailboxes);
+    pthread_mutex_init(&s->lock, NULL);
+    pthread_mutex_init(&s->send_lock, NULL);
+    pthread_cond_init(&s->cond, NULL);
+
+    // One READ_ANDX at a time, unless told otherwise
+    s->read_window        = 1;
+    s->find_count         = SMB_FIND_COUNT_DEFAULT;
+    s->find_buf_size      = SMB_FIND_BUF_MAX;
+
     // Until we know more, assume server supports everything.
     // s->c
 
@@ -80,7 +92,12 @@ void            smb_session_destroy(smb_session *s)
 
     if(s!=NULL){
         
+        // Pending async requests will never complete
+        smb_session_pending_fail(s, DSM_ERROR_NETWORK);
+
         smb_session_share_clear(s);
+        smb_session_mailbox_clear(s);
+        smb_stat_cache_destroy(s->stat_cache);
 
         // FIXME Free smb_share and smb_file
         if (s->transport.session != NULL)
@@ -101,10 +118,49 @@ void            smb_session_destroy(smb_session *s)
         free(s->creds.domain);
         free(s->creds.login);
         free(s->creds.password);
+
+        pthread_cond_destroy(&s->cond);
+        pthread_mutex_destroy(&s->send_lock);
+        pthread_mutex_destroy(&s->lock);
         free(s);
     }
 }
 
+int             smb_session_set_thread_safe(smb_session *s, int thread_safe)
+{
+    bdsm_assert(s != NULL);
+
+    if (s == NULL)
+        return DSM_ERROR_GENERIC;
+
+    // Event loop integration relies on a single thread receiving
+    if (thread_safe && s->nonblocking)
+        return DSM_ERROR_GENERIC;
+
+    if (thread_safe && !s->has_mailbox_key)
+    {
+        if (pthread_key_create(&s->mailbox_key,
+                               smb_session_mailbox_release) != 0)
+            return DSM_ERROR_GENERIC;
+        s->has_mailbox_key = true;
+    }
+
+    s->thread_safe = thread_safe != 0;
+    return DSM_SUCCESS;
+}
+
+void            smb_session_lock(smb_session *s)
+{
+    if (s->thread_safe)
+        pthread_mutex_lock(&s->lock);
+}
+
+void            smb_session_unlock(smb_session *s)
+{
+    if (s->thread_safe)
+        pthread_mutex_unlock(&s->lock);
+}
+
 void            smb_session_set_creds(smb_session *s, const char *domain,
                                       const char *login, const char *password)
 {
@@ -219,6 +275,10 @@ static int        smb_negotiate(smb_session *s)
 
         s->srv.dialect        = nego->dialect_index;
         s->srv.security_mode  = nego->security_mode;
+        s->srv.max_mpx        = nego->max_mpx_count;
+        s->srv.max_bufsize    = nego->max_bufsize;
+        if (s->srv.max_mpx != 0 && s->read_window > s->srv.max_mpx)
+            s->read_window    = s->srv.max_mpx;
         s->srv.caps           = nego->caps;
         s->srv.ts             = nego->ts;
         s->srv.tz             = nego->tz;
@@ -477,11 +537,95 @@ int             smb_session_supports(smb_session *s, int what)
     return 0;
 }
 
+size_t          smb_session_max_read(smb_session *s)
+{
+    size_t      max_read;
+
+    bdsm_assert(s != NULL);
+
+    if (s->srv.caps & SMB_CAPS_LARGE_READX)
+        max_read = SMB_IO_LARGE_MAX;
+    else
+    {
+        // The reply has to fit in the server's buffer
+        max_read = SMB_IO_MAX;
+        if (s->srv.max_bufsize > SMB_IO_OVERHEAD
+            && s->srv.max_bufsize - SMB_IO_OVERHEAD < max_read)
+            max_read = s->srv.max_bufsize - SMB_IO_OVERHEAD;
+    }
+
+    if (s->transport.max_msg_size - SMB_IO_OVERHEAD < max_read)
+        max_read = s->transport.max_msg_size - SMB_IO_OVERHEAD;
+
+    return max_read;
+}
+
+size_t          smb_session_max_write(smb_session *s)
+{
+    size_t      max_write;
+
+    bdsm_assert(s != NULL);
+
+    if (s->srv.caps & SMB_CAPS_LARGE_WRITEX)
+        max_write = SMB_IO_LARGE_MAX;
+    else
+    {
+        // total size of SMB message shall not exceed maximum size of
+        // netbios data payload nor the server's buffer
+        max_write = SMB_IO_MAX;
+        if (s->srv.max_bufsize != 0 && s->srv.max_bufsize < max_write)
+            max_write = s->srv.max_bufsize;
+        max_write -= SMB_IO_OVERHEAD;
+    }
+
+    if (s->transport.max_msg_size - SMB_IO_OVERHEAD < max_write)
+        max_write = s->transport.max_msg_size - SMB_IO_OVERHEAD;
+
+    return max_write;
+}
+
+int             smb_session_set_read_window(smb_session *s, unsigned int window)
+{
+    bdsm_assert(s != NULL);
+
+    if(s!=NULL){
+
+        if (window == 0)
+            window = 1;
+        if (window > SMB_READ_WINDOW_MAX)
+            window = SMB_READ_WINDOW_MAX;
+        // Never exceed what the server told us it can handle
+        if (s->srv.max_mpx != 0 && window > s->srv.max_mpx)
+            window = s->srv.max_mpx;
+
+        s->read_window = window;
+        return (int)window;
+    }
+    return DSM_ERROR_GENERIC;
+}
+
+int             smb_session_set_find_batch(smb_session *s, uint16_t count,
+                                           uint16_t buf_size)
+{
+    bdsm_assert(s != NULL);
+
+    if (s == NULL)
+        return DSM_ERROR_GENERIC;
+
+    s->find_count    = count != 0 ? count : SMB_FIND_COUNT_DEFAULT;
+    s->find_buf_size = buf_size != 0 && buf_size < SMB_FIND_BUF_MAX
+                     ? buf_size : SMB_FIND_BUF_MAX;
+
+    return DSM_SUCCESS;
+}
+
 uint32_t        smb_session_get_nt_status(smb_session *s)
 {
     bdsm_assert(s != NULL);
 
     if(s!=NULL){
+        if (s->thread_safe)
+            return smb_session_mailbox_nt_status(s);
         return s->nt_status;
     }
     return 0;
@@ -495,7 +639,10 @@ bool smb_session_check_nt_status(smb_session *s, smb_message *msg)
     
         if (msg->packet->header.status != NT_STATUS_SUCCESS)
         {
-            s->nt_status = msg->packet->header.status;
+            if (s->thread_safe)
+                smb_session_mailbox_set_nt_status(s, msg->packet->header.status);
+            else
+                s->nt_status = msg->packet->header.status;
             return false;
         }
         return true;
@@ -67,6 +67,31 @@
 /* Our reception buffer grows as necessary, so we can put the max here */
 #define SMB_SESSION_MAX_BUFFER (0xffff)
 
+/* Largest READ/WRITE_ANDX data without CAP_LARGE_READX/CAP_LARGE_WRITEX */
+#define SMB_IO_MAX             (0xffff)
+/* Largest READ/WRITE_ANDX data when the server allows large read/write */
+#define SMB_IO_LARGE_MAX       (128 * 1024)
+/* Room for the SMB header and READ/WRITE_ANDX parameters in a message */
+#define SMB_IO_OVERHEAD        (sizeof(smb_packet) + sizeof(smb_write_req))
+
+/* Upper bound for smb_session_set_read_window() */
+#define SMB_READ_WINDOW_MAX    (32)
+
+/* Entries asked per FIND_FIRST2/FIND_NEXT2 unless told otherwise */
+#define SMB_FIND_COUNT_DEFAULT (1366)
+/* Largest find reply data that still fits in a single message */
+#define SMB_FIND_BUF_MAX       (SMB_SESSION_MAX_BUFFER - sizeof(smb_packet) \
+                                - sizeof(smb_trans2_resp)                   \
+                                - sizeof(smb_tr2_findfirst2_params))
+
 bool smb_session_check_nt_status(smb_session *s, smb_message *msg);
 
+/* Protect the session state in thread-safe mode, no-ops otherwise */
+void            smb_session_lock(smb_session *s);
+void            smb_session_unlock(smb_session *s);
+
+/* Max data size of a single READ_ANDX/WRITE_ANDX for this session */
+size_t          smb_session_max_read(smb_session *s);
+size_t          smb_session_max_write(smb_session *s);
+
 #endif
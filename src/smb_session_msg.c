@@ -29,13 +29,376 @@
  *****************************************************************************/
 
 #include <assert.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "../xcode/config.h"
+#include "bdsm_debug.h"
+#include "smb_async.h"
 #include "smb_session.h"
 #include "smb_message.h"
+#include "smb_session_msg.h"
+#include "netbios_session.h"
+
+/*
+ * Thread-safe mode: one thread at a time receives for everyone. Replies to
+ * the synchronous requests of a thread are copied to its mailbox, found by
+ * MID, and replies to async requests are dispatched as usual.
+ */
+
+// Lock must be held
+static smb_mailbox *smb_session_mailbox(smb_session *s)
+{
+    smb_mailbox     *mb;
+
+    if (!s->has_mailbox_key)
+        return NULL;
+    if ((mb = pthread_getspecific(s->mailbox_key)) != NULL)
+        return mb;
+
+    mb = calloc(1, sizeof(smb_mailbox));
+    if (!mb)
+        return NULL;
+
+    mb->session = s;
+    TAILQ_INIT(&mb->mails);
+    if (pthread_setspecific(s->mailbox_key, mb) != 0)
+    {
+        free(mb);
+        return NULL;
+    }
+    TAILQ_INSERT_TAIL(&s->mailboxes, mb, next);
+
+    return mb;
+}
+
+// The mailbox must not be in the list anymore
+static void     smb_session_mailbox_free(smb_mailbox *mb)
+{
+    smb_mail        *mail;
+
+    while ((mail = TAILQ_FIRST(&mb->mails)) != NULL)
+    {
+        TAILQ_REMOVE(&mb->mails, mail, next);
+        free(mail);
+    }
+    free(mb->current);
+    free(mb->routes);
+    free(mb);
+}
+
+// Destructor of the mailbox key, called when a thread which used the session
+// exits. Its replies can't be waited for anymore.
+void            smb_session_mailbox_release(void *opaque)
+{
+    smb_mailbox     *mb = opaque;
+    smb_session     *s = mb->session;
+
+    pthread_mutex_lock(&s->lock);
+    TAILQ_REMOVE(&s->mailboxes, mb, next);
+    // The receiving thread is delivering a reply to it, it'll free it
+    if (s->routing == mb)
+        mb->orphan = true;
+    else
+        smb_session_mailbox_free(mb);
+    pthread_mutex_unlock(&s->lock);
+}
+
+// Lock must be held. Replies are expected on this route until the thread
+// sends again after having taken one: multi-part replies share the MID.
+static bool     smb_session_route_add(smb_session *s, uint16_t mid)
+{
+    smb_mailbox     *mb;
+    smb_route       *routes;
+    size_t          i, kept = 0;
+
+    if ((mb = smb_session_mailbox(s)) == NULL)
+        return false;
+
+    if (mb->received)
+    {
+        for (i = 0; i < mb->nb_routes; i++)
+            if (!mb->routes[i].answered)
+                mb->routes[kept++] = mb->routes[i];
+        mb->nb_routes = kept;
+        mb->received  = false;
+    }
+
+    if (mb->nb_routes == mb->routes_size)
+    {
+        routes = realloc(mb->routes, (mb->routes_size ? mb->routes_size * 2 : 4)
+                                     * sizeof(smb_route));
+        if (!routes)
+            return false;
+        mb->routes      = routes;
+        mb->routes_size = mb->routes_size ? mb->routes_size * 2 : 4;
+    }
+
+    mb->routes[mb->nb_routes].mid      = mid;
+    mb->routes[mb->nb_routes].answered = false;
+    mb->nb_routes++;
+
+    return true;
+}
+
+// Lock must be held
+static void     smb_session_route_remove(smb_session *s, uint16_t mid)
+{
+    smb_mailbox     *mb;
+
+    if ((mb = smb_session_mailbox(s)) == NULL)
+        return;
+
+    for (size_t i = 0; i < mb->nb_routes; i++)
+        if (mb->routes[i].mid == mid)
+        {
+            mb->routes[i] = mb->routes[--mb->nb_routes];
+            return;
+        }
+}
+
+// Lock must be held. Returns the mailbox of the thread waiting for 'mid'.
+static smb_mailbox *smb_session_route_find(smb_session *s, uint16_t mid)
+{
+    smb_mailbox     *mb;
+
+    TAILQ_FOREACH(mb, &s->mailboxes, next)
+        for (size_t i = 0; i < mb->nb_routes; i++)
+            if (mb->routes[i].mid == mid)
+            {
+                mb->routes[i].answered = true;
+                return mb;
+            }
+
+    return NULL;
+}
+
+void            smb_session_mailbox_clear(smb_session *s)
+{
+    smb_mailbox     *mb;
+
+    // Exiting threads mustn't free them anymore
+    if (s->has_mailbox_key)
+    {
+        pthread_key_delete(s->mailbox_key);
+        s->has_mailbox_key = false;
+    }
+
+    while ((mb = TAILQ_FIRST(&s->mailboxes)) != NULL)
+    {
+        TAILQ_REMOVE(&s->mailboxes, mb, next);
+        smb_session_mailbox_free(mb);
+    }
+}
+
+uint32_t        smb_session_mailbox_nt_status(smb_session *s)
+{
+    smb_mailbox     *mb;
+    uint32_t        status;
+
+    smb_session_lock(s);
+    mb = smb_session_mailbox(s);
+    status = mb != NULL ? mb->nt_status : s->nt_status;
+    smb_session_unlock(s);
+
+    return status;
+}
+
+void            smb_session_mailbox_set_nt_status(smb_session *s,
+                                                  uint32_t status)
+{
+    smb_mailbox     *mb;
+
+    smb_session_lock(s);
+    if ((mb = smb_session_mailbox(s)) != NULL)
+        mb->nt_status = status;
+    s->nt_status = status;
+    smb_session_unlock(s);
+}
+
+// Receive one message and route it, as the receiving thread (without the
+// lock). The async request it completed, if any, is returned in 'done' to be
+// finished once the socket is released. Returns false on network error.
+static bool     smb_session_route_next(smb_session *s, smb_request **done)
+{
+    smb_message     msg;
+    smb_mailbox     *mb;
+    smb_mail        *mail;
+    smb_request     *req;
+    void            *data;
+    ssize_t         payload_size;
+    size_t          received;
+    uint16_t        mid;
+    bool            ok;
+
+    *done = NULL;
+
+    payload_size = s->transport.recv_partial(s->transport.session, &data,
+                                             sizeof(smb_header), &received);
+    if (payload_size < (ssize_t)sizeof(smb_header))
+        return false;
+
+    msg.packet       = (smb_packet *)data;
+    msg.payload_size = received - sizeof(smb_header);
+    msg.cursor       = 0;
+    mid              = msg.packet->header.mux_id;
+
+    smb_session_lock(s);
+    mb = s->routing = smb_session_route_find(s, mid);
+    smb_session_unlock(s);
+
+    if (mb != NULL)
+    {
+        mail = NULL;
+        if (received >= (size_t)payload_size
+            || s->transport.recv_rest(s->transport.session, &data) >= 0)
+            mail = malloc(sizeof(smb_mail) + payload_size);
+        if (mail != NULL)
+        {
+            mail->payload_size = payload_size - sizeof(smb_header);
+            memcpy(mail->data, data, payload_size);
+        }
+
+        ok = mail != NULL;
+
+        smb_session_lock(s);
+        s->routing = NULL;
+        if (mb->orphan)
+        {
+            free(mail);
+            smb_session_mailbox_free(mb);
+        }
+        else if (mail != NULL)
+            TAILQ_INSERT_TAIL(&mb->mails, mail, next);
+        smb_session_unlock(s);
+        return ok;
+    }
+
+    if ((req = smb_session_pending_take(s, mid)) != NULL)
+    {
+        smb_request_complete(s, req, &msg, payload_size - sizeof(smb_header));
+        *done = req;
+        return true;
+    }
+
+    if (mid != 0xffff)
+        BDSM_dbg("Dropping unexpected message (cmd 0x%02x, mid %hu)\n",
+                 msg.packet->header.command, mid);
+    return true;
+}
+
+// Lock must be held. Receive and route one message if nobody else is doing
+// it, otherwise wait for the receiving thread to make progress.
+static void     smb_session_route_step(smb_session *s)
+{
+    smb_request     *done;
+    bool            ok;
+
+    if (s->reading)
+    {
+        pthread_cond_wait(&s->cond, &s->lock);
+        return;
+    }
+
+    s->reading = true;
+    smb_session_unlock(s);
+
+    ok = smb_session_route_next(s, &done);
+
+    smb_session_lock(s);
+    s->reading = false;
+    if (!ok)
+        s->broken = true;
+    pthread_cond_broadcast(&s->cond);
+    smb_session_unlock(s);
+
+    if (done != NULL)
+        smb_request_finish(s, done);
+    if (!ok)
+        smb_session_pending_fail(s, DSM_ERROR_NETWORK);
+
+    smb_session_lock(s);
+}
+
+// Wait for the next reply to a request sent by this thread
+static size_t   smb_session_recv_routed(smb_session *s, smb_message *msg)
+{
+    smb_mailbox     *mb;
+    smb_mail        *mail = NULL;
+
+    smb_session_lock(s);
+
+    if ((mb = smb_session_mailbox(s)) == NULL)
+        goto out;
+
+    // The previous reply isn't needed anymore
+    free(mb->current);
+    mb->current = NULL;
+
+    while ((mail = TAILQ_FIRST(&mb->mails)) == NULL && !s->broken)
+        smb_session_route_step(s);
+
+    if (mail != NULL)
+    {
+        TAILQ_REMOVE(&mb->mails, mail, next);
+        mb->current  = mail;
+        mb->received = true;
+    }
+
+out:
+    smb_session_unlock(s);
+
+    if (mail == NULL)
+        return 0;
+
+    if (msg != NULL)
+    {
+        msg->packet       = (smb_packet *)mail->data;
+        msg->payload_size = mail->payload_size;
+        msg->cursor       = 0;
+    }
+
+    return mail->payload_size;
+}
+
+int             smb_session_wait_routed(smb_session *s)
+{
+    unsigned int    completed;
+    int             res = DSM_SUCCESS;
+
+    smb_session_lock(s);
+
+    completed = s->completed;
+    while (s->completed == completed && s->nb_pending > 0 && !s->broken)
+        smb_session_route_step(s);
+
+    if (s->completed == completed && s->broken)
+        res = DSM_ERROR_NETWORK;
+
+    smb_session_unlock(s);
+
+    return res;
+}
 
 int             smb_session_send_msg(smb_session *s, smb_message *msg)
 {
-    size_t        pkt_sz;
+    return smb_session_send_req(s, msg, NULL, 0, NULL);
+}
+
+int             smb_session_send_msg_data(smb_session *s, smb_message *msg,
+                                          const void *data, size_t size)
+{
+    return smb_session_send_req(s, msg, data, size, NULL);
+}
+
+int             smb_session_send_req(smb_session *s, smb_message *msg,
+                                     const void *data, size_t size,
+                                     smb_request *req)
+{
+    struct iovec  iov[2];
+    uint16_t      mid;
+    bool          routed = true;
+    int           res;
 
     bdsm_assert(s != NULL);
     bdsm_assert(s->transport.session != NULL);
@@ -48,45 +411,223 @@ int             smb_session_send_msg(smb_session *s, smb_message *msg)
         // msg->packet->header.flags2  = 0xc043; // w/o extended security;
         msg->packet->header.uid = s->srv.uid;
 
-        s->transport.pkt_init(s->transport.session);
+        if (s->thread_safe)
+            pthread_mutex_lock(&s->send_lock);
 
-        pkt_sz = sizeof(smb_packet) + msg->cursor;
-        if (!s->transport.pkt_append(s->transport.session, (void *)msg->packet, pkt_sz))
-            return 0;
-        if (!s->transport.send(s->transport.session))
+        smb_session_lock(s);
+
+        // 0xffff is reserved for unsolicited oplock break notifications
+        if (++s->mid == 0xffff)
+            s->mid = 1;
+        mid = s->mid;
+        msg->packet->header.mux_id = mid;
+
+        // Know where the reply goes before it can possibly arrive
+        if (req != NULL)
+        {
+            req->mid = mid;
+            TAILQ_INSERT_TAIL(&s->pending, req, next);
+            s->nb_pending++;
+        }
+        else if (s->thread_safe)
+            routed = smb_session_route_add(s, mid);
+
+        smb_session_unlock(s);
+
+        iov[0].iov_base = (void *)msg->packet;
+        iov[0].iov_len  = sizeof(smb_packet) + msg->cursor;
+        iov[1].iov_base = (void *)data;
+        iov[1].iov_len  = size;
+
+        res = routed && s->transport.send_iov(s->transport.session, iov,
+                                              size > 0 ? 2 : 1);
+
+        if (s->thread_safe)
+            pthread_mutex_unlock(&s->send_lock);
+
+        if (!res)
+        {
+            smb_session_lock(s);
+            if (req != NULL)
+            {
+                TAILQ_REMOVE(&s->pending, req, next);
+                s->nb_pending--;
+            }
+            else if (s->thread_safe)
+                smb_session_route_remove(s, mid);
+            smb_session_unlock(s);
             return 0;
+        }
 
         return 1;
-        
     }
     return 0;
 }
 
-size_t          smb_session_recv_msg(smb_session *s, smb_message *msg)
+// Hand a received message over to the pending async request it replies to,
+// if any. Returns true if it was dispatched.
+static bool     smb_session_dispatch_msg(smb_session *s, smb_message *msg,
+                                         size_t payload_size)
+{
+    smb_request               *req;
+
+    if (s->nb_pending == 0
+        || !(req = smb_session_pending_take(s, msg->packet->header.mux_id)))
+        return false;
+
+    smb_request_dispatch(s, req, msg, payload_size);
+    return true;
+}
+
+// Receive the next message. Only 'size' bytes of its payload are received in
+// memory (SIZE_MAX for the whole message). Replies to pending async requests
+// are dispatched to them and unsolicited messages are dropped, then we wait
+// for the next one. Unless 'dispatched' isn't NULL: we then return after the
+// first message, telling if it was dispatched. Returns the full payload size,
+// or 0 on error.
+static size_t   smb_session_recv_next(smb_session *s, smb_message *msg,
+                                      size_t size, bool *dispatched)
 {
+    smb_message               tmp;
     void                      *data;
     ssize_t                   payload_size;
+    size_t                    want, received;
 
-    bdsm_assert(s != NULL && s->transport.session != NULL);
-    
-    if( s != NULL && s->transport.session != NULL ){
+    want = size < SIZE_MAX - sizeof(smb_header) ? sizeof(smb_header) + size
+                                                 : SIZE_MAX;
+
+    if (dispatched != NULL)
+        *dispatched = false;
 
-        payload_size = s->transport.recv(s->transport.session, &data);
+    for (;;)
+    {
+        payload_size = s->transport.recv_partial(s->transport.session, &data,
+                                                 want, &received);
         if (payload_size <= 0)
             return 0;
 
         if ((size_t)payload_size < sizeof(smb_header))
             return 0;
 
-        if (msg != NULL)
+        tmp.packet       = (smb_packet *)data;
+        tmp.payload_size = received - sizeof(smb_header);
+        tmp.cursor       = 0;
+
+        if (smb_session_dispatch_msg(s, &tmp, payload_size - sizeof(smb_header)))
+        {
+            if (dispatched != NULL)
+            {
+                *dispatched = true;
+                break;
+            }
+            continue;
+        }
+
+        // 0xffff is used by the server for oplock breaks, we don't ask for
+        // oplocks so there is nothing to do about it
+        if (tmp.packet->header.mux_id == 0xffff && dispatched == NULL)
         {
-            msg->packet = (smb_packet *)data;
-            msg->payload_size = payload_size - sizeof(smb_header);
-            msg->cursor       = 0;
+            BDSM_dbg("Dropping unsolicited message (cmd 0x%02x)\n",
+                     tmp.packet->header.command);
+            continue;
         }
 
-        return payload_size - sizeof(smb_header);
+        break;
     }
+
+    if (msg != NULL)
+        *msg = tmp;
+
+    return payload_size - sizeof(smb_header);
+}
+
+size_t          smb_session_recv_msg(smb_session *s, smb_message *msg)
+{
+    bdsm_assert(s != NULL && s->transport.session != NULL);
     
+    if (s == NULL || s->transport.session == NULL)
+        return 0;
+
+    if (s->thread_safe)
+        return smb_session_recv_routed(s, msg);
+
+    return smb_session_recv_next(s, msg, SIZE_MAX, NULL);
+}
+
+size_t          smb_session_recv_msg_partial(smb_session *s, smb_message *msg,
+                                             size_t size)
+{
+    bdsm_assert(s != NULL && s->transport.session != NULL);
+
+    if (s == NULL || s->transport.session == NULL)
+        return 0;
+
+    // Replies are received whole in thread-safe mode
+    if (s->thread_safe)
+        return smb_session_recv_routed(s, msg);
+
+    return smb_session_recv_next(s, msg, size, NULL);
+}
+
+int             smb_session_recv_dispatch(smb_session *s)
+{
+    smb_message     msg;
+    bool            dispatched;
+
+    bdsm_assert(s != NULL && s->transport.session != NULL);
+
+    if (s == NULL || s->transport.session == NULL)
+        return -1;
+
+    if (!smb_session_recv_next(s, &msg, 0, &dispatched))
+        return -1;
+
+    if (dispatched)
+        return 1;
+
+    BDSM_dbg("Dropping unexpected message (cmd 0x%02x, mid %hu)\n",
+             msg.packet->header.command, msg.packet->header.mux_id);
     return 0;
 }
+
+int             smb_session_recv_msg_data(smb_session *s, void *buf, size_t size)
+{
+    bdsm_assert(s != NULL && s->transport.session != NULL);
+
+    if (s == NULL || s->transport.session == NULL)
+        return 0;
+
+    // The whole reply is already in memory
+    if (s->thread_safe)
+        return size == 0;
+
+    return s->transport.recv_data(s->transport.session, buf, size);
+}
+
+int             smb_session_recv_nonblock(smb_session *s)
+{
+    smb_message     msg;
+    void            *data;
+    ssize_t         payload_size;
+
+    bdsm_assert(s != NULL && s->transport.session != NULL);
+
+    if (s == NULL || s->transport.session == NULL)
+        return -1;
+
+    payload_size = s->transport.recv_nonblock(s->transport.session, &data);
+    if (payload_size == NETBIOS_SESSION_AGAIN)
+        return 0;
+    if (payload_size < 0 || (size_t)payload_size < sizeof(smb_header))
+        return -1;
+
+    msg.packet       = (smb_packet *)data;
+    msg.payload_size = payload_size - sizeof(smb_header);
+    msg.cursor       = 0;
+
+    if (!smb_session_dispatch_msg(s, &msg, msg.payload_size))
+        BDSM_dbg("Dropping unexpected message (cmd 0x%02x, mid %hu)\n",
+                 msg.packet->header.command, msg.packet->header.mux_id);
+
+    return 1;
+}
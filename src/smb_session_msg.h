@@ -35,10 +35,49 @@
 
 // Send a smb message for the provided smb_session
 int             smb_session_send_msg(smb_session *s, smb_message *msg);
+// Send a smb message followed by 'size' bytes of 'data', which are not copied
+// into the message (this is how WRITE_ANDX payloads are sent)
+int             smb_session_send_msg_data(smb_session *s, smb_message *msg,
+                                          const void *data, size_t size);
+// Same as smb_session_send_msg_data(), but if 'req' isn't NULL it is queued
+// as waiting for the reply under the MID given to the message
+int             smb_session_send_req(smb_session *s, smb_message *msg,
+                                     const void *data, size_t size,
+                                     smb_request *req);
 
 // msg->packet will be updated to point on received data. You don't own this
 // memory. It'll be reused on next recv_msg
 size_t          smb_session_recv_msg(smb_session *s, smb_message *msg);
 
+// Same as smb_session_recv_msg(), but only the first 'size' bytes of the
+// message payload are received in memory (msg->payload_size is set
+// accordingly). Returns the full payload size, the remaining bytes can be
+// received with smb_session_recv_msg_data() or will be discarded on next
+// reception.
+size_t          smb_session_recv_msg_partial(smb_session *s, smb_message *msg,
+                                             size_t size);
+// Receive one message and dispatch it to the pending async request it
+// replies to. Returns 1 if a request was completed, 0 if the message was
+// dropped, -1 on network error.
+int             smb_session_recv_dispatch(smb_session *s);
+// Same without blocking: returns 1 if a message was received (and dispatched
+// or dropped), 0 if no complete message is available yet, -1 on error.
+int             smb_session_recv_nonblock(smb_session *s);
+// Receive the next 'size' bytes of a partially received message directly into
+// 'buf' (or discard them if 'buf' is NULL)
+int             smb_session_recv_msg_data(smb_session *s, void *buf, size_t size);
+
+// Thread-safe mode: wait until an async request completes, whichever thread
+// receives its reply. Returns DSM_SUCCESS or DSM_ERROR_NETWORK.
+int             smb_session_wait_routed(smb_session *s);
+// Free the per-thread reply mailboxes
+void            smb_session_mailbox_clear(smb_session *s);
+// Destructor of s->mailbox_key: free the mailbox of an exiting thread
+void            smb_session_mailbox_release(void *opaque);
+// NT status of the last failed request of the calling thread
+uint32_t        smb_session_mailbox_nt_status(smb_session *s);
+void            smb_session_mailbox_set_nt_status(smb_session *s,
+                                                  uint32_t status);
+
 
 #endif
@@ -39,6 +39,7 @@
 #include "smb_session_msg.h"
 #include "smb_utils.h"
 #include "smb_fd.h"
+#include "smb_stat_cache.h"
 #include "smb_share.h"
 #include "smb_file.h"
 
@@ -104,7 +105,7 @@ int smb_tree_connect(smb_session *s, const char *name, smb_tid *tid)
         }
         
         resp  = (smb_tree_connect_resp *)resp_msg.packet->payload;
-        share = calloc(1, sizeof(smb_share));
+        share = calloc(1, sizeof(smb_share) + strlen(path) + 1);
         if (!share)
             return DSM_ERROR_GENERIC;
 
@@ -112,6 +113,7 @@ int smb_tree_connect(smb_session *s, const char *name, smb_tid *tid)
         share->opts         = resp->opt_support;
         share->rights       = resp->max_rights;
         share->guest_rights = resp->guest_rights;
+        strcpy(share->path, path);
 
         smb_session_share_add(s, share);
 
@@ -133,6 +135,9 @@ int           smb_tree_disconnect(smb_session *s, smb_tid tid)
     
     if( s != NULL){
 
+        // The server may give this tid to another share
+        smb_stat_cache_invalidate_tid(s, tid);
+
         req_msg = smb_message_new(SMB_CMD_TREE_DISCONNECT);
         if (!req_msg)
             return DSM_ERROR_GENERIC;
@@ -29,6 +29,9 @@
  *****************************************************************************/
 
 #include <assert.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "../xcode/config.h"
 #include "smb_stat.h"
@@ -48,13 +51,109 @@ smb_stat        smb_stat_fd(smb_session *s, smb_fd fd)
 
 void            smb_stat_destroy(smb_stat stat)
 {
-    smb_stat_list_destroy((smb_stat_list) stat); 
+    smb_stat_list_destroy((smb_stat_list) stat);
+}
+
+/*
+ * Listings are stored in a single block: this header, the entries and then
+ * their names. The list is the first entry, the 'next' fields keep it
+ * walkable as a linked list and every entry points to the first one.
+ */
+typedef struct
+{
+    size_t          count;
+    smb_file        files[];
+}                   smb_stat_arena;
+
+static smb_stat_arena *smb_stat_list_arena(smb_stat_list list)
+{
+    return (smb_stat_arena *)((char *)list - offsetof(smb_stat_arena, files));
+}
+
+int             smb_stat_builder_add(smb_stat_builder *b, smb_stat entry)
+{
+    smb_file        *files;
+    char            *names;
+    size_t          size;
+
+    if (b->count == b->size)
+    {
+        size  = b->size ? b->size * 2 : 64;
+        files = realloc(b->files, size * sizeof(smb_file));
+        if (!files)
+            return DSM_ERROR_GENERIC;
+        b->files = files;
+        b->size  = size;
+    }
+    if (b->names_len + entry->name_len + 1 > b->names_size)
+    {
+        size = b->names_size ? b->names_size * 2 : 4096;
+        while (b->names_len + entry->name_len + 1 > size)
+            size *= 2;
+        names = realloc(b->names, size);
+        if (!names)
+            return DSM_ERROR_GENERIC;
+        b->names      = names;
+        b->names_size = size;
+    }
+
+    b->files[b->count]      = *entry;
+    b->files[b->count].name = NULL;    // Set by smb_stat_builder_finish()
+    memcpy(b->names + b->names_len, entry->name, entry->name_len);
+    b->names[b->names_len + entry->name_len] = 0;
+    b->names_len += entry->name_len + 1;
+    b->count++;
+
+    return DSM_SUCCESS;
+}
+
+smb_stat_list   smb_stat_builder_finish(smb_stat_builder *b)
+{
+    smb_stat_arena  *arena = NULL;
+    char            *names;
+
+    if (b->count == 0)
+        goto out;
+
+    arena = malloc(sizeof(smb_stat_arena) + b->count * sizeof(smb_file)
+                   + b->names_len);
+    if (!arena)
+        goto out;
+
+    arena->count = b->count;
+    memcpy(arena->files, b->files, b->count * sizeof(smb_file));
+    names = (char *)(arena->files + b->count);
+    memcpy(names, b->names, b->names_len);
+
+    for (size_t i = 0; i < b->count; i++)
+    {
+        arena->files[i].list_head = arena->files;
+        arena->files[i].name = names;
+        arena->files[i].next = i + 1 < b->count ? &arena->files[i + 1] : NULL;
+        names += arena->files[i].name_len + 1;
+    }
+
+out:
+    smb_stat_builder_clear(b);
+    return arena != NULL ? arena->files : NULL;
+}
+
+void            smb_stat_builder_clear(smb_stat_builder *b)
+{
+    free(b->files);
+    free(b->names);
+    memset(b, 0, sizeof(smb_stat_builder));
 }
 
 size_t            smb_stat_list_count(smb_stat_list list)
 {
     size_t          count = 0;
 
+    // A listing knows its size, whichever of its entries the list starts at
+    if (list != NULL && list->list_head != NULL)
+        return smb_stat_list_arena(list->list_head)->count
+               - (list - list->list_head);
+
     while (list != NULL)
     {
         list = list->next;
@@ -64,12 +163,20 @@ size_t            smb_stat_list_count(smb_stat_list list)
     return count;
 }
 
-// XXX: Duplicate some code of smb_session_share_clear
 void            smb_stat_list_destroy(smb_stat_list list)
 {
     smb_stat_list tmp;
 
-    while(list != NULL)
+    // The entries of a listing are freed all at once, with the first one
+    if (list != NULL && list->list_head != NULL)
+    {
+        if (list == list->list_head)
+            free(smb_stat_list_arena(list));
+        return;
+    }
+
+    // Allocated one by one, by smb_fstat() for instance
+    while (list != NULL)
     {
         tmp = list->next;
         free(list->name);
@@ -87,6 +194,9 @@ smb_stat        smb_stat_list_at(smb_stat_list list, size_t index)
 {
     size_t          pos = 0;
 
+    if (list != NULL && list->list_head != NULL)
+        return index < smb_stat_list_count(list) ? &list[index] : NULL;
+
     while (list != NULL && pos < index)
     {
         list = list->next;
@@ -37,5 +37,30 @@
 #define _SMB_STAT_H_
 
 #include "../include/bdsm/smb_stat.h"
+#include "smb_types.h"
+
+// Accumulates the entries of a listing, see smb_stat_builder_finish()
+typedef struct
+{
+    smb_file        *files;         // Copies of the entries, names excepted
+    size_t          count;
+    size_t          size;
+    char            *names;         // Names of the entries, one after another
+    size_t          names_len;
+    size_t          names_size;
+}                   smb_stat_builder;
+
+// Copy 'entry' at the end of the listing
+int             smb_stat_builder_add(smb_stat_builder *b, smb_stat entry);
+// Turn what was added into a list in a single allocation (an array of
+// entries followed by their names), to be freed with smb_stat_list_destroy().
+// Returns NULL if the listing is empty. The builder is emptied.
+smb_stat_list   smb_stat_builder_finish(smb_stat_builder *b);
+void            smb_stat_builder_clear(smb_stat_builder *b);
+
+// smb_find_open() telling why it failed: DSM_ERROR_NT if the server refused
+// the listing, DSM_ERROR_NETWORK if the session is unusable
+smb_find_iter   *smb_find_start(smb_session *s, smb_tid tid,
+                                const char *pattern, int *status);
 
 #endif
@@ -0,0 +1,435 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "../xcode/config.h"
+#include "bdsm_debug.h"
+#include "smb_session.h"
+#include "smb_stat_cache.h"
+
+// Don't go beyond this many hash buckets, whatever the size of the cache
+#define SMB_STAT_CACHE_BUCKETS_MAX  (1 << 16)
+
+typedef struct smb_stat_cache_entry smb_stat_cache_entry;
+struct smb_stat_cache_entry
+{
+    smb_stat_cache_entry    *hnext;     // Next entry of the hash bucket
+    TAILQ_ENTRY(smb_stat_cache_entry) lru;
+    uint32_t                hash;
+    smb_tid                 tid;
+    uint64_t                stamp;      // When it was stored, in ms
+    smb_file                st;         // Name and pointers unused
+    size_t                  key_len;
+    char                    key[];      // Normalized path, see key_append()
+};
+
+/**
+ * @internal
+ * @brief Status of paths recently queried or listed, by (tid, path). The
+ * least recently used entries go first once the cache is full.
+ */
+struct smb_stat_cache
+{
+    smb_stat_cache_entry    **buckets;
+    size_t                  nb_buckets; // A power of two
+    size_t                  count;
+    size_t                  max_entries;
+    uint64_t                ttl;        // In ms, 0 for no expiry
+    // Most recently used first
+    TAILQ_HEAD(smb_stat_cache_lru, smb_stat_cache_entry) lru;
+    uint64_t                hits;
+    uint64_t                misses;
+};
+
+static uint64_t smb_stat_cache_now()
+{
+    struct timeval  now;
+
+    gettimeofday(&now, NULL);
+    return (uint64_t)now.tv_sec * 1000 + now.tv_usec / 1000;
+}
+
+// Append 'len' bytes of 'path' to the key, folding the case and the
+// separators, so that the various spellings of a path share an entry. The
+// key has neither leading, trailing nor repeated separators.
+static size_t   smb_stat_cache_key_append(char *key, size_t key_len,
+                                          const char *path, size_t len)
+{
+    bool        sep = key_len > 0;
+    size_t      i;
+    char        c;
+
+    for (i = 0; i < len && path[i] != 0; i++)
+    {
+        c = path[i];
+        if (c == '\\' || c == '/')
+        {
+            sep = key_len > 0;
+            continue;
+        }
+        if (sep)
+            key[key_len++] = '\\';
+        sep = false;
+        key[key_len++] = c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c;
+    }
+
+    return key_len;
+}
+
+static uint32_t smb_stat_cache_hash(smb_tid tid, const char *key,
+                                    size_t key_len)
+{
+    uint32_t    hash = 2166136261u ^ tid; // FNV-1a
+    size_t      i;
+
+    for (i = 0; i < key_len; i++)
+    {
+        hash ^= (uint8_t)key[i];
+        hash *= 16777619u;
+    }
+
+    return hash;
+}
+
+static smb_stat_cache_entry **smb_stat_cache_find(smb_stat_cache *c,
+                                                  smb_tid tid, uint32_t hash,
+                                                  const char *key,
+                                                  size_t key_len)
+{
+    smb_stat_cache_entry    **ref;
+
+    ref = &c->buckets[hash & (c->nb_buckets - 1)];
+    for (; *ref != NULL; ref = &(*ref)->hnext)
+        if ((*ref)->hash == hash && (*ref)->tid == tid
+            && (*ref)->key_len == key_len
+            && memcmp((*ref)->key, key, key_len) == 0)
+            break;
+
+    return ref;
+}
+
+static void     smb_stat_cache_remove(smb_stat_cache *c,
+                                      smb_stat_cache_entry **ref)
+{
+    smb_stat_cache_entry    *entry = *ref;
+
+    *ref = entry->hnext;
+    TAILQ_REMOVE(&c->lru, entry, lru);
+    c->count--;
+    free(entry);
+}
+
+// Remove an entry found while walking the LRU list
+static void     smb_stat_cache_drop(smb_stat_cache *c,
+                                    smb_stat_cache_entry *entry)
+{
+    smb_stat_cache_entry    **ref;
+
+    ref = &c->buckets[entry->hash & (c->nb_buckets - 1)];
+    while (*ref != entry)
+        ref = &(*ref)->hnext;
+    smb_stat_cache_remove(c, ref);
+}
+
+static void     smb_stat_cache_clear(smb_stat_cache *c)
+{
+    smb_stat_cache_entry    *entry;
+
+    while ((entry = TAILQ_FIRST(&c->lru)) != NULL)
+    {
+        TAILQ_REMOVE(&c->lru, entry, lru);
+        free(entry);
+    }
+    memset(c->buckets, 0, c->nb_buckets * sizeof(*c->buckets));
+    c->count = 0;
+}
+
+static smb_stat_cache *smb_stat_cache_new(unsigned int ttl_ms,
+                                          size_t max_entries)
+{
+    smb_stat_cache  *c;
+
+    c = calloc(1, sizeof(smb_stat_cache));
+    if (!c)
+        return NULL;
+
+    c->nb_buckets = 1;
+    while (c->nb_buckets < max_entries
+           && c->nb_buckets < SMB_STAT_CACHE_BUCKETS_MAX)
+        c->nb_buckets <<= 1;
+    c->buckets = calloc(c->nb_buckets, sizeof(*c->buckets));
+    if (!c->buckets)
+    {
+        free(c);
+        return NULL;
+    }
+    c->max_entries = max_entries;
+    c->ttl         = ttl_ms;
+    TAILQ_INIT(&c->lru);
+
+    return c;
+}
+
+void            smb_stat_cache_destroy(smb_stat_cache *c)
+{
+    if (c == NULL)
+        return;
+
+    smb_stat_cache_clear(c);
+    free(c->buckets);
+    free(c);
+}
+
+smb_file        *smb_stat_cache_get(smb_session *s, smb_tid tid,
+                                    const char *path)
+{
+    smb_stat_cache          *c;
+    smb_stat_cache_entry    **ref, *entry;
+    smb_file                *file = NULL;
+    size_t                  key_len;
+    uint32_t                hash;
+    uint64_t                now;
+    char                    *key;
+
+    smb_session_lock(s);
+    if ((c = s->stat_cache) == NULL)
+        goto out;
+
+    key = malloc(strlen(path) + 1);
+    if (!key)
+        goto out;
+    key_len = smb_stat_cache_key_append(key, 0, path, strlen(path));
+    hash    = smb_stat_cache_hash(tid, key, key_len);
+    ref     = smb_stat_cache_find(c, tid, hash, key, key_len);
+    free(key);
+
+    if ((entry = *ref) != NULL && c->ttl != 0)
+    {
+        // The clock going backward expires everything as well
+        now = smb_stat_cache_now();
+        if (now < entry->stamp || now - entry->stamp >= c->ttl)
+        {
+            smb_stat_cache_remove(c, ref);
+            entry = NULL;
+        }
+    }
+
+    if (entry != NULL && (file = malloc(sizeof(smb_file))) != NULL)
+    {
+        *file = entry->st;
+        TAILQ_REMOVE(&c->lru, entry, lru);
+        TAILQ_INSERT_HEAD(&c->lru, entry, lru);
+        c->hits++;
+    }
+    else
+        c->misses++;
+
+out:
+    smb_session_unlock(s);
+    return file;
+}
+
+void            smb_stat_cache_put(smb_session *s, smb_tid tid,
+                                   const char *path, size_t path_len,
+                                   const char *name, smb_stat st)
+{
+    smb_stat_cache          *c;
+    smb_stat_cache_entry    **ref, *entry;
+    size_t                  size;
+
+    smb_session_lock(s);
+    if ((c = s->stat_cache) == NULL)
+        goto out;
+
+    size  = path_len + 1 + (name != NULL ? strlen(name) : 0);
+    entry = malloc(sizeof(smb_stat_cache_entry) + size);
+    if (!entry)
+        goto out;
+
+    entry->key_len = smb_stat_cache_key_append(entry->key, 0, path, path_len);
+    if (name != NULL)
+        entry->key_len = smb_stat_cache_key_append(entry->key, entry->key_len,
+                                                   name, strlen(name));
+    entry->hash  = smb_stat_cache_hash(tid, entry->key, entry->key_len);
+    entry->tid   = tid;
+    entry->stamp = smb_stat_cache_now();
+
+    entry->st          = *st;
+    entry->st.next     = NULL;
+    entry->st.list_head = NULL;
+    entry->st.name     = NULL;
+    entry->st.name_len = 0;
+    entry->st.ra       = NULL;
+    entry->st.wb       = NULL;
+
+    ref = smb_stat_cache_find(c, tid, entry->hash, entry->key,
+                              entry->key_len);
+    if (*ref != NULL)
+        smb_stat_cache_remove(c, ref);
+    else if (c->count >= c->max_entries)
+        smb_stat_cache_drop(c, TAILQ_LAST(&c->lru, smb_stat_cache_lru));
+
+    ref = &c->buckets[entry->hash & (c->nb_buckets - 1)];
+    entry->hnext = *ref;
+    *ref         = entry;
+    TAILQ_INSERT_HEAD(&c->lru, entry, lru);
+    c->count++;
+
+out:
+    smb_session_unlock(s);
+}
+
+void            smb_stat_cache_invalidate(smb_session *s, smb_tid tid,
+                                          const char *path, bool subtree)
+{
+    smb_stat_cache          *c;
+    smb_stat_cache_entry    **ref, *entry, *next;
+    size_t                  key_len, parent_len;
+    char                    *key;
+
+    smb_session_lock(s);
+    if ((c = s->stat_cache) == NULL)
+        goto out;
+
+    key = malloc(strlen(path) + 1);
+    if (!key)
+    {
+        // Better forget too much than keep something stale
+        smb_stat_cache_clear(c);
+        goto out;
+    }
+    key_len = smb_stat_cache_key_append(key, 0, path, strlen(path));
+
+    ref = smb_stat_cache_find(c, tid, smb_stat_cache_hash(tid, key, key_len),
+                              key, key_len);
+    if (*ref != NULL)
+        smb_stat_cache_remove(c, ref);
+
+    // The modification time of the directory changes as well
+    for (parent_len = key_len; parent_len > 0; parent_len--)
+        if (key[parent_len - 1] == '\\')
+            break;
+    if (parent_len > 0)
+        parent_len--;
+    if (key_len > 0)
+    {
+        ref = smb_stat_cache_find(c, tid,
+                                  smb_stat_cache_hash(tid, key, parent_len),
+                                  key, parent_len);
+        if (*ref != NULL)
+            smb_stat_cache_remove(c, ref);
+    }
+
+    if (subtree)
+        for (entry = TAILQ_FIRST(&c->lru); entry != NULL; entry = next)
+        {
+            next = TAILQ_NEXT(entry, lru);
+            if (entry->tid == tid
+                && (key_len == 0
+                    || (entry->key_len > key_len
+                        && entry->key[key_len] == '\\'
+                        && memcmp(entry->key, key, key_len) == 0)))
+                smb_stat_cache_drop(c, entry);
+        }
+
+    free(key);
+
+out:
+    smb_session_unlock(s);
+}
+
+void            smb_stat_cache_invalidate_tid(smb_session *s, smb_tid tid)
+{
+    smb_stat_cache          *c;
+    smb_stat_cache_entry    *entry, *next;
+
+    smb_session_lock(s);
+    if ((c = s->stat_cache) != NULL)
+        for (entry = TAILQ_FIRST(&c->lru); entry != NULL; entry = next)
+        {
+            next = TAILQ_NEXT(entry, lru);
+            if (entry->tid == tid)
+                smb_stat_cache_drop(c, entry);
+        }
+    smb_session_unlock(s);
+}
+
+int             smb_session_set_stat_cache(smb_session *s,
+                                           unsigned int ttl_ms,
+                                           size_t max_entries)
+{
+    smb_stat_cache  *c = NULL, *old;
+
+    bdsm_assert(s != NULL);
+
+    if (s == NULL)
+        return DSM_ERROR_GENERIC;
+
+    if (max_entries > 0)
+    {
+        c = smb_stat_cache_new(ttl_ms, max_entries);
+        if (!c)
+            return DSM_ERROR_GENERIC;
+    }
+
+    smb_session_lock(s);
+    old           = s->stat_cache;
+    s->stat_cache = c;
+    smb_session_unlock(s);
+
+    smb_stat_cache_destroy(old);
+
+    return DSM_SUCCESS;
+}
+
+int             smb_session_get_stat_cache_stats(smb_session *s,
+                                                 smb_stat_cache_stats *stats)
+{
+    bdsm_assert(s != NULL && stats != NULL);
+
+    if (s == NULL || stats == NULL)
+        return DSM_ERROR_GENERIC;
+
+    memset(stats, 0, sizeof(*stats));
+
+    smb_session_lock(s);
+    if (s->stat_cache != NULL)
+    {
+        stats->hits    = s->stat_cache->hits;
+        stats->misses  = s->stat_cache->misses;
+        stats->entries = s->stat_cache->count;
+    }
+    smb_session_unlock(s);
+
+    return DSM_SUCCESS;
+}
@@ -0,0 +1,56 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#ifndef _SMB_STAT_CACHE_H_
+#define _SMB_STAT_CACHE_H_
+
+#include "smb_types.h"
+
+// The metadata cache of a session, see smb_session_set_stat_cache(). All the
+// functions below do nothing if the cache isn't enabled.
+
+// Get a copy of the cached status of 'path', to be freed with
+// smb_stat_destroy(), or NULL if it isn't known
+smb_file        *smb_stat_cache_get(smb_session *s, smb_tid tid,
+                                    const char *path);
+// Store the status of 'path', or of the entry 'name' of the directory 'path'
+// if name isn't NULL. Only the first 'path_len' bytes of path are used.
+void            smb_stat_cache_put(smb_session *s, smb_tid tid,
+                                   const char *path, size_t path_len,
+                                   const char *name, smb_stat st);
+// Forget about 'path' and its parent directory, and about everything below
+// path if 'subtree' is set
+void            smb_stat_cache_invalidate(smb_session *s, smb_tid tid,
+                                          const char *path, bool subtree);
+// Forget about everything on a share
+void            smb_stat_cache_invalidate_tid(smb_session *s, smb_tid tid);
+void            smb_stat_cache_destroy(smb_stat_cache *c);
+
+#endif
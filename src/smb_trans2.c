@@ -36,11 +36,15 @@
 
 #include "../xcode/config.h"
 #include "bdsm_debug.h"
+#include "smb_async.h"
+#include "smb_fd.h"
+#include "smb_file.h"
 #include "smb_message.h"
 #include "smb_session.h"
 #include "smb_session_msg.h"
 #include "smb_utils.h"
 #include "smb_stat.h"
+#include "smb_stat_cache.h"
 
 /*
  * Receive trans2 management
@@ -87,95 +91,140 @@ static smb_message *smb_tr2_recv(smb_session *s)
  * Find management
  */
 
-static void smb_tr2_find2_parse_entries(smb_file **files_p, smb_tr2_find2_entry *iter, size_t count, uint8_t *eod)
+struct smb_find_iter
 {
-    smb_file *tmp = NULL;
-    size_t   i;
+    smb_session         *s;
+    smb_tid             tid;
+    char                *pattern;
+    size_t              dir_len;        // Directory part of the pattern
+    bool                cache;          // Entries go to the stat cache
+    smb_message         *msg;           // The batch being iterated
+    uint8_t             *entry;         // Next entry of the batch
+    uint8_t             *eod;
+    size_t              left;           // Entries left in the batch
+    uint16_t            sid;
+    uint16_t            resume_key;
+    bool                eos;            // The server has closed the search
+    int                 status;
+    smb_file            file;           // The last entry returned
+    // The next batch, requested while the current one is iterated. The
+    // completion sets next_msg, next_status and prefetching under the
+    // session lock, the rest belongs to the reader.
+    bool                ahead;          // Its FIND_NEXT2 was sent
+    bool                prefetching;    // Its reply isn't complete yet
+    smb_message         *next_msg;
+    int                 next_status;
+    bool                orphan;         // Closed, free once the reply is in
+};
+
+static void smb_find_iter_free(smb_find_iter *it)
+{
+    smb_message_destroy(it->msg);
+    smb_message_destroy(it->next_msg);
+    free(it->file.name);
+    free(it->pattern);
+    free(it);
+}
 
-    for (i = 0; i < count && (uint8_t *)iter < eod; i++)
+// Make a FIND_FIRST2 or FIND_NEXT2 reply the current batch of entries
+static int  smb_find_iter_load(smb_find_iter *it, smb_message *msg,
+                               bool first)
+{
+    smb_trans2_resp             *tr2;
+    smb_tr2_findfirst2_params   *ff_params;
+    smb_tr2_findnext2_params    *fn_params;
+    size_t                      params_size;
+    uint16_t                    error_offset;
+
+    smb_message_destroy(it->msg);
+    it->msg  = msg;
+    it->left = 0;
+
+    // Some servers don't flag the last batch as such
+    if (!first && msg->packet->header.status == NT_STATUS_NO_MORE_FILES)
     {
-        // Create a smb_file and fill it
-        tmp = calloc(1, sizeof(smb_file));
-        if (!tmp)
-            return;
-
-        tmp->name_len = smb_from_utf16((const char *)iter->name, iter->name_len,
-                                       &tmp->name);
-        if (tmp->name_len == 0)
-        {
-            free(tmp);
-            return;
-        }
-        tmp->name[tmp->name_len] = 0;
-
-        tmp->created    = iter->created;
-        tmp->accessed   = iter->accessed;
-        tmp->written    = iter->written;
-        tmp->changed    = iter->changed;
-        tmp->size       = iter->size;
-        tmp->alloc_size = iter->alloc_size;
-        tmp->attr       = iter->attr;
-        tmp->is_dir     = tmp->attr & SMB_ATTR_DIR;
-
-        tmp->next = *files_p;
-        *files_p  = tmp;
-
-        iter = (smb_tr2_find2_entry *)(((char *)iter) + iter->next_entry);
+        it->eos = true;
+        return DSM_SUCCESS;
+    }
+    if (!smb_session_check_nt_status(it->s, msg))
+        return DSM_ERROR_NT;
+
+    params_size = first ? sizeof(smb_tr2_findfirst2_params)
+                        : sizeof(smb_tr2_findnext2_params);
+    tr2 = (smb_trans2_resp *)msg->packet->payload;
+    if (msg->payload_size < sizeof(smb_trans2_resp) + params_size
+        || tr2->wct == 0)
+    {
+        BDSM_dbg("[smb_find]Malformed message.\n");
+        return DSM_ERROR_NETWORK;
     }
 
-    return;
-}
+    if (first)
+    {
+        ff_params      = (smb_tr2_findfirst2_params *)tr2->payload;
+        it->sid        = ff_params->id;
+        it->left       = ff_params->count;
+        it->eos        = ff_params->eos;
+        it->resume_key = ff_params->last_name_offset;
+        error_offset   = ff_params->ea_error_offset;
+    }
+    else
+    {
+        fn_params      = (smb_tr2_findnext2_params *)tr2->payload;
+        it->left       = fn_params->count;
+        it->eos        = fn_params->eos;
+        it->resume_key = fn_params->last_name_offset;
+        error_offset   = fn_params->ea_error_offset;
+    }
+    it->entry = tr2->payload + params_size;
+    it->eod   = msg->packet->payload + msg->payload_size;
 
-static void smb_find_first_parse(smb_message *msg, smb_file **files_p)
-{
-    smb_trans2_resp       *tr2;
-    smb_tr2_findfirst2_params  *params;
-    smb_tr2_find2_entry   *iter;
-    uint8_t               *eod;
-    size_t                count;
+    // Don't go further than this batch
+    if (error_offset != 0)
+        it->eos = true;
 
-    bdsm_assert(msg != NULL);
-    
-    if(msg != NULL){
-        
-        // Let's parse the answer we got from server
-        tr2     = (smb_trans2_resp *)msg->packet->payload;
-
-        if(tr2->wct>0){
-            params  = (smb_tr2_findfirst2_params *)tr2->payload;
-            iter    = (smb_tr2_find2_entry *)(tr2->payload + sizeof(smb_tr2_findfirst2_params));
-            eod     = msg->packet->payload + msg->payload_size;
-            count   = params->count;
-            smb_tr2_find2_parse_entries(files_p, iter, count, eod);
-        }
-        
-    }
+    return DSM_SUCCESS;
 }
 
-static void smb_find_next_parse(smb_message *msg, smb_file **files_p)
+// Fill the iterator file with the next entry of the batch. Returns false if
+// the entry is unusable
+static bool smb_find_iter_parse(smb_find_iter *it)
 {
-    smb_trans2_resp       *tr2;
-    smb_tr2_findnext2_params  *params;
-    smb_tr2_find2_entry   *iter;
-    uint8_t               *eod;
-    size_t                count;
+    smb_tr2_find2_entry *entry = (smb_tr2_find2_entry *)it->entry;
+    smb_file            *file = &it->file;
 
-    bdsm_assert(msg != NULL);
-    
-    if(msg != NULL){
-
-        // Let's parse the answer we got from server
-        tr2     = (smb_trans2_resp *)msg->packet->payload;
-
-        if(tr2->wct>0){
-            params  = (smb_tr2_findnext2_params *)tr2->payload;
-            iter    = (smb_tr2_find2_entry *)(tr2->payload + sizeof(smb_tr2_findnext2_params));
-            eod     = msg->packet->payload + msg->payload_size;
-            count   = params->count;
-            smb_tr2_find2_parse_entries(files_p, iter, count, eod);
-        }
-        
+    if (it->entry + sizeof(smb_tr2_find2_entry) > it->eod
+        || it->entry + sizeof(smb_tr2_find2_entry) + entry->name_len > it->eod)
+    {
+        BDSM_dbg("[smb_find]Malformed message.\n");
+        it->status = DSM_ERROR_NETWORK;
+        it->left   = 0;
+        return false;
     }
+
+    if (--it->left == 0 || entry->next_entry == 0)
+        it->left = 0;
+    else
+        it->entry += entry->next_entry;
+
+    free(file->name);
+    file->name     = NULL;
+    file->name_len = smb_from_utf16((const char *)entry->name, entry->name_len,
+                                    &file->name);
+    if (file->name_len == 0)
+        return false;
+    file->name[file->name_len] = 0;
+
+    file->created    = entry->created;
+    file->accessed   = entry->accessed;
+    file->written    = entry->written;
+    file->changed    = entry->changed;
+    file->size       = entry->size;
+    file->alloc_size = entry->alloc_size;
+    file->attr       = entry->attr;
+    file->is_dir     = file->attr & SMB_ATTR_DIR;
+
+    return true;
 }
 
 static smb_message  *smb_trans2_find_first (smb_session *s, smb_tid tid, const char *pattern)
@@ -216,7 +265,7 @@ static smb_message  *smb_trans2_find_first (smb_session *s, smb_tid tid, const c
         SMB_MSG_INIT_PKT(tr2);
         tr2.wct                = 15;
         tr2.max_param_count    = 10; // ?? Why not the same or 12 ?
-        tr2.max_data_count     = 0xffff;;
+        tr2.max_data_count     = s->find_buf_size;
         tr2.param_offset       = 68; // Offset of find_first_params in packet;
         tr2.data_count         = 0;
         tr2.data_offset        = 88; // Offset of pattern in packet
@@ -229,7 +278,7 @@ static smb_message  *smb_trans2_find_first (smb_session *s, smb_tid tid, const c
 
         SMB_MSG_INIT_PKT(find);
         find.attrs     = SMB_FIND2_ATTR_DEFAULT;
-        find.count     = 1366;     // ??
+        find.count     = s->find_count;
         find.flags     = SMB_FIND2_FLAG_CLOSE_EOS | SMB_FIND2_FLAG_RESUME;
         find.interest  = SMB_FIND2_INTEREST_BOTH_DIRECTORY_INFO;
         SMB_MSG_PUT_PKT(msg, find);
@@ -254,77 +303,93 @@ static smb_message  *smb_trans2_find_first (smb_session *s, smb_tid tid, const c
      return NULL;
 }
 
-static smb_message  *smb_trans2_find_next (smb_session *s, smb_tid tid, uint16_t resume_key, uint16_t sid, const char *pattern)
+static smb_message  *smb_trans2_find_next_build(smb_session *s, smb_tid tid,
+                                                uint16_t resume_key,
+                                                uint16_t sid,
+                                                const char *pattern)
 {
     smb_message           *msg_find_next2 = NULL;
     smb_trans2_req        tr2_find_next2;
     smb_tr2_findnext2     find_next2;
     size_t                utf_pattern_len, tr2_bct, tr2_param_count;
     char                  *utf_pattern;
-    int                   res;
     unsigned int          padding = 0;
 
-    bdsm_assert(s != NULL && pattern != NULL);
-    
-    if(s != NULL && pattern != NULL){
+    utf_pattern_len = smb_to_utf16(pattern, strlen(pattern) + 1, &utf_pattern);
+    if (utf_pattern_len == 0)
+        return NULL;
 
-        utf_pattern_len = smb_to_utf16(pattern, strlen(pattern) + 1, &utf_pattern);
-        if (utf_pattern_len == 0)
-            return NULL;
+    tr2_bct = sizeof(smb_tr2_findnext2) + utf_pattern_len;
+    tr2_param_count = tr2_bct;
+    tr2_bct += 3;
+    // Adds padding at the end if necessary.
+    while ((tr2_bct % 4) != 3)
+    {
+        padding++;
+        tr2_bct++;
+    }
 
-        tr2_bct = sizeof(smb_tr2_findnext2) + utf_pattern_len;
-        tr2_param_count = tr2_bct;
-        tr2_bct += 3;
-        // Adds padding at the end if necessary.
-        while ((tr2_bct % 4) != 3)
-        {
-            padding++;
-            tr2_bct++;
-        }
+    msg_find_next2 = smb_message_new(SMB_CMD_TRANS2);
+    if (!msg_find_next2)
+    {
+        free(utf_pattern);
+        return NULL;
+    }
+    msg_find_next2->packet->header.tid = tid;
+
+    SMB_MSG_INIT_PKT(tr2_find_next2);
+    tr2_find_next2.wct                = 0x0f;
+    tr2_find_next2.total_param_count  = tr2_param_count;
+    tr2_find_next2.total_data_count   = 0x0000;
+    tr2_find_next2.max_param_count    = 10; // ?? Why not the same or 12 ?
+    tr2_find_next2.max_data_count     = s->find_buf_size;
+    //max_setup_count
+    //reserved
+    //flags
+    //timeout
+    //reserve2
+    tr2_find_next2.param_count        = tr2_param_count;
+    tr2_find_next2.param_offset       = 68; // Offset of find_next_params in packet;
+    tr2_find_next2.data_count         = 0;
+    tr2_find_next2.data_offset        = 88; // Offset of pattern in packet
+    tr2_find_next2.setup_count        = 1;
+    //reserve3
+    tr2_find_next2.cmd                = SMB_TR2_FIND_NEXT;
+    tr2_find_next2.bct = tr2_bct; //3 == padding
+    SMB_MSG_PUT_PKT(msg_find_next2, tr2_find_next2);
+
+    SMB_MSG_INIT_PKT(find_next2);
+    find_next2.sid        = sid;
+    find_next2.count      = s->find_count;
+    find_next2.interest   = SMB_FIND2_INTEREST_BOTH_DIRECTORY_INFO;
+    find_next2.flags      = SMB_FIND2_FLAG_CLOSE_EOS|SMB_FIND2_FLAG_CONTINUE;
+    find_next2.resume_key = resume_key;
+    SMB_MSG_PUT_PKT(msg_find_next2, find_next2);
+    smb_message_append(msg_find_next2, utf_pattern, utf_pattern_len);
+    while (padding--)
+        smb_message_put8(msg_find_next2, 0);
+
+    free(utf_pattern);
+
+    return msg_find_next2;
+}
+
+static smb_message  *smb_trans2_find_next (smb_session *s, smb_tid tid, uint16_t resume_key, uint16_t sid, const char *pattern)
+{
+    smb_message           *msg_find_next2;
+    int                   res;
+
+    bdsm_assert(s != NULL && pattern != NULL);
+
+    if(s != NULL && pattern != NULL){
 
-        msg_find_next2 = smb_message_new(SMB_CMD_TRANS2);
+        msg_find_next2 = smb_trans2_find_next_build(s, tid, resume_key, sid,
+                                                    pattern);
         if (!msg_find_next2)
-        {
-            free(utf_pattern);
             return NULL;
-        }
-        msg_find_next2->packet->header.tid = tid;
-
-        SMB_MSG_INIT_PKT(tr2_find_next2);
-        tr2_find_next2.wct                = 0x0f;
-        tr2_find_next2.total_param_count  = tr2_param_count;
-        tr2_find_next2.total_data_count   = 0x0000;
-        tr2_find_next2.max_param_count    = 10; // ?? Why not the same or 12 ?
-        tr2_find_next2.max_data_count     = 0xffff;
-        //max_setup_count
-        //reserved
-        //flags
-        //timeout
-        //reserve2
-        tr2_find_next2.param_count        = tr2_param_count;
-        tr2_find_next2.param_offset       = 68; // Offset of find_next_params in packet;
-        tr2_find_next2.data_count         = 0;
-        tr2_find_next2.data_offset        = 88; // Offset of pattern in packet
-        tr2_find_next2.setup_count        = 1;
-        //reserve3
-        tr2_find_next2.cmd                = SMB_TR2_FIND_NEXT;
-        tr2_find_next2.bct = tr2_bct; //3 == padding
-        SMB_MSG_PUT_PKT(msg_find_next2, tr2_find_next2);
-
-        SMB_MSG_INIT_PKT(find_next2);
-        find_next2.sid        = sid;
-        find_next2.count      = 255;
-        find_next2.interest   = SMB_FIND2_INTEREST_BOTH_DIRECTORY_INFO;
-        find_next2.flags      = SMB_FIND2_FLAG_CLOSE_EOS|SMB_FIND2_FLAG_CONTINUE;
-        find_next2.resume_key = resume_key;
-        SMB_MSG_PUT_PKT(msg_find_next2, find_next2);
-        smb_message_append(msg_find_next2, utf_pattern, utf_pattern_len);
-        while (padding--)
-            smb_message_put8(msg_find_next2, 0);
 
         res = smb_session_send_msg(s, msg_find_next2);
         smb_message_destroy(msg_find_next2);
-        free(utf_pattern);
 
         if (!res)
         {
@@ -338,223 +403,535 @@ static smb_message  *smb_trans2_find_next (smb_session *s, smb_tid tid, uint16_t
     return NULL;
 }
 
-smb_file  *smb_find(smb_session *s, smb_tid tid, const char *pattern)
+// Gathers the reply to the FIND_NEXT2 sent by smb_find_iter_prefetch(),
+// which may come in several messages
+static void smb_find_iter_prefetched(smb_session *s, smb_request *req,
+                                     smb_message *msg, size_t payload_size)
+{
+    smb_find_iter       *it = req->ctx;
+    smb_trans2_resp     *tr2 = NULL;
+    smb_message         *next;
+    int                 status = DSM_SUCCESS, remaining = 0;
+    bool                orphan;
+
+    (void)payload_size;
+
+    if (msg != NULL && msg->payload_size >= sizeof(smb_trans2_resp))
+        tr2 = (smb_trans2_resp *)msg->packet->payload;
+    if (tr2 != NULL && tr2->wct != 0)
+        remaining = (int)tr2->total_data_count -
+                    (tr2->data_displacement + tr2->data_count);
+
+    if (msg == NULL)
+        status = req->result.status != DSM_SUCCESS ? req->result.status
+                                                   : DSM_ERROR_NETWORK;
+    else if (it->next_msg == NULL)
+    {
+        // Room for the following messages, as smb_tr2_recv() does
+        next = smb_message_grow(msg, remaining > 0 ? remaining : 0);
+        if (next != NULL)
+            next->cursor = msg->payload_size;
+        else
+            status = DSM_ERROR_GENERIC;
+        smb_session_lock(s);
+        it->next_msg = next;
+        smb_session_unlock(s);
+    }
+    else if (tr2 == NULL
+             || msg->payload_size < sizeof(smb_trans2_resp) + tr2->data_count
+             || smb_message_append(it->next_msg, tr2->payload,
+                                   tr2->data_count) != 1)
+        status = DSM_ERROR_NETWORK;
+
+    if (remaining > 0 && status == DSM_SUCCESS)
+    {
+        if (smb_request_follow(s, req))
+            return;
+        status = DSM_ERROR_GENERIC;
+    }
+
+    smb_session_lock(s);
+    if (status != DSM_SUCCESS)
+    {
+        smb_message_destroy(it->next_msg);
+        it->next_msg = NULL;
+    }
+    it->next_status = status;
+    it->prefetching = false;
+    orphan          = it->orphan;
+    smb_session_unlock(s);
+
+    if (orphan)
+        smb_find_iter_free(it);
+}
+
+// Ask for the next batch before the current one is consumed, so that the
+// round trip overlaps with its iteration
+static void smb_find_iter_prefetch(smb_find_iter *it)
+{
+    smb_message     *msg;
+    smb_request     *req;
+
+    // The server doesn't take a second request while one is processed
+    if (it->eos || it->s->srv.max_mpx == 1)
+        return;
+
+    msg = smb_trans2_find_next_build(it->s, it->tid, it->resume_key, it->sid,
+                                     it->pattern);
+    if (!msg)
+        return;
+
+    req = smb_request_new(NULL, NULL);
+    if (!req)
+    {
+        smb_message_destroy(msg);
+        return;
+    }
+    req->handler = smb_find_iter_prefetched;
+    req->ctx     = it;
+
+    it->next_msg    = NULL;
+    it->next_status = DSM_SUCCESS;
+    it->prefetching = true;
+    // On failure, the batch is requested when it's needed
+    it->ahead = smb_request_submit(it->s, req, msg, NULL, 0) == DSM_SUCCESS;
+    if (!it->ahead)
+        it->prefetching = false;
+
+    smb_message_destroy(msg);
+}
+
+// Wait for the batch requested ahead. Returns false if the session failed
+// before it completed.
+static bool smb_find_iter_collect(smb_find_iter *it)
+{
+    bool            prefetching;
+
+    for (;;)
+    {
+        smb_session_lock(it->s);
+        prefetching = it->prefetching;
+        smb_session_unlock(it->s);
+        if (!prefetching)
+            return true;
+
+        if (smb_session_wait(it->s) != DSM_SUCCESS)
+        {
+            smb_session_lock(it->s);
+            prefetching = it->prefetching;
+            smb_session_unlock(it->s);
+            return !prefetching;
+        }
+    }
+}
+
+smb_find_iter   *smb_find_start(smb_session *s, smb_tid tid,
+                                const char *pattern, int *status)
+{
+    smb_find_iter   *it;
+    smb_message     *msg;
+
+    *status = DSM_ERROR_GENERIC;
+
+    it = calloc(1, sizeof(smb_find_iter));
+    if (!it)
+        return NULL;
+    it->s       = s;
+    it->tid     = tid;
+    it->pattern = strdup(pattern);
+    if (!it->pattern)
+    {
+        free(it);
+        return NULL;
+    }
+
+    // Only the listing of a whole directory tells which files it holds
+    it->dir_len = strlen(pattern);
+    while (it->dir_len > 0 && pattern[it->dir_len - 1] != '\\'
+           && pattern[it->dir_len - 1] != '/')
+        it->dir_len--;
+    it->cache = strcmp(pattern + it->dir_len, "*") == 0;
+
+    msg = smb_trans2_find_first(s, tid, pattern);
+    *status = msg ? smb_find_iter_load(it, msg, true) : DSM_ERROR_NETWORK;
+    if (*status != DSM_SUCCESS)
+    {
+        BDSM_dbg("Error during FIND_FIRST request\n");
+        smb_find_iter_free(it);
+        return NULL;
+    }
+    smb_find_iter_prefetch(it);
+
+    return it;
+}
+
+smb_find_iter *smb_find_open(smb_session *s, smb_tid tid, const char *pattern)
 {
-    smb_file                  *files = NULL;
-    smb_message               *msg;
-    smb_trans2_resp           *tr2_resp;
-    smb_tr2_findfirst2_params *findfirst2_params;
-    smb_tr2_findnext2_params  *findnext2_params;
-    bool                      end_of_search;
-    uint16_t                  sid;
-    uint16_t                  resume_key;
-    uint16_t                  error_offset;
+    int             status;
 
     bdsm_assert(s != NULL && pattern != NULL);
-    
-    if(s != NULL && pattern != NULL){
 
-        // Send FIND_FIRST request
-        msg = smb_trans2_find_first(s,tid,pattern);
-        
-        if (msg)
+    if (s == NULL || pattern == NULL)
+        return NULL;
+
+    return smb_find_start(s, tid, pattern, &status);
+}
+
+smb_stat        smb_find_next_entry(smb_find_iter *it)
+{
+    smb_message     *msg;
+
+    bdsm_assert(it != NULL);
+
+    if (it == NULL)
+        return NULL;
+
+    for (;;)
+    {
+        while (it->left > 0)
+            if (smb_find_iter_parse(it))
+            {
+                if (it->cache && strcmp(it->file.name, ".") != 0
+                    && strcmp(it->file.name, "..") != 0)
+                    smb_stat_cache_put(it->s, it->tid, it->pattern,
+                                       it->dir_len, it->file.name, &it->file);
+                return &it->file;
+            }
+
+        if (it->status != DSM_SUCCESS || it->eos)
+            return NULL;
+
+        if (it->ahead)
         {
-            smb_find_first_parse(msg,&files);
-            if (files)
+            if (!smb_find_iter_collect(it))
             {
-                // Check if we shall send a FIND_NEXT request
-                tr2_resp          = (smb_trans2_resp *)msg->packet->payload;
-                findfirst2_params = (smb_tr2_findfirst2_params *)tr2_resp->payload;
-
-                sid               = findfirst2_params->id;
-                end_of_search     = findfirst2_params->eos;
-                resume_key        = findfirst2_params->last_name_offset;
-                error_offset      = findfirst2_params->ea_error_offset;
-
-                smb_message_destroy(msg);
-
-                // Send FIND_NEXT queries until the find is finished
-                // or until an error occurs
-                while ((!end_of_search) && (error_offset == 0))
-                {
-                    msg = smb_trans2_find_next(s, tid, resume_key, sid, pattern);
-
-                    if (msg)
-                    {
-                        // Update info for next FIND_NEXT query
-                        tr2_resp         = (smb_trans2_resp *)msg->packet->payload;
-                        findnext2_params = (smb_tr2_findnext2_params *)tr2_resp->payload;
-                        end_of_search    = findnext2_params->eos;
-                        resume_key       = findnext2_params->last_name_offset;
-                        error_offset     = findnext2_params->ea_error_offset;
-
-                        // parse the result for files
-                        smb_find_next_parse(msg, &files);
-                        smb_message_destroy(msg);
-
-                        if (!files)
-                        {
-                            BDSM_dbg("Error during FIND_NEXT answer parsing\n");
-                            end_of_search = true;
-                        }
-                    }
-                    else
-                    {
-                        BDSM_dbg("Error during FIND_NEXT request\n");
-                        smb_stat_list_destroy(files);
-                        return NULL;
-                    }
-                }
+                it->status = DSM_ERROR_NETWORK;
+                return NULL;
             }
-            else
+            it->ahead    = false;
+            msg          = it->next_msg;
+            it->next_msg = NULL;
+            if (!msg)
             {
-                BDSM_dbg("Error during FIND_FIRST answer parsing\n");
-                smb_message_destroy(msg);
+                BDSM_dbg("Error during FIND_NEXT request\n");
+                it->status = it->next_status;
+                return NULL;
             }
         }
         else
         {
-            BDSM_dbg("Error during FIND_FIRST request\n");
-            smb_stat_list_destroy(files);
+            msg = smb_trans2_find_next(it->s, it->tid, it->resume_key,
+                                       it->sid, it->pattern);
+            if (!msg)
+            {
+                BDSM_dbg("Error during FIND_NEXT request\n");
+                it->status = DSM_ERROR_NETWORK;
+                return NULL;
+            }
+        }
+
+        it->status = smb_find_iter_load(it, msg, false);
+        if (it->status == DSM_SUCCESS)
+            smb_find_iter_prefetch(it);
+    }
+}
+
+int             smb_find_close(smb_find_iter *it)
+{
+    smb_message         *msg;
+    smb_find_close2_req req;
+    int                 res;
+    bool                orphan;
+
+    bdsm_assert(it != NULL);
+
+    if (it == NULL)
+        return DSM_ERROR_GENERIC;
+
+    if (it->ahead)
+    {
+        if (!smb_find_iter_collect(it))
+        {
+            // The reply may still come, it will free the iterator
+            smb_session_lock(it->s);
+            it->orphan = orphan = it->prefetching;
+            smb_session_unlock(it->s);
+            if (orphan)
+                return DSM_ERROR_NETWORK;
+        }
+
+        // The batch we didn't get to may have ended the search
+        if (it->next_msg != NULL)
+        {
+            msg          = it->next_msg;
+            it->next_msg = NULL;
+            smb_find_iter_load(it, msg, false);
+        }
+        else if (it->next_status == DSM_ERROR_NETWORK)
+            it->status = DSM_ERROR_NETWORK;
+    }
+
+    // The server only closes the search by itself once it's over
+    if (!it->eos && it->status != DSM_ERROR_NETWORK)
+    {
+        msg = smb_message_new(SMB_CMD_FIND_CLOSE2);
+        if (msg)
+        {
+            msg->packet->header.tid = it->tid;
+
+            SMB_MSG_INIT_PKT(req);
+            req.wct = 1;
+            req.sid = it->sid;
+            req.bct = 0;
+            SMB_MSG_PUT_PKT(msg, req);
+
+            if (smb_session_send_msg(it->s, msg))
+                smb_session_recv_msg(it->s, NULL);
             smb_message_destroy(msg);
+        }
+    }
+
+    res = it->status;
+    smb_find_iter_free(it);
+
+    return res;
+}
+
+smb_file  *smb_find(smb_session *s, smb_tid tid, const char *pattern)
+{
+    smb_find_iter       *it;
+    smb_stat_builder    list;
+    smb_stat            st;
+
+    bdsm_assert(s != NULL && pattern != NULL);
+
+    if ((it = smb_find_open(s, tid, pattern)) == NULL)
+        return NULL;
+
+    memset(&list, 0, sizeof(list));
+    while ((st = smb_find_next_entry(it)) != NULL)
+        if (smb_stat_builder_add(&list, st) != DSM_SUCCESS)
+        {
+            smb_find_close(it);
+            smb_stat_builder_clear(&list);
             return NULL;
         }
 
-        return files;
+    if (smb_find_close(it) != DSM_SUCCESS)
+    {
+        smb_stat_builder_clear(&list);
+        return NULL;
     }
-    return NULL;
+
+    return smb_stat_builder_finish(&list);
 }
 
 /*
  * Query management
  */
     
-smb_file  *smb_fstat_interest(smb_session *s, smb_tid tid, uint16_t interest, const char *path)
+static smb_message *smb_fstat_interest_build(smb_tid tid, uint16_t interest,
+                                             const char *path)
 {
-    smb_message           *msg, reply;
+    smb_message           *msg;
     smb_trans2_query_path_info_req tr2;
-    smb_trans2_resp       *tr2_resp;
     smb_tr2_query         query;
-    smb_tr2_basic_path_info     *info_basic;
-    smb_tr2_standard_path_info  *info_standard;
-    smb_file              *file;
     size_t                utf_path_len, msg_len;
     char                  *utf_path;
-    int                   res, padding = 0;
+    int                   padding = 0;
 
-    bdsm_assert(s != NULL && path != NULL);
-    
-    bdsm_assert(interest == SMB_FIND2_QUERY_FILE_BASIC_INFO || interest == SMB_FIND2_QUERY_FILE_STANDARD_INFO);
+    utf_path_len = smb_to_utf16(path, strlen(path) + 1, &utf_path);
+    if (utf_path_len == 0)
+        return NULL;
 
-    bdsm_assert(smb_session_supports(s, SMB_SESSION_NTSMB));
-    if (smb_session_supports(s, SMB_SESSION_NTSMB) == false)
-    {
+    msg_len   = sizeof(smb_trans2_req) + sizeof(smb_tr2_query);
+    msg_len  += utf_path_len;
+    if (msg_len %4)
+        padding = 4 - msg_len % 4;
+
+    msg = smb_message_new(SMB_CMD_TRANS2);
+    if (!msg) {
+        free(utf_path);
         return NULL;
     }
+    msg->packet->header.tid = tid;
+
+    SMB_MSG_INIT_PKT(tr2);
+    tr2.wct                = 15;
+    tr2.total_param_count  = utf_path_len + sizeof(smb_tr2_query);
+    tr2.param_count        = tr2.total_param_count;
+    tr2.max_param_count    = 2; // ?? Why not the same or 12 ?
+    tr2.max_data_count     = 40;
+    // The name of the file comes at the end of FILE_ALL_INFO, the server may
+    // give it longer than asked (8.3 path, normalization)
+    if (interest == SMB_FIND2_QUERY_FILE_ALL_INFO)
+        tr2.max_data_count = SMB_FIND_BUF_MAX;
+    tr2.param_offset       = 66; // Offset of find_first_params in packet;
+    tr2.data_count         = 0;
+    tr2.data_offset        = 0; // Offset of pattern in packet
+    tr2.setup_count        = 1;
+    tr2.cmd                = SMB_TR2_QUERY_PATH;
+    tr2.bct                = sizeof(smb_tr2_query) + utf_path_len + padding + 1; // 1 - reserved
+    SMB_MSG_PUT_PKT(msg, tr2);
+    
+    SMB_MSG_INIT_PKT(query);
+    query.interest   = interest;
+    SMB_MSG_PUT_PKT(msg, query);
 
-    if(s != NULL && path != NULL){
+    smb_message_append(msg, utf_path, utf_path_len);
+    free(utf_path);
 
-        utf_path_len = smb_to_utf16(path, strlen(path) + 1, &utf_path);
-        if (utf_path_len == 0)
-            return 0;
+    // Adds padding at the end if necessary.
+    while (padding--)
+        smb_message_put8(msg, 0);
 
-        msg_len   = sizeof(smb_trans2_req) + sizeof(smb_tr2_query);
-        msg_len  += utf_path_len;
-        if (msg_len %4)
-            padding = 4 - msg_len % 4;
+    return msg;
+}
 
-        msg = smb_message_new(SMB_CMD_TRANS2);
-        if (!msg) {
-            free(utf_path);
-            return 0;
-        }
-        msg->packet->header.tid = tid;
+// Fill the fields of 'file' given by a QUERY_PATH_INFO reply
+static bool smb_fstat_interest_parse(smb_message *reply, uint16_t interest,
+                                     smb_file *file)
+{
+    smb_trans2_resp       *tr2_resp;
+    smb_tr2_basic_path_info     *info_basic;
+    smb_tr2_standard_path_info  *info_standard;
+    smb_tr2_path_info           *info_all;
 
-        SMB_MSG_INIT_PKT(tr2);
-        tr2.wct                = 15;
-        tr2.total_param_count  = utf_path_len + sizeof(smb_tr2_query);
-        tr2.param_count        = tr2.total_param_count;
-        tr2.max_param_count    = 2; // ?? Why not the same or 12 ?
-        tr2.max_data_count     = 40;
-        tr2.param_offset       = 66; // Offset of find_first_params in packet;
-        tr2.data_count         = 0;
-        tr2.data_offset        = 0; // Offset of pattern in packet
-        tr2.setup_count        = 1;
-        tr2.cmd                = SMB_TR2_QUERY_PATH;
-        tr2.bct                = sizeof(smb_tr2_query) + utf_path_len + padding + 1; // 1 - reserved
-        SMB_MSG_PUT_PKT(msg, tr2);
+    bool isBasicFileInfo = (interest == SMB_FIND2_QUERY_FILE_BASIC_INFO);
+    bool isStandardFileInfo = (interest == SMB_FIND2_QUERY_FILE_STANDARD_INFO);
+
+    if (interest == SMB_FIND2_QUERY_FILE_ALL_INFO)
+    {
+        // Everything up to the directory flag, the name isn't needed
+        if (reply->payload_size < sizeof(smb_trans2_resp) + 4
+                                  + offsetof(smb_tr2_path_info, ea_list_len))
+            return false;
+
+        tr2_resp = (smb_trans2_resp *)reply->packet->payload;
+        info_all = (smb_tr2_path_info *)(tr2_resp->payload + 4); //+4 is padding
+
+        file->created     = info_all->created;
+        file->accessed    = info_all->accessed;
+        file->written     = info_all->written;
+        file->changed     = info_all->changed;
+        file->attr        = info_all->attr;
+        file->is_dir      = info_all->attr & SMB_ATTR_DIR;
+        file->alloc_size  = info_all->alloc_size;
+        file->size        = info_all->size;
+
+        return true;
+    }
+
+    if (isBasicFileInfo && reply->payload_size < sizeof(smb_tr2_basic_path_info))
+        return false;
+    
+    if (isStandardFileInfo && reply->payload_size < sizeof(smb_tr2_standard_path_info))
+        return false;
+    
+    tr2_resp  = (smb_trans2_resp *)reply->packet->payload;
+    
+    if (isBasicFileInfo) {
+        info_basic = (smb_tr2_basic_path_info *)(tr2_resp->payload + 4); //+4 is padding
         
-        SMB_MSG_INIT_PKT(query);
-        query.interest   = interest;
-        SMB_MSG_PUT_PKT(msg, query);
+        file->created     = info_basic->created;
+        file->accessed    = info_basic->accessed;
+        file->written     = info_basic->written;
+        file->changed     = info_basic->changed;
+        file->attr        = info_basic->attr;
+        file->is_dir      = info_basic->attr & SMB_ATTR_DIR;
+    }
+    else if (isStandardFileInfo) {
+        info_standard = (smb_tr2_standard_path_info *)(tr2_resp->payload + 4); //+4 is padding
+        
+        file->alloc_size     = info_standard->alloc_size;
+        file->size           = info_standard->size;
+        //file->link_count     = info_standard->link_count;
+        //file->rm_pending     = info_standard->rm_pending;
+        file->is_dir         = info_standard->is_dir;
+    }
+    else{
+        BDSM_dbg("[smb_fstat]Unknown file info\n");
+    }
 
-        smb_message_append(msg, utf_path, utf_path_len);
-        free(utf_path);
+    return true;
+}
 
-        // Adds padding at the end if necessary.
-        while (padding--)
-            smb_message_put8(msg, 0);
+// Send a QUERY_PATH_INFO or QUERY_FILE_INFO request for 'interest' and fill
+// 'file' with the reply. Returns DSM_ERROR_GENERIC if the reply couldn't be
+// understood.
+static int  smb_fstat_interest_exchange(smb_session *s, smb_message *msg,
+                                        uint16_t interest, smb_file *file)
+{
+    smb_message           reply;
+    int                   res;
 
-        res = smb_session_send_msg(s, msg);
-        smb_message_destroy(msg);
-        if (!res)
-        {
-            BDSM_dbg("Unable to query pattern: %s\n", path);
-            return NULL;
-        }
+    res = smb_session_send_msg(s, msg);
+    smb_message_destroy(msg);
+    if (!res)
+    {
+        BDSM_dbg("Unable to send query\n");
+        return DSM_ERROR_NETWORK;
+    }
+
+    if (!smb_session_recv_msg(s, &reply))
+    {
+        BDSM_dbg("Unable to recv query reply\n");
+        return DSM_ERROR_NETWORK;
+    }
+    if (!smb_session_check_nt_status(s, &reply))
+        return DSM_ERROR_NT;
+
+    if (!smb_fstat_interest_parse(&reply, interest, file))
+    {
+        BDSM_dbg("[smb_fstat]Malformed message\n");
+        return DSM_ERROR_GENERIC;
+    }
+
+    return DSM_SUCCESS;
+}
+
+static int  smb_fstat_interest_query(smb_session *s, smb_tid tid,
+                                     uint16_t interest, const char *path,
+                                     smb_file *file)
+{
+    smb_message           *msg;
+
+    msg = smb_fstat_interest_build(tid, interest, path);
+    if (!msg)
+        return DSM_ERROR_GENERIC;
+
+    return smb_fstat_interest_exchange(s, msg, interest, file);
+}
+
+smb_file  *smb_fstat_interest(smb_session *s, smb_tid tid, uint16_t interest, const char *path)
+{
+    smb_file              *file;
+
+    bdsm_assert(s != NULL && path != NULL);
+    
+    bdsm_assert(interest == SMB_FIND2_QUERY_FILE_BASIC_INFO || interest == SMB_FIND2_QUERY_FILE_STANDARD_INFO
+                || interest == SMB_FIND2_QUERY_FILE_ALL_INFO);
+
+    bdsm_assert(smb_session_supports(s, SMB_SESSION_NTSMB));
+    if (smb_session_supports(s, SMB_SESSION_NTSMB) == false)
+    {
+        return NULL;
+    }
+
+    if(s != NULL && path != NULL){
 
-        if (!smb_session_recv_msg(s, &reply) ||
-            !smb_session_check_nt_status(s, &reply))
-        {
-            BDSM_dbg("Unable to recv msg or failure for %s\n", path);
-            return NULL;
-        }
-        
         file      = calloc(1, sizeof(smb_file));
         if (!file) {
             BDSM_dbg("Unable to create file for %s\n", path);
             return NULL;
         }
-        
-        bool isBasicFileInfo = (query.interest == SMB_FIND2_QUERY_FILE_BASIC_INFO);
-        bool isStandardFileInfo = (query.interest == SMB_FIND2_QUERY_FILE_STANDARD_INFO);
 
-        if (isBasicFileInfo && reply.payload_size < sizeof(smb_tr2_basic_path_info))
-        {
-            BDSM_dbg("[smb_fstat]Malformed message %s\n", path);
-            return NULL;
-        }
-        
-        if (isStandardFileInfo && reply.payload_size < sizeof(smb_tr2_standard_path_info))
+        if (smb_fstat_interest_query(s, tid, interest, path, file)
+            != DSM_SUCCESS)
         {
-            BDSM_dbg("[smb_fstat]Malformed message %s\n", path);
+            free(file);
             return NULL;
         }
-        
-        tr2_resp  = (smb_trans2_resp *)reply.packet->payload;
-        
-        if (isBasicFileInfo) {
-            info_basic = (smb_tr2_basic_path_info *)(tr2_resp->payload + 4); //+4 is padding
-            
-            file->created     = info_basic->created;
-            file->accessed    = info_basic->accessed;
-            file->written     = info_basic->written;
-            file->changed     = info_basic->changed;
-            file->attr        = info_basic->attr;
-            file->is_dir      = info_basic->attr & SMB_ATTR_DIR;
-        }
-        else if (isStandardFileInfo) {
-            info_standard = (smb_tr2_standard_path_info *)(tr2_resp->payload + 4); //+4 is padding
-            
-            file->alloc_size     = info_standard->alloc_size;
-            file->size           = info_standard->size;
-            //file->link_count     = info_standard->link_count;
-            //file->rm_pending     = info_standard->rm_pending;
-            file->is_dir         = info_standard->is_dir;
-        }
-        else{
-            BDSM_dbg("[smb_fstat]Unknown file info %s\n", path);
-        }
 
         return file;
     }
@@ -571,45 +948,80 @@ smb_file  *smb_fstat_standard(smb_session *s, smb_tid tid, const char *path)
     return smb_fstat_interest(s, tid, SMB_FIND2_QUERY_FILE_STANDARD_INFO, path);
 }
 
-//https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-cifs/847573c9-cbe6-4dcb-a0db-9b5af815759b
-smb_file  *smb_fstat_query_info(smb_session *s, smb_tid tid, const char *path)
+static smb_message *smb_fstat_query_info_build(smb_tid tid, const char *path)
 {
-    smb_message           *req_msg, resp_msg;
+    smb_message           *req_msg;
     smb_query_path_info_req  req;
-    smb_query_path_info_resp *resp;
     size_t                utf_pattern_len;
     char                  *utf_pattern;
+
+    utf_pattern_len = smb_to_utf16(path, strlen(path) + 1, &utf_pattern);
+    if (utf_pattern_len == 0)
+        return NULL;
+
+    req_msg = smb_message_new(SMB_CMD_QUERY_INFO);
+    if (!req_msg)
+    {
+        free(utf_pattern);
+        return NULL;
+    }
+
+    req_msg->packet->header.tid = (uint16_t)tid;
+
+    SMB_MSG_INIT_PKT(req);
+    req.wct              = 0x00; // Must be 0
+    req.bct              = (uint16_t)(utf_pattern_len + 1);
+    req.buffer_format    = 0x04; // Must be 4
+    SMB_MSG_PUT_PKT(req_msg, req);
+    smb_message_append(req_msg, utf_pattern, utf_pattern_len);
+
+    free(utf_pattern);
+
+    return req_msg;
+}
+
+static bool smb_fstat_query_info_parse(smb_session *s, smb_message *resp_msg,
+                                       smb_file *file)
+{
+    smb_query_path_info_resp *resp;
+
+    if (resp_msg->payload_size < sizeof(smb_query_path_info_resp))
+        return false;
+
+    resp = (smb_query_path_info_resp *)resp_msg->packet->payload;
+    if ((resp->wct) == 0) {
+        BDSM_dbg("[smb_query_path_info]Malformed message wct == 0\n");
+        return false;
+    }
+
+    uint64_t time_zone = smb_session_server_time_zone(s);
+    
+    file->written_dep = resp->written + time_zone;
+    file->attr        = resp->attr;
+    file->is_dir      = resp->attr & SMB_ATTR_DIR;
+    file->size        = resp->size;
+    file->alloc_size  = resp->size;
+
+    return true;
+}
+
+//https://docs.microsoft.com/en-us/openspecs/windows_protocols/ms-cifs/847573c9-cbe6-4dcb-a0db-9b5af815759b
+smb_file  *smb_fstat_query_info(smb_session *s, smb_tid tid, const char *path)
+{
+    smb_message           *req_msg, resp_msg;
     smb_file              *file;
 
     bdsm_assert(s != NULL && path != NULL);
 
     if(s != NULL && path != NULL){
         
-        utf_pattern_len = smb_to_utf16(path, strlen(path) + 1, &utf_pattern);
-        if (utf_pattern_len == 0)
-            return NULL;
-
-        req_msg = smb_message_new(SMB_CMD_QUERY_INFO);
+        req_msg = smb_fstat_query_info_build(tid, path);
         if (!req_msg)
-        {
-            free(utf_pattern);
             return NULL;
-        }
-
-        req_msg->packet->header.tid = (uint16_t)tid;
-
-        SMB_MSG_INIT_PKT(req);
-        req.wct              = 0x00; // Must be 0
-        req.bct              = (uint16_t)(utf_pattern_len + 1);
-        req.buffer_format    = 0x04; // Must be 4
-        SMB_MSG_PUT_PKT(req_msg, req);
-        smb_message_append(req_msg, utf_pattern, utf_pattern_len);
 
         smb_session_send_msg(s, req_msg);
         smb_message_destroy(req_msg);
 
-        free(utf_pattern);
-
         if (!smb_session_recv_msg(s, &resp_msg)){
             BDSM_dbg("Unable to recv msg or failure for %s\n", path);
             return NULL;
@@ -619,32 +1031,19 @@ smb_file  *smb_fstat_query_info(smb_session *s, smb_tid tid, const char *path)
             BDSM_dbg("Unable to recv msg or failure for %s\n", path);
             return NULL;
         }
-        
-        if (resp_msg.payload_size < sizeof(smb_query_path_info_resp))
-        {
-            BDSM_dbg("[smb_query_path_info]Malformed message %s\n", path);
-            return NULL;
-        }
-
-        resp = (smb_query_path_info_resp *)resp_msg.packet->payload;
-        if ((resp->wct) == 0) {
-            BDSM_dbg("[smb_query_path_info]Malformed message wct == 0 %s\n", path);
-            return NULL;
-        }
 
         file = calloc(1, sizeof(smb_file));
         if (!file) {
             BDSM_dbg("Unable to create file for %s\n", path);
             return NULL;
         }
-        
-        uint64_t time_zone = smb_session_server_time_zone(s);
-        
-        file->written_dep = resp->written + time_zone;
-        file->attr        = resp->attr;
-        file->is_dir      = resp->attr & SMB_ATTR_DIR;
-        file->size        = resp->size;
-        file->alloc_size  = resp->size;
+
+        if (!smb_fstat_query_info_parse(s, &resp_msg, file))
+        {
+            BDSM_dbg("[smb_query_path_info]Malformed message %s\n", path);
+            free(file);
+            return NULL;
+        }
         
         return file;
     }
@@ -652,8 +1051,34 @@ smb_file  *smb_fstat_query_info(smb_session *s, smb_tid tid, const char *path)
 }
 
 
-smb_file  *smb_fstat(smb_session *s, smb_tid tid, const char *path)
+// Did the server refuse FILE_ALL_INFO itself, rather than the query ?
+static bool smb_fstat_all_info_rejected(smb_session *s, int res)
+{
+    uint32_t    status;
+
+    if (res == DSM_ERROR_GENERIC)
+        return true;
+    if (res != DSM_ERROR_NT)
+        return false;
+
+    status = smb_session_get_nt_status(s);
+    return status == NT_STATUS_INVALID_LEVEL
+        || status == NT_STATUS_NOT_SUPPORTED
+        || status == NT_STATUS_NOT_IMPLEMENTED
+        || status == NT_STATUS_INVALID_PARAMETER;
+}
+
+// Was the name of the file too long for the FILE_ALL_INFO reply ? The
+// level works, the other queries are used for this file only
+static bool smb_fstat_all_info_overflow(smb_session *s, int res)
+{
+    return res == DSM_ERROR_NT
+        && smb_session_get_nt_status(s) == NT_STATUS_BUFFER_OVERFLOW;
+}
+
+static smb_file *smb_fstat_query(smb_session *s, smb_tid tid, const char *path)
 {
+    int res;
    
     if (smb_session_supports(s, SMB_SESSION_NTSMB) == false)
     {
@@ -666,6 +1091,31 @@ smb_file  *smb_fstat(smb_session *s, smb_tid tid, const char *path)
         BDSM_dbg("Unable to create file for %s\n", path);
         return NULL;
     }
+
+    // Everything in a single round trip, if the server knows about it
+    if (s->all_info >= 0)
+    {
+        res = smb_fstat_interest_query(s, tid, SMB_FIND2_QUERY_FILE_ALL_INFO,
+                                       path, file);
+        if (res == DSM_SUCCESS)
+        {
+            s->all_info = 1;
+            return file;
+        }
+        if (smb_fstat_all_info_overflow(s, res))
+            BDSM_dbg("FILE_ALL_INFO too large for %s\n", path);
+        else if (s->all_info > 0 || !smb_fstat_all_info_rejected(s, res))
+        {
+            smb_stat_destroy(file);
+            return NULL;
+        }
+        else
+        {
+            BDSM_dbg("FILE_ALL_INFO unsupported, using BASIC and STANDARD\n");
+            s->all_info = -1;
+        }
+        memset(file, 0, sizeof(smb_file));
+    }
     
     smb_stat statBasic = smb_fstat_basic(s, tid, path);
     
@@ -708,4 +1158,469 @@ smb_file  *smb_fstat(smb_session *s, smb_tid tid, const char *path)
     return file;
 }
 
+smb_file  *smb_fstat(smb_session *s, smb_tid tid, const char *path)
+{
+    smb_file    *file;
 
+    bdsm_assert(s != NULL && path != NULL);
+
+    if (s == NULL || path == NULL)
+        return NULL;
+
+    if ((file = smb_stat_cache_get(s, tid, path)) != NULL)
+        return file;
+
+    file = smb_fstat_query(s, tid, path);
+    if (file != NULL)
+        smb_stat_cache_put(s, tid, path, strlen(path), NULL, file);
+
+    return file;
+}
+
+static smb_message *smb_fstat_fid_build(smb_file *file, uint16_t interest)
+{
+    smb_message           *msg;
+    smb_trans2_query_path_info_req tr2;
+    smb_tr2_query_file    query;
+
+    msg = smb_message_new(SMB_CMD_TRANS2);
+    if (!msg)
+        return NULL;
+    msg->packet->header.tid = file->tid;
+
+    SMB_MSG_INIT_PKT(tr2);
+    tr2.wct                = 15;
+    tr2.total_param_count  = sizeof(smb_tr2_query_file);
+    tr2.param_count        = tr2.total_param_count;
+    tr2.max_param_count    = 2;
+    tr2.max_data_count     = 40;
+    // The file might have been renamed, don't guess the length of its name
+    if (interest == SMB_FIND2_QUERY_FILE_ALL_INFO)
+        tr2.max_data_count = SMB_FIND_BUF_MAX;
+    tr2.param_offset       = 66;
+    tr2.data_count         = 0;
+    tr2.data_offset        = 0;
+    tr2.setup_count        = 1;
+    tr2.cmd                = SMB_TR2_QUERY_FILE;
+    tr2.bct                = sizeof(smb_tr2_query_file) + 1; // 1 - reserved
+    SMB_MSG_PUT_PKT(msg, tr2);
+
+    SMB_MSG_INIT_PKT(query);
+    query.fid      = file->fid;
+    query.interest = interest;
+    SMB_MSG_PUT_PKT(msg, query);
+
+    return msg;
+}
+
+// QUERY_FILE_INFO counterpart of smb_fstat_interest_query()
+static int  smb_fstat_fid_query(smb_session *s, smb_file *file,
+                                uint16_t interest, smb_file *info)
+{
+    smb_message           *msg;
+
+    msg = smb_fstat_fid_build(file, interest);
+    if (!msg)
+        return DSM_ERROR_GENERIC;
+
+    return smb_fstat_interest_exchange(s, msg, interest, info);
+}
+
+int         smb_stat_fd_refresh(smb_session *s, smb_fd fd)
+{
+    smb_file    *file, info, *old;
+    bool        all_info = false;
+    int         res;
+
+    bdsm_assert(s != NULL && fd);
+    if (s == NULL || !fd)
+        return DSM_ERROR_GENERIC;
+
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+        return DSM_ERROR_GENERIC;
+
+    // What write-behind holds isn't part of the file yet
+    if ((res = smb_fflush(s, fd)) != DSM_SUCCESS)
+        return res;
+
+    memset(&info, 0, sizeof(info));
+    if (!smb_session_supports(s, SMB_SESSION_NTSMB))
+    {
+        // No handle based query, go by the path it was opened with
+        if ((old = smb_fstat_query_info(s, file->tid, file->name)) == NULL)
+            return DSM_ERROR_NT;
+        info = *old;
+        smb_stat_destroy(old);
+    }
+    else
+    {
+        if (s->all_info >= 0)
+        {
+            res = smb_fstat_fid_query(s, file, SMB_FIND2_QUERY_FILE_ALL_INFO,
+                                      &info);
+            if (res == DSM_SUCCESS)
+            {
+                s->all_info = 1;
+                all_info    = true;
+            }
+            else if (smb_fstat_all_info_overflow(s, res))
+                memset(&info, 0, sizeof(info));
+            else if (s->all_info > 0 || !smb_fstat_all_info_rejected(s, res))
+                return res;
+            else
+                s->all_info = -1;
+        }
+        if (!all_info)
+        {
+            res = smb_fstat_fid_query(s, file,
+                                      SMB_FIND2_QUERY_FILE_BASIC_INFO, &info);
+            if (res == DSM_SUCCESS)
+                res = smb_fstat_fid_query(s, file,
+                                          SMB_FIND2_QUERY_FILE_STANDARD_INFO,
+                                          &info);
+            if (res != DSM_SUCCESS)
+                return res;
+            info.is_dir = info.attr & SMB_ATTR_DIR;
+        }
+    }
+
+    file->created     = info.created;
+    file->accessed    = info.accessed;
+    file->written     = info.written;
+    file->changed     = info.changed;
+    file->written_dep = info.written_dep;
+    file->alloc_size  = info.alloc_size;
+    file->size        = info.size;
+    file->attr        = info.attr;
+    file->is_dir      = info.is_dir;
+
+    return DSM_SUCCESS;
+}
+
+int         smb_stat_fd_size(smb_session *s, smb_fd fd, uint64_t *size)
+{
+    smb_file    *file, info;
+    int         res;
+
+    bdsm_assert(s != NULL && fd && size != NULL);
+    if (s == NULL || !fd || size == NULL)
+        return DSM_ERROR_GENERIC;
+
+    if ((file = smb_session_file_get(s, fd)) == NULL)
+        return DSM_ERROR_GENERIC;
+
+    if (!smb_session_supports(s, SMB_SESSION_NTSMB))
+        res = smb_stat_fd_refresh(s, fd);
+    else if ((res = smb_fflush(s, fd)) == DSM_SUCCESS)
+    {
+        memset(&info, 0, sizeof(info));
+        res = smb_fstat_fid_query(s, file, SMB_FIND2_QUERY_FILE_STANDARD_INFO,
+                                  &info);
+        if (res == DSM_SUCCESS)
+        {
+            file->alloc_size = info.alloc_size;
+            file->size       = info.size;
+        }
+    }
+    if (res != DSM_SUCCESS)
+        return res;
+
+    *size = file->size;
+    return DSM_SUCCESS;
+}
+
+// Shared by the QUERY_PATH_INFO requests of a smb_fstat_async() call
+typedef struct
+{
+    smb_file            *file;
+    unsigned int        left;       // Replies still expected, plus one for
+                                    // the caller while it sends the queries.
+                                    // Under the session lock
+    smb_async_result    result;
+    smb_async_cb        cb;
+    void                *opaque;
+}   smb_fstat_async_ctx;
+
+// Drop a reference to ctx, completing the call with the last one
+static void smb_fstat_async_release(smb_session *s, smb_fstat_async_ctx *ctx)
+{
+    unsigned int        left;
+
+    smb_session_lock(s);
+    left = --ctx->left;
+    smb_session_unlock(s);
+    if (left > 0)
+        return;
+
+    if (ctx->result.status == DSM_SUCCESS)
+        ctx->result.st = ctx->file;
+    else
+        smb_stat_destroy(ctx->file);
+
+    if (ctx->cb != NULL)
+        ctx->cb(s, &ctx->result, ctx->opaque);
+    else if (ctx->result.st != NULL)
+        smb_stat_destroy(ctx->result.st);
+    free(ctx);
+}
+
+static void smb_fstat_async_handler(smb_session *s, smb_request *req,
+                                    smb_message *msg, size_t payload_size)
+{
+    smb_fstat_async_ctx *ctx = req->ctx;
+    uint16_t            interest = req->buf_size;
+    bool                ok;
+
+    (void)payload_size;
+
+    if (msg == NULL)
+        ok = false;
+    else if (!smb_request_check_nt_status(s, req, msg))
+        ok = false;
+    else if (interest == 0)
+        ok = smb_fstat_query_info_parse(s, msg, ctx->file);
+    else
+        ok = smb_fstat_interest_parse(msg, interest, ctx->file);
+
+    if (!ok && req->result.status == DSM_SUCCESS)
+        req->result.status = DSM_ERROR_NETWORK;
+
+    // Like smb_fstat(), a missing standard info isn't fatal
+    smb_session_lock(s);
+    if (!ok && interest != SMB_FIND2_QUERY_FILE_STANDARD_INFO
+        && ctx->result.status == DSM_SUCCESS)
+    {
+        ctx->result.status    = req->result.status;
+        ctx->result.nt_status = req->result.nt_status;
+    }
+    smb_session_unlock(s);
+
+    smb_fstat_async_release(s, ctx);
+}
+
+int         smb_fstat_async(smb_session *s, smb_tid tid, const char *path,
+                            smb_async_cb cb, void *opaque)
+{
+    static const uint16_t   interests[] = { SMB_FIND2_QUERY_FILE_BASIC_INFO,
+                                            SMB_FIND2_QUERY_FILE_STANDARD_INFO };
+    smb_fstat_async_ctx     *ctx;
+    uint16_t                interest = 0;
+    smb_request             *req;
+    smb_message             *msg;
+    unsigned int            nb_queries, i;
+    int                     res = DSM_SUCCESS;
+
+    bdsm_assert(s != NULL && path != NULL);
+    if (s == NULL || path == NULL)
+        return DSM_ERROR_GENERIC;
+
+    ctx = calloc(1, sizeof(smb_fstat_async_ctx));
+    if (!ctx)
+        return DSM_ERROR_GENERIC;
+    ctx->file = calloc(1, sizeof(smb_file));
+    if (!ctx->file) {
+        free(ctx);
+        return DSM_ERROR_GENERIC;
+    }
+    ctx->cb     = cb;
+    ctx->opaque = opaque;
+    // The replies may be handled by another thread as soon as the queries
+    // are sent, ctx stays alive until they all are
+    ctx->left   = 1;
+
+    // Old servers only know about the deprecated QUERY_INFORMATION. Unlike
+    // smb_fstat(), FILE_ALL_INFO isn't tried unless it's known to work, as
+    // falling back from a completion would be quite a mess.
+    if (!smb_session_supports(s, SMB_SESSION_NTSMB))
+    {
+        nb_queries = 1;
+        interest   = 0;
+    }
+    else if (s->all_info > 0)
+    {
+        nb_queries = 1;
+        interest   = SMB_FIND2_QUERY_FILE_ALL_INFO;
+    }
+    else
+        nb_queries = 2;
+
+    for (i = 0; i < nb_queries; i++)
+    {
+        if (nb_queries == 2)
+            interest = interests[i];
+        if (interest == 0)
+            msg = smb_fstat_query_info_build(tid, path);
+        else
+            msg = smb_fstat_interest_build(tid, interest, path);
+        req = msg ? smb_request_new(NULL, NULL) : NULL;
+        if (!req)
+        {
+            smb_message_destroy(msg);
+            res = DSM_ERROR_GENERIC;
+            break;
+        }
+        req->handler  = smb_fstat_async_handler;
+        req->ctx      = ctx;
+        req->buf_size = interest;
+
+        smb_session_lock(s);
+        ctx->left++;
+        smb_session_unlock(s);
+        res = smb_request_submit(s, req, msg, NULL, 0);
+        smb_message_destroy(msg);
+        if (res != DSM_SUCCESS)
+        {
+            smb_session_lock(s);
+            ctx->left--;
+            smb_session_unlock(s);
+            break;
+        }
+    }
+
+    if (i == 0)
+    {
+        // Nothing was sent, the callback won't be called
+        smb_stat_destroy(ctx->file);
+        free(ctx);
+        return res;
+    }
+
+    // The callback will be called once the queries already sent are done
+    smb_session_lock(s);
+    if (i < nb_queries && ctx->result.status == DSM_SUCCESS)
+        ctx->result.status = res;
+    smb_session_unlock(s);
+    smb_fstat_async_release(s, ctx);
+
+    return DSM_SUCCESS;
+}
+
+// State of a smb_fstat_many() call
+typedef struct
+{
+    smb_tid             tid;
+    const char * const  *paths;
+    smb_stat            *st;
+    unsigned int        in_flight;
+    size_t              found;
+}   smb_fstat_many_ctx;
+
+typedef struct
+{
+    smb_fstat_many_ctx  *ctx;
+    size_t              i;
+}   smb_fstat_many_slot;
+
+static void smb_fstat_many_done(smb_session *s, const smb_async_result *res,
+                                void *opaque)
+{
+    smb_fstat_many_slot *slot = opaque;
+    smb_fstat_many_ctx  *ctx = slot->ctx;
+
+    if (res->status == DSM_SUCCESS)
+    {
+        ctx->st[slot->i] = res->st;
+        smb_stat_cache_put(s, ctx->tid, ctx->paths[slot->i],
+                           strlen(ctx->paths[slot->i]), NULL, res->st);
+    }
+
+    smb_session_lock(s);
+    if (res->status == DSM_SUCCESS)
+        ctx->found++;
+    ctx->in_flight--;
+    smb_session_unlock(s);
+}
+
+// Wait until at most 'max' queries are in flight
+static int  smb_fstat_many_wait(smb_session *s, smb_fstat_many_ctx *ctx,
+                                unsigned int max)
+{
+    unsigned int    in_flight;
+
+    for (;;)
+    {
+        smb_session_lock(s);
+        in_flight = ctx->in_flight;
+        smb_session_unlock(s);
+        if (in_flight <= max)
+            return DSM_SUCCESS;
+
+        if (smb_session_wait(s) != DSM_SUCCESS)
+            return DSM_ERROR_NETWORK;
+    }
+}
+
+ssize_t     smb_fstat_many(smb_session *s, smb_tid tid,
+                           const char * const *paths, size_t count,
+                           smb_stat *st)
+{
+    smb_fstat_many_ctx  ctx;
+    smb_fstat_many_slot *slots;
+    unsigned int        window;
+    size_t              i;
+    int                 res = DSM_SUCCESS;
+
+    bdsm_assert(s != NULL && (count == 0 || (paths != NULL && st != NULL)));
+    if (s == NULL || (count > 0 && (paths == NULL || st == NULL)))
+        return -1;
+
+    memset(st, 0, count * sizeof(smb_stat));
+    slots = calloc(count, sizeof(smb_fstat_many_slot));
+    if (count > 0 && !slots)
+        return -1;
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.tid   = tid;
+    ctx.paths = paths;
+    ctx.st    = st;
+
+    for (i = 0; i < count && res == DSM_SUCCESS; i++)
+    {
+        if ((st[i] = smb_stat_cache_get(s, tid, paths[i])) != NULL)
+        {
+            ctx.found++;
+            continue;
+        }
+
+        // Find out whether FILE_ALL_INFO works before relying on it
+        if (s->all_info == 0 && smb_session_supports(s, SMB_SESSION_NTSMB))
+        {
+            if ((st[i] = smb_fstat_query(s, tid, paths[i])) != NULL)
+            {
+                smb_stat_cache_put(s, tid, paths[i], strlen(paths[i]), NULL,
+                                   st[i]);
+                ctx.found++;
+            }
+            continue;
+        }
+
+        // Keep as many queries in flight as the server allows
+        window = s->srv.max_mpx != 0 ? s->srv.max_mpx : 1;
+        if (smb_session_supports(s, SMB_SESSION_NTSMB) && s->all_info < 0)
+            window = window > 1 ? window / 2 : 1;
+        if ((res = smb_fstat_many_wait(s, &ctx, window - 1)) != DSM_SUCCESS)
+            break;
+
+        slots[i].ctx = &ctx;
+        slots[i].i   = i;
+        smb_session_lock(s);
+        ctx.in_flight++;
+        smb_session_unlock(s);
+
+        res = smb_fstat_async(s, tid, paths[i], smb_fstat_many_done,
+                              &slots[i]);
+        if (res != DSM_SUCCESS)
+        {
+            smb_session_lock(s);
+            ctx.in_flight--;
+            smb_session_unlock(s);
+        }
+    }
+
+    // The completions write to ctx and slots, wait for all of them
+    if (smb_fstat_many_wait(s, &ctx, 0) != DSM_SUCCESS)
+        res = DSM_ERROR_NETWORK;
+    free(slots);
+
+    return res == DSM_SUCCESS ? (ssize_t)ctx.found : -1;
+}
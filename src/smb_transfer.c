@@ -0,0 +1,535 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/time.h>
+
+#include "../xcode/config.h"
+#include "bdsm_debug.h"
+#include "smb_async.h"
+#include "smb_session.h"
+#include "smb_file.h"
+#include "smb_pool.h"
+#include "smb_stat.h"
+#include "../include/bdsm/smb_transfer.h"
+
+// Default number of requests in flight per connection
+#define SMB_TRANSFER_WINDOW     (8)
+// Access mask of the upload workers. Unlike SMB_MOD_RW it opens the file
+// created beforehand instead of superseding it
+#define SMB_TRANSFER_MOD_WRITE  (SMB_MOD_WRITE | SMB_MOD_WRITE_EXT \
+                                | SMB_MOD_WRITE_ATTR | SMB_MOD_READ_CTL)
+
+typedef struct
+{
+    smb_session         *s;             // The session given by the caller
+    smb_tid             tid;
+    const char          *path;
+    int                 local_fd;
+    bool                upload;
+    uint64_t            size;
+    smb_transfer_opts   opts;
+    pthread_mutex_t     lock;
+    uint64_t            next;           // Offset of the next piece to transfer
+    uint64_t            done;           // Bytes transferred so far
+    int                 status;         // First error met, stops everything
+    struct timeval      start;
+}                       smb_transfer;
+
+typedef struct smb_transfer_conn smb_transfer_conn;
+
+// A buffer and the piece of the file it holds, in flight or not
+typedef struct
+{
+    smb_transfer_conn   *conn;
+    uint8_t             *buf;
+    uint64_t            offset;         // Where the piece is in the file
+    size_t              len;            // Size of the piece
+    size_t              pos;            // Bytes of the piece transferred
+    bool                busy;           // A request is in flight
+}                       smb_transfer_slot;
+
+struct smb_transfer_conn
+{
+    smb_transfer        *xfer;
+    smb_session         *s;
+    smb_fd              fd;
+    // The completions can run in another thread if the session is thread-safe
+    pthread_mutex_t     lock;
+    unsigned int        in_flight;
+    int                 status;
+};
+
+static void     smb_transfer_fail(smb_transfer *xfer, int status)
+{
+    pthread_mutex_lock(&xfer->lock);
+    if (xfer->status == DSM_SUCCESS)
+        xfer->status = status;
+    pthread_mutex_unlock(&xfer->lock);
+}
+
+// Hand out the next piece of at most 'max' bytes. Returns false once the
+// whole file is distributed or the transfer failed
+static bool     smb_transfer_take(smb_transfer *xfer, size_t max,
+                                  uint64_t *offset, size_t *len)
+{
+    bool    ok = false;
+
+    pthread_mutex_lock(&xfer->lock);
+    if (xfer->status == DSM_SUCCESS && xfer->next < xfer->size)
+    {
+        *offset = xfer->next;
+        *len    = xfer->size - xfer->next < max ? xfer->size - xfer->next : max;
+        xfer->next += *len;
+        ok = true;
+    }
+    pthread_mutex_unlock(&xfer->lock);
+
+    return ok;
+}
+
+static void     smb_transfer_progress(smb_transfer *xfer, size_t size)
+{
+    struct timeval  now;
+    uint64_t        elapsed, rate = 0;
+
+    pthread_mutex_lock(&xfer->lock);
+    xfer->done += size;
+    if (xfer->opts.progress != NULL)
+    {
+        gettimeofday(&now, NULL);
+        elapsed = (uint64_t)(now.tv_sec - xfer->start.tv_sec) * 1000000
+                  + now.tv_usec - xfer->start.tv_usec;
+        if (elapsed > 0)
+            rate = xfer->done * 1000000 / elapsed;
+        // Under the lock, so that the calls are serialized
+        xfer->opts.progress(xfer->done, xfer->size, rate, xfer->opts.opaque);
+    }
+    pthread_mutex_unlock(&xfer->lock);
+}
+
+static bool     smb_transfer_pwrite(int fd, const uint8_t *buf, size_t size,
+                                    uint64_t offset)
+{
+    ssize_t res;
+
+    while (size > 0)
+    {
+        res = pwrite(fd, buf, size, offset);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)
+            return false;
+        buf    += res;
+        size   -= res;
+        offset += res;
+    }
+
+    return true;
+}
+
+static bool     smb_transfer_pread(int fd, uint8_t *buf, size_t size,
+                                   uint64_t offset)
+{
+    ssize_t res;
+
+    while (size > 0)
+    {
+        res = pread(fd, buf, size, offset);
+        if (res < 0 && errno == EINTR)
+            continue;
+        if (res <= 0)   // The local file shrank
+            return false;
+        buf    += res;
+        size   -= res;
+        offset += res;
+    }
+
+    return true;
+}
+
+static void     smb_transfer_done(smb_session *s, const smb_async_result *res,
+                                  void *opaque)
+{
+    smb_transfer_slot   *slot = opaque;
+    smb_transfer_conn   *conn = slot->conn;
+    smb_transfer        *xfer = conn->xfer;
+    int                 status = res->status;
+    (void)s;
+
+    if (status == DSM_SUCCESS && res->size <= 0)
+    {
+        // The remote file is shorter than announced, or the server accepts
+        // no more data
+        BDSM_dbg("smb_transfer: no progress at offset %llu\n",
+                 (unsigned long long)(slot->offset + slot->pos));
+        status = DSM_ERROR_GENERIC;
+    }
+    else if (status == DSM_SUCCESS && !xfer->upload
+             && !smb_transfer_pwrite(xfer->local_fd, slot->buf + slot->pos,
+                                     res->size, slot->offset + slot->pos))
+    {
+        BDSM_dbg("smb_transfer: local write failed (%s)\n", strerror(errno));
+        status = DSM_ERROR_GENERIC;
+    }
+    if (status == DSM_SUCCESS)
+    {
+        slot->pos += res->size;
+        smb_transfer_progress(xfer, res->size);
+    }
+
+    pthread_mutex_lock(&conn->lock);
+    if (status != DSM_SUCCESS && conn->status == DSM_SUCCESS)
+        conn->status = status;
+    slot->busy = false;
+    conn->in_flight--;
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// (Re)start the transfer of an idle slot, taking a new piece if the previous
+// one is complete
+static void     smb_transfer_submit(smb_transfer_conn *conn,
+                                    smb_transfer_slot *slot, size_t piece)
+{
+    smb_transfer    *xfer = conn->xfer;
+    int             res;
+
+    if (slot->pos == slot->len)
+    {
+        if (!smb_transfer_take(xfer, piece, &slot->offset, &slot->len))
+            return;
+        slot->pos = 0;
+
+        if (xfer->upload
+            && !smb_transfer_pread(xfer->local_fd, slot->buf, slot->len,
+                                   slot->offset))
+        {
+            BDSM_dbg("smb_transfer: local read failed\n");
+            res = DSM_ERROR_GENERIC;
+            goto error;
+        }
+    }
+
+    // Accounted before sending, the reply could be processed by another
+    // thread right away
+    pthread_mutex_lock(&conn->lock);
+    slot->busy = true;
+    conn->in_flight++;
+    pthread_mutex_unlock(&conn->lock);
+
+    if (xfer->upload)
+        res = smb_fwrite_async(conn->s, conn->fd, slot->buf + slot->pos,
+                               slot->len - slot->pos, slot->offset + slot->pos,
+                               smb_transfer_done, slot);
+    else
+        res = smb_fread_async(conn->s, conn->fd, slot->buf + slot->pos,
+                              slot->len - slot->pos, slot->offset + slot->pos,
+                              smb_transfer_done, slot);
+    if (res == DSM_SUCCESS)
+        return;
+
+    pthread_mutex_lock(&conn->lock);
+    slot->busy = false;
+    conn->in_flight--;
+    pthread_mutex_unlock(&conn->lock);
+
+error:
+    pthread_mutex_lock(&conn->lock);
+    if (conn->status == DSM_SUCCESS)
+        conn->status = res;
+    pthread_mutex_unlock(&conn->lock);
+}
+
+// Transfer pieces on a session until there are none left, keeping up to
+// 'window' requests in flight
+static int      smb_transfer_run(smb_transfer *xfer, smb_session *s,
+                                 smb_tid tid)
+{
+    smb_transfer_conn   conn;
+    smb_transfer_slot   *slots;
+    uint8_t             *bufs;
+    unsigned int        window = xfer->opts.window;
+    size_t              piece;
+    bool                idle;
+    int                 res;
+
+    if (window == 0)
+        window = SMB_TRANSFER_WINDOW;
+    if (s->srv.max_mpx != 0 && window > s->srv.max_mpx)
+        window = s->srv.max_mpx;
+    piece = xfer->upload ? smb_session_max_write(s) : smb_session_max_read(s);
+
+    res = smb_fopen(s, tid, xfer->path,
+                    xfer->upload ? SMB_TRANSFER_MOD_WRITE : SMB_MOD_RO,
+                    &conn.fd);
+    if (res != DSM_SUCCESS)
+        return res;
+
+    slots = calloc(window, sizeof(smb_transfer_slot));
+    bufs  = malloc(window * piece);
+    if (!slots || !bufs)
+    {
+        free(slots);
+        free(bufs);
+        smb_fclose(s, conn.fd);
+        return DSM_ERROR_GENERIC;
+    }
+
+    conn.xfer      = xfer;
+    conn.s         = s;
+    conn.in_flight = 0;
+    conn.status    = DSM_SUCCESS;
+    pthread_mutex_init(&conn.lock, NULL);
+    for (unsigned int i = 0; i < window; i++)
+    {
+        slots[i].conn = &conn;
+        slots[i].buf  = bufs + i * piece;
+    }
+
+    for (;;)
+    {
+        // Keep the idle slots busy, with the rest of a partially transferred
+        // piece or a new one. After an error, only drain what's in flight
+        for (unsigned int i = 0; i < window; i++)
+        {
+            pthread_mutex_lock(&conn.lock);
+            idle = !slots[i].busy && conn.status == DSM_SUCCESS;
+            pthread_mutex_unlock(&conn.lock);
+            if (idle)
+                smb_transfer_submit(&conn, &slots[i], piece);
+        }
+
+        pthread_mutex_lock(&conn.lock);
+        res  = conn.status;
+        idle = conn.in_flight == 0;
+        pthread_mutex_unlock(&conn.lock);
+
+        if (res != DSM_SUCCESS)
+            smb_transfer_fail(xfer, res);   // Stop the other workers too
+        if (idle)
+            break;
+
+        // On error, the requests in flight are failed
+        if (smb_session_wait(s) != DSM_SUCCESS)
+        {
+            pthread_mutex_lock(&conn.lock);
+            if (conn.status == DSM_SUCCESS)
+                conn.status = DSM_ERROR_NETWORK;
+            pthread_mutex_unlock(&conn.lock);
+        }
+    }
+
+    smb_fclose(s, conn.fd);
+    pthread_mutex_destroy(&conn.lock);
+    free(bufs);
+    free(slots);
+
+    return res;
+}
+
+static void     *smb_transfer_worker(void *opaque)
+{
+    smb_transfer    *xfer = opaque;
+    smb_session     *s;
+    smb_tid         tid;
+    int             res;
+
+    if ((s = smb_session_pool_lease(xfer->opts.pool, &tid)) == NULL)
+        return NULL;   // The other connections will do without this one
+    res = smb_transfer_run(xfer, s, tid);
+    smb_session_pool_release(xfer->opts.pool, s, res == DSM_ERROR_NETWORK);
+
+    return NULL;
+}
+
+// The number of connections to take from the pool
+static unsigned int smb_transfer_pool_wanted(smb_transfer *xfer)
+{
+    unsigned int    wanted;
+
+    if (xfer->opts.pool == NULL)
+        return 0;
+
+    // The caller's session counts as one of the connections
+    wanted = xfer->opts.connections > 0 ? xfer->opts.connections - 1
+                                        : UINT_MAX;
+    return smb_session_pool_get_size(xfer->opts.pool) < wanted
+           ? smb_session_pool_get_size(xfer->opts.pool) : wanted;
+}
+
+// The pool connections use the remote path on their own share, which must
+// be the caller's one, or the pieces would come from another file
+static bool     smb_transfer_pool_check(smb_transfer *xfer)
+{
+    if (smb_transfer_pool_wanted(xfer) == 0
+        || smb_session_pool_on_share(xfer->opts.pool, xfer->s, xfer->tid))
+        return true;
+
+    BDSM_dbg("smb_transfer: the pool isn't connected to the share\n");
+    return false;
+}
+
+static int      smb_transfer_start(smb_transfer *xfer)
+{
+    pthread_t       *threads = NULL;
+    unsigned int    nb_threads = 0, wanted;
+    int             res;
+
+    wanted = smb_transfer_pool_wanted(xfer);
+    if (wanted > 0)
+        threads = malloc(wanted * sizeof(pthread_t));
+    if (threads == NULL)
+        wanted = 0;
+
+    pthread_mutex_init(&xfer->lock, NULL);
+    gettimeofday(&xfer->start, NULL);
+    xfer->next   = 0;
+    xfer->done   = 0;
+    xfer->status = DSM_SUCCESS;
+
+    for (unsigned int i = 0; i < wanted; i++)
+        if (pthread_create(&threads[nb_threads], NULL, smb_transfer_worker,
+                           xfer) == 0)
+            nb_threads++;
+    res = smb_transfer_run(xfer, xfer->s, xfer->tid);
+    for (unsigned int i = 0; i < nb_threads; i++)
+        pthread_join(threads[i], NULL);
+
+    // Everything handed out must have been transferred
+    if (res == DSM_SUCCESS)
+        res = xfer->status;
+    if (res == DSM_SUCCESS && xfer->done != xfer->size)
+        res = DSM_ERROR_GENERIC;
+
+    pthread_mutex_destroy(&xfer->lock);
+    free(threads);
+
+    return res;
+}
+
+static void     smb_transfer_init(smb_transfer *xfer, smb_session *s,
+                                  smb_tid tid, const char *path, int local_fd,
+                                  const smb_transfer_opts *opts)
+{
+    memset(xfer, 0, sizeof(smb_transfer));
+    xfer->s        = s;
+    xfer->tid      = tid;
+    xfer->path     = path;
+    xfer->local_fd = local_fd;
+    if (opts != NULL)
+        xfer->opts = *opts;
+}
+
+int             smb_file_download(smb_session *s, smb_tid tid,
+                                  const char *remote_path, int local_fd,
+                                  const smb_transfer_opts *opts)
+{
+    smb_transfer    xfer;
+    smb_stat        st;
+    smb_fd          fd;
+    int             res;
+
+    bdsm_assert(s != NULL && remote_path != NULL && local_fd >= 0);
+
+    if (s == NULL || remote_path == NULL || local_fd < 0)
+        return DSM_ERROR_GENERIC;
+
+    smb_transfer_init(&xfer, s, tid, remote_path, local_fd, opts);
+    if (!smb_transfer_pool_check(&xfer))
+        return DSM_ERROR_GENERIC;
+
+    // The size from the open reply, smb_fstat() may answer from the cache
+    // with the size of a file which grew since
+    if ((res = smb_fopen(s, tid, remote_path, SMB_MOD_RO, &fd)) != DSM_SUCCESS)
+        return res;
+    if ((st = smb_stat_fd(s, fd)) == NULL)
+    {
+        smb_fclose(s, fd);
+        return DSM_ERROR_GENERIC;
+    }
+    xfer.size = smb_stat_get(st, SMB_STAT_SIZE);
+    smb_fclose(s, fd);
+
+    // Allocate the whole file up front, pieces are written out of order
+    if (ftruncate(local_fd, xfer.size) != 0)
+    {
+        BDSM_dbg("smb_file_download: unable to resize the local file (%s)\n",
+                 strerror(errno));
+        return DSM_ERROR_GENERIC;
+    }
+    if (xfer.size == 0)
+        return DSM_SUCCESS;
+
+    return smb_transfer_start(&xfer);
+}
+
+int             smb_file_upload(smb_session *s, smb_tid tid,
+                                const char *remote_path, int local_fd,
+                                const smb_transfer_opts *opts)
+{
+    smb_transfer    xfer;
+    struct stat     st;
+    smb_fd          fd;
+    int             res;
+
+    bdsm_assert(s != NULL && remote_path != NULL && local_fd >= 0);
+
+    if (s == NULL || remote_path == NULL || local_fd < 0)
+        return DSM_ERROR_GENERIC;
+
+    smb_transfer_init(&xfer, s, tid, remote_path, local_fd, opts);
+    xfer.upload = true;
+    if (!smb_transfer_pool_check(&xfer))
+        return DSM_ERROR_GENERIC;
+
+    if (fstat(local_fd, &st) != 0 || !S_ISREG(st.st_mode))
+        return DSM_ERROR_GENERIC;
+    xfer.size = st.st_size;
+#ifdef HAVE_POSIX_FADVISE
+    posix_fadvise(local_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+
+    // Create or truncate the file once, the workers then only open it
+    if ((res = smb_fopen(s, tid, remote_path, SMB_MOD_RW, &fd)) != DSM_SUCCESS)
+        return res;
+    smb_fclose(s, fd);
+    if (xfer.size == 0)
+        return DSM_SUCCESS;
+
+    return smb_transfer_start(&xfer);
+}
@@ -65,7 +65,17 @@ void              smb_transport_nbt(smb_transport *tr)
         tr->pkt_init      = (void *)netbios_session_packet_init;
         tr->pkt_append    = (void *)netbios_session_packet_append;
         tr->send          = (void *)netbios_session_packet_send;
+        tr->send_iov      = (void *)netbios_session_send_iov;
         tr->recv          = (void *)netbios_session_packet_recv;
+        tr->recv_partial  = (void *)netbios_session_packet_recv_partial;
+        tr->recv_nonblock = (void *)netbios_session_packet_recv_nonblock;
+        tr->recv_rest     = (void *)netbios_session_packet_recv_rest;
+        tr->recv_data     = (void *)netbios_session_packet_recv_data;
+        tr->set_nonblocking = (void *)netbios_session_set_nonblocking;
+        tr->flush         = (void *)netbios_session_flush;
+        tr->want_write    = (void *)netbios_session_want_write;
+        tr->get_fd        = (void *)netbios_session_get_fd;
+        tr->max_msg_size  = NETBIOS_SESSION_MAX_PAYLOAD;
     }
 }
 
@@ -80,6 +90,16 @@ void              smb_transport_tcp(smb_transport *tr)
         tr->pkt_init      = (void *)netbios_session_packet_init;
         tr->pkt_append    = (void *)netbios_session_packet_append;
         tr->send          = (void *)netbios_session_packet_send;
+        tr->send_iov      = (void *)netbios_session_send_iov;
         tr->recv          = (void *)netbios_session_packet_recv;
+        tr->recv_partial  = (void *)netbios_session_packet_recv_partial;
+        tr->recv_nonblock = (void *)netbios_session_packet_recv_nonblock;
+        tr->recv_rest     = (void *)netbios_session_packet_recv_rest;
+        tr->recv_data     = (void *)netbios_session_packet_recv_data;
+        tr->set_nonblocking = (void *)netbios_session_set_nonblocking;
+        tr->flush         = (void *)netbios_session_flush;
+        tr->want_write    = (void *)netbios_session_want_write;
+        tr->get_fd        = (void *)netbios_session_get_fd;
+        tr->max_msg_size  = NETBIOS_SESSION_DIRECT_MAX_PAYLOAD;
     }
 }
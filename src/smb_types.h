@@ -38,11 +38,19 @@
 
 #include <stddef.h>
 #include <stdbool.h>
+#include <pthread.h>
 
 #include "libtasn1.h"
 
+#ifdef HAVE_SYS_QUEUE_H
+# include <sys/queue.h>
+#else
+# include "queue.h"
+#endif
+
 #if !defined _WIN32
 # include <netinet/ip.h>
+# include <sys/uio.h>
 #else
 # include <winsock2.h>
 #endif
@@ -51,6 +59,69 @@
 #include "smb_buffer.h"
 #include "smb_packets.h"
 
+typedef struct smb_readahead smb_readahead;
+
+// One READ_ANDX of a prefetch
+typedef struct
+{
+    smb_readahead       *ra;
+    size_t              len;            // Requested length
+    ssize_t             got;            // Bytes received, -1 on error
+}                       smb_readahead_seg;
+
+/**
+ * @internal
+ * @brief Read-ahead buffers of a file, see smb_file_set_readahead()
+ * @details The segments and in_flight are updated by the completion of the
+ * prefetch, under the session lock. The rest belongs to the reader.
+ */
+struct smb_readahead
+{
+    size_t              window;         // Size of each buffer
+    uint8_t             *cur;           // The window reads are served from
+    uint64_t            cur_offset;
+    size_t              cur_len;
+    bool                cur_eof;        // The file ends at cur_offset + cur_len
+    uint8_t             *next;          // The window being prefetched
+    uint64_t            next_offset;
+    bool                prefetching;    // 'next' holds or receives a prefetch
+    bool                stale;          // Drop the prefetch once it's there
+    unsigned int        in_flight;      // Prefetch requests not replied yet
+    bool                orphan;         // The file is closed, free on last reply
+    smb_readahead_seg   *segs;
+    size_t              nb_segs;
+    uint64_t            seq_end;        // Where the previous smb_fread() ended
+};
+
+typedef struct smb_writebehind smb_writebehind;
+
+// One WRITE_ANDX of a flush
+typedef struct
+{
+    smb_writebehind     *wb;
+    size_t              len;            // Bytes to write
+}                       smb_writebehind_req;
+
+/**
+ * @internal
+ * @brief Write-behind buffers of a file, see smb_file_set_write_behind()
+ * @details in_flight and error are updated by the completion of the writes,
+ * under the session lock. The rest belongs to the writer.
+ */
+struct smb_writebehind
+{
+    size_t              threshold;      // Size of each buffer
+    uint8_t             *buf;           // Data not sent yet
+    size_t              len;
+    uint64_t            offset;         // Where 'buf' goes in the file
+    uint8_t             *sending;       // Data of the writes in flight
+    smb_writebehind_req *reqs;
+    size_t              nb_reqs;
+    unsigned int        in_flight;
+    int                 error;          // First failure, reported on next call
+    bool                orphan;         // The file is closed, free on last reply
+};
+
 /**
  * @internal
  * @struct smb_file
@@ -58,7 +129,9 @@
  */
 struct smb_file
 {
-    smb_file            *next;          // Next file in this share
+    smb_file            *next;          // Next entry of a listing
+    smb_file            *list_head;     // First entry of the listing it's
+                                        // stored in, NULL if allocated alone
     char                *name;
     smb_fid             fid;
     smb_tid             tid;
@@ -73,17 +146,36 @@ struct smb_file
     off_t               offset;          // Current position pointer
     int                 is_dir;         // 0 -> file, 1 -> directory
     uint64_t            written_dep;
+    smb_readahead       *ra;            // NULL unless enabled
+    smb_writebehind     *wb;            // NULL unless enabled
+    bool                no_write_through;
+    smb_file_stats      stats;
 };
 
+typedef struct smb_stat_cache smb_stat_cache;
+
+/**
+ * @internal
+ * @brief Pointers indexed by a 32 bits key, see smb_fd.c
+ * @details Open addressing with linear probing, so that a lookup is usually
+ * a single access whatever the number of entries.
+ */
+typedef struct
+{
+    uint32_t            *keys;
+    void                **values;       // NULL for a free slot
+    size_t              size;           // A power of two, 0 while empty
+    size_t              count;
+}                       smb_fd_table;
+
 typedef struct smb_share smb_share;
 struct smb_share
 {
-    smb_share           *next;          // Next share in this session
-    smb_file            *files;         // List of all open files for this share
     smb_tid             tid;
     uint16_t            opts;           // Optionnal support opts
     uint16_t            rights;         // Maximum rights field
     uint16_t            guest_rights;
+    char                path[];         // \\SERVER\Share, as connected
 };
 
 typedef struct smb_transport smb_transport;
@@ -96,7 +188,18 @@ struct smb_transport
     void              (*pkt_init)(void *s);
     int               (*pkt_append)(void *s, void *data, size_t size);
     int               (*send)(void *s);
+    int               (*send_iov)(void *s, const struct iovec *iov, int iovcnt);
     ssize_t           (*recv)(void *s, void **data);
+    ssize_t           (*recv_partial)(void *s, void **data, size_t size,
+                                      size_t *received);
+    ssize_t           (*recv_nonblock)(void *s, void **data);
+    ssize_t           (*recv_rest)(void *s, void **data);
+    int               (*recv_data)(void *s, void *buf, size_t size);
+    void              (*set_nonblocking)(void *s, int nonblocking);
+    int               (*flush)(void *s, int block);
+    int               (*want_write)(void *s);
+    int               (*get_fd)(void *s);
+    size_t            max_msg_size;   // Largest SMB message the framing allows
 };
 
 typedef struct smb_srv_info smb_srv_info;
@@ -106,6 +209,8 @@ struct smb_srv_info
     uint16_t            dialect;        // The selected dialect
     uint16_t            security_mode;  // Security mode
     uint16_t            uid;            // uid attributed by the server.
+    uint16_t            max_mpx;        // Max number of pending requests
+    uint32_t            max_bufsize;    // Max message size the server accepts
     uint32_t            session_key;    // The session key sent by the server on protocol negotiate
     uint32_t            caps;           // Server caps replyed during negotiate
     uint64_t            challenge;      // For challenge response security
@@ -113,6 +218,79 @@ struct smb_srv_info
     uint16_t            tz;             // Server time zone
 };
 
+typedef struct smb_message smb_message;
+struct smb_message
+{
+    size_t          payload_size; // Size of the allocated payload
+    size_t          cursor;       // Write cursor in the payload
+    smb_packet      *packet;      // Yummy yummy, Fruity fruity !
+};
+
+/**
+ * @internal
+ * @brief A request sent asynchronously and waiting for its reply
+ */
+typedef struct smb_request smb_request;
+struct smb_request
+{
+    TAILQ_ENTRY(smb_request) next;
+    uint16_t            mid;            // MID of the request on the wire
+    size_t              hdr_size;       // Payload bytes the handler needs in memory
+    // Parses the reply into 'result'. msg is NULL if the request failed
+    // before a reply could be received. 'payload_size' is the full size of
+    // the reply, some of which may still be on the socket (see hdr_size)
+    void              (*handler)(smb_session *s, smb_request *req,
+                                 smb_message *msg, size_t payload_size);
+    smb_async_cb        cb;             // User callback, may be NULL
+    void                *opaque;        // User data for cb
+    smb_async_result    result;
+    smb_fd              fd;             // Operation specific data
+    void                *buf;
+    size_t              buf_size;
+    void                *ctx;
+};
+
+typedef TAILQ_HEAD(, smb_request) smb_request_queue;
+
+/**
+ * @internal
+ * @brief A reply received for a thread of a thread-safe session
+ */
+typedef struct smb_mail smb_mail;
+struct smb_mail
+{
+    TAILQ_ENTRY(smb_mail) next;
+    size_t              payload_size;   // SMB payload size
+    uint8_t             data[];         // The whole SMB message
+};
+
+typedef struct
+{
+    uint16_t            mid;
+    bool                answered;
+} smb_route;
+
+/**
+ * @internal
+ * @brief Where the replies to the synchronous requests of a thread go, when
+ * the session is thread-safe. Freed when the thread exits.
+ */
+typedef struct smb_mailbox smb_mailbox;
+struct smb_mailbox
+{
+    TAILQ_ENTRY(smb_mailbox) next;
+    smb_session         *session;
+    bool                orphan;         // The thread exited while a reply
+                                        // was being delivered
+    smb_route           *routes;        // MIDs of the requests sent
+    size_t              nb_routes;
+    size_t              routes_size;
+    bool                received;       // A reply was taken since last send
+    TAILQ_HEAD(, smb_mail) mails;       // Replies not taken yet
+    smb_mail            *current;       // Last reply taken, see recv_msg
+    uint32_t            nt_status;
+};
+
 /**
  * @brief An opaque data structure to represent a SMB Session.
  */
@@ -131,16 +309,33 @@ struct smb_session
     smb_creds           creds;
     smb_transport       transport;
 
-    smb_share           *shares;          // shares->files | Map fd <-> smb_file
+    smb_fd_table        shares;           // smb_share by tid
+    smb_fd_table        files;            // Open smb_file by smb_fd
     uint32_t            nt_status;
-};
 
-typedef struct smb_message smb_message;
-struct smb_message
-{
-    size_t          payload_size; // Size of the allocated payload
-    size_t          cursor;       // Write cursor in the payload
-    smb_packet      *packet;      // Yummy yummy, Fruity fruity !
+    uint16_t            mid;              // Last multiplex ID sent
+    smb_request_queue   pending;          // Async requests waiting for a reply
+    unsigned int        nb_pending;
+    unsigned int        read_window;      // Max READ_ANDX in flight in smb_fread
+    uint16_t            find_count;       // Entries asked per FIND_FIRST2/NEXT2
+    uint16_t            find_buf_size;    // Max data of their replies
+    smb_stat_cache      *stat_cache;      // NULL unless enabled
+    int                 all_info;         // QUERY_FILE_ALL_INFO works: 1 if
+                                          // so, -1 if not, 0 until known
+    bool                nonblocking;
+
+    // Thread-safe mode, see smb_session_set_thread_safe()
+    bool                thread_safe;
+    bool                reading;          // A thread is receiving for all
+    bool                broken;           // Reception failed, give up
+    unsigned int        completed;        // Async requests completed so far
+    pthread_mutex_t     lock;             // Everything but the socket
+    pthread_mutex_t     send_lock;        // Sending side of the socket
+    pthread_cond_t      cond;             // Reception progressed
+    TAILQ_HEAD(, smb_mailbox) mailboxes;  // One per thread
+    pthread_key_t       mailbox_key;      // The mailbox of the calling thread
+    bool                has_mailbox_key;
+    smb_mailbox         *routing;         // Getting a reply, see route_next
 };
 
 #endif
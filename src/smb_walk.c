@@ -0,0 +1,490 @@
+/*****************************************************************************
+ *  __________________    _________  _____            _____  .__         ._.
+ *  \______   \______ \  /   _____/ /     \          /  _  \ |__| ____   | |
+ *   |    |  _/|    |  \ \_____  \ /  \ /  \        /  /_\  \|  _/ __ \  | |
+ *   |    |   \|    `   \/        /    Y    \      /    |    |  \  ___/   \|
+ *   |______  /_______  /_______  \____|__  / /\   \____|__  |__|\___ |   __
+ *          \/        \/        \/        \/  )/           \/        \/   \/
+ *
+ * This file is part of liBDSM. Copyright © 2014-2015 VideoLabs SAS
+ *
+ * Author: Julien 'Lta' BALLET <contact@lta.io>
+ *
+ * liBDSM is released under LGPLv2.1 (or later) and is also available
+ * under a commercial license.
+ *****************************************************************************
+ * This program is free software; you can redistribute it and/or modify it
+ * under the terms of the GNU Lesser General Public License as published by
+ * the Free Software Foundation; either version 2.1 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public License
+ * along with this program; if not, write to the Free Software Foundation,
+ * Inc., 51 Franklin Street, Fifth Floor, Boston MA 02110-1301, USA.
+ *****************************************************************************/
+
+#include <assert.h>
+#include <ctype.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+
+#include "../xcode/config.h"
+#include "bdsm_debug.h"
+#include "compat.h"
+#include "smb_fd.h"
+#include "smb_pool.h"
+#include "smb_session.h"
+#include "smb_stat.h"
+#include "../include/bdsm/smb_walk.h"
+
+// Initial size of the queue of a worker
+#define SMB_WALK_QUEUE_SIZE     (64)
+
+// A directory to list
+typedef struct
+{
+    char                *path;
+    unsigned int        depth;          // Of the directory itself
+}                       smb_walk_dir;
+
+// Directories found by a worker, its owner works at the tail and the others
+// steal from the head
+typedef struct
+{
+    pthread_mutex_t     lock;
+    smb_walk_dir        *dirs;          // Ring buffer
+    size_t              size;
+    size_t              head;
+    size_t              count;
+}                       smb_walk_queue;
+
+typedef struct smb_walk_worker smb_walk_worker;
+
+typedef struct
+{
+    smb_walk_cb         cb;
+    void                *opaque;
+    smb_walk_opts       opts;
+    smb_walk_worker     *workers;
+    unsigned int        nb_workers;
+    pthread_mutex_t     cb_lock;        // Serializes the callbacks
+    pthread_mutex_t     lock;           // Protects what follows
+    pthread_cond_t      cond;           // Work was queued or the walk is over
+    size_t              pending;        // Directories queued or being listed
+    size_t              queued;         // Directories queued
+    bool                stop;
+    int                 status;         // First error met, stops everything
+}                       smb_walk_state;
+
+struct smb_walk_worker
+{
+    smb_walk_state      *walk;
+    smb_session         *s;
+    smb_tid             tid;
+    smb_walk_queue      queue;
+    int                 status;         // Error met on this session
+};
+
+// Case insensitive match of '*' and '?' patterns
+static bool     smb_walk_match(const char *pattern, const char *name)
+{
+    const char  *star = NULL, *retry = NULL;
+
+    while (*name)
+    {
+        if (*pattern == '*')
+        {
+            star  = ++pattern;
+            retry = name;
+        }
+        else if (*pattern == '?'
+                 || (*pattern && tolower((unsigned char)*pattern)
+                                 == tolower((unsigned char)*name)))
+        {
+            pattern++;
+            name++;
+        }
+        else if (star != NULL)
+        {
+            // Let the last star eat one more character
+            pattern = star;
+            name    = ++retry;
+        }
+        else
+            return false;
+    }
+    while (*pattern == '*')
+        pattern++;
+
+    return *pattern == 0;
+}
+
+static void     smb_walk_stop(smb_walk_state *walk, int status)
+{
+    pthread_mutex_lock(&walk->lock);
+    if (walk->status == DSM_SUCCESS)
+        walk->status = status;
+    walk->stop = true;
+    pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+static bool     smb_walk_stopped(smb_walk_state *walk)
+{
+    bool    stop;
+
+    pthread_mutex_lock(&walk->lock);
+    stop = walk->stop;
+    pthread_mutex_unlock(&walk->lock);
+
+    return stop;
+}
+
+static int      smb_walk_report(smb_walk_state *walk, const char *path,
+                                smb_stat st, unsigned int depth)
+{
+    int     action = SMB_WALK_STOP;
+
+    pthread_mutex_lock(&walk->cb_lock);
+    if (!smb_walk_stopped(walk))
+        action = walk->cb(path, st, depth, walk->opaque);
+    pthread_mutex_unlock(&walk->cb_lock);
+
+    if (action == SMB_WALK_STOP)
+        smb_walk_stop(walk, DSM_SUCCESS);
+
+    return action;
+}
+
+// Queue a directory on the worker's queue, which takes 'path' over
+static bool     smb_walk_push(smb_walk_worker *w, char *path,
+                              unsigned int depth)
+{
+    smb_walk_queue  *q = &w->queue;
+    smb_walk_state  *walk = w->walk;
+    smb_walk_dir    *dirs;
+    size_t          size;
+    bool            ok = true;
+
+    pthread_mutex_lock(&walk->lock);
+    pthread_mutex_lock(&q->lock);
+    if (q->count == q->size)
+    {
+        size = q->size ? q->size * 2 : SMB_WALK_QUEUE_SIZE;
+        dirs = malloc(size * sizeof(smb_walk_dir));
+        if (dirs != NULL)
+        {
+            for (size_t i = 0; i < q->count; i++)
+                dirs[i] = q->dirs[(q->head + i) % q->size];
+            free(q->dirs);
+            q->dirs = dirs;
+            q->size = size;
+            q->head = 0;
+        }
+        else
+            ok = false;
+    }
+    if (ok)
+    {
+        q->dirs[(q->head + q->count) % q->size].path  = path;
+        q->dirs[(q->head + q->count) % q->size].depth = depth;
+        q->count++;
+        walk->pending++;
+        walk->queued++;
+        pthread_cond_signal(&walk->cond);
+    }
+    pthread_mutex_unlock(&q->lock);
+    pthread_mutex_unlock(&walk->lock);
+
+    return ok;
+}
+
+// Take a directory from the tail of our queue (the latest found, depth
+// first) or from the head of another's (the oldest, closer to the root)
+static bool     smb_walk_take(smb_walk_worker *w, smb_walk_queue *q,
+                              smb_walk_dir *dir)
+{
+    smb_walk_state  *walk = w->walk;
+    bool            found = false;
+
+    pthread_mutex_lock(&q->lock);
+    if (q->count > 0)
+    {
+        if (q == &w->queue)
+            *dir = q->dirs[(q->head + q->count - 1) % q->size];
+        else
+        {
+            *dir    = q->dirs[q->head];
+            q->head = (q->head + 1) % q->size;
+        }
+        q->count--;
+        found = true;
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    if (found)
+    {
+        pthread_mutex_lock(&walk->lock);
+        walk->queued--;
+        pthread_mutex_unlock(&walk->lock);
+    }
+
+    return found;
+}
+
+// Get the next directory to list. Returns false once the walk is over
+static bool     smb_walk_next(smb_walk_worker *w, smb_walk_dir *dir)
+{
+    smb_walk_state  *walk = w->walk;
+    unsigned int    self = w - walk->workers;
+
+    for (;;)
+    {
+        if (smb_walk_stopped(walk))
+            return false;
+
+        if (smb_walk_take(w, &w->queue, dir))
+            return true;
+        for (unsigned int i = 1; i < walk->nb_workers; i++)
+            if (smb_walk_take(w, &walk->workers[(self + i) % walk->nb_workers]
+                                     .queue, dir))
+                return true;
+
+        // Wait for the others to find more
+        pthread_mutex_lock(&walk->lock);
+        while (!walk->stop && walk->pending > 0 && walk->queued == 0)
+            pthread_cond_wait(&walk->cond, &walk->lock);
+        if (walk->pending == 0)
+            walk->stop = true;
+        pthread_mutex_unlock(&walk->lock);
+    }
+}
+
+static void     smb_walk_done(smb_walk_state *walk)
+{
+    pthread_mutex_lock(&walk->lock);
+    if (--walk->pending == 0)
+        pthread_cond_broadcast(&walk->cond);
+    pthread_mutex_unlock(&walk->lock);
+}
+
+// Report the entries of a directory and queue its subdirectories. Returns a
+// DSM error code if the session is unusable, or if the root can't be listed.
+// Other directories the server refuses to list are reported and skipped.
+static int      smb_walk_list(smb_walk_worker *w, smb_walk_dir *dir)
+{
+    smb_walk_state  *walk = w->walk;
+    smb_find_iter   *it;
+    smb_stat        st;
+    const char      *name;
+    char            *pattern, *path;
+    size_t          len = strlen(dir->path), name_len;
+    unsigned int    depth = dir->depth + 1;
+    bool            enter;
+    int             res, action;
+
+    pattern = malloc(len + 3);
+    if (!pattern)
+        return DSM_ERROR_GENERIC;
+    memcpy(pattern, dir->path, len);
+    memcpy(pattern + len, "\\*", 3);
+
+    it = smb_find_start(w->s, w->tid, pattern, &res);
+    free(pattern);
+    if (!it)
+        goto error;
+
+    while (!smb_walk_stopped(walk) && (st = smb_find_next_entry(it)) != NULL)
+    {
+        name = smb_stat_name(st);
+        if (!strcmp(name, ".") || !strcmp(name, ".."))
+            continue;
+        if (walk->opts.exclude != NULL
+            && smb_walk_match(walk->opts.exclude, name))
+            continue;
+
+        name_len = strlen(name);
+        path     = malloc(len + name_len + 2);
+        if (!path)
+        {
+            smb_find_close(it);
+            return DSM_ERROR_GENERIC;
+        }
+        memcpy(path, dir->path, len);
+        path[len] = '\\';
+        memcpy(path + len + 1, name, name_len + 1);
+
+        action = SMB_WALK_CONTINUE;
+        if (walk->opts.include == NULL
+            || smb_walk_match(walk->opts.include, name))
+            action = smb_walk_report(walk, path, st, depth);
+
+        enter = action == SMB_WALK_CONTINUE
+                && smb_stat_get(st, SMB_STAT_ISDIR)
+                && (walk->opts.max_depth == 0 || depth < walk->opts.max_depth);
+        if (!enter || !smb_walk_push(w, path, depth))
+            free(path);
+    }
+
+    res = smb_find_close(it);
+
+error:
+    if (res != DSM_ERROR_NT || dir->depth == 0)
+        return res;
+    smb_walk_report(walk, dir->path, NULL, dir->depth);
+    return DSM_SUCCESS;
+}
+
+static void     smb_walk_run(smb_walk_worker *w)
+{
+    smb_walk_dir    dir;
+    int             res;
+
+    while (smb_walk_next(w, &dir))
+    {
+        res = smb_walk_list(w, &dir);
+        free(dir.path);
+        if (res != DSM_SUCCESS)
+        {
+            w->status = res;
+            smb_walk_stop(w->walk, res);
+        }
+        smb_walk_done(w->walk);
+    }
+}
+
+static void     *smb_walk_thread(void *opaque)
+{
+    smb_walk_run(opaque);
+    return NULL;
+}
+
+static void     *smb_walk_pool_thread(void *opaque)
+{
+    smb_walk_worker *w = opaque;
+    smb_walk_state  *walk = w->walk;
+
+    if ((w->s = smb_session_pool_lease(walk->opts.pool, &w->tid)) == NULL)
+        return NULL;   // The other workers will do without this one
+    smb_walk_run(w);
+    smb_session_pool_release(walk->opts.pool, w->s,
+                             w->status == DSM_ERROR_NETWORK);
+
+    return NULL;
+}
+
+int             smb_walk(smb_session *s, smb_tid tid, const char *root,
+                         smb_walk_cb cb, void *opaque,
+                         const smb_walk_opts *opts)
+{
+    smb_walk_state  walk;
+    smb_walk_dir    dir;
+    pthread_t       *threads;
+    unsigned int    nb_local = 1, nb_pool = 0, nb_threads = 0;
+    char            *path;
+    size_t          len;
+    int             res;
+
+    bdsm_assert(s != NULL && root != NULL && cb != NULL);
+
+    if (s == NULL || root == NULL || cb == NULL)
+        return DSM_ERROR_GENERIC;
+
+    memset(&walk, 0, sizeof(walk));
+    walk.cb     = cb;
+    walk.opaque = opaque;
+    if (opts != NULL)
+        walk.opts = *opts;
+
+    // Threads can only share the session if it's thread-safe
+    if (walk.opts.threads > 1 && s->thread_safe)
+        nb_local = walk.opts.threads;
+    if (walk.opts.pool != NULL)
+    {
+        nb_pool = walk.opts.connections > 0 ? walk.opts.connections - 1
+                                            : UINT_MAX;
+        nb_pool = smb_session_pool_get_size(walk.opts.pool) < nb_pool
+                  ? smb_session_pool_get_size(walk.opts.pool) : nb_pool;
+        if (nb_pool > 0 && !smb_session_pool_on_share(walk.opts.pool, s, tid))
+        {
+            BDSM_dbg("smb_walk: The pool isn't connected to the walked share\n");
+            return DSM_ERROR_GENERIC;
+        }
+    }
+
+    // The root, without trailing separators. Its entries are then listed
+    // as "root\*" and named "root\name"
+    len = strlen(root);
+    while (len > 0 && root[len - 1] == '\\')
+        len--;
+    path = strndup(root, len);
+
+    walk.nb_workers = nb_local + nb_pool;
+    walk.workers    = calloc(walk.nb_workers, sizeof(smb_walk_worker));
+    threads         = calloc(walk.nb_workers, sizeof(pthread_t));
+    if (!path || !walk.workers || !threads)
+    {
+        free(path);
+        free(walk.workers);
+        free(threads);
+        return DSM_ERROR_GENERIC;
+    }
+
+    pthread_mutex_init(&walk.cb_lock, NULL);
+    pthread_mutex_init(&walk.lock, NULL);
+    pthread_cond_init(&walk.cond, NULL);
+    walk.status = DSM_SUCCESS;
+    for (unsigned int i = 0; i < walk.nb_workers; i++)
+    {
+        walk.workers[i].walk = &walk;
+        pthread_mutex_init(&walk.workers[i].queue.lock, NULL);
+        if (i < nb_local)
+        {
+            walk.workers[i].s   = s;
+            walk.workers[i].tid = tid;
+        }
+    }
+
+    if (!smb_walk_push(&walk.workers[0], path, 0))
+    {
+        free(path);
+        walk.status = DSM_ERROR_GENERIC;
+    }
+    else
+    {
+        for (unsigned int i = 1; i < walk.nb_workers; i++)
+            if (pthread_create(&threads[nb_threads], NULL,
+                               i < nb_local ? smb_walk_thread
+                                            : smb_walk_pool_thread,
+                               &walk.workers[i]) == 0)
+                nb_threads++;
+        smb_walk_run(&walk.workers[0]);
+        for (unsigned int i = 0; i < nb_threads; i++)
+            pthread_join(threads[i], NULL);
+    }
+
+    // What's left after a stop
+    for (unsigned int i = 0; i < walk.nb_workers; i++)
+    {
+        while (smb_walk_take(&walk.workers[i], &walk.workers[i].queue, &dir))
+            free(dir.path);
+        free(walk.workers[i].queue.dirs);
+        pthread_mutex_destroy(&walk.workers[i].queue.lock);
+    }
+
+    res = walk.status;
+    pthread_cond_destroy(&walk.cond);
+    pthread_mutex_destroy(&walk.lock);
+    pthread_mutex_destroy(&walk.cb_lock);
+    free(walk.workers);
+    free(threads);
+
+    return res;
+}
@@ -52,6 +52,9 @@
 /* Define to 1 if you have the `pipe' function. */
 #define HAVE_PIPE 1
 
+/* Define to 1 if you have the `posix_fadvise' function. */
+/* #undef HAVE_POSIX_FADVISE */
+
 /* Define if you have POSIX threads libraries and header files. */
 #define HAVE_PTHREAD 1
 